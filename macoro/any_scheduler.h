@@ -0,0 +1,259 @@
+#pragma once
+
+#include "macoro/config.h"
+#include "macoro/coroutine_handle.h"
+#include "macoro/coro_frame.h"
+#include "macoro/deadline.h"
+#include "macoro/stop.h"
+#include "macoro/type_traits.h"
+
+#include <chrono>
+#include <cstddef>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+namespace macoro
+{
+	namespace detail
+	{
+		template<typename Scheduler, typename = void>
+		struct has_schedule_after : std::false_type {};
+
+		template<typename Scheduler>
+		struct has_schedule_after<Scheduler, void_t<
+			decltype(std::declval<Scheduler&>().schedule_after(std::chrono::nanoseconds{}, stop_token{}))>>
+			: std::true_type {};
+
+		// large enough for the awaiters of thread_pool and strand.
+		constexpr std::size_t any_scheduler_storage = 16 * sizeof(void*);
+
+		struct any_scheduler_vtable
+		{
+			// set if schedule() never suspends, e.g. inline_scheduler.
+			bool ready;
+
+			// Constructs the awaiter of schedule() or schedule_after() in
+			// storage, passes it the deadline of the awaiting task if any,
+			// and suspends h on it. Returns the coroutine to resume, h
+			// itself if the awaiter did not suspend. schedule_after is null
+			// if the scheduler does not have it.
+			coroutine_handle<> (*schedule)(void* s, void* storage, coroutine_handle<> h,
+				const deadline_context* deadline);
+			coroutine_handle<> (*schedule_after)(void* s, void* storage, coroutine_handle<> h,
+				std::chrono::nanoseconds d, stop_token& token, const deadline_context* deadline);
+
+			// Calls await_resume() on the awaiter and destroys it. Null if
+			// neither does anything.
+			void (*resume)(void* storage);
+			void (*resume_after)(void* storage);
+		};
+
+		template<typename Awaiter>
+		coroutine_handle<> any_scheduler_suspend(Awaiter& a, coroutine_handle<> h,
+			const deadline_context* deadline)
+		{
+			if (deadline)
+				set_deadline(a, deadline);
+			if (a.await_ready())
+				return h;
+			auto r = macoro::await_suspend(a, h);
+			return r ? coroutine_handle<>(r.get_handle()) : h;
+		}
+
+		template<typename Awaiter>
+		void any_scheduler_resume(void* storage)
+		{
+			struct destroy
+			{
+				Awaiter* a;
+				~destroy() { a->~Awaiter(); }
+			} d{ static_cast<Awaiter*>(storage) };
+			d.a->await_resume();
+		}
+
+		template<typename Awaiter>
+		constexpr void (*any_scheduler_resume_fn())(void*)
+		{
+			return std::is_trivially_destructible<Awaiter>::value &&
+				noexcept(std::declval<Awaiter&>().await_resume()) ?
+				nullptr : &any_scheduler_resume<Awaiter>;
+		}
+
+		template<typename Scheduler>
+		struct any_scheduler_impl
+		{
+			using awaiter = decltype(std::declval<Scheduler&>().schedule());
+			static_assert(sizeof(awaiter) <= any_scheduler_storage && alignof(awaiter) <= alignof(std::max_align_t),
+				"the awaiter of Scheduler::schedule() does not fit in any_scheduler.");
+
+			static coroutine_handle<> schedule(void* s, void* storage, coroutine_handle<> h,
+				const deadline_context* deadline)
+			{
+				auto a = ::new (storage) awaiter(static_cast<Scheduler*>(s)->schedule());
+				return any_scheduler_suspend(*a, h, deadline);
+			}
+
+			template<typename S>
+			struct after
+			{
+				using awaiter = decltype(std::declval<S&>().schedule_after(std::chrono::nanoseconds{}, stop_token{}));
+				static_assert(sizeof(awaiter) <= any_scheduler_storage && alignof(awaiter) <= alignof(std::max_align_t),
+					"the awaiter of Scheduler::schedule_after() does not fit in any_scheduler.");
+
+				static coroutine_handle<> schedule(void* s, void* storage, coroutine_handle<> h,
+					std::chrono::nanoseconds d, stop_token& token, const deadline_context* deadline)
+				{
+					auto a = ::new (storage) awaiter(static_cast<S*>(s)->schedule_after(d, std::move(token)));
+					return any_scheduler_suspend(*a, h, deadline);
+				}
+			};
+
+			static constexpr any_scheduler_vtable make(std::true_type)
+			{
+				return {
+					std::is_same<awaiter, suspend_never>::value,
+					&schedule,
+					&after<Scheduler>::schedule,
+					any_scheduler_resume_fn<awaiter>(),
+					any_scheduler_resume_fn<typename after<Scheduler>::awaiter>() };
+			}
+
+			static constexpr any_scheduler_vtable make(std::false_type)
+			{
+				return {
+					std::is_same<awaiter, suspend_never>::value,
+					&schedule,
+					nullptr,
+					any_scheduler_resume_fn<awaiter>(),
+					nullptr };
+			}
+		};
+
+		template<typename Scheduler>
+		constexpr any_scheduler_vtable any_scheduler_vtable_for =
+			any_scheduler_impl<Scheduler>::make(has_schedule_after<Scheduler>{});
+
+		class any_schedule_operation
+		{
+		public:
+			any_schedule_operation(void* s, const any_scheduler_vtable* v) noexcept
+				: mScheduler(s)
+				, mVtable(v)
+			{}
+
+			any_schedule_operation(void* s, const any_scheduler_vtable* v, std::chrono::nanoseconds d, stop_token&& token) noexcept
+				: mScheduler(s)
+				, mVtable(v)
+				, mAfter(true)
+				, mDelay(d)
+				, mToken(std::move(token))
+			{}
+
+			// the awaiter is only constructed in await_suspend(), so there
+			// is nothing in mStorage to move.
+			any_schedule_operation(any_schedule_operation&& o) noexcept
+				: mScheduler(o.mScheduler)
+				, mVtable(o.mVtable)
+				, mAfter(o.mAfter)
+				, mDelay(o.mDelay)
+				, mToken(std::move(o.mToken))
+				, mDeadline(o.mDeadline)
+			{}
+
+			// forwarded to the scheduler's awaiter, so that e.g.
+			// thread_pool::schedule_after() does not sleep past it.
+			void macoro_set_deadline(const deadline_context* d) noexcept
+			{
+				mDeadline = d;
+			}
+
+			bool await_ready() const noexcept { return !mAfter && mVtable->ready; }
+
+#ifdef MACORO_CPP_20
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<> h)
+			{
+				return await_suspend(coroutine_handle<>(h)).std_cast();
+			}
+#endif
+			coroutine_handle<> await_suspend(coroutine_handle<> h)
+			{
+				if (mAfter)
+					return mVtable->schedule_after(mScheduler, mStorage, h, mDelay, mToken, mDeadline);
+				return mVtable->schedule(mScheduler, mStorage, h, mDeadline);
+			}
+
+			void await_resume()
+			{
+				auto resume = mAfter ? mVtable->resume_after : mVtable->resume;
+				if (resume && !await_ready())
+					resume(mStorage);
+			}
+
+		private:
+			void* mScheduler;
+			const any_scheduler_vtable* mVtable;
+			bool mAfter = false;
+			std::chrono::nanoseconds mDelay{ 0 };
+			stop_token mToken;
+			const deadline_context* mDeadline = nullptr;
+			alignas(std::max_align_t) unsigned char mStorage[any_scheduler_storage];
+		};
+	}
+
+	/// A type-erased reference to a scheduler, e.g. thread_pool,
+	/// inline_scheduler or strand, so that code which picks its executor
+	/// at runtime does not have to be a template. Any type with a
+	/// schedule() that returns an awaiter can be wrapped, and optionally a
+	/// schedule_after(duration, stop_token).
+	///
+	/// Nothing is allocated. The scheduler's awaiter is constructed inside
+	/// the any_scheduler's awaiter, and the calls go through a static
+	/// table, one indirect call per schedule() for thread_pool and strand
+	/// and none for inline_scheduler. The scheduler must outlive the
+	/// any_scheduler.
+	class any_scheduler
+	{
+	public:
+		template<typename Scheduler, enable_if_t<
+			!std::is_same<remove_cvref_t<Scheduler>, any_scheduler>::value, int> = 0>
+		any_scheduler(Scheduler& s) noexcept
+			: mScheduler(&s)
+			, mVtable(&detail::any_scheduler_vtable_for<Scheduler>)
+		{}
+
+		any_scheduler(const any_scheduler&) = default;
+		any_scheduler& operator=(const any_scheduler&) = default;
+
+		detail::any_schedule_operation schedule() const noexcept
+		{
+			return { mScheduler, mVtable };
+		}
+
+		/// Resumes the caller on the scheduler after the delay or once
+		/// stop is requested, as the scheduler's schedule_after() does,
+		/// including how it treats the deadline of the awaiting task.
+		/// Throws if it does not have one.
+		template<typename Rep, typename Per>
+		detail::any_schedule_operation schedule_after(
+			std::chrono::duration<Rep, Per> delay,
+			stop_token token = {}) const
+		{
+			if (!has_schedule_after())
+				throw std::logic_error("the scheduler does not support schedule_after().");
+			return { mScheduler, mVtable,
+				std::chrono::duration_cast<std::chrono::nanoseconds>(delay), std::move(token) };
+		}
+
+		bool has_schedule_after() const noexcept { return mVtable->schedule_after != nullptr; }
+
+		/// True if both refer to the same scheduler.
+		bool operator==(const any_scheduler& o) const noexcept { return mScheduler == o.mScheduler; }
+		bool operator!=(const any_scheduler& o) const noexcept { return mScheduler != o.mScheduler; }
+
+	private:
+		void* mScheduler;
+		const detail::any_scheduler_vtable* mVtable;
+	};
+}
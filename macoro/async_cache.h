@@ -0,0 +1,425 @@
+#pragma once
+
+#include "macoro/shared_task.h"
+#include "macoro/task.h"
+#include "macoro/result.h"
+#include "macoro/stop.h"
+#include "macoro/type_traits.h"
+#include "macoro/detail/operation_cancelled.h"
+#include "macoro/macros.h"
+
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace macoro
+{
+	namespace detail
+	{
+		template<typename F, typename K, typename = void>
+		struct loader_takes_stop_token : std::false_type {};
+
+		template<typename F, typename K>
+		struct loader_takes_stop_token<F, K, void_t<decltype(std::declval<F&>()(std::declval<const K&>(), std::declval<const stop_token&>()))>> : std::true_type {};
+
+		template<typename F, typename K>
+		auto invoke_loader(F& f, const K& key, const stop_token& token, std::true_type) -> decltype(f(key, token)) { return f(key, token); }
+
+		template<typename F, typename K>
+		auto invoke_loader(F& f, const K& key, const stop_token&, std::false_type) -> decltype(f(key)) { return f(key); }
+
+		template<typename F, typename K>
+		auto invoke_loader(F& f, const K& key, const stop_token& token)
+			-> decltype(invoke_loader(f, key, token, loader_takes_stop_token<F, K>{}))
+		{
+			return invoke_loader(f, key, token, loader_takes_stop_token<F, K>{});
+		}
+
+		/// A coroutine that starts at once and frees its own frame when it
+		/// completes. Nothing waits for it, so it must not throw.
+		struct detached_task
+		{
+			struct promise_type
+			{
+				suspend_never initial_suspend() const noexcept { return {}; }
+				suspend_never final_suspend() const noexcept { return {}; }
+				detached_task get_return_object() noexcept { return {}; }
+				detached_task macoro_get_return_object() noexcept { return {}; }
+				void return_void() noexcept {}
+				void unhandled_exception() noexcept { std::terminate(); }
+			};
+		};
+	}
+
+	/// \brief
+	/// A sharded LRU cache whose values are produced by coroutines.
+	///
+	/// get(key, loader) returns a task that completes with the cached
+	/// value. On a miss loader(key) is called, or loader(key, token) if it
+	/// accepts a stop_token, and the awaitable it returns is awaited by a
+	/// shared_task. Concurrent misses on the same key await that one
+	/// shared_task, so each key has at most one load in flight.
+	///
+	/// Values are handed out as std::shared_ptr<const V> so that they
+	/// outlive eviction. Each entry costs cost(value), or 1 by default,
+	/// and the least recently used entries of a shard are evicted once its
+	/// share of the capacity is exceeded. Loads in flight are not evicted,
+	/// so a shard may exceed its share until they complete. Keys are
+	/// spread over the shards by hash, each with its own mutex, which is
+	/// only held to look up and update entries and never while a loader
+	/// runs.
+	///
+	/// A load that throws is removed from the cache before its waiters
+	/// are resumed, so they all see the exception and the next get()
+	/// starts a new load. If get()'s token is stopped the caller is
+	/// resumed with operation_cancelled at once and the load continues for
+	/// the other waiters. Once every waiter of a load has been stopped the
+	/// loader's token is stopped and the entry is dropped, so later callers
+	/// do not inherit the cancellation. Waiters that pass no stop_token
+	/// keep the load alive.
+	///
+	/// The cache must outlive the loads that it starts, which may still
+	/// be running after every get() has returned.
+	template<typename K, typename V, typename Hash = std::hash<K>, typename KeyEqual = std::equal_to<K>>
+	class async_cache
+	{
+	public:
+		using key_type = K;
+		using value_type = V;
+		using value_ptr = std::shared_ptr<const V>;
+		using cost_fn = std::function<std::size_t(const V&)>;
+
+		/// \param capacity The total cost of the entries that are kept.
+		/// \param shardCount The number of independently locked shards.
+		/// \param cost The cost of a value, 1 if not given.
+		async_cache(std::size_t capacity, std::size_t shardCount = 16, cost_fn cost = {})
+			: mShards(shardCount ? shardCount : 1)
+			, mCost(std::move(cost))
+		{
+			// spread the capacity over the shards, rounding up so that
+			// a small cache can still hold something in every shard.
+			auto per = (capacity + mShards.size() - 1) / mShards.size();
+			for (auto& s : mShards)
+				s.mCapacity = per;
+		}
+
+		async_cache(const async_cache&) = delete;
+		async_cache& operator=(const async_cache&) = delete;
+
+		/// Returns the value of key, loading it with loader on a miss.
+		template<typename Loader>
+		task<value_ptr> get(K key, Loader loader, stop_token token = {})
+		{
+			MC_BEGIN(task<value_ptr>, this, key = std::move(key), loader = std::move(loader),
+				token = std::move(token),
+				load = shared_task<value_ptr>{},
+				state = std::shared_ptr<load_state>{},
+				reg = optional_stop_callback{},
+				v = value_ptr{});
+
+			if (token.stop_requested())
+				throw operation_cancelled{};
+
+			{
+				auto& s = shard_for(key);
+				std::lock_guard<std::mutex> lock(s.mMutex);
+				auto iter = find_or_load(s, key, loader);
+				load = iter->mLoad;
+				if (!load.is_ready())
+				{
+					state = iter->mState;
+					++state->mWaiters;
+					if (!token.stop_possible())
+						state->mPinned = true;
+				}
+			}
+
+			// registered outside of the lock since a stop that has just
+			// been requested runs the callback inline.
+			if (state && token.stop_possible())
+			{
+				reg.emplace(token, [this, key, state]() {
+					abandon(key, *state);
+				});
+			}
+
+			if (state && token.stop_possible())
+			{
+				MC_AWAIT_SET(v, (stoppable_load{ load, token }));
+			}
+			else
+			{
+				MC_AWAIT_SET(v, load);
+			}
+			MC_RETURN(std::move(v));
+			MC_END();
+		}
+
+		/// Returns the value of key if it is loaded, nullptr otherwise.
+		/// Does not start a load.
+		value_ptr try_get(const K& key)
+		{
+			auto& s = shard_for(key);
+			std::lock_guard<std::mutex> lock(s.mMutex);
+			auto iter = s.mMap.find(key);
+			if (iter == s.mMap.end() || !iter->second->mLoad.is_ready())
+				return nullptr;
+			s.mLru.splice(s.mLru.begin(), s.mLru, iter->second);
+
+			// a failed load is removed before it completes, so this
+			// does not throw.
+			return iter->second->mLoad.handle().promise().result();
+		}
+
+		/// Removes key. A load in flight still completes for its waiters.
+		void erase(const K& key)
+		{
+			auto& s = shard_for(key);
+			std::lock_guard<std::mutex> lock(s.mMutex);
+			auto iter = s.mMap.find(key);
+			if (iter != s.mMap.end())
+				remove(s, iter->second);
+		}
+
+		/// The number of entries, including loads in flight.
+		std::size_t size() const
+		{
+			std::size_t n = 0;
+			for (auto& s : mShards)
+			{
+				std::lock_guard<std::mutex> lock(s.mMutex);
+				n += s.mMap.size();
+			}
+			return n;
+		}
+
+	private:
+
+		// The part of an entry that the waiters of its load refer to. It
+		// is only accessed with the shard's mutex held.
+		struct load_state
+		{
+			stop_source mStop;
+			std::size_t mWaiters = 0;
+			bool mPinned = false;
+		};
+
+		struct entry
+		{
+			K mKey;
+			shared_task<value_ptr> mLoad;
+			std::shared_ptr<load_state> mState;
+			std::size_t mCost = 1;
+		};
+
+		using list_iter = typename std::list<entry>::iterator;
+
+		// A waiter of a load that can be stopped. The load and the stop
+		// token race to resume it.
+		struct stop_race
+		{
+			enum : int { claimed = 1, suspended = 2 };
+			std::atomic<int> mState{ 0 };
+			coroutine_handle<> mWaiter;
+
+			// the first caller resumes the waiter, once it has suspended.
+			void wake() noexcept
+			{
+				if (mState.fetch_or(claimed, std::memory_order_acq_rel) == suspended)
+					mWaiter.resume();
+			}
+		};
+
+		// Awaits load but is resumed with operation_cancelled as soon as
+		// token is stopped. The load is awaited by a relay coroutine
+		// instead of the waiter, so that the waiter can leave first.
+		struct stoppable_load
+		{
+			shared_task<value_ptr> mLoad;
+			stop_token mToken;
+			std::shared_ptr<stop_race> mRace;
+			optional_stop_callback mReg;
+
+			bool await_ready() const noexcept
+			{
+				return mLoad.is_ready();
+			}
+
+#ifdef MACORO_CPP_20
+			bool await_suspend(std::coroutine_handle<> h)
+			{
+				return await_suspend(coroutine_handle<>(h));
+			}
+#endif
+			bool await_suspend(coroutine_handle<> h)
+			{
+				mRace = std::make_shared<stop_race>();
+				mRace->mWaiter = h;
+				relay(mLoad, mRace);
+				mReg.emplace(mToken, [race = mRace.get()] { race->wake(); });
+
+				// false if either one has already claimed the waiter.
+				return mRace->mState.fetch_or(stop_race::suspended, std::memory_order_acq_rel) == 0;
+			}
+
+			value_ptr await_resume()
+			{
+				mReg.reset();
+				if (!mLoad.is_ready())
+					throw operation_cancelled{};
+				return mLoad.handle().promise().result();
+			}
+		};
+
+		static detail::detached_task relay(shared_task<value_ptr> load, std::shared_ptr<stop_race> race)
+		{
+			MC_BEGIN(detail::detached_task, load = std::move(load), race = std::move(race));
+			MC_AWAIT(load.when_ready());
+			race->wake();
+			MC_END();
+		}
+
+		struct alignas(MACORO_CPU_CACHE_LINE) shard
+		{
+			mutable std::mutex mMutex;
+
+			// most recently used first.
+			std::list<entry> mLru;
+			std::unordered_map<K, list_iter, Hash, KeyEqual> mMap;
+			std::size_t mCost = 0;
+			std::size_t mCapacity = 0;
+		};
+
+		shard& shard_for(const K& key)
+		{
+			return mShards[Hash{}(key) % mShards.size()];
+		}
+
+		template<typename Loader>
+		list_iter find_or_load(shard& s, const K& key, Loader& loader)
+		{
+			auto iter = s.mMap.find(key);
+			if (iter != s.mMap.end())
+			{
+				auto e = iter->second;
+				s.mLru.splice(s.mLru.begin(), s.mLru, e);
+				return e;
+			}
+
+			auto state = std::make_shared<load_state>();
+			s.mLru.push_front(entry{ key, load(s, key, loader, state), state, 1 });
+			s.mMap.emplace(key, s.mLru.begin());
+			s.mCost += 1;
+			trim(s, s.mLru.end());
+			return s.mLru.begin();
+		}
+
+		// the entry of key, if it is still the one that state belongs to.
+		static list_iter find_entry(shard& s, const K& key, const load_state& state)
+		{
+			auto iter = s.mMap.find(key);
+			if (iter == s.mMap.end() || iter->second->mState.get() != &state)
+				return s.mLru.end();
+			return iter->second;
+		}
+
+		void remove(shard& s, list_iter e)
+		{
+			s.mCost -= e->mCost;
+			s.mMap.erase(e->mKey);
+			s.mLru.erase(e);
+		}
+
+		// evicts from the back, but never the most recent entry or a load
+		// in flight, which would let the next get() of its key start a
+		// second load. done is a load that is completing, or end.
+		void trim(shard& s, list_iter done)
+		{
+			auto e = s.mLru.end();
+			while (s.mCost > s.mCapacity && std::prev(e) != s.mLru.begin())
+			{
+				auto victim = std::prev(e);
+				if (victim == done || victim->mLoad.is_ready())
+					remove(s, victim);
+				else
+					e = victim;
+			}
+		}
+
+		// a waiter of the load was stopped.
+		void abandon(const K& key, load_state& state)
+		{
+			{
+				auto& s = shard_for(key);
+				std::lock_guard<std::mutex> lock(s.mMutex);
+				assert(state.mWaiters);
+				if (--state.mWaiters || state.mPinned)
+					return;
+
+				// nobody is left to wait for it.
+				auto e = find_entry(s, key, state);
+				if (e != s.mLru.end() && !e->mLoad.is_ready())
+					remove(s, e);
+			}
+
+			// the loader may be resumed inline and then lock the shard.
+			state.mStop.request_stop();
+		}
+
+		template<typename Loader>
+		shared_task<value_ptr> load(shard& s, const K& key, Loader& loader, std::shared_ptr<load_state> state)
+		{
+			using loader_result = decltype(detail::invoke_loader(loader, key, state->mStop.get_token()));
+			using value_result = remove_rvalue_reference_t<awaitable_result_t<loader_result>>;
+
+			MC_BEGIN(shared_task<value_ptr>, this, &s, key, loader, state,
+				r = result<value_result>{},
+				v = value_ptr{});
+
+			MC_AWAIT_TRY(r, detail::invoke_loader(loader, key, state->mStop.get_token()));
+
+			{
+				std::lock_guard<std::mutex> lock(s.mMutex);
+				auto e = find_entry(s, key, *state);
+				if (r.has_error())
+				{
+					// failures are not cached.
+					if (e != s.mLru.end())
+						remove(s, e);
+				}
+				else
+				{
+					v = std::make_shared<const V>(std::move(r.value()));
+					if (e != s.mLru.end())
+					{
+						if (mCost)
+						{
+							s.mCost -= e->mCost;
+							e->mCost = mCost(*v);
+							s.mCost += e->mCost;
+						}
+
+						// this and the loads that trim() skipped before may
+						// now be evicted.
+						trim(s, e);
+					}
+				}
+			}
+
+			if (r.has_error())
+				std::rethrow_exception(r.error());
+			MC_RETURN(std::move(v));
+			MC_END();
+		}
+
+		std::vector<shard> mShards;
+		cost_fn mCost;
+	};
+}
@@ -0,0 +1,134 @@
+#include "macoro/async_file.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <new>
+#include <stdexcept>
+
+namespace macoro
+{
+	file_buffer_pool::file_buffer_pool(std::size_t bufferSize, std::size_t alignment, std::size_t preallocate)
+		: mBufferSize(bufferSize)
+		, mAlignment(alignment)
+	{
+		if (alignment == 0 || (alignment & (alignment - 1)) || alignment % sizeof(void*))
+			throw std::invalid_argument("alignment must be a power of two multiple of sizeof(void*).");
+
+		std::vector<file_buffer> bufs;
+		for (std::size_t i = 0; i < preallocate; ++i)
+			bufs.push_back(acquire());
+	}
+
+	file_buffer_pool::~file_buffer_pool()
+	{
+		assert(mFree.size() == mAllocated && "file_buffer_pool destroyed with outstanding buffers.");
+		for (auto p : mFree)
+			std::free(p);
+	}
+
+	file_buffer file_buffer_pool::acquire()
+	{
+		file_buffer b;
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			if (mFree.size())
+			{
+				b.mData = mFree.back();
+				mFree.pop_back();
+			}
+			else
+			{
+				// reserve now so that release() does not allocate.
+				mFree.reserve(mAllocated + 1);
+				++mAllocated;
+			}
+		}
+
+		if (b.mData == nullptr)
+		{
+			void* p = nullptr;
+			if (::posix_memalign(&p, mAlignment, mBufferSize))
+			{
+				std::lock_guard<std::mutex> lock(mMutex);
+				--mAllocated;
+				throw std::bad_alloc();
+			}
+			b.mData = static_cast<char*>(p);
+		}
+
+		b.mPool = this;
+		return b;
+	}
+
+	void file_buffer_pool::release(char* p) noexcept
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mFree.push_back(p);
+	}
+
+	namespace detail
+	{
+		int open_file(const std::string& path, file_mode mode, file_options options)
+		{
+			int flags = O_CLOEXEC;
+			switch (mode)
+			{
+			case file_mode::read: flags |= O_RDONLY; break;
+			case file_mode::write: flags |= O_WRONLY; break;
+			case file_mode::read_write: flags |= O_RDWR; break;
+			}
+			if (options.create)
+				flags |= O_CREAT;
+			if (options.truncate)
+				flags |= O_TRUNC;
+			if (options.direct)
+				flags |= O_DIRECT;
+
+			int fd;
+			do {
+				fd = ::open(path.c_str(), flags, 0644);
+			} while (fd < 0 && errno == EINTR);
+			if (fd < 0)
+				throw std::system_error(errno, std::system_category(), "open " + path);
+			return fd;
+		}
+
+		void close_file(int fd) noexcept
+		{
+			::close(fd);
+		}
+
+		std::uint64_t file_size(int fd)
+		{
+			struct stat st;
+			if (::fstat(fd, &st))
+				throw std::system_error(errno, std::system_category(), "fstat");
+			return static_cast<std::uint64_t>(st.st_size);
+		}
+
+		std::size_t pread_some(int fd, void* buffer, std::size_t size, std::uint64_t offset)
+		{
+			ssize_t n;
+			do {
+				n = ::pread(fd, buffer, size, static_cast<off_t>(offset));
+			} while (n < 0 && errno == EINTR);
+			if (n < 0)
+				throw std::system_error(errno, std::system_category(), "pread");
+			return static_cast<std::size_t>(n);
+		}
+
+		std::size_t pwrite_some(int fd, const void* buffer, std::size_t size, std::uint64_t offset)
+		{
+			ssize_t n;
+			do {
+				n = ::pwrite(fd, buffer, size, static_cast<off_t>(offset));
+			} while (n < 0 && errno == EINTR);
+			if (n < 0)
+				throw std::system_error(errno, std::system_category(), "pwrite");
+			return static_cast<std::size_t>(n);
+		}
+	}
+}
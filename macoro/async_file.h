@@ -0,0 +1,428 @@
+#pragma once
+
+#include "macoro/config.h"
+
+#if !MACORO_LINUX_OS
+# error "macoro/async_file.h" is only supported on Linux.
+#endif
+
+#include "macoro/thread_pool.h"
+#include "macoro/task.h"
+#include "macoro/channel.h"
+#include "macoro/result.h"
+#include "macoro/macros.h"
+#ifdef MACORO_IO_URING
+#include "macoro/io_uring_service.h"
+#endif
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+namespace macoro
+{
+	enum class file_mode
+	{
+		read,
+		write,
+		read_write
+	};
+
+	struct file_options
+	{
+		bool create = false;
+		bool truncate = false;
+
+		/// Open with O_DIRECT, bypassing the page cache. Buffers, offsets
+		/// and sizes must then be multiples of the device block size,
+		/// e.g. buffers from a file_buffer_pool with a matching alignment.
+		bool direct = false;
+	};
+
+	class file_buffer_pool;
+
+	/// An aligned buffer from a file_buffer_pool. It is returned to the
+	/// pool when destroyed.
+	class file_buffer
+	{
+	public:
+		file_buffer() = default;
+		file_buffer(const file_buffer&) = delete;
+		file_buffer(file_buffer&& o) noexcept
+			: mPool(std::exchange(o.mPool, nullptr))
+			, mData(std::exchange(o.mData, nullptr))
+			, mSize(std::exchange(o.mSize, 0))
+			, mOffset(o.mOffset)
+		{}
+
+		file_buffer& operator=(const file_buffer&) = delete;
+		file_buffer& operator=(file_buffer&& o) noexcept
+		{
+			if (this != &o)
+			{
+				release();
+				mPool = std::exchange(o.mPool, nullptr);
+				mData = std::exchange(o.mData, nullptr);
+				mSize = std::exchange(o.mSize, 0);
+				mOffset = o.mOffset;
+			}
+			return *this;
+		}
+
+		~file_buffer() { release(); }
+
+		char* data() noexcept { return mData; }
+		const char* data() const noexcept { return mData; }
+
+		/// The number of valid bytes.
+		std::size_t size() const noexcept { return mSize; }
+		void resize(std::size_t s) noexcept;
+
+		std::size_t capacity() const noexcept;
+		std::size_t alignment() const noexcept;
+
+		/// The file offset that data() was read from.
+		std::uint64_t offset() const noexcept { return mOffset; }
+		void set_offset(std::uint64_t o) noexcept { mOffset = o; }
+
+		/// Returns the buffer to its pool.
+		void release() noexcept;
+
+	private:
+		friend class file_buffer_pool;
+
+		file_buffer_pool* mPool = nullptr;
+		char* mData = nullptr;
+		std::size_t mSize = 0;
+		std::uint64_t mOffset = 0;
+	};
+
+	/// Recycles fixed size, aligned buffers. Grows when it runs out, so
+	/// acquire() never waits. The pool must outlive its buffers.
+	class file_buffer_pool
+	{
+	public:
+		file_buffer_pool(std::size_t bufferSize, std::size_t alignment = 4096, std::size_t preallocate = 0);
+		file_buffer_pool(const file_buffer_pool&) = delete;
+		file_buffer_pool& operator=(const file_buffer_pool&) = delete;
+		~file_buffer_pool();
+
+		file_buffer acquire();
+
+		std::size_t buffer_size() const noexcept { return mBufferSize; }
+		std::size_t alignment() const noexcept { return mAlignment; }
+
+	private:
+		friend class file_buffer;
+
+		void release(char* p) noexcept;
+
+		std::size_t mBufferSize, mAlignment;
+		std::mutex mMutex;
+		std::vector<char*> mFree;
+		std::size_t mAllocated = 0;
+	};
+
+	inline void file_buffer::resize(std::size_t s) noexcept
+	{
+		assert(s <= capacity());
+		mSize = s;
+	}
+
+	inline std::size_t file_buffer::capacity() const noexcept
+	{
+		return mPool ? mPool->buffer_size() : 0;
+	}
+
+	inline std::size_t file_buffer::alignment() const noexcept
+	{
+		return mPool ? mPool->alignment() : 1;
+	}
+
+	inline void file_buffer::release() noexcept
+	{
+		if (mPool)
+		{
+			mPool->release(mData);
+			mPool = nullptr;
+			mData = nullptr;
+			mSize = 0;
+		}
+	}
+
+	namespace detail
+	{
+		int open_file(const std::string& path, file_mode mode, file_options options);
+		std::uint64_t file_size(int fd);
+		std::size_t pread_some(int fd, void* buffer, std::size_t size, std::uint64_t offset);
+		std::size_t pwrite_some(int fd, const void* buffer, std::size_t size, std::uint64_t offset);
+
+		/// The fallback for engines that can not perform file I/O
+		/// asynchronously. The awaiting coroutine is moved onto the pool
+		/// and performs the blocking syscall there.
+		class pool_file_operation
+		{
+		public:
+			pool_file_operation(thread_pool& p, int fd, const void* buffer, std::size_t size, std::uint64_t offset, bool write) noexcept
+				: mPool(&p)
+				, mFd(fd)
+				, mBuffer(const_cast<void*>(buffer))
+				, mSize(size)
+				, mOffset(offset)
+				, mWrite(write)
+			{}
+
+			bool await_ready() const noexcept { return false; }
+
+			template<typename H>
+			void await_suspend(H h)
+			{
+				mPool->post(coroutine_handle<>(h));
+			}
+
+			std::size_t await_resume()
+			{
+				if (mWrite)
+					return pwrite_some(mFd, mBuffer, mSize, mOffset);
+				return pread_some(mFd, mBuffer, mSize, mOffset);
+			}
+
+		private:
+			thread_pool* mPool;
+			int mFd;
+			void* mBuffer;
+			std::size_t mSize;
+			std::uint64_t mOffset;
+			bool mWrite;
+		};
+
+		inline pool_file_operation file_read_at(thread_pool& p, int fd, void* buffer, std::size_t size, std::uint64_t offset)
+		{
+			return { p, fd, buffer, size, offset, false };
+		}
+
+		inline pool_file_operation file_write_at(thread_pool& p, int fd, const void* buffer, std::size_t size, std::uint64_t offset)
+		{
+			return { p, fd, buffer, size, offset, true };
+		}
+
+#ifdef MACORO_IO_URING
+		inline io_uring_operation<std::size_t> file_read_at(io_uring_service& s, int fd, void* buffer, std::size_t size, std::uint64_t offset)
+		{
+			return s.read_at(fd, buffer, size, offset);
+		}
+
+		inline io_uring_operation<std::size_t> file_write_at(io_uring_service& s, int fd, const void* buffer, std::size_t size, std::uint64_t offset)
+		{
+			return s.write_at(fd, buffer, size, offset);
+		}
+#endif
+	}
+
+	/// A file for positional asynchronous I/O. Engine is io_uring_service,
+	/// which performs the I/O in the kernel, or thread_pool, where the
+	/// awaiting coroutine performs a blocking read on a pool thread.
+	/// epoll based io_service can not be used since regular files are
+	/// always reported ready.
+	template<typename Engine>
+	class async_file
+	{
+	public:
+		async_file() = default;
+
+		async_file(Engine& e, const std::string& path, file_mode mode, file_options options = {})
+			: mEngine(&e)
+			, mFd(detail::open_file(path, mode, options))
+			, mDirect(options.direct)
+		{}
+
+		async_file(const async_file&) = delete;
+		async_file(async_file&& o) noexcept
+			: mEngine(o.mEngine)
+			, mFd(std::exchange(o.mFd, -1))
+			, mDirect(o.mDirect)
+		{}
+
+		async_file& operator=(const async_file&) = delete;
+		async_file& operator=(async_file&& o) noexcept
+		{
+			if (this != &o)
+			{
+				close();
+				mEngine = o.mEngine;
+				mFd = std::exchange(o.mFd, -1);
+				mDirect = o.mDirect;
+			}
+			return *this;
+		}
+
+		~async_file() { close(); }
+
+		void close() noexcept;
+
+		int native_handle() const noexcept { return mFd; }
+		bool is_direct() const noexcept { return mDirect; }
+		Engine& engine() const noexcept { return *mEngine; }
+
+		std::uint64_t size() const { return detail::file_size(mFd); }
+
+		/// Reads up to size bytes at offset. Returns 0 at end of file.
+		auto read_at(void* buffer, std::size_t size, std::uint64_t offset)
+		{
+			return detail::file_read_at(*mEngine, mFd, buffer, size, offset);
+		}
+
+		/// Writes up to size bytes at offset and returns how many were
+		/// written.
+		auto write_at(const void* buffer, std::size_t size, std::uint64_t offset)
+		{
+			return detail::file_write_at(*mEngine, mFd, buffer, size, offset);
+		}
+
+	private:
+		Engine* mEngine = nullptr;
+		int mFd = -1;
+		bool mDirect = false;
+	};
+
+	namespace detail
+	{
+		void close_file(int fd) noexcept;
+
+		// reads [offset, offset + size) into b, less at end of file.
+		template<typename Engine>
+		eager_task<file_buffer> read_chunk(async_file<Engine>& f, file_buffer b, std::uint64_t offset, std::size_t size)
+		{
+			MC_BEGIN(eager_task<file_buffer>, &f, b = std::move(b), offset, size
+				, n = std::size_t{}
+				, len = std::size_t{});
+
+			b.set_offset(offset);
+			b.resize(0);
+			while (b.size() < size)
+			{
+				len = size - b.size();
+
+				// direct reads must cover whole blocks. The buffer capacity
+				// is a multiple of the alignment so this stays in bounds.
+				if (f.is_direct())
+					len = std::min(b.capacity() - b.size(),
+						(len + b.alignment() - 1) / b.alignment() * b.alignment());
+
+				MC_AWAIT_SET(n, f.read_at(b.data() + b.size(), len, offset + b.size()));
+				if (n == 0)
+					break;
+				b.resize(std::min(size, b.size() + n));
+			}
+			MC_RETURN(std::move(b));
+			MC_END();
+		}
+	}
+
+	template<typename Engine>
+	void async_file<Engine>::close() noexcept
+	{
+		if (mFd >= 0)
+			detail::close_file(std::exchange(mFd, -1));
+	}
+
+	/// Streams [offset, offset + length) of f into out, in order, as
+	/// buffers of up to pool.buffer_size() bytes. Up to inFlight reads
+	/// are kept outstanding so that the device stays busy while the
+	/// consumer works. The channel is closed once the range or the file
+	/// ends. If a read fails the reads in flight are drained, the channel
+	/// is closed and the error is rethrown.
+	///
+	/// \throw std::invalid_argument if f uses direct I/O and offset or
+	/// pool.buffer_size() is not a multiple of pool.alignment(), since
+	/// every read must then start on a block boundary.
+	template<typename Engine>
+	task<> stream_file(
+		async_file<Engine>& f,
+		spsc::channel_sender<file_buffer>& out,
+		file_buffer_pool& pool,
+		std::size_t inFlight,
+		std::uint64_t offset = 0,
+		std::uint64_t length = ~std::uint64_t(0))
+	{
+		if (f.is_direct() && (offset % pool.alignment() || pool.buffer_size() % pool.alignment()))
+			throw std::invalid_argument("stream_file: direct I/O requires the offset and buffer size to be multiples of the pool's alignment.");
+
+		using read_result = result<file_buffer>;
+		using push_wrapper = spsc::channel_sender<file_buffer>::push_wrapper;
+		MC_BEGIN(task<>, &f, &out, &pool, inFlight, offset, length
+			, reads = std::vector<eager_task<file_buffer>>(std::max<std::size_t>(inFlight, 1))
+			, end = std::uint64_t{}
+			, next = std::uint64_t{}
+			, head = std::size_t{}
+			, pending = std::size_t{}
+			, chunk = std::size_t{}
+			, r = read_result{}
+			, error = result<void>{}
+			, slot = push_wrapper{});
+
+			end = f.size();
+			if (length < end - std::min(offset, end))
+				end = offset + length;
+			next = std::min(offset, end);
+			chunk = pool.buffer_size();
+
+			// fill the pipeline.
+			for (head = 0; head < reads.size() && next < end; ++head, ++pending)
+			{
+				reads[head] = detail::read_chunk(f, pool.acquire(), next,
+					static_cast<std::size_t>(std::min<std::uint64_t>(chunk, end - next)));
+				next += chunk;
+			}
+
+			head = 0;
+			while (pending)
+			{
+				MC_AWAIT_TRY(r, std::move(reads[head]));
+				--pending;
+
+				if (r.has_error())
+				{
+					// stop issuing reads but drain the ones in flight, they
+					// refer to the file and the pool.
+					if (error.has_value())
+						error = Err(r.error());
+					end = next;
+				}
+				else if (r.value().offset() + r.value().size() <
+					std::min<std::uint64_t>(end, r.value().offset() + chunk))
+				{
+					// the file is shorter than it was.
+					end = next;
+				}
+
+				if (next < end)
+				{
+					reads[head] = detail::read_chunk(f, pool.acquire(), next,
+						static_cast<std::size_t>(std::min<std::uint64_t>(chunk, end - next)));
+					next += chunk;
+					++pending;
+				}
+				head = (head + 1) % reads.size();
+
+				if (r.has_value() && error.has_value() && r.value().size())
+				{
+					MC_AWAIT_SET(slot, out.push());
+					slot = std::move(r.value());
+					slot.publish();
+				}
+				r = read_result{};
+			}
+
+			MC_AWAIT(out.close());
+			error.value();
+		MC_END();
+	}
+}
@@ -0,0 +1,242 @@
+#pragma once
+
+#include "macoro/generator.h"
+
+namespace macoro
+{
+	template<typename T>
+	class async_generator;
+
+	namespace detail
+	{
+		template<typename T>
+		class async_generator_promise : public generator_promise_base<T>
+		{
+		public:
+			using typename generator_promise_base<T>::value_type;
+			using typename generator_promise_base<T>::reference_type;
+
+			async_generator<T> get_return_object() noexcept;
+			async_generator<T> macoro_get_return_object() noexcept;
+
+			/// Transfers to the consumer that is waiting for the next value.
+			struct yield_awaiter
+			{
+				async_generator_promise* mPromise;
+
+				bool await_ready() const noexcept { return false; }
+
+#ifdef MACORO_CPP_20
+				template<typename PROMISE>
+				std::coroutine_handle<> await_suspend(std::coroutine_handle<PROMISE>) noexcept
+				{
+					return mPromise->mConsumer.std_cast();
+				}
+#endif
+				template<typename PROMISE>
+				coroutine_handle<> await_suspend(coroutine_handle<PROMISE>) noexcept
+				{
+					return mPromise->mConsumer;
+				}
+
+				void await_resume() const noexcept {}
+			};
+
+			yield_awaiter final_suspend() noexcept { return { this }; }
+
+			yield_awaiter yield_value(typename std::remove_reference<reference_type>::type& value) noexcept
+			{
+				this->mValue = std::addressof(value);
+				return { this };
+			}
+
+			yield_move_awaiter<async_generator_promise, value_type> yield_value(value_type&& value)
+				noexcept(std::is_nothrow_move_constructible<value_type>::value)
+			{
+				return { std::move(value), this };
+			}
+
+			/// Sets the coroutine to resume once the generator yields or
+			/// completes.
+			void set_consumer(coroutine_handle<> consumer) noexcept { mConsumer = consumer; }
+
+		private:
+			coroutine_handle<> mConsumer;
+		};
+
+		template<typename T>
+		class async_generator_iterator;
+
+		/// The awaiter of begin() and ++it. Resumes the generator and
+		/// suspends the consumer until it yields or completes. Both are
+		/// symmetric transfers.
+		template<typename T>
+		class async_generator_advance
+		{
+		public:
+			using promise_type = async_generator_promise<T>;
+
+			async_generator_advance(async_generator_iterator<T>& it) noexcept
+				: mIter(&it)
+			{}
+
+			bool await_ready() const noexcept { return !mIter->m_coroutine; }
+
+#ifdef MACORO_CPP_20
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<> consumer) noexcept
+			{
+				return await_suspend(coroutine_handle<>(consumer)).std_cast();
+			}
+#endif
+			coroutine_handle<> await_suspend(coroutine_handle<> consumer) noexcept
+			{
+				mIter->m_coroutine.promise().set_consumer(consumer);
+				return mIter->m_coroutine;
+			}
+
+			/// Returns the iterator, which equals end() once the generator
+			/// has completed. Rethrows its exception, if any.
+			async_generator_iterator<T>& await_resume()
+			{
+				auto& c = mIter->m_coroutine;
+				if (c && c.done())
+					std::exchange(c, nullptr).promise().rethrow_if_exception();
+				return *mIter;
+			}
+
+		private:
+			async_generator_iterator<T>* mIter;
+		};
+
+		template<typename T>
+		class async_generator_iterator
+		{
+		public:
+			using promise_type = async_generator_promise<T>;
+			using iterator_category = std::input_iterator_tag;
+			using difference_type = std::ptrdiff_t;
+			using value_type = typename promise_type::value_type;
+			using reference = typename promise_type::reference_type;
+			using pointer = typename std::remove_reference<reference>::type*;
+
+			async_generator_iterator() noexcept = default;
+
+			explicit async_generator_iterator(coroutine_handle<promise_type> coroutine) noexcept
+				: m_coroutine(coroutine)
+			{}
+
+			/// Must be awaited. Resumes the generator until it yields the
+			/// next value or completes.
+			async_generator_advance<T> operator++() noexcept { return { *this }; }
+
+			reference operator*() const noexcept { return m_coroutine.promise().value(); }
+			pointer operator->() const noexcept { return std::addressof(**this); }
+
+			bool operator==(const async_generator_iterator& o) const noexcept { return m_coroutine == o.m_coroutine; }
+			bool operator!=(const async_generator_iterator& o) const noexcept { return m_coroutine != o.m_coroutine; }
+
+		private:
+			friend class async_generator_advance<T>;
+
+			coroutine_handle<promise_type> m_coroutine;
+		};
+	}
+
+	/// \brief
+	/// A generator whose coroutine may co_await between values, e.g. to
+	/// read from a socket or to move to another thread_pool. The consumer
+	/// awaits begin() and each ++it, and is resumed on whichever thread
+	/// the generator yields from. Nothing is synchronized, the generator
+	/// only runs while its consumer is suspended on it. In C++20:
+	///
+	///   for (auto it = co_await gen.begin(); it != gen.end(); co_await ++it)
+	///
+	/// With the macros, the iterator is a frame variable:
+	///
+	///   MC_AWAIT_SET(it, gen.begin());
+	///   while (it != gen.end()) { ...; MC_AWAIT(++it); }
+	///
+	/// Values are passed as for generator: lvalues by pointer, rvalues
+	/// moved into the frame. The frame is allocated from the thread's
+	/// frame_arena, if it has one.
+	template<typename T>
+	class [[nodiscard]] async_generator
+	{
+	public:
+		using promise_type = detail::async_generator_promise<T>;
+		using iterator = detail::async_generator_iterator<T>;
+		using value_type = typename promise_type::value_type;
+
+		async_generator() noexcept = default;
+
+#ifdef MACORO_CPP_20
+		explicit async_generator(std::coroutine_handle<promise_type> coroutine) noexcept
+			: async_generator(coroutine_handle<promise_type>(coroutine))
+		{}
+#endif
+		explicit async_generator(coroutine_handle<promise_type> coroutine) noexcept
+			: m_coroutine(coroutine)
+			, m_begin(coroutine)
+		{}
+
+		async_generator(async_generator&& o) noexcept
+			: m_coroutine(std::exchange(o.m_coroutine, nullptr))
+			, m_begin(std::exchange(o.m_begin, iterator{}))
+		{}
+
+		async_generator(const async_generator&) = delete;
+		async_generator& operator=(const async_generator&) = delete;
+
+		async_generator& operator=(async_generator&& o) noexcept
+		{
+			if (std::addressof(o) != this)
+			{
+				if (m_coroutine)
+					m_coroutine.destroy();
+				m_coroutine = std::exchange(o.m_coroutine, nullptr);
+				m_begin = std::exchange(o.m_begin, iterator{});
+			}
+			return *this;
+		}
+
+		~async_generator()
+		{
+			if (m_coroutine)
+				m_coroutine.destroy();
+		}
+
+		/// Must be awaited, once. Runs the coroutine to its first value and
+		/// returns the iterator.
+		detail::async_generator_advance<T> begin() noexcept
+		{
+			return { m_begin };
+		}
+
+		iterator end() noexcept
+		{
+			return iterator{};
+		}
+
+	private:
+		coroutine_handle<promise_type> m_coroutine;
+
+		// the iterator that begin() advances, so that the awaiter has
+		// something to refer to.
+		iterator m_begin;
+	};
+
+	namespace detail
+	{
+		template<typename T>
+		async_generator<T> async_generator_promise<T>::get_return_object() noexcept
+		{
+			return async_generator<T>{ coroutine_handle<async_generator_promise>::from_promise(*this, coroutine_handle_type::std) };
+		}
+
+		template<typename T>
+		async_generator<T> async_generator_promise<T>::macoro_get_return_object() noexcept
+		{
+			return async_generator<T>{ coroutine_handle<async_generator_promise>::from_promise(*this, coroutine_handle_type::macoro) };
+		}
+	}
+}
@@ -3,6 +3,7 @@
 #include "macoro/coro_frame.h"
 #include "macoro/optional.h"
 #include "macoro/coroutine_handle.h"
+#include "macoro/detail/blocking_event.h"
 #include <future>
 #include "macros.h"
 namespace macoro
@@ -18,22 +19,16 @@ namespace macoro
 		{
 
 			std::exception_ptr exception;
-			std::mutex mutex;
-			std::condition_variable cv;
-			bool is_set = false;
+			blocking_event event;
 
 			void wait()
 			{
-				std::unique_lock<std::mutex> lock(mutex);
-				cv.wait(lock, [this] { return is_set; });
+				event.wait();
 			}
 
 			void set()
 			{
-				assert(is_set == false);
-				std::lock_guard<std::mutex> lock(this->mutex);
-				this->is_set = true;
-				this->cv.notify_all();
+				event.set();
 			}
 
 
@@ -8,6 +8,7 @@
 
 #include "macoro/config.h"
 #include "macoro/coroutine_handle.h"
+#include "macoro/detail/frame_arena.h"
 #include <array>
 #include <vector>
 #include <cstddef>
@@ -282,6 +283,14 @@ namespace macoro
 		FrameBase(const FrameBase<void>&) = delete;
 		FrameBase(FrameBase<void>&&) = delete;
 
+		// frames come from the thread's frame_arena, if it has one.
+		static void* operator new(std::size_t size) { return detail::frame_allocate(size); }
+		static void operator delete(void* ptr, std::size_t size) noexcept { detail::frame_deallocate(ptr, size); }
+#ifdef __cpp_aligned_new
+		static void* operator new(std::size_t size, std::align_val_t a) { return detail::frame_allocate(size, a); }
+		static void operator delete(void* ptr, std::size_t size, std::align_val_t a) noexcept { detail::frame_deallocate(ptr, size, a); }
+#endif
+
 		// The current suspend location of the coroutines
 		SuspensionPoint _suspension_idx_ = SuspensionPoint::InitialSuspendBegin;
 
@@ -667,6 +676,14 @@ namespace macoro
 
 					bool await_ready() { return false; }
 
+#ifdef _MSC_VER
+					// Ideally we would perform symmetric transfer here but there is
+					// a compiler bug in MSVC. Doing anything but returning here may cause
+					//  ASAN error on MSVC. See 
+					// https://developercommunity.visualstudio.com/mTask/c20-coroutine-resume-thread-safety/1668687?entry=myfeedback&space=62&ref=native&refTime=1645079575781&refUserId=36961f1e-1836-4f6a-af82-ffcfa64d75a3&viewtype=all
+					// In particular, the adpater might have already been destroyed
+					// and MSVC for some unknown reason updates the adapter frame even
+					// though the coro has already been suspended. 
 					void await_suspend(std::coroutine_handle<P>)
 					{
 						auto ll = frame->frame_adapter_storage;
@@ -675,34 +692,31 @@ namespace macoro
 						assert(h);
 						h.resume();
 					}
-					//std::coroutine_handle<> await_suspend(std::coroutine_handle<P>)
-					//{
-						//// resume our own coro
-						//auto h = (*frame)(static_cast<FrameBase<promise_type>*>(frame));
-						//assert(h);
-
-						//// Ideally we would perform sysmetric transfer here but there is
-						//// a compiler bug in MSVC. Doing anothing but returning here may cause
-						////  ASAN error on MSVC. See 
-						//// https://developercommunity.visualstudio.com/mTask/c20-coroutine-resume-thread-safety/1668687?entry=myfeedback&space=62&ref=native&refTime=1645079575781&refUserId=36961f1e-1836-4f6a-af82-ffcfa64d75a3&viewtype=all
-						//// In particular, the adpater might have already been destroyed
-						//// and MSVC for some unknown reason updates the adapter frame even
-						//// though the coro has already been suspended. 
-						//return h.std_cast();
-
-						//// we have to perform the symmetric transfer loop here for
-						//// macoro coroutines since we can only return std::coroutine_handle<>.
-						//while (h != noop_coroutine() && h.is_std() == false)
-						//{
-						//	auto realAddr = reinterpret_cast<FrameBase<void>*>((std::size_t)h.address() ^ 1);
-						//	auto _address = realAddr->resume(realAddr).address();
-						//	h = coroutine_handle<void>::from_address(_address);
-						//}
-
-						//// we either have a std coro or a noop. We can
-						//// have the std perform symmetric transfer on that. 
-						//return h.std_cast();
-					//}
+#else
+					std::coroutine_handle<> await_suspend(std::coroutine_handle<P>)
+					{
+						// the frame, and with it the adapter, may be destroyed
+						// by the coroutines we resume below.
+						auto ll = frame->frame_adapter_storage;
+
+						// resume our own coro
+						auto h = (*frame)(static_cast<FrameBase<promise_type>*>(frame));
+						assert(h);
+
+						// we have to perform the symmetric transfer loop here for
+						// macoro coroutines since we can only return std::coroutine_handle<>.
+						// Otherwise each std to macoro transfer would nest a trampoline.
+						while (h != noop_coroutine() && h.is_std() == false)
+						{
+							auto realAddr = reinterpret_cast<FrameBase<void>*>((std::size_t)h.address() ^ 1);
+							h = coroutine_handle<void>::from_address(realAddr->resume(realAddr).address());
+						}
+
+						// we either have a std coro or a noop. We can
+						// have the std perform symmetric transfer on that. 
+						return h.std_cast();
+					}
+#endif
 
 					void await_resume() {}
 				};
@@ -730,6 +744,17 @@ namespace macoro
 		return !bool((std::size_t)_address & 1);
 	}
 #endif
+
+	// the handle of a frame that is not a coroutine, e.g. an awaiter
+	// that posts itself to a scheduler.
+	inline coroutine_handle<void> _macoro_frame_handle(FrameBase<void>* frame) noexcept
+	{
+#ifdef MACORO_CPP_20
+		return coroutine_handle<void>::from_address((void*)((std::size_t)frame ^ 1));
+#else
+		return coroutine_handle<void>::from_address(frame);
+#endif
+	}
 	template<typename Promise>
 	Promise* _macoro_coro_promise(void* _address) noexcept
 	{
@@ -795,90 +820,47 @@ namespace macoro
 		return realAddr->done();
 #endif
 	}
-	inline void coroutine_handle<void>::resume() const {
-		auto _address = _Ptr;
+	// The trampoline that drives symmetric transfer for macoro frames.
+	// A macoro frame's resume() returns the coroutine to transfer to
+	// instead of resuming it, so chains of awaits and of final_suspend()
+	// continuations are run by this loop without growing the stack, until
+	// noop_coroutine() is returned. In C++20 mode a std coroutine is
+	// resumed directly and the loop returns. The std coroutine performs
+	// its own symmetric transfer. A macoro frame it transfers to is run
+	// by the frame's adapter, which continues this loop and hands the
+	// next std coroutine back to the compiler, except on MSVC where the
+	// adapter has to nest a new trampoline.
+	inline void _macoro_coro_resume(void* _address)
+	{
 		while (true)
 		{
 #ifdef MACORO_CPP_20
-
-			if (!_macoro_coro_is_std(_address))
-			{
-				if (_address == noop_coroutine().address())
-					return;
-				auto realAddr = reinterpret_cast<FrameBase<void>*>((std::size_t)_address ^ 1);
-				_address = realAddr->resume(realAddr).address();
-				assert(_address);
-			}
-			else
+			if (_macoro_coro_is_std(_address))
 			{
 				std::coroutine_handle<void>::from_address(_address).resume();
 				return;
 			}
+			if (_address == noop_coroutine().address())
+				return;
+			auto realAddr = reinterpret_cast<FrameBase<void>*>((std::size_t)_address ^ 1);
 #else
 			if (_address == noop_coroutine().address())
 				return;
 			auto realAddr = reinterpret_cast<FrameBase<void>*>((std::size_t)_address);
-			_address = realAddr->resume(realAddr).address();
 #endif
+			_address = realAddr->resume(realAddr).address();
+			assert(_address);
 		}
-		//_macoro_coro_resume(_Ptr);
 	}
+
+	inline void coroutine_handle<void>::resume() const {
+		_macoro_coro_resume(_Ptr);
+	}
+
 	template<typename T>
 	inline void coroutine_handle<T>::resume() const {
-		auto _address = _Ptr;
-		while (true)
-		{
-#ifdef MACORO_CPP_20
-
-			if (!_macoro_coro_is_std(_address))
-			{
-				if (_address == noop_coroutine().address())
-					return;
-				auto realAddr = reinterpret_cast<FrameBase<void>*>((std::size_t)_address ^ 1);
-				_address = realAddr->resume(realAddr).address();
-				assert(_address);
-			}
-			else
-			{
-				std::coroutine_handle<void>::from_address(_address).resume();
-				return;
-			}
-#else
-			if (_address == noop_coroutine().address())
-				return;
-			auto realAddr = reinterpret_cast<FrameBase<void>*>((std::size_t)_address);
-			_address = realAddr->resume(realAddr).address();
-#endif
-		}
+		_macoro_coro_resume(_Ptr);
 	}
-//
-//	inline void _macoro_coro_resume(void* _address)
-//	{
-//		while (true)
-//		{
-//#ifdef MACORO_CPP_20
-//
-//			if (!_macoro_coro_is_std(_address))
-//			{
-//				if (_address == noop_coroutine().address())
-//					return;
-//				auto realAddr = reinterpret_cast<FrameBase<void>*>((std::size_t)_address ^ 1);
-//				_address = realAddr->resume(realAddr).address();
-//				assert(_address);
-//			}
-//			else
-//			{
-//				std::coroutine_handle<void>::from_address(_address).resume();
-//				return;
-//			}
-//#else
-//			auto realAddr = reinterpret_cast<FrameBase<void>*>((std::size_t)_address);
-//			_address = realAddr->resume(realAddr).address();
-//			if (_address == noop_coroutine().address())
-//				return;
-//#endif
-//		}
-//	}
 
 	inline void _macoro_coro_destroy(void* _address)noexcept
 	{
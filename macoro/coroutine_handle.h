@@ -84,7 +84,7 @@ namespace macoro
     void* _macoro_coro_frame(void* address, coroutine_handle_type te) noexcept;
 
     bool _macoro_coro_done(void* address)noexcept;
-    //void _macoro_coro_resume(void* address);
+    void _macoro_coro_resume(void* address);
     void _macoro_coro_destroy(void* address)noexcept;
 
 
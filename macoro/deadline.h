@@ -0,0 +1,349 @@
+#pragma once
+
+#include "macoro/type_traits.h"
+#include "macoro/coroutine_handle.h"
+#include "macoro/stop.h"
+#include "macoro/detail/timer_node.h"
+
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <utility>
+#include <algorithm>
+
+namespace macoro
+{
+	using deadline_clock = std::chrono::steady_clock;
+	using deadline_time_point = deadline_clock::time_point;
+
+	namespace detail
+	{
+		/// The deadline that a task inherited from the coroutine that
+		/// awaited it. Lives in the with_deadline() awaitable that created it,
+		/// which outlives every task that refers to it.
+		///
+		/// token() is stopped once the deadline passes or the enclosing
+		/// deadline is stopped. The deadline is tracked by a single timer
+		/// that is registered with a scheduler by arm(), either by
+		/// with_deadline() if it was given one, or else by the first
+		/// deadline-aware operation that runs on a scheduler, e.g.
+		/// thread_pool::schedule_after().
+		struct deadline_context
+		{
+			deadline_time_point mDeadline;
+
+			deadline_context(deadline_time_point d)
+				: mDeadline(d)
+			{}
+
+			// only before it is armed, i.e. before it is awaited.
+			deadline_context(deadline_context&& o)
+				: mDeadline(o.mDeadline)
+				, mStop(o.mStop)
+			{
+				assert(!o.mArmed.load(std::memory_order_relaxed));
+				mTimer.mAdd = o.mTimer.mAdd;
+				mTimer.mScheduler = o.mTimer.mScheduler;
+			}
+
+			deadline_context& operator=(deadline_context&&) = delete;
+
+			~deadline_context()
+			{
+				mParentReg.reset();
+				mTimer.cancel();
+			}
+
+			stop_token token() const noexcept { return mStop.get_token(); }
+
+			/// Registers the timer with s if it is not already registered.
+			template<typename Scheduler>
+			void arm(Scheduler& s) const
+			{
+				arm(s, has_add_timer<Scheduler>{});
+			}
+
+			/// The scheduler that start() registers the timer with.
+			template<typename Scheduler>
+			void set_scheduler(Scheduler& s) noexcept
+			{
+				mTimer.mScheduler = &s;
+				mTimer.mAdd = &add_to<Scheduler>;
+			}
+
+			/// Called when the with_deadline() awaitable is awaited. A
+			/// tighter nested deadline is stopped with parent and, without
+			/// a scheduler of its own, uses the parent's.
+			void start(const deadline_context* parent)
+			{
+				if (parent)
+				{
+					mParentReg.emplace(parent->token(), [this]() {
+						mStop.request_stop();
+					});
+					if (mTimer.mAdd == nullptr)
+					{
+						mTimer.mAdd = parent->mTimer.mAdd;
+						mTimer.mScheduler = parent->mTimer.mScheduler;
+					}
+				}
+
+				if (mTimer.mAdd)
+					arm_with(mTimer.mAdd, mTimer.mScheduler);
+			}
+
+		private:
+
+			template<typename Scheduler>
+			static void add_to(void* s, timer_node& n)
+			{
+				static_cast<Scheduler*>(s)->add_timer(n);
+			}
+
+			template<typename Scheduler>
+			void arm(Scheduler& s, std::true_type) const
+			{
+				arm_with(&add_to<Scheduler>, &s);
+			}
+
+			template<typename Scheduler>
+			void arm(Scheduler&, std::false_type) const {}
+
+			void arm_with(void (*add)(void*, timer_node&), void* scheduler) const
+			{
+				if (mArmed.exchange(true, std::memory_order_acq_rel))
+					return;
+
+				if (mDeadline <= deadline_clock::now())
+				{
+					mStop.request_stop();
+					return;
+				}
+
+				mTimer.mCallback = [](timer_node* t) {
+					static_cast<const deadline_context*>(t->mContext)->mStop.request_stop(); };
+				mTimer.mContext = const_cast<deadline_context*>(this);
+				mTimer.mDeadline = mDeadline;
+				add(scheduler, mTimer);
+			}
+
+			mutable stop_source mStop;
+			mutable timer_node mTimer;
+			mutable std::atomic<bool> mArmed{ false };
+			optional_stop_callback mParentReg;
+		};
+
+		template<typename A, typename = void>
+		struct has_set_deadline : std::false_type {};
+
+		template<typename A>
+		struct has_set_deadline<A, void_t<
+			decltype(std::declval<A&>().macoro_set_deadline(std::declval<const deadline_context*>()))>>
+			: std::true_type {};
+
+		/// Passes the deadline to an awaitable that supports it. Awaitables
+		/// opt in by providing
+		///
+		///     void macoro_set_deadline(const detail::deadline_context*);
+		///
+		/// which is called before they are awaited by a task.
+		template<typename A>
+		enable_if_t<has_set_deadline<A>::value> set_deadline(A& a, const deadline_context* d)
+		{
+			a.macoro_set_deadline(d);
+		}
+
+		template<typename A>
+		enable_if_t<!has_set_deadline<A>::value> set_deadline(A&, const deadline_context*)
+		{}
+	}
+
+	/// Awaitable that returns the deadline of the current task, or
+	/// deadline_time_point::max() if there is none. Awaited outside of a
+	/// task it always returns max().
+	struct current_deadline_t
+	{
+		bool await_ready() const noexcept { return true; }
+		void await_suspend(coroutine_handle<>) const noexcept {}
+#ifdef MACORO_CPP_20
+		void await_suspend(std::coroutine_handle<>) const noexcept {}
+#endif
+		deadline_time_point await_resume() const noexcept { return deadline_time_point::max(); }
+	};
+
+	inline current_deadline_t current_deadline() noexcept { return {}; }
+
+	/// Awaitable that returns the stop_token of the current task's
+	/// deadline. It is stopped once the deadline passes, provided that
+	/// its timer has been armed, see with_deadline(). Without a deadline
+	/// the token can not be stopped.
+	struct current_deadline_token_t
+	{
+		bool await_ready() const noexcept { return true; }
+		void await_suspend(coroutine_handle<>) const noexcept {}
+#ifdef MACORO_CPP_20
+		void await_suspend(std::coroutine_handle<>) const noexcept {}
+#endif
+		stop_token await_resume() const noexcept { return {}; }
+	};
+
+	inline current_deadline_token_t current_deadline_token() noexcept { return {}; }
+
+	namespace detail
+	{
+		struct current_deadline_awaiter
+		{
+			deadline_time_point mDeadline;
+
+			bool await_ready() const noexcept { return true; }
+			void await_suspend(coroutine_handle<>) const noexcept {}
+#ifdef MACORO_CPP_20
+			void await_suspend(std::coroutine_handle<>) const noexcept {}
+#endif
+			deadline_time_point await_resume() const noexcept { return mDeadline; }
+		};
+
+		struct current_deadline_token_awaiter
+		{
+			stop_token mToken;
+
+			bool await_ready() const noexcept { return true; }
+			void await_suspend(coroutine_handle<>) const noexcept {}
+#ifdef MACORO_CPP_20
+			void await_suspend(std::coroutine_handle<>) const noexcept {}
+#endif
+			stop_token await_resume() noexcept { return std::move(mToken); }
+		};
+
+		/// Promise mixin that stores the inherited deadline and passes it
+		/// on to everything the coroutine awaits.
+		class deadline_promise_base
+		{
+		public:
+
+			template<typename A>
+			A&& await_transform(A&& a)
+			{
+				if (m_deadline)
+					set_deadline(a, m_deadline);
+				return static_cast<A&&>(a);
+			}
+
+			current_deadline_awaiter await_transform(current_deadline_t) noexcept
+			{
+				return { m_deadline ? m_deadline->mDeadline : deadline_time_point::max() };
+			}
+
+			current_deadline_token_awaiter await_transform(current_deadline_token_t) noexcept
+			{
+				return { m_deadline ? m_deadline->token() : stop_token{} };
+			}
+
+			void set_deadline_context(const deadline_context* d) noexcept
+			{
+				m_deadline = d;
+			}
+
+			const deadline_context* deadline() const noexcept
+			{
+				return m_deadline;
+			}
+
+		private:
+			const deadline_context* m_deadline = nullptr;
+		};
+	}
+
+	/// The awaitable returned by with_deadline().
+	template<typename Awaitable>
+	class with_deadline_awaitable
+	{
+	public:
+		with_deadline_awaitable(deadline_time_point d, Awaitable&& a)
+			: mAwaitable(std::move(a))
+			, mContext{ d }
+		{}
+
+		template<typename Scheduler>
+		with_deadline_awaitable(Scheduler& s, deadline_time_point d, Awaitable&& a)
+			: mAwaitable(std::move(a))
+			, mContext{ d }
+		{
+			mContext.set_scheduler(s);
+		}
+
+		with_deadline_awaitable(with_deadline_awaitable&&) = default;
+
+		void macoro_set_deadline(const detail::deadline_context* parent) noexcept
+		{
+			mParent = parent;
+		}
+
+		decltype(auto) MACORO_OPERATOR_COAWAIT() &
+		{
+			detail::set_deadline(mAwaitable, start());
+			return get_awaiter(mAwaitable);
+		}
+
+		decltype(auto) MACORO_OPERATOR_COAWAIT() &&
+		{
+			detail::set_deadline(mAwaitable, start());
+			return get_awaiter(std::move(mAwaitable));
+		}
+
+	private:
+
+		// An enclosing deadline that is at least as tight is used as is,
+		// so nested deadlines share its stop_source and timer.
+		const detail::deadline_context* start()
+		{
+			if (mParent && mParent->mDeadline <= mContext.mDeadline)
+				return mParent;
+			mContext.start(mParent);
+			return &mContext;
+		}
+
+		Awaitable mAwaitable;
+		detail::deadline_context mContext;
+		const detail::deadline_context* mParent = nullptr;
+	};
+
+	/// Awaits `a` with the deadline `d`. Tasks awaited within `a`, and
+	/// tasks they await in turn, inherit the deadline. It can be queried
+	/// with co_await current_deadline(). thread_pool::schedule_after()
+	/// will not sleep past it, and a sleep that it cuts short throws
+	/// operation_cancelled. If an enclosing deadline is earlier it is
+	/// kept.
+	///
+	/// The deadline is only propagated by tasks. when_all(), start_on(),
+	/// transfer_to() and wrap() do not pass it on to what they await.
+	template<typename Awaitable>
+	with_deadline_awaitable<remove_cvref_t<Awaitable>> with_deadline(deadline_time_point d, Awaitable&& a)
+	{
+		return { d, remove_cvref_t<Awaitable>(std::forward<Awaitable>(a)) };
+	}
+
+	template<typename Awaitable, typename Rep, typename Per>
+	with_deadline_awaitable<remove_cvref_t<Awaitable>> with_deadline(std::chrono::duration<Rep, Per> d, Awaitable&& a)
+	{
+		return { deadline_clock::now() + std::chrono::duration_cast<deadline_clock::duration>(d),
+			remove_cvref_t<Awaitable>(std::forward<Awaitable>(a)) };
+	}
+
+	/// Like with_deadline(d, a) but the deadline's timer is registered
+	/// with s, which must support add_timer(), as soon as it is awaited.
+	/// Operations that only observe the deadline's stop_token are then
+	/// stopped on time too.
+	template<typename Scheduler, typename Awaitable>
+	with_deadline_awaitable<remove_cvref_t<Awaitable>> with_deadline(Scheduler& s, deadline_time_point d, Awaitable&& a)
+	{
+		return { s, d, remove_cvref_t<Awaitable>(std::forward<Awaitable>(a)) };
+	}
+
+	template<typename Scheduler, typename Awaitable, typename Rep, typename Per>
+	with_deadline_awaitable<remove_cvref_t<Awaitable>> with_deadline(Scheduler& s, std::chrono::duration<Rep, Per> d, Awaitable&& a)
+	{
+		return { s, deadline_clock::now() + std::chrono::duration_cast<deadline_clock::duration>(d),
+			remove_cvref_t<Awaitable>(std::forward<Awaitable>(a)) };
+	}
+}
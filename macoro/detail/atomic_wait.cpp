@@ -0,0 +1,130 @@
+#include "macoro/detail/atomic_wait.h"
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <climits>
+#include <ctime>
+#else
+#include <mutex>
+#include <condition_variable>
+#include <cstddef>
+#endif
+
+namespace macoro
+{
+	namespace detail
+	{
+#if defined(__linux__)
+
+		static_assert(sizeof(std::atomic<std::uint32_t>) == sizeof(std::uint32_t),
+			"futex requires std::atomic<std::uint32_t> to be a plain 32 bit word.");
+
+		namespace
+		{
+			long futex(const void* addr, int op, std::uint32_t val,
+				const timespec* timeout = nullptr, std::uint32_t val3 = 0) noexcept
+			{
+				return ::syscall(SYS_futex, addr, op, val, timeout, nullptr, val3);
+			}
+		}
+
+		void atomic_wait(const std::atomic<std::uint32_t>& value, std::uint32_t old) noexcept
+		{
+			// EAGAIN if the value already changed, EINTR on signals. Both
+			// are handled by the caller re-checking the value.
+			if (value.load(std::memory_order_acquire) == old)
+				futex(&value, FUTEX_WAIT_PRIVATE, old);
+		}
+
+		void atomic_wait_until(
+			const std::atomic<std::uint32_t>& value,
+			std::uint32_t old,
+			std::chrono::steady_clock::time_point deadline) noexcept
+		{
+			if (deadline == std::chrono::steady_clock::time_point::max())
+				return atomic_wait(value, old);
+
+			// FUTEX_WAIT_BITSET takes an absolute CLOCK_MONOTONIC time,
+			// which is what steady_clock uses. ETIMEDOUT once it passes.
+			auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+				deadline.time_since_epoch()).count();
+			if (ns < 0)
+				return;
+			timespec ts;
+			ts.tv_sec = static_cast<time_t>(ns / 1000000000);
+			ts.tv_nsec = static_cast<long>(ns % 1000000000);
+			if (value.load(std::memory_order_acquire) == old)
+				futex(&value, FUTEX_WAIT_BITSET_PRIVATE, old, &ts, FUTEX_BITSET_MATCH_ANY);
+		}
+
+		void atomic_notify_one(std::atomic<std::uint32_t>& value) noexcept
+		{
+			futex(&value, FUTEX_WAKE_PRIVATE, 1);
+		}
+
+		void atomic_notify_all(std::atomic<std::uint32_t>& value) noexcept
+		{
+			futex(&value, FUTEX_WAKE_PRIVATE, INT_MAX);
+		}
+
+#else
+
+		namespace
+		{
+			// Waiters are hashed by address into a fixed table of buckets.
+			// Unrelated addresses may share a bucket which only results in
+			// spurious wake ups.
+			struct alignas(MACORO_CPU_CACHE_LINE) atomic_wait_bucket
+			{
+				std::mutex mMutex;
+				std::condition_variable mCondition;
+			};
+
+			atomic_wait_bucket& get_bucket(const void* addr) noexcept
+			{
+				static atomic_wait_bucket buckets[64];
+				auto i = (reinterpret_cast<std::size_t>(addr) >> 4) % 64;
+				return buckets[i];
+			}
+		}
+
+		void atomic_wait(const std::atomic<std::uint32_t>& value, std::uint32_t old) noexcept
+		{
+			auto& b = get_bucket(&value);
+			std::unique_lock<std::mutex> lock(b.mMutex);
+			if (value.load(std::memory_order_acquire) == old)
+				b.mCondition.wait(lock);
+		}
+
+		void atomic_wait_until(
+			const std::atomic<std::uint32_t>& value,
+			std::uint32_t old,
+			std::chrono::steady_clock::time_point deadline) noexcept
+		{
+			auto& b = get_bucket(&value);
+			std::unique_lock<std::mutex> lock(b.mMutex);
+			if (value.load(std::memory_order_acquire) == old)
+				b.mCondition.wait_until(lock, deadline);
+		}
+
+		void atomic_notify_one(std::atomic<std::uint32_t>& value) noexcept
+		{
+			// the bucket may be shared so everyone is woken.
+			atomic_notify_all(value);
+		}
+
+		void atomic_notify_all(std::atomic<std::uint32_t>& value) noexcept
+		{
+			auto& b = get_bucket(&value);
+			{
+				// acquire the lock so that a waiter can not miss the
+				// notification between checking the value and waiting.
+				std::lock_guard<std::mutex> lock(b.mMutex);
+			}
+			b.mCondition.notify_all();
+		}
+#endif
+	}
+}
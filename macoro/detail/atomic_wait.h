@@ -0,0 +1,56 @@
+#pragma once
+
+#include "macoro/config.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+namespace macoro
+{
+	namespace detail
+	{
+		/// Hint to the processor that we are in a spin loop.
+		inline void cpu_relax() noexcept
+		{
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+			_mm_pause();
+#elif defined(__x86_64__) || defined(__i386__)
+			_mm_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+			asm volatile("yield");
+#endif
+		}
+
+		/// Blocks the calling thread while `value == old`. Like
+		/// std::atomic::wait this may return spuriously, callers should
+		/// re-check their condition in a loop.
+		///
+		/// A futex is used on Linux and a table of mutex/condition
+		/// variables elsewhere.
+		void atomic_wait(const std::atomic<std::uint32_t>& value, std::uint32_t old) noexcept;
+
+		/// Like atomic_wait() but also returns once deadline has passed.
+		void atomic_wait_until(
+			const std::atomic<std::uint32_t>& value,
+			std::uint32_t old,
+			std::chrono::steady_clock::time_point deadline) noexcept;
+
+		/// Wakes one thread blocked in atomic_wait() on value.
+		void atomic_notify_one(std::atomic<std::uint32_t>& value) noexcept;
+
+		/// Wakes all threads blocked in atomic_wait() on value.
+		///
+		/// Both notify functions only use the address of value, never its
+		/// contents, so they may be called after a woken thread has
+		/// destroyed it. Other threads waiting on a reused address may see
+		/// a spurious wake up.
+		void atomic_notify_all(std::atomic<std::uint32_t>& value) noexcept;
+	}
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include "macoro/config.h"
+#include "macoro/detail/atomic_wait.h"
+
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+
+namespace macoro
+{
+	namespace detail
+	{
+		using before_block_fn = void(*)();
+
+		/// Called by the calling thread before it sleeps in
+		/// blocking_event::wait(), if set. A scheduler that keeps work on
+		/// a thread where no other thread can run it, like thread_pool's
+		/// next slot, sets it to hand that work back first.
+		inline before_block_fn& before_block() noexcept
+		{
+			static thread_local before_block_fn fn = nullptr;
+			return fn;
+		}
+
+		/// A one-shot event that a single thread blocks on, e.g. in
+		/// sync_wait(). It is one 32 bit word. If set() happens first, as
+		/// when the awaitable completes synchronously, wait() returns
+		/// without blocking and set() makes no system call.
+		class blocking_event
+		{
+		public:
+
+			void wait() noexcept
+			{
+				std::uint32_t s = mState.load(std::memory_order_acquire);
+				if (s == set_state)
+					return;
+
+				// announce that we are going to sleep so that set() knows
+				// to wake us.
+				assert(s == empty_state);
+				if (mState.compare_exchange_strong(s, waiting_state,
+					std::memory_order_acq_rel, std::memory_order_acquire))
+				{
+					if (auto fn = before_block())
+						fn();
+					while (mState.load(std::memory_order_acquire) != set_state)
+						atomic_wait(mState, waiting_state);
+				}
+			}
+
+			void set() noexcept
+			{
+				auto s = mState.exchange(set_state, std::memory_order_acq_rel);
+				assert(s != set_state);
+
+				// the waiter may already have returned and destroyed the
+				// event. atomic_notify_all() only uses the address, unlike
+				// std::atomic::notify_all(), so this is fine.
+				if (s == waiting_state)
+					atomic_notify_all(mState);
+			}
+
+			bool is_set() const noexcept
+			{
+				return mState.load(std::memory_order_acquire) == set_state;
+			}
+
+		private:
+
+			enum : std::uint32_t
+			{
+				empty_state,
+				waiting_state,
+				set_state
+			};
+
+			std::atomic<std::uint32_t> mState{ empty_state };
+		};
+	}
+}
@@ -0,0 +1,279 @@
+#include "macoro/detail/frame_arena.h"
+
+#include <cassert>
+#include <cstdint>
+#include <utility>
+
+namespace macoro
+{
+	namespace detail
+	{
+		struct frame_free_block
+		{
+			frame_free_block* mNext;
+		};
+
+		namespace
+		{
+			// the byte past every frame.
+			enum : unsigned char
+			{
+				from_heap,
+				from_arena
+			};
+
+			unsigned char& frame_tag(void* ptr, std::size_t size) noexcept
+			{
+				return static_cast<unsigned char*>(ptr)[size];
+			}
+
+			// an arena block holds the frame, its tag and, in the last
+			// word, the arena.
+			std::size_t block_bytes(std::size_t size) noexcept
+			{
+				auto g = frame_arena::granularity;
+				return (size + 1 + sizeof(void*) + g - 1) / g * g;
+			}
+
+			frame_arena*& block_arena(void* block, std::size_t bytes) noexcept
+			{
+				return *reinterpret_cast<frame_arena**>(static_cast<char*>(block) + bytes - sizeof(void*));
+			}
+
+			void* heap_allocate(std::size_t size)
+			{
+				auto ptr = ::operator new(size + 1);
+				frame_tag(ptr, size) = from_heap;
+				return ptr;
+			}
+
+			// Set once this thread's cache has been destroyed. Frames are
+			// then allocated from the heap and freed as if by another
+			// thread. It is trivially destructible so that it can be read
+			// during teardown.
+			thread_local bool t_frame_cache_destroyed = false;
+		}
+
+		// The calling thread's blocks of one arena.
+		struct frame_cache
+		{
+			frame_arena* mArena = nullptr;
+			frame_free_block* mFree[frame_arena::class_count] = {};
+			char* mCur = nullptr;
+			char* mEnd = nullptr;
+
+			// frames allocated minus frames freed through this cache.
+			std::int64_t mBalance = 0;
+
+			~frame_cache()
+			{
+				t_frame_cache_destroyed = true;
+				unbind();
+			}
+
+			void* allocate(frame_arena* arena, std::size_t size)
+			{
+				auto bytes = block_bytes(size);
+				auto sizeClass = bytes / frame_arena::granularity - 1;
+				if (sizeClass >= frame_arena::class_count)
+					return heap_allocate(size);
+
+				if (mArena != arena)
+					bind(arena);
+
+				// take back what other threads have freed.
+				auto& remote = mArena->mRemote[sizeClass];
+				if (mFree[sizeClass] == nullptr && remote.load(std::memory_order_relaxed))
+					mFree[sizeClass] = remote.exchange(nullptr, std::memory_order_acquire);
+
+				void* block;
+				if (mFree[sizeClass])
+				{
+					block = mFree[sizeClass];
+					mFree[sizeClass] = mFree[sizeClass]->mNext;
+				}
+				else
+				{
+					// the rest of the old chunk is dropped.
+					if (std::size_t(mEnd - mCur) < bytes)
+					{
+						mCur = mArena->allocate_chunk();
+						mEnd = mCur + frame_arena::chunk_size;
+					}
+					block = mCur;
+					mCur += bytes;
+				}
+
+				++mBalance;
+				frame_tag(block, size) = from_arena;
+				block_arena(block, bytes) = mArena;
+				return block;
+			}
+
+			// false if the block belongs to another arena.
+			bool deallocate(frame_arena* arena, void* block, std::size_t sizeClass) noexcept
+			{
+				if (arena != mArena)
+					return false;
+
+				auto b = static_cast<frame_free_block*>(block);
+				b->mNext = mFree[sizeClass];
+				mFree[sizeClass] = b;
+				--mBalance;
+				return true;
+			}
+
+			void bind(frame_arena* arena)
+			{
+				unbind();
+				arena->add(frame_arena::one_bound);
+				mArena = arena;
+			}
+
+			// gives the free blocks to the other threads and settles the
+			// balance.
+			void unbind() noexcept
+			{
+				if (mArena == nullptr)
+					return;
+
+				for (std::size_t i = 0; i < frame_arena::class_count; ++i)
+				{
+					if (auto first = std::exchange(mFree[i], nullptr))
+					{
+						auto last = first;
+						while (last->mNext)
+							last = last->mNext;
+						mArena->free_remote(i, first, last);
+					}
+				}
+
+				mCur = mEnd = nullptr;
+				auto arena = std::exchange(mArena, nullptr);
+				auto balance = std::exchange(mBalance, 0);
+				arena->add(std::uint64_t(balance) - frame_arena::one_bound);
+			}
+		};
+
+		namespace
+		{
+			thread_local frame_cache t_frame_cache;
+		}
+
+		constexpr std::size_t frame_arena::chunk_size;
+		constexpr std::size_t frame_arena::granularity;
+		constexpr std::size_t frame_arena::class_count;
+		constexpr std::uint64_t frame_arena::one_bound;
+
+		frame_arena* frame_arena::create()
+		{
+			return new frame_arena;
+		}
+
+		frame_arena::~frame_arena()
+		{
+			for (auto c : mChunks)
+				::operator delete(c);
+		}
+
+		void frame_arena::release() noexcept
+		{
+			add(std::uint64_t(0) - one_bound);
+		}
+
+		void frame_arena::add(std::uint64_t delta) noexcept
+		{
+			if (mState.fetch_add(delta, std::memory_order_acq_rel) + delta == 0)
+				delete this;
+		}
+
+		frame_arena*& frame_arena::current() noexcept
+		{
+			static thread_local frame_arena* arena = nullptr;
+			return arena;
+		}
+
+		char* frame_arena::allocate_chunk()
+		{
+			void* c;
+			{
+				std::lock_guard<std::mutex> lock(mMutex);
+				mChunks.reserve(mChunks.size() + 1);
+				c = ::operator new(chunk_size + granularity);
+				mChunks.push_back(c);
+			}
+			auto p = reinterpret_cast<std::uintptr_t>(c);
+			return reinterpret_cast<char*>((p + granularity - 1) / granularity * granularity);
+		}
+
+		void frame_arena::free_remote(std::size_t sizeClass, frame_free_block* first, frame_free_block* last) noexcept
+		{
+			// only ever popped by exchanging the whole list, so there is
+			// no ABA problem.
+			auto& head = mRemote[sizeClass];
+			auto h = head.load(std::memory_order_relaxed);
+			do
+			{
+				last->mNext = h;
+			} while (!head.compare_exchange_weak(h, first,
+				std::memory_order_release, std::memory_order_relaxed));
+		}
+
+		void deallocate_block(void* block, std::size_t size) noexcept
+		{
+			auto bytes = block_bytes(size);
+			auto sizeClass = bytes / frame_arena::granularity - 1;
+			auto arena = block_arena(block, bytes);
+			if (!t_frame_cache_destroyed && t_frame_cache.deallocate(arena, block, sizeClass))
+				return;
+
+			auto b = static_cast<frame_free_block*>(block);
+			arena->free_remote(sizeClass, b, b);
+			arena->add(std::uint64_t(0) - 1);
+		}
+
+		void* frame_allocate(std::size_t size)
+		{
+			auto arena = frame_arena::current();
+			if (arena && !t_frame_cache_destroyed)
+				return t_frame_cache.allocate(arena, size);
+			return heap_allocate(size);
+		}
+
+		void frame_deallocate(void* ptr, std::size_t size) noexcept
+		{
+			if (ptr == nullptr)
+				return;
+
+			if (frame_tag(ptr, size) == from_arena)
+				deallocate_block(ptr, size);
+			else
+				::operator delete(ptr);
+		}
+
+#ifdef __cpp_aligned_new
+		void* frame_allocate(std::size_t size, std::align_val_t align)
+		{
+			// arena blocks are aligned to the granularity.
+			auto arena = frame_arena::current();
+			if (arena && !t_frame_cache_destroyed && std::size_t(align) <= frame_arena::granularity)
+				return t_frame_cache.allocate(arena, size);
+
+			auto ptr = ::operator new(size + 1, align);
+			frame_tag(ptr, size) = from_heap;
+			return ptr;
+		}
+
+		void frame_deallocate(void* ptr, std::size_t size, std::align_val_t align) noexcept
+		{
+			if (ptr == nullptr)
+				return;
+
+			if (frame_tag(ptr, size) == from_arena)
+				deallocate_block(ptr, size);
+			else
+				::operator delete(ptr, align);
+		}
+#endif
+	}
+}
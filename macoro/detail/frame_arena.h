@@ -0,0 +1,96 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <vector>
+
+namespace macoro
+{
+	namespace detail
+	{
+		struct frame_cache;
+		struct frame_free_block;
+		void deallocate_block(void* block, std::size_t size) noexcept;
+
+		/// A pool of coroutine frame memory. While a thread has a current
+		/// arena, the lambda coroutine frames it creates are carved from
+		/// the arena's chunks. numa_thread_pool gives each node an arena
+		/// so that, by first touch, frames live in the node's memory.
+		///
+		/// Each thread allocates from a cache of its own that is bound to
+		/// one arena at a time, and frees that arena's frames back to it,
+		/// without locking. Frames freed by other threads go to a lock-free
+		/// list that the caches refill from. A cache gives its frames back
+		/// when it moves to another arena or its thread exits.
+		///
+		/// The arena lives until its owner has released it, no cache is
+		/// bound to it and every frame has been freed.
+		class frame_arena
+		{
+		public:
+			/// Allocates a new arena with a reference held by the caller.
+			///
+			/// \throw std::bad_alloc
+			static frame_arena* create();
+
+			/// Drops the caller's reference.
+			void release() noexcept;
+
+			/// The arena that frames created by this thread come from.
+			static frame_arena*& current() noexcept;
+
+			/// The number of bytes in each chunk.
+			static constexpr std::size_t chunk_size = 1 << 16;
+
+			/// Blocks are multiples of this, and aligned to it.
+			static constexpr std::size_t granularity = 64;
+
+		private:
+			friend struct frame_cache;
+			friend void deallocate_block(void* block, std::size_t size) noexcept;
+
+			static constexpr std::size_t class_count = 32;
+
+			// bound caches and the owner, in units of one_bound, plus the
+			// frames that are known to be outstanding. The frames that a
+			// cache has allocated or freed are only added when it unbinds,
+			// until then the cache keeps the arena alive.
+			static constexpr std::uint64_t one_bound = std::uint64_t(1) << 32;
+
+			frame_arena() = default;
+			~frame_arena();
+
+			void add(std::uint64_t delta) noexcept;
+
+			// a new chunk, aligned to granularity, first touched by the
+			// caller.
+			char* allocate_chunk();
+
+			void free_remote(std::size_t sizeClass, frame_free_block* first, frame_free_block* last) noexcept;
+
+			std::mutex mMutex;
+			std::vector<void*> mChunks;
+			std::atomic<frame_free_block*> mRemote[class_count] = {};
+			std::atomic<std::uint64_t> mState{ one_bound };
+		};
+
+		/// Allocates a lambda coroutine frame, from frame_arena::current()
+		/// if set and otherwise from the global heap. One byte past the
+		/// frame records where it came from, so size must be passed back
+		/// to frame_deallocate().
+		void* frame_allocate(std::size_t size);
+
+		/// Frees a frame from frame_allocate() on any thread.
+		void frame_deallocate(void* ptr, std::size_t size) noexcept;
+
+#ifdef __cpp_aligned_new
+		/// Over-aligned frames. Alignments up to frame_arena::granularity
+		/// are served by the arena, larger ones by the global heap.
+		void* frame_allocate(std::size_t size, std::align_val_t align);
+		void frame_deallocate(void* ptr, std::size_t size, std::align_val_t align) noexcept;
+#endif
+	}
+}
@@ -0,0 +1,407 @@
+#pragma once
+
+#include "macoro/detail/stop_callback.h"
+#include "macoro/detail/operation_cancelled.h"
+#include "macoro/type_traits.h"
+
+#include <functional>
+#include <utility>
+#include <cstdint>
+#include <cassert>
+
+namespace macoro
+{
+	class local_stop_source;
+	class local_stop_token;
+	class local_stop_callback;
+
+	namespace detail
+	{
+		/// The shared state of a local_stop_source and its tokens.
+		///
+		/// Unlike stop_state, none of the operations here are synchronized.
+		/// All sources, tokens and callbacks that refer to the same state
+		/// must be used from a single thread at a time.
+		class local_stop_state
+		{
+		public:
+
+			static local_stop_state* create() { return new local_stop_state(); }
+
+			void add_source_ref() noexcept { ++m_sourceRefs; }
+
+			void release_source_ref() noexcept
+			{
+				assert(m_sourceRefs);
+				if (--m_sourceRefs == 0 && m_tokenRefs == 0)
+					delete this;
+			}
+
+			void add_token_ref() noexcept { ++m_tokenRefs; }
+
+			void release_token_ref() noexcept
+			{
+				assert(m_tokenRefs);
+				if (--m_tokenRefs == 0 && m_sourceRefs == 0)
+					delete this;
+			}
+
+			bool stop_requested() const noexcept { return m_requested; }
+
+			/// Query if stop has been requested or there is still a source
+			/// that could request it.
+			bool stop_possible() const noexcept { return m_requested || m_sourceRefs != 0; }
+
+			/// Sets the stop flag and invokes the registered callbacks in
+			/// the order they were registered. Returns false if stop had
+			/// already been requested.
+			bool request_stop() noexcept;
+
+			/// Links the callback into the list. Returns false if stop has
+			/// already been requested, in which case the caller should
+			/// invoke the callback itself.
+			bool try_register_callback(local_stop_callback* cb) noexcept;
+
+			/// Unlinks the callback if it has not already been invoked.
+			void deregister_callback(local_stop_callback* cb) noexcept;
+
+		private:
+
+			local_stop_state() = default;
+
+			std::uint32_t m_sourceRefs = 1;
+			std::uint32_t m_tokenRefs = 0;
+			bool m_requested = false;
+
+			// Intrusive list of registered callbacks.
+			local_stop_callback* m_head = nullptr;
+			local_stop_callback* m_tail = nullptr;
+		};
+	}
+
+	/// A stop_token for cancellation scopes that never cross threads.
+	///
+	/// Has the same interface as stop_token but the reference counts and
+	/// callback list are not atomic. A local_stop_token, its source and
+	/// all registered callbacks must only be used from a single thread
+	/// at a time, e.g. a coroutine tree that is pinned to one thread.
+	class local_stop_token
+	{
+	public:
+
+		/// Construct to a cancellation token that can't be cancelled.
+		local_stop_token() noexcept
+			: m_state(nullptr)
+		{}
+
+		local_stop_token(const local_stop_token& other) noexcept
+			: m_state(other.m_state)
+		{
+			if (m_state)
+				m_state->add_token_ref();
+		}
+
+		local_stop_token(local_stop_token&& other) noexcept
+			: m_state(std::exchange(other.m_state, nullptr))
+		{}
+
+		~local_stop_token()
+		{
+			if (m_state)
+				m_state->release_token_ref();
+		}
+
+		local_stop_token& operator=(const local_stop_token& other) noexcept
+		{
+			if (other.m_state != m_state)
+			{
+				if (m_state)
+					m_state->release_token_ref();
+				m_state = other.m_state;
+				if (m_state)
+					m_state->add_token_ref();
+			}
+			return *this;
+		}
+
+		local_stop_token& operator=(local_stop_token&& other) noexcept
+		{
+			if (this != &other)
+			{
+				if (m_state)
+					m_state->release_token_ref();
+				m_state = std::exchange(other.m_state, nullptr);
+			}
+			return *this;
+		}
+
+		void swap(local_stop_token& other) noexcept
+		{
+			std::swap(m_state, other.m_state);
+		}
+
+		/// Query if it is possible that this operation will be cancelled
+		/// or not.
+		bool stop_possible() const noexcept
+		{
+			return m_state && m_state->stop_possible();
+		}
+
+		/// Query if cancellation has been requested on the associated
+		/// local_stop_source.
+		bool stop_requested() const noexcept
+		{
+			return m_state && m_state->stop_requested();
+		}
+
+		/// Throws macoro::operation_cancelled exception if cancellation
+		/// has been requested for the associated operation.
+		void throw_if_stop_requested() const
+		{
+			if (stop_requested())
+				throw operation_cancelled{};
+		}
+
+	private:
+
+		friend class local_stop_source;
+		friend class local_stop_callback;
+
+		// takes ownership of a token reference.
+		local_stop_token(detail::local_stop_state* state) noexcept
+			: m_state(state)
+		{}
+
+		detail::local_stop_state* m_state;
+	};
+
+	inline void swap(local_stop_token& a, local_stop_token& b) noexcept
+	{
+		a.swap(b);
+	}
+
+	/// The single threaded counterpart of stop_source.
+	class local_stop_source
+	{
+	public:
+
+		/// Construct to a new cancellation source.
+		local_stop_source()
+			: m_state(detail::local_stop_state::create())
+		{}
+
+		local_stop_source(const local_stop_source& other) noexcept
+			: m_state(other.m_state)
+		{
+			if (m_state)
+				m_state->add_source_ref();
+		}
+
+		local_stop_source(local_stop_source&& other) noexcept
+			: m_state(std::exchange(other.m_state, nullptr))
+		{}
+
+		~local_stop_source()
+		{
+			if (m_state)
+				m_state->release_source_ref();
+		}
+
+		local_stop_source& operator=(const local_stop_source& other) noexcept
+		{
+			if (other.m_state != m_state)
+			{
+				if (m_state)
+					m_state->release_source_ref();
+				m_state = other.m_state;
+				if (m_state)
+					m_state->add_source_ref();
+			}
+			return *this;
+		}
+
+		local_stop_source& operator=(local_stop_source&& other) noexcept
+		{
+			if (this != &other)
+			{
+				if (m_state)
+					m_state->release_source_ref();
+				m_state = std::exchange(other.m_state, nullptr);
+			}
+			return *this;
+		}
+
+		/// Query if this cancellation source can be cancelled. Returns
+		/// false if the source has been moved from.
+		bool stop_possible() const noexcept { return m_state != nullptr; }
+
+		/// Obtain a token that can be used to query if cancellation has
+		/// been requested on this source.
+		local_stop_token get_token() const noexcept
+		{
+			if (m_state)
+				m_state->add_token_ref();
+			return local_stop_token(m_state);
+		}
+
+		/// Request cancellation. Registered callbacks are invoked inside
+		/// this call in the order they were registered.
+		///
+		/// This operation is a no-op if stop_possible() returns false.
+		void request_stop()
+		{
+			if (m_state)
+				m_state->request_stop();
+		}
+
+		bool stop_requested() const noexcept
+		{
+			return m_state && m_state->stop_requested();
+		}
+
+	private:
+
+		detail::local_stop_state* m_state;
+	};
+
+	/// The single threaded counterpart of stop_callback.
+	///
+	/// Registration and deregistration are O(1) list operations and never
+	/// allocate beyond what std::function requires for the callable.
+	class local_stop_callback
+	{
+	public:
+
+		/// Registers the callback to be executed when cancellation is
+		/// requested on the token. If cancellation has already been
+		/// requested the callback is executed before the constructor
+		/// returns. The callback must not throw.
+		template<
+			typename FUNC,
+			typename = enable_if_t<std::is_constructible<std::function<void()>, FUNC&&>::value>>
+		local_stop_callback(local_stop_token token, FUNC&& callback)
+			: m_callback(std::forward<FUNC>(callback))
+		{
+			register_callback(std::move(token));
+		}
+
+		local_stop_callback(const local_stop_callback&) = delete;
+		local_stop_callback& operator=(const local_stop_callback&) = delete;
+
+		/// Deregisters the callback. It is safe to destroy the callback
+		/// from within its own invocation.
+		~local_stop_callback()
+		{
+			if (m_state)
+			{
+				m_state->deregister_callback(this);
+				m_state->release_token_ref();
+			}
+		}
+
+	private:
+
+		friend class detail::local_stop_state;
+
+		void register_callback(local_stop_token&& token)
+		{
+			auto* state = token.m_state;
+			if (state != nullptr && state->stop_possible())
+			{
+				if (state->try_register_callback(this))
+				{
+					m_state = std::exchange(token.m_state, nullptr);
+				}
+				else
+				{
+					m_callback();
+				}
+			}
+		}
+
+		detail::local_stop_state* m_state = nullptr;
+		std::function<void()> m_callback;
+
+		// Intrusive list links. m_linked is cleared once the callback
+		// has been removed from the list, either by deregistration or
+		// because it is about to be invoked.
+		local_stop_callback* m_prev = nullptr;
+		local_stop_callback* m_next = nullptr;
+		bool m_linked = false;
+	};
+
+	template<>
+	struct stop_callback_for<local_stop_token>
+	{
+		using type = local_stop_callback;
+	};
+
+	using optional_local_stop_callback = basic_optional_stop_callback<local_stop_callback>;
+
+	namespace detail
+	{
+		inline bool local_stop_state::request_stop() noexcept
+		{
+			if (m_requested)
+				return false;
+			m_requested = true;
+
+			// keep the state alive in case a callback releases the last
+			// reference to it.
+			add_source_ref();
+
+			// Each callback is unlinked before it is invoked so that it
+			// may deregister itself, or any other callback, while running.
+			while (m_head)
+			{
+				auto cb = m_head;
+				m_head = cb->m_next;
+				if (m_head)
+					m_head->m_prev = nullptr;
+				else
+					m_tail = nullptr;
+
+				cb->m_linked = false;
+				cb->m_prev = cb->m_next = nullptr;
+				cb->m_callback();
+			}
+
+			release_source_ref();
+			return true;
+		}
+
+		inline bool local_stop_state::try_register_callback(local_stop_callback* cb) noexcept
+		{
+			if (m_requested)
+				return false;
+
+			cb->m_prev = m_tail;
+			cb->m_next = nullptr;
+			cb->m_linked = true;
+			if (m_tail)
+				m_tail->m_next = cb;
+			else
+				m_head = cb;
+			m_tail = cb;
+			return true;
+		}
+
+		inline void local_stop_state::deregister_callback(local_stop_callback* cb) noexcept
+		{
+			if (cb->m_linked == false)
+				return;
+
+			if (cb->m_prev)
+				cb->m_prev->m_next = cb->m_next;
+			else
+				m_head = cb->m_next;
+
+			if (cb->m_next)
+				cb->m_next->m_prev = cb->m_prev;
+			else
+				m_tail = cb->m_prev;
+
+			cb->m_linked = false;
+		}
+	}
+}
@@ -13,6 +13,7 @@
 #include <atomic>
 #include <cstdint>
 #include <memory>
+#include <cassert>
 
 namespace macoro
 {
@@ -80,68 +81,96 @@ namespace macoro
 
 		detail::stop_state* m_state;
 		std::function<void()> m_callback;
+
+		// The chunk and index of the slot that holds this registration.
+		// m_chunk is null if the slot is one of the stop_state's inline slots.
 		detail::stop_callback_list_chunk* m_chunk;
 		std::uint32_t m_entryIndex;
 	};
 
-	namespace detail
+	/// Maps a stop token type to the callback type that registers with it.
+	template<typename Token>
+	struct stop_callback_for;
+
+	template<>
+	struct stop_callback_for<stop_token>
 	{
+		using type = stop_callback;
+	};
 
-		//struct RVO_TEST
-		//{
-		//	RVO_TEST(int) {};
-		//	RVO_TEST(const RVO_TEST&) = delete;
-		//	RVO_TEST(RVO_TEST&&) = delete;
-		//};
+	template<typename Token>
+	using stop_callback_for_t = typename stop_callback_for<remove_cvref_t<Token>>::type;
+
+	/// Inline storage for a stop callback that may or may not be registered.
+	///
+	/// A registered callback can not be relocated since the stop state
+	/// holds a pointer to it. Rather than placing the callback on the heap,
+	/// this type only allows itself to be moved while it is empty. This is
+	/// sufficient for awaiters which are moved around before await_suspend()
+	/// is called and the callback is emplaced.
+	template<typename Callback>
+	class basic_optional_stop_callback
+	{
+	public:
+		basic_optional_stop_callback() = default;
+		basic_optional_stop_callback(const basic_optional_stop_callback&) = delete;
+		basic_optional_stop_callback& operator=(const basic_optional_stop_callback&) = delete;
 
+		basic_optional_stop_callback(basic_optional_stop_callback&& other) noexcept
+		{
+			assert(!other.has_value() && "a registered stop callback can not be moved.");
+			(void)other;
+		}
 
-		//inline stop_callback CALL_RVO_TEST2()
-		//{
-		//	return {  };
-		//}
+		basic_optional_stop_callback& operator=(basic_optional_stop_callback&& other) noexcept
+		{
+			assert(!other.has_value() && "a registered stop callback can not be moved.");
+			(void)other;
+			reset();
+			return *this;
+		}
 
+		~basic_optional_stop_callback()
+		{
+			reset();
+		}
 
-		inline void CALL_RVO_TEST1()
+		explicit operator bool() const noexcept
 		{
-			optional<stop_callback> t;
-			t.emplace(stop_token{}, []() {});
+			return mHasValue;
 		}
-	}
 
-#ifndef MACORO_RVO
-	#if defined(MACORO_CPP20) 
-		#define MACORO_RVO 1
-	#else 
-		#define MACORO_RVO 0
-	#endif
-#endif // !MACORO_RVO
-
-#if MACORO_RVO
-	using optional_stop_callback = optional<stop_callback>;
-#else
-	struct optional_stop_callback : std::unique_ptr<stop_callback>
-	{
-		operator bool() const
+		bool has_value() const noexcept
 		{
-			return get();
+			return mHasValue;
 		}
 
 		template<typename... Args>
-		stop_callback& emplace(Args&&... args)
+		Callback& emplace(Args&&... args)
 		{
-			reset(new stop_callback(std::forward<Args>(args)...));
-			return value();
+			reset();
+			auto* cb = ::new (static_cast<void*>(&mStorage)) Callback(std::forward<Args>(args)...);
+			mHasValue = true;
+			return *cb;
 		}
 
-		bool has_value() const
+		/// Deregisters and destroys the callback if there is one.
+		void reset() noexcept
 		{
-			return *this;
+			if (mHasValue)
+			{
+				value().~Callback();
+				mHasValue = false;
+			}
 		}
 
-		stop_callback& value() { return *get(); }
-		const stop_callback& value() const { return *get(); }
+		Callback& value() noexcept { assert(mHasValue); return *reinterpret_cast<Callback*>(&mStorage); }
+		const Callback& value() const noexcept { assert(mHasValue); return *reinterpret_cast<const Callback*>(&mStorage); }
+
+	private:
+		typename std::aligned_storage<sizeof(Callback), alignof(Callback)>::type mStorage;
+		bool mHasValue = false;
 	};
 
-#endif
+	using optional_stop_callback = basic_optional_stop_callback<stop_callback>;
 }
-
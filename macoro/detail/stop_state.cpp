@@ -8,7 +8,9 @@
 #include "macoro/config.h"
 
 #include "macoro/detail/stop_callback.h"
+#include "macoro/detail/atomic_wait.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cstdlib>
 
@@ -58,8 +60,6 @@ namespace macoro
 			stop_callback_result add_registration(
 				macoro::stop_callback* registration);
 
-			std::thread::id m_notificationThreadId;
-
 			// Store N separate lists and randomly apportion threads to a given
 			// list to reduce chance of contention.
 			std::uint32_t m_listCount;
@@ -326,14 +326,160 @@ macoro::detail::stop_callback_state::add_registration(
 	}
 }
 
+namespace macoro
+{
+	namespace detail
+	{
+		namespace
+		{
+			// A released stop_state is reinterpreted as one of these
+			// so that it can be threaded onto a freelist.
+			struct stop_state_pool_node
+			{
+				stop_state_pool_node* m_next;
+			};
+
+			static_assert(sizeof(stop_state_pool_node) <= sizeof(stop_state), "");
+
+			// The maximum number of objects that each thread caches locally
+			// and the (approximate) maximum number held by the global list.
+			constexpr std::size_t stop_state_local_cache_size = 64;
+			constexpr std::size_t stop_state_global_cache_size = 4096;
+
+			// The global freelist is a lock-free intrusive stack. Nodes are only
+			// ever pushed individually and popped by taking the whole list with
+			// a single exchange. This avoids the ABA problem that a node-at-a-time
+			// pop would have. The size is added before a push and subtracted
+			// after an exchange, so it never counts fewer nodes than the list
+			// holds.
+			std::atomic<stop_state_pool_node*> g_stop_state_freelist(nullptr);
+			std::atomic<std::size_t> g_stop_state_freelist_size(0);
+
+			void push_global(stop_state_pool_node* first, stop_state_pool_node* last, std::size_t count) noexcept
+			{
+				g_stop_state_freelist_size.fetch_add(count, std::memory_order_relaxed);
+				auto* head = g_stop_state_freelist.load(std::memory_order_relaxed);
+				do
+				{
+					last->m_next = head;
+				} while (!g_stop_state_freelist.compare_exchange_weak(
+					head,
+					first,
+					std::memory_order_release,
+					std::memory_order_relaxed));
+			}
+
+			// Set once this thread's cache has been destroyed. A stop_state
+			// may still be released after that, e.g. by a static or another
+			// thread_local, and then bypasses the cache. It is trivially
+			// destructible so that it can be read during teardown.
+			thread_local bool t_stop_state_cache_destroyed = false;
+
+			void release_global(void* ptr) noexcept
+			{
+				auto* node = static_cast<stop_state_pool_node*>(ptr);
+				if (g_stop_state_freelist_size.load(std::memory_order_relaxed) < stop_state_global_cache_size)
+					push_global(node, node, 1);
+				else
+					::operator delete(ptr);
+			}
+
+			struct stop_state_local_cache
+			{
+				stop_state_pool_node* m_head = nullptr;
+				std::size_t m_size = 0;
+
+				~stop_state_local_cache()
+				{
+					t_stop_state_cache_destroyed = true;
+
+					// give our cached objects back to the other threads.
+					if (m_head)
+					{
+						auto* last = m_head;
+						while (last->m_next)
+							last = last->m_next;
+						push_global(m_head, last, m_size);
+					}
+				}
+
+				void* pop()
+				{
+					if (m_head == nullptr)
+					{
+						m_head = g_stop_state_freelist.exchange(nullptr, std::memory_order_acquire);
+						if (m_head == nullptr)
+							return ::operator new(sizeof(stop_state));
+
+						// keep at most a local cache worth and give the
+						// rest back in one push.
+						std::size_t total = 1;
+						auto* keepLast = m_head;
+						auto* last = m_head;
+						for (; last->m_next; last = last->m_next)
+						{
+							if (total++ < stop_state_local_cache_size)
+								keepLast = last->m_next;
+						}
+						g_stop_state_freelist_size.fetch_sub(total, std::memory_order_relaxed);
+
+						auto* rest = keepLast->m_next;
+						keepLast->m_next = nullptr;
+						m_size = std::min(total, stop_state_local_cache_size);
+						if (rest)
+							push_global(rest, last, total - m_size);
+					}
+
+					auto* node = m_head;
+					m_head = node->m_next;
+					--m_size;
+					return node;
+				}
+
+				void push(void* ptr) noexcept
+				{
+					auto* node = static_cast<stop_state_pool_node*>(ptr);
+					if (m_size < stop_state_local_cache_size)
+					{
+						node->m_next = m_head;
+						m_head = node;
+						++m_size;
+					}
+					else
+					{
+						release_global(ptr);
+					}
+				}
+			};
+
+			thread_local stop_state_local_cache t_stop_state_cache;
+		}
+	}
+}
+
 macoro::detail::stop_state* macoro::detail::stop_state::create()
 {
-	return new stop_state();
+	if (t_stop_state_cache_destroyed)
+		return ::new (::operator new(sizeof(stop_state))) stop_state();
+	return ::new (t_stop_state_cache.pop()) stop_state();
+}
+
+void macoro::detail::stop_state::destroy(stop_state* state) noexcept
+{
+	state->~stop_state();
+	if (t_stop_state_cache_destroyed)
+		release_global(state);
+	else
+		t_stop_state_cache.push(state);
 }
 
 macoro::detail::stop_state::~stop_state()
 {
 	assert((m_state.load(std::memory_order_relaxed) & cancellation_ref_count_mask) == 0);
+#ifndef NDEBUG
+	for (auto& entry : m_inlineEntries)
+		assert(entry.load(std::memory_order_relaxed) == nullptr);
+#endif
 
 	// Use relaxed memory order in reads here since we should already have visibility
 	// to all writes as the ref-count decrement that preceded the call to the destructor
@@ -373,7 +519,7 @@ void macoro::detail::stop_state::release_token_ref() noexcept
 	const std::uint64_t oldState = m_state.fetch_sub(stop_token_ref_increment, std::memory_order_acq_rel);
 	if ((oldState & cancellation_ref_count_mask) == stop_token_ref_increment)
 	{
-		delete this;
+		destroy(this);
 	}
 }
 
@@ -387,7 +533,7 @@ void macoro::detail::stop_state::release_source_ref() noexcept
 	const std::uint64_t oldState = m_state.fetch_sub(stop_source_ref_increment, std::memory_order_acq_rel);
 	if ((oldState & cancellation_ref_count_mask) == stop_source_ref_increment)
 	{
-		delete this;
+		destroy(this);
 	}
 }
 
@@ -418,25 +564,51 @@ void macoro::detail::stop_state::request_stop()
 	// We are the first caller of request_stop.
 	// Need to execute any registered callbacks to notify them of cancellation.
 
+	// A callback may destroy the stop_source that request_stop() was
+	// called through, e.g. by resuming a coroutine that owns it. Hold
+	// a reference so that the state outlives this call.
+	add_token_ref();
+
 	// NOTE: We need to use sequentially-consistent operations here to ensure
 	// that if there is a concurrent call to try_register_callback() on another
 	// thread that either the other thread will read the prior write to m_state
 	// after they write to a registration slot or we will read their write to the
 	// registration slot after the prior write to m_state.
 
+	// Note that there should be no data-race in writing to this value here
+	// as another thread will only read it if they are trying to deregister
+	// a callback and that fails because we have acquired the pointer to
+	// the registration inside the loops below. In this case the atomic
+	// exchange that acquires the pointer below acts as a release-operation
+	// that synchronises with the failed exchange operation in deregister_callback()
+	// which has acquire semantics and thus will have visibility of the write to
+	// the m_notificationThreadId value.
+	m_notificationThreadId = std::this_thread::get_id();
+
+	for (auto& entry : m_inlineEntries)
+	{
+		auto* registration = entry.load(std::memory_order_seq_cst);
+		if (registration != nullptr)
+		{
+			// See below for why we need to exchange rather than just read.
+			registration = entry.exchange(nullptr, std::memory_order_seq_cst);
+			if (registration != nullptr)
+			{
+				try
+				{
+					registration->m_callback();
+				}
+				catch (...)
+				{
+					std::terminate();
+				}
+			}
+		}
+	}
+
 	auto* const registrationState = m_registrationState.load(std::memory_order_seq_cst);
 	if (registrationState != nullptr)
 	{
-		// Note that there should be no data-race in writing to this value here
-		// as another thread will only read it if they are trying to deregister
-		// a callback and that fails because we have acquired the pointer to
-		// the registration inside the loop below. In this case the atomic
-		// exchange that acquires the pointer below acts as a release-operation
-		// that synchronises with the failed exchange operation in deregister_callback()
-		// which has acquire semantics and thus will have visibility of the write to
-		// the m_notificationThreadId value.
-		registrationState->m_notificationThreadId = std::this_thread::get_id();
-
 		for (std::uint32_t listIndex = 0, listCount = registrationState->m_listCount;
 			listIndex < listCount;
 			++listIndex)
@@ -484,8 +656,42 @@ void macoro::detail::stop_state::request_stop()
 				chunk = chunk->m_nextChunk.load(std::memory_order_seq_cst);
 			} while (chunk != nullptr);
 		}
+	}
+
+	m_state.fetch_add(cancellation_notification_complete_flag, std::memory_order_release);
+
+	// only make the syscall if someone has given up spinning.
+	auto old = m_notification.exchange(notification_complete_flag, std::memory_order_release);
+	if (old & notification_waiter_flag)
+		atomic_notify_all(m_notification);
+
+	release_token_ref();
+}
+
+void macoro::detail::stop_state::wait_for_notification_complete() noexcept
+{
+	// Most callbacks are short so spin for a little while first.
+	for (std::uint32_t i = 0; i < deregister_spin_count; ++i)
+	{
+		if (m_notification.load(std::memory_order_acquire) & notification_complete_flag)
+			return;
+		cpu_relax();
+	}
+
+	auto v = m_notification.load(std::memory_order_acquire);
+	while ((v & notification_complete_flag) == 0)
+	{
+		if ((v & notification_waiter_flag) == 0)
+		{
+			// let request_stop() know that it needs to wake us.
+			if (!m_notification.compare_exchange_weak(v, v | notification_waiter_flag,
+				std::memory_order_acquire, std::memory_order_acquire))
+				continue;
+			v |= notification_waiter_flag;
+		}
 
-		m_state.fetch_add(cancellation_notification_complete_flag, std::memory_order_release);
+		atomic_wait(m_notification, v);
+		v = m_notification.load(std::memory_order_acquire);
 	}
 }
 
@@ -497,33 +703,11 @@ bool macoro::detail::stop_state::try_register_callback(
 		return false;
 	}
 
-	auto* registrationState = m_registrationState.load(std::memory_order_acquire);
-	if (registrationState == nullptr)
+	if (try_add_inline_registration(registration) == false)
 	{
-		// Could throw std::bad_alloc
-		auto* newRegistrationState = stop_callback_state::allocate();
-
-		// Need to use 'sequentially consistent' on the write here to ensure that if
-		// we subsequently read a value from m_state at the end of this function that
-		// doesn't have the cancellation_requested_flag bit set that a subsequent call
-		// in another thread to request_stop() will see this write.
-		if (m_registrationState.compare_exchange_strong(
-			registrationState,
-			newRegistrationState,
-			std::memory_order_seq_cst,
-			std::memory_order_acquire))
-		{
-			registrationState = newRegistrationState;
-		}
-		else
-		{
-			stop_callback_state::free(newRegistrationState);
-		}
+		add_chunk_registration(registration);
 	}
 
-	// Could throw std::bad_alloc
-	auto result = registrationState->add_registration(registration);
-
 	// Need to check status again to handle the case where
 	// another thread calls request_stop() concurrently
 	// but doesn't see our write to the registration list.
@@ -540,7 +724,7 @@ bool macoro::detail::stop_state::try_register_callback(
 		// callback. If it fails it means that the thread that requested
 		// cancellation will execute our callback and we need to wait
 		// until it finishes before returning.
-		auto& entry = result.m_chunk->m_entries[result.m_entryIndex];
+		auto& entry = registration_entry(registration);
 
 		// Need to use compare_exchange here rather than just exchange since
 		// it may be possible that the thread calling request_stop()
@@ -566,10 +750,78 @@ bool macoro::detail::stop_state::try_register_callback(
 	return true;
 }
 
+bool macoro::detail::stop_state::try_add_inline_registration(
+	stop_callback* registration) noexcept
+{
+	registration->m_chunk = nullptr;
+	for (std::uint32_t i = 0; i < inline_callback_count; ++i)
+	{
+		auto& entry = m_inlineEntries[i];
+
+		// cheap read first to skip occupied slots without a locked instruction.
+		auto* entryValue = entry.load(std::memory_order_relaxed);
+		if (entryValue == nullptr)
+		{
+			registration->m_entryIndex = i;
+			if (entry.compare_exchange_strong(
+				entryValue,
+				registration,
+				std::memory_order_seq_cst,
+				std::memory_order_relaxed))
+			{
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+std::atomic<macoro::stop_callback*>& macoro::detail::stop_state::registration_entry(
+	stop_callback* registration) noexcept
+{
+	if (registration->m_chunk == nullptr)
+		return m_inlineEntries[registration->m_entryIndex];
+	return registration->m_chunk->m_entries[registration->m_entryIndex];
+}
+
+void macoro::detail::stop_state::add_chunk_registration(
+	stop_callback* registration)
+{
+	auto* registrationState = m_registrationState.load(std::memory_order_acquire);
+	if (registrationState == nullptr)
+	{
+		// Could throw std::bad_alloc
+		auto* newRegistrationState = stop_callback_state::allocate();
+
+		// Need to use 'sequentially consistent' on the write here to ensure that if
+		// we subsequently read a value from m_state at the end of this function that
+		// doesn't have the cancellation_requested_flag bit set that a subsequent call
+		// in another thread to request_stop() will see this write.
+		if (m_registrationState.compare_exchange_strong(
+			registrationState,
+			newRegistrationState,
+			std::memory_order_seq_cst,
+			std::memory_order_acquire))
+		{
+			registrationState = newRegistrationState;
+		}
+		else
+		{
+			stop_callback_state::free(newRegistrationState);
+		}
+	}
+
+	// Could throw std::bad_alloc
+	auto result = registrationState->add_registration(registration);
+	assert(registration->m_chunk == result.m_chunk);
+	assert(registration->m_entryIndex == result.m_entryIndex);
+	(void)result;
+}
+
 void macoro::detail::stop_state::deregister_callback(stop_callback* registration) noexcept
 {
 	auto* chunk = registration->m_chunk;
-	auto& entry = chunk->m_entries[registration->m_entryIndex];
+	auto& entry = registration_entry(registration);
 
 	// Use 'acquire' memory order on failure case so that we synchronise with the write
 	// to the slot inside request_stop() that acquired the registration such that
@@ -584,6 +836,9 @@ void macoro::detail::stop_state::deregister_callback(stop_callback* registration
 		std::memory_order_acquire);
 	if (deregisteredSuccessfully)
 	{
+		if (chunk == nullptr)
+			return;
+
 		// Increment free-count if it won't make it larger than entry count.
 		const std::int32_t oldFreeCount = chunk->m_approximateFreeCount.load(std::memory_order_relaxed);
 		if (oldFreeCount < static_cast<std::int32_t>(chunk->m_entryCount))
@@ -602,17 +857,9 @@ void macoro::detail::stop_state::deregister_callback(stop_callback* registration
 		// removed from within a callback which would otherwise deadlock waiting
 		// for the callbacks to finish executing.
 
-		// Use relaxed memory order here as we should already have visibility
-		// of the write to m_registrationState from when the registration was first
-		// registered.
-		auto* registrationState = m_registrationState.load(std::memory_order_relaxed);
-		if (std::this_thread::get_id() != registrationState->m_notificationThreadId)
+		if (std::this_thread::get_id() != m_notificationThreadId)
 		{
-			// TODO: More efficient busy-wait backoff strategy
-			while (!is_cancellation_notification_complete())
-			{
-				std::this_thread::yield();
-			}
+			wait_for_notification_complete();
 		}
 	}
 }
@@ -620,5 +867,8 @@ void macoro::detail::stop_state::deregister_callback(stop_callback* registration
 macoro::detail::stop_state::stop_state() noexcept
 	: m_state(stop_source_ref_increment)
 	, m_registrationState(nullptr)
+	, m_notification(0)
 {
+	for (auto& entry : m_inlineEntries)
+		entry.store(nullptr, std::memory_order_relaxed);
 }
@@ -20,7 +20,9 @@ namespace macoro
 		{
 		public:
 
-			/// Allocates a new stop_state object.
+			/// Allocates a new stop_state object. Objects are recycled through
+			/// a lock-free freelist so that the common case does not touch the
+			/// global heap.
 			///
 			/// \throw std::bad_alloc
 			/// If there was insufficient memory to allocate one.
@@ -28,6 +30,10 @@ namespace macoro
 
 			~stop_state();
 
+			/// The number of callbacks that can be registered directly in the
+			/// stop_state before the chunked callback lists are allocated.
+			static constexpr std::uint32_t inline_callback_count = 4;
+
 			/// Increment the reference count of stop_token and
 			/// stop_callback objects referencing this state.
 			void add_token_ref() noexcept;
@@ -75,14 +81,37 @@ namespace macoro
 			/// If the callback is currently being executed on another
 			/// thread that is concurrently calling request_stop()
 			/// then this call will block until the callback has finished executing.
+			/// The wait spins for a short period before blocking on m_notification.
 			void deregister_callback(stop_callback* registration) noexcept;
 
+			/// The number of iterations deregister_callback() spins for before
+			/// blocking.
+			static constexpr std::uint32_t deregister_spin_count = 128;
+
 		private:
 
 			stop_state() noexcept;
 
+			/// Destroys the state and returns its memory to the freelist.
+			static void destroy(stop_state* state) noexcept;
+
 			bool is_cancellation_notification_complete() const noexcept;
 
+			/// Block until the thread running request_stop() has finished
+			/// executing the callbacks.
+			void wait_for_notification_complete() noexcept;
+
+			/// Try to claim one of the inline callback slots.
+			bool try_add_inline_registration(stop_callback* registration) noexcept;
+
+			/// Add the registration to the chunked callback lists.
+			///
+			/// \throw std::bad_alloc
+			void add_chunk_registration(stop_callback* registration);
+
+			/// Returns the slot that the registration was assigned by try_register_callback().
+			std::atomic<stop_callback*>& registration_entry(stop_callback* registration) noexcept;
+
 			static constexpr std::uint64_t cancellation_requested_flag = 1;
 			static constexpr std::uint64_t cancellation_notification_complete_flag = 2;
 			static constexpr std::uint64_t stop_source_ref_increment = 4;
@@ -98,8 +127,23 @@ namespace macoro
 			// - bits 33-63 - ref-count for stop_token/stop_callback instances.
 			std::atomic<std::uint64_t> m_state;
 
+			// The first few callbacks are stored here. Only once these are all
+			// occupied is m_registrationState allocated.
+			std::atomic<stop_callback*> m_inlineEntries[inline_callback_count];
+
 			std::atomic<stop_callback_state*> m_registrationState;
 
+			// The thread that is executing the callbacks in request_stop().
+			std::thread::id m_notificationThreadId;
+
+			static constexpr std::uint32_t notification_complete_flag = 1;
+			static constexpr std::uint32_t notification_waiter_flag = 2;
+
+			// A 32 bit word that deregister_callback() can futex wait on
+			// while another thread is running the callbacks. Holds the
+			// notification complete and waiter flags.
+			std::atomic<std::uint32_t> m_notification;
+
 		};
 	}
 }
@@ -0,0 +1,79 @@
+#pragma once
+
+#include "macoro/type_traits.h"
+
+#include <chrono>
+#include <cstdint>
+#include <thread>
+#include <utility>
+
+namespace macoro
+{
+	namespace detail
+	{
+		/// An intrusive timer that a scheduler invokes directly once its
+		/// deadline has passed. Unlike schedule_after() no coroutine is
+		/// involved, the owner embeds the node and supplies a callback.
+		///
+		/// A scheduler that supports these provides
+		///
+		///     void add_timer(timer_node& node);
+		///
+		/// which sets mCancel, mAdd and the bookkeeping fields.
+		struct timer_node
+		{
+			using clock = std::chrono::steady_clock;
+
+			enum class state : std::uint8_t
+			{
+				idle,
+				pending,
+				firing,
+				done
+			};
+
+			timer_node() = default;
+			timer_node(const timer_node&) = delete;
+			timer_node& operator=(const timer_node&) = delete;
+
+			/// Set by the owner before add_timer(). Called on a scheduler
+			/// thread once mDeadline has passed. Must not throw.
+			void (*mCallback)(timer_node*) = nullptr;
+			void* mContext = nullptr;
+			clock::time_point mDeadline;
+
+			/// Removes the timer from its scheduler. Returns true if the
+			/// callback was prevented from running. If the callback is
+			/// executing on another thread this blocks until it returns.
+			/// If it is executing on this thread, e.g. the callback is
+			/// destroying the node, this returns immediately and the
+			/// scheduler will not touch the node again.
+			bool cancel() noexcept
+			{
+				if (mCancel)
+					return mCancel(this);
+				return false;
+			}
+
+			// Scheduler bookkeeping, protected by the scheduler's lock.
+			// mAdd registers another node with the same scheduler, which
+			// lets an owner re-arm after it has been moved.
+			bool (*mCancel)(timer_node*) noexcept = nullptr;
+			void (*mAdd)(void* scheduler, timer_node&) = nullptr;
+			void* mScheduler = nullptr;
+			std::size_t mIdx = 0;
+			state mState = state::idle;
+			bool mWaiting = false;
+			bool* mDetached = nullptr;
+			std::thread::id mFiringThread;
+		};
+
+		template<typename Scheduler, typename = void>
+		struct has_add_timer : std::false_type {};
+
+		template<typename Scheduler>
+		struct has_add_timer<Scheduler, void_t<
+			decltype(std::declval<Scheduler&>().add_timer(std::declval<timer_node&>()))>>
+			: std::true_type {};
+	}
+}
@@ -0,0 +1,255 @@
+#pragma once
+
+#include "macoro/config.h"
+#include "macoro/coroutine_handle.h"
+#include "macoro/coro_frame.h"
+#include "macoro/type_traits.h"
+#include "macoro/detail/frame_arena.h"
+
+#include <cassert>
+#include <cstddef>
+#include <exception>
+#include <iterator>
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+namespace macoro
+{
+	template<typename T>
+	class generator;
+
+	namespace detail
+	{
+		/// The awaiter of yielding an rvalue. MC_YIELD's argument is a
+		/// temporary that does not outlive the suspension, so the value is
+		/// moved into the awaiter, which lives in the frame until the
+		/// coroutine is resumed. The promise is pointed at it once the
+		/// awaiter is at its final address.
+		template<typename Promise, typename V>
+		struct yield_move_awaiter : Promise::yield_awaiter
+		{
+			V mValue;
+
+			yield_move_awaiter(V&& v, Promise* p)
+				noexcept(std::is_nothrow_move_constructible<V>::value)
+				: Promise::yield_awaiter{ p }
+				, mValue(std::move(v))
+			{}
+
+			template<typename H>
+			auto await_suspend(H h) noexcept
+			{
+				this->mPromise->mValue = std::addressof(mValue);
+				return Promise::yield_awaiter::await_suspend(h);
+			}
+		};
+
+		/// The promise of both generator and async_generator. Yielded
+		/// lvalues are passed to the consumer by pointer.
+		template<typename T>
+		class generator_promise_base
+		{
+		public:
+			using value_type = remove_cvref_t<T>;
+			using reference_type = typename std::conditional<std::is_reference<T>::value, T, T&>::type;
+			using pointer_type = typename std::remove_reference<reference_type>::type*;
+
+			// std coroutine frames come from the frame_arena, as the
+			// lambda frames do.
+			static void* operator new(std::size_t size) { return frame_allocate(size); }
+			static void operator delete(void* ptr, std::size_t size) noexcept { frame_deallocate(ptr, size); }
+
+			suspend_always initial_suspend() const noexcept { return {}; }
+
+			void unhandled_exception() noexcept
+			{
+				mException = std::current_exception();
+			}
+
+			void return_void() noexcept {}
+
+			reference_type value() const noexcept
+			{
+				return static_cast<reference_type>(*mValue);
+			}
+
+			void rethrow_if_exception()
+			{
+				if (mException)
+					std::rethrow_exception(std::exchange(mException, nullptr));
+			}
+
+		protected:
+			template<typename, typename>
+			friend struct yield_move_awaiter;
+
+			pointer_type mValue = nullptr;
+			std::exception_ptr mException;
+		};
+
+		template<typename T>
+		class generator_promise : public generator_promise_base<T>
+		{
+		public:
+			using typename generator_promise_base<T>::value_type;
+			using typename generator_promise_base<T>::reference_type;
+
+			generator<T> get_return_object() noexcept;
+			generator<T> macoro_get_return_object() noexcept;
+
+			suspend_always final_suspend() const noexcept { return {}; }
+
+			struct yield_awaiter
+			{
+				generator_promise* mPromise;
+
+				bool await_ready() const noexcept { return false; }
+
+				template<typename H>
+				void await_suspend(H) noexcept {}
+
+				void await_resume() const noexcept {}
+			};
+
+			yield_awaiter yield_value(typename std::remove_reference<reference_type>::type& value) noexcept
+			{
+				this->mValue = std::addressof(value);
+				return { this };
+			}
+
+			yield_move_awaiter<generator_promise, value_type> yield_value(value_type&& value)
+				noexcept(std::is_nothrow_move_constructible<value_type>::value)
+			{
+				return { std::move(value), this };
+			}
+		};
+
+		template<typename T>
+		class generator_iterator
+		{
+		public:
+			using promise_type = generator_promise<T>;
+			using iterator_category = std::input_iterator_tag;
+			using difference_type = std::ptrdiff_t;
+			using value_type = typename promise_type::value_type;
+			using reference = typename promise_type::reference_type;
+			using pointer = typename std::remove_reference<reference>::type*;
+
+			generator_iterator() noexcept = default;
+
+			explicit generator_iterator(coroutine_handle<promise_type> coroutine) noexcept
+				: m_coroutine(coroutine)
+			{}
+
+			/// Resumes the generator until it yields the next value or
+			/// completes. Rethrows its exception, if any.
+			generator_iterator& operator++()
+			{
+				m_coroutine.resume();
+				if (m_coroutine.done())
+				{
+					auto c = std::exchange(m_coroutine, nullptr);
+					c.promise().rethrow_if_exception();
+				}
+				return *this;
+			}
+
+			void operator++(int) { ++*this; }
+
+			reference operator*() const noexcept { return m_coroutine.promise().value(); }
+			pointer operator->() const noexcept { return std::addressof(**this); }
+
+			bool operator==(const generator_iterator& o) const noexcept { return m_coroutine == o.m_coroutine; }
+			bool operator!=(const generator_iterator& o) const noexcept { return m_coroutine != o.m_coroutine; }
+
+		private:
+			coroutine_handle<promise_type> m_coroutine;
+		};
+	}
+
+	/// \brief
+	/// A synchronous generator. The coroutine runs each time the
+	/// iterator is incremented, until its next co_yield or MC_YIELD, so
+	/// values are produced lazily on the consumer's thread. It may be
+	/// consumed with a range-based for loop.
+	///
+	/// A yielded lvalue is passed to the consumer by pointer and is valid
+	/// until the iterator is next incremented. An rvalue is moved into
+	/// the frame first. The frame is allocated from the thread's
+	/// frame_arena, if it has one. The coroutine can not co_await.
+	template<typename T>
+	class [[nodiscard]] generator
+	{
+	public:
+		using promise_type = detail::generator_promise<T>;
+		using iterator = detail::generator_iterator<T>;
+		using value_type = typename promise_type::value_type;
+
+		generator() noexcept = default;
+
+#ifdef MACORO_CPP_20
+		explicit generator(std::coroutine_handle<promise_type> coroutine) noexcept
+			: m_coroutine(coroutine_handle<promise_type>(coroutine))
+		{}
+#endif
+		explicit generator(coroutine_handle<promise_type> coroutine) noexcept
+			: m_coroutine(coroutine)
+		{}
+
+		generator(generator&& o) noexcept
+			: m_coroutine(std::exchange(o.m_coroutine, nullptr))
+		{}
+
+		generator(const generator&) = delete;
+		generator& operator=(const generator&) = delete;
+
+		generator& operator=(generator&& o) noexcept
+		{
+			if (std::addressof(o) != this)
+			{
+				if (m_coroutine)
+					m_coroutine.destroy();
+				m_coroutine = std::exchange(o.m_coroutine, nullptr);
+			}
+			return *this;
+		}
+
+		~generator()
+		{
+			if (m_coroutine)
+				m_coroutine.destroy();
+		}
+
+		/// Runs the coroutine to its first value. Must be called once.
+		iterator begin()
+		{
+			if (!m_coroutine)
+				return end();
+			return ++iterator{ m_coroutine };
+		}
+
+		iterator end() noexcept
+		{
+			return iterator{};
+		}
+
+	private:
+		coroutine_handle<promise_type> m_coroutine;
+	};
+
+	namespace detail
+	{
+		template<typename T>
+		generator<T> generator_promise<T>::get_return_object() noexcept
+		{
+			return generator<T>{ coroutine_handle<generator_promise>::from_promise(*this, coroutine_handle_type::std) };
+		}
+
+		template<typename T>
+		generator<T> generator_promise<T>::macoro_get_return_object() noexcept
+		{
+			return generator<T>{ coroutine_handle<generator_promise>::from_promise(*this, coroutine_handle_type::macoro) };
+		}
+	}
+}
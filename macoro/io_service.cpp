@@ -0,0 +1,255 @@
+#include "macoro/io_service.h"
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cassert>
+#include <climits>
+#include <cstdint>
+
+namespace macoro
+{
+	namespace
+	{
+		[[noreturn]] void throw_errno(const char* what)
+		{
+			throw std::system_error(errno, std::system_category(), what);
+		}
+
+		// the epoll data of the wake eventfd. fd states are never null.
+		void* const wake_tag = nullptr;
+	}
+
+	namespace detail
+	{
+		bool io_read_operation::try_syscall() noexcept
+		{
+			long n;
+			do {
+				n = ::read(mState->mFd, mBuffer, mSize);
+			} while (n < 0 && errno == EINTR);
+			return complete(n);
+		}
+
+		bool io_write_operation::try_syscall() noexcept
+		{
+			long n;
+			do {
+				// MSG_NOSIGNAL so that a closed peer is reported as EPIPE
+				// rather than raising SIGPIPE.
+				n = ::send(mState->mFd, mBuffer, mSize, MSG_NOSIGNAL);
+				if (n < 0 && errno == ENOTSOCK)
+					n = ::write(mState->mFd, mBuffer, mSize);
+			} while (n < 0 && errno == EINTR);
+			return complete(n);
+		}
+	}
+
+	io_fd::io_fd(io_service& s, int fd)
+		: mService(&s)
+		, mState(s.add(fd))
+	{}
+
+	void io_fd::reset() noexcept
+	{
+		if (mState)
+		{
+			assert(mState->mWaiter[0] == nullptr && mState->mWaiter[1] == nullptr &&
+				"io_fd destroyed with an outstanding operation.");
+			mService->retire(mState);
+			mService = nullptr;
+			mState = nullptr;
+		}
+	}
+
+	io_service::io_service()
+		: mStopped(false)
+		, mWakePending(false)
+	{
+		mEpoll = ::epoll_create1(EPOLL_CLOEXEC);
+		if (mEpoll < 0)
+			throw_errno("epoll_create1");
+
+		mWakeFd = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (mWakeFd < 0)
+		{
+			::close(mEpoll);
+			throw_errno("eventfd");
+		}
+
+		epoll_event ev{};
+		ev.events = EPOLLIN;
+		ev.data.ptr = wake_tag;
+		if (::epoll_ctl(mEpoll, EPOLL_CTL_ADD, mWakeFd, &ev))
+		{
+			::close(mWakeFd);
+			::close(mEpoll);
+			throw_errno("epoll_ctl");
+		}
+	}
+
+	io_service::io_service(thread_pool& pool)
+		: io_service()
+	{
+		mPool = &pool;
+		mPool->set_reactor(this);
+	}
+
+	io_service::~io_service()
+	{
+		// waits for any worker that is blocked in poll().
+		if (mPool)
+			mPool->set_reactor(nullptr);
+
+		for (auto s : mRetired)
+			delete s;
+		::close(mWakeFd);
+		::close(mEpoll);
+	}
+
+	detail::io_fd_state* io_service::add(int fd)
+	{
+		auto s = new detail::io_fd_state(fd);
+		epoll_event ev{};
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		ev.data.ptr = s;
+		if (::epoll_ctl(mEpoll, EPOLL_CTL_ADD, fd, &ev))
+		{
+			auto err = errno;
+			delete s;
+			errno = err;
+			throw_errno("epoll_ctl");
+		}
+		return s;
+	}
+
+	void io_service::retire(detail::io_fd_state* s) noexcept
+	{
+		// the fd may already have been closed, in which case the kernel
+		// removed it for us.
+		::epoll_ctl(mEpoll, EPOLL_CTL_DEL, s->mFd, nullptr);
+
+		std::lock_guard<std::mutex> lock(mRetiredMutex);
+		mRetired.push_back(s);
+	}
+
+	void io_service::wake()
+	{
+		if (mWakePending.exchange(true) == false)
+		{
+			std::uint64_t one = 1;
+			auto r = ::write(mWakeFd, &one, sizeof(one));
+			(void)r;
+		}
+	}
+
+	void io_service::stop() noexcept
+	{
+		mStopped.store(true);
+		wake();
+	}
+
+	std::size_t io_service::run_once(int timeoutMs)
+	{
+		// states retired before this point have been removed from epoll
+		// and so can not be returned by the epoll_wait below.
+		{
+			std::vector<detail::io_fd_state*> retired;
+			{
+				std::lock_guard<std::mutex> lock(mRetiredMutex);
+				retired.swap(mRetired);
+			}
+			for (auto s : retired)
+				delete s;
+		}
+
+		epoll_event events[64];
+		int n;
+		do {
+			n = ::epoll_wait(mEpoll, events, 64, timeoutMs);
+		} while (n < 0 && errno == EINTR);
+		if (n < 0)
+			throw_errno("epoll_wait");
+
+		mReady.clear();
+		for (int i = 0; i < n; ++i)
+		{
+			auto& ev = events[i];
+			if (ev.data.ptr == wake_tag)
+			{
+				std::uint64_t v;
+				auto r = ::read(mWakeFd, &v, sizeof(v));
+				(void)r;
+				mWakePending.store(false);
+				continue;
+			}
+
+			auto s = static_cast<detail::io_fd_state*>(ev.data.ptr);
+			auto signal = [&](detail::io_fd_state::direction d) {
+				s->mReady[d].store(true);
+				auto op = s->mWaiter[d].exchange(nullptr);
+				if (op && (s->attempt(d, op) || s->park(d, op) == false))
+					mReady.push_back(op->mHandle);
+			};
+
+			if (ev.events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+				signal(detail::io_fd_state::read);
+			if (ev.events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+				signal(detail::io_fd_state::write);
+		}
+
+		// the operations have completed and will not touch the fd state
+		// again, so they can be resumed now.
+		auto count = mReady.size();
+		if (mPool)
+		{
+			for (auto h : mReady)
+				mPool->post(h);
+		}
+		else
+		{
+			// a resumed coroutine may call process_pending_events().
+			auto ready = std::move(mReady);
+			mReady.clear();
+			for (auto h : ready)
+				h.resume();
+			if (mReady.empty())
+				mReady = std::move(ready);
+		}
+		return count;
+	}
+
+	void io_service::poll(detail::thread_pool_time_point deadline)
+	{
+		int timeoutMs = -1;
+		if (deadline != detail::thread_pool_time_point::max())
+		{
+			auto now = detail::thread_pool_clock::now();
+			if (deadline <= now)
+				timeoutMs = 0;
+			else
+			{
+				// round up so that we do not wake just before the deadline.
+				auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+					deadline - now + std::chrono::milliseconds(1) - detail::thread_pool_clock::duration(1)).count();
+				timeoutMs = static_cast<int>(std::min<decltype(ms)>(ms, INT_MAX));
+			}
+		}
+		run_once(timeoutMs);
+	}
+
+	void io_service::process_events()
+	{
+		assert(mPool == nullptr);
+		while (mStopped.load() == false)
+			run_once(-1);
+	}
+
+	std::size_t io_service::process_pending_events()
+	{
+		assert(mPool == nullptr);
+		return run_once(0);
+	}
+}
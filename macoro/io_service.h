@@ -0,0 +1,298 @@
+#pragma once
+
+#include "macoro/config.h"
+
+#if !MACORO_LINUX_OS
+# error "macoro/io_service.h" is only supported on Linux.
+#endif
+
+#include "macoro/coroutine_handle.h"
+#include "macoro/thread_pool.h"
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <mutex>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+namespace macoro
+{
+	class io_service;
+
+	namespace detail
+	{
+		/// A read or write that is waiting for its fd to become ready.
+		struct io_operation_base
+		{
+			/// Performs the syscall. Returns false if it would block.
+			bool (*mTry)(io_operation_base*) noexcept = nullptr;
+			coroutine_handle<void> mHandle;
+		};
+
+		/// The epoll registration of an io_fd. Owned by the io_service
+		/// so that it can outlive the io_fd until epoll is done with it.
+		struct io_fd_state
+		{
+			enum direction : std::size_t { read = 0, write = 1 };
+
+			int mFd = -1;
+
+			// mReady is set by the reactor on every edge and cleared before
+			// each syscall. Together with mWaiter this lets an operation
+			// that hit EAGAIN park itself without missing an edge that
+			// arrives concurrently.
+			std::atomic<bool> mReady[2];
+			std::atomic<io_operation_base*> mWaiter[2];
+
+			io_fd_state(int fd) noexcept
+				: mFd(fd)
+			{
+				for (std::size_t i = 0; i < 2; ++i)
+				{
+					mReady[i].store(false, std::memory_order_relaxed);
+					mWaiter[i].store(nullptr, std::memory_order_relaxed);
+				}
+			}
+
+			/// Clears the ready flag and performs the operation once.
+			/// Returns true if it completed.
+			bool attempt(direction d, io_operation_base* op) noexcept
+			{
+				mReady[d].store(false);
+				return op->mTry(op);
+			}
+
+			/// Parks op until the next edge. If an edge arrived since the
+			/// last attempt the operation is retried instead. Returns false
+			/// if the operation completed without parking. Once op is
+			/// parked the reactor owns it and may resume it at any time.
+			bool park(direction d, io_operation_base* op) noexcept
+			{
+				while (true)
+				{
+					mWaiter[d].store(op);
+					if (mReady[d].load() == false)
+						return true;
+					if (mWaiter[d].exchange(nullptr) != op)
+						return true;
+					if (attempt(d, op))
+						return false;
+				}
+			}
+		};
+
+		template<typename Derived>
+		class io_operation : protected io_operation_base
+		{
+		public:
+
+			io_operation(io_fd_state* state, io_fd_state::direction d) noexcept
+				: mState(state)
+				, mDirection(d)
+			{
+				mTry = &io_operation::try_op;
+			}
+
+			io_operation(const io_operation&) = delete;
+			io_operation(io_operation&&) = default;
+
+			bool await_ready() noexcept
+			{
+				return mState->attempt(mDirection, this);
+			}
+
+			template<typename H>
+			bool await_suspend(H h) noexcept
+			{
+				mHandle = coroutine_handle<void>(h);
+				return mState->park(mDirection, this);
+			}
+
+			std::size_t await_resume()
+			{
+				if (mError)
+					throw std::system_error(mError, std::system_category());
+				return mResult;
+			}
+
+		private:
+
+			static bool try_op(io_operation_base* base) noexcept
+			{
+				auto self = static_cast<io_operation*>(base);
+				return static_cast<Derived*>(self)->try_syscall();
+			}
+
+		protected:
+			io_fd_state* mState;
+			io_fd_state::direction mDirection;
+			std::size_t mResult = 0;
+			int mError = 0;
+
+			// Stores the outcome of a syscall. Returns false if it
+			// would have blocked.
+			bool complete(long n) noexcept
+			{
+				if (n >= 0)
+				{
+					mResult = static_cast<std::size_t>(n);
+					return true;
+				}
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
+					return false;
+				mError = errno;
+				return true;
+			}
+		};
+
+		class io_read_operation : public io_operation<io_read_operation>
+		{
+		public:
+			io_read_operation(io_fd_state* s, void* buffer, std::size_t size) noexcept
+				: io_operation<io_read_operation>(s, io_fd_state::read)
+				, mBuffer(buffer)
+				, mSize(size)
+			{}
+
+			bool try_syscall() noexcept;
+
+		private:
+			void* mBuffer;
+			std::size_t mSize;
+		};
+
+		class io_write_operation : public io_operation<io_write_operation>
+		{
+		public:
+			io_write_operation(io_fd_state* s, const void* buffer, std::size_t size) noexcept
+				: io_operation<io_write_operation>(s, io_fd_state::write)
+				, mBuffer(buffer)
+				, mSize(size)
+			{}
+
+			bool try_syscall() noexcept;
+
+		private:
+			const void* mBuffer;
+			std::size_t mSize;
+		};
+	}
+
+	/// A nonblocking file descriptor registered with an io_service. The
+	/// fd is not owned and must be set to O_NONBLOCK by the caller. At most
+	/// one read and one write may be outstanding at a time and the io_fd
+	/// must not be destroyed while either is.
+	class io_fd
+	{
+	public:
+		io_fd() = default;
+		io_fd(io_service& s, int fd);
+		io_fd(const io_fd&) = delete;
+		io_fd(io_fd&& o) noexcept
+			: mService(std::exchange(o.mService, nullptr))
+			, mState(std::exchange(o.mState, nullptr))
+		{}
+
+		io_fd& operator=(const io_fd&) = delete;
+		io_fd& operator=(io_fd&& o) noexcept
+		{
+			if (this != &o)
+			{
+				reset();
+				mService = std::exchange(o.mService, nullptr);
+				mState = std::exchange(o.mState, nullptr);
+			}
+			return *this;
+		}
+
+		~io_fd() { reset(); }
+
+		/// Deregisters the fd from the io_service. Does not close it.
+		void reset() noexcept;
+
+		int native_handle() const noexcept { return mState ? mState->mFd : -1; }
+
+		/// Reads up to size bytes. The awaiting coroutine is suspended
+		/// only if no data is available. Returns 0 at end of file and
+		/// throws std::system_error on failure.
+		detail::io_read_operation read_some(void* buffer, std::size_t size) noexcept
+		{
+			return { mState, buffer, size };
+		}
+
+		/// Writes up to size bytes, suspending only while the fd is not
+		/// writable. Throws std::system_error on failure.
+		detail::io_write_operation write_some(const void* buffer, std::size_t size) noexcept
+		{
+			return { mState, buffer, size };
+		}
+
+	private:
+		io_service* mService = nullptr;
+		detail::io_fd_state* mState = nullptr;
+	};
+
+	/// An edge triggered epoll reactor.
+	///
+	/// Standalone, process_events() runs the event loop on the calling
+	/// thread and resumes coroutines inline. Constructed with a
+	/// thread_pool it is instead polled by an idle worker from within
+	/// thread_pool::run() and ready coroutines are posted to the pool.
+	/// The thread_pool must outlive the io_service.
+	class io_service : private detail::thread_pool_reactor
+	{
+	public:
+		io_service();
+		explicit io_service(thread_pool& pool);
+		io_service(const io_service&) = delete;
+		io_service& operator=(const io_service&) = delete;
+		~io_service();
+
+		/// Processes events until stop() is called. Must not be called
+		/// concurrently or when attached to a thread_pool.
+		void process_events();
+
+		/// Processes the events that are ready without blocking.
+		/// Returns the number of coroutines that were resumed.
+		std::size_t process_pending_events();
+
+		/// Makes process_events() return. Thread safe.
+		void stop() noexcept;
+
+		/// Undoes stop() so that process_events() can be called again.
+		void reset() noexcept { mStopped.store(false); }
+
+		bool is_stop_requested() const noexcept { return mStopped.load(); }
+
+	private:
+		friend class io_fd;
+
+		void poll(detail::thread_pool_time_point deadline) override;
+		void wake() override;
+
+		// waits for at most timeoutMs and resumes or posts what is ready.
+		std::size_t run_once(int timeoutMs);
+
+		detail::io_fd_state* add(int fd);
+		void retire(detail::io_fd_state* s) noexcept;
+
+		int mEpoll = -1;
+		int mWakeFd = -1;
+		thread_pool* mPool = nullptr;
+
+		std::atomic<bool> mStopped;
+
+		// Set by wake() so that only the first call writes to mWakeFd.
+		std::atomic<bool> mWakePending;
+
+		// fd states whose io_fd has been destroyed. Freed by the next
+		// poll since an event returned before EPOLL_CTL_DEL may refer to
+		// them.
+		std::mutex mRetiredMutex;
+		std::vector<detail::io_fd_state*> mRetired;
+
+		std::vector<coroutine_handle<void>> mReady;
+	};
+}
@@ -0,0 +1,415 @@
+#include "macoro/io_uring_service.h"
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <climits>
+#include <utility>
+
+namespace macoro
+{
+	namespace
+	{
+		[[noreturn]] void throw_errno(int err, const char* what)
+		{
+			throw std::system_error(err, std::system_category(), what);
+		}
+
+		int io_uring_setup(unsigned entries, io_uring_params* p) noexcept
+		{
+			return static_cast<int>(::syscall(__NR_io_uring_setup, entries, p));
+		}
+
+		int io_uring_register(int fd, unsigned op, const void* arg, unsigned n) noexcept
+		{
+			return static_cast<int>(::syscall(__NR_io_uring_register, fd, op, arg, n));
+		}
+
+		unsigned load_acquire(const unsigned* p) noexcept
+		{
+			return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+		}
+
+		void store_release(unsigned* p, unsigned v) noexcept
+		{
+			__atomic_store_n(p, v, __ATOMIC_RELEASE);
+		}
+
+		template<typename T>
+		T* at(void* base, unsigned offset) noexcept
+		{
+			return reinterpret_cast<T*>(static_cast<char*>(base) + offset);
+		}
+
+		io_uring_sqe make_sqe(std::uint8_t opcode, int fd, const void* addr, std::size_t len, std::uint64_t off) noexcept
+		{
+			io_uring_sqe sqe{};
+			sqe.opcode = opcode;
+			sqe.fd = fd;
+			sqe.addr = reinterpret_cast<std::uint64_t>(addr);
+			sqe.len = static_cast<std::uint32_t>(std::min<std::size_t>(len, UINT_MAX));
+			sqe.off = off;
+			return sqe;
+		}
+
+		// the service whose completions the current thread is resuming
+		// inline, if any. Operations it starts are submitted by the next
+		// run_once() rather than right away.
+		thread_local io_uring_service* t_resuming = nullptr;
+	}
+
+	io_uring_service::io_uring_service(unsigned entries)
+		: mWakePending(false)
+		, mStopped(false)
+	{
+		io_uring_params p{};
+		mRing = io_uring_setup(entries, &p);
+		if (mRing < 0)
+			throw_errno(errno, "io_uring_setup");
+
+		if ((p.features & IORING_FEAT_EXT_ARG) == 0)
+		{
+			close_ring();
+			throw_errno(ENOSYS, "io_uring_service requires IORING_FEAT_EXT_ARG");
+		}
+
+		mSqMapSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+		mCqMapSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+		if (p.features & IORING_FEAT_SINGLE_MMAP)
+			mSqMapSize = mCqMapSize = std::max(mSqMapSize, mCqMapSize);
+
+		auto map = [&](std::size_t size, off_t offset) {
+			auto r = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mRing, offset);
+			if (r == MAP_FAILED)
+			{
+				auto err = errno;
+				close_ring();
+				throw_errno(err, "mmap");
+			}
+			return r;
+		};
+
+		mSqMap = map(mSqMapSize, IORING_OFF_SQ_RING);
+		mCqMap = (p.features & IORING_FEAT_SINGLE_MMAP) ? mSqMap : map(mCqMapSize, IORING_OFF_CQ_RING);
+		mSqesSize = p.sq_entries * sizeof(io_uring_sqe);
+		mSqes = static_cast<io_uring_sqe*>(map(mSqesSize, IORING_OFF_SQES));
+
+		mSqHead = at<unsigned>(mSqMap, p.sq_off.head);
+		mSqTail = at<unsigned>(mSqMap, p.sq_off.tail);
+		mSqMask = *at<unsigned>(mSqMap, p.sq_off.ring_mask);
+		mSqEntries = *at<unsigned>(mSqMap, p.sq_off.ring_entries);
+		mSqArray = at<unsigned>(mSqMap, p.sq_off.array);
+
+		mCqHead = at<unsigned>(mCqMap, p.cq_off.head);
+		mCqTail = at<unsigned>(mCqMap, p.cq_off.tail);
+		mCqMask = *at<unsigned>(mCqMap, p.cq_off.ring_mask);
+		mCqes = at<io_uring_cqe>(mCqMap, p.cq_off.cqes);
+
+		// the sqe array is used as a ring in order, so the index array
+		// is the identity.
+		for (unsigned i = 0; i < mSqEntries; ++i)
+			mSqArray[i] = i;
+	}
+
+	io_uring_service::io_uring_service(thread_pool& pool, unsigned entries)
+		: io_uring_service(entries)
+	{
+		mPool = &pool;
+		mPool->set_reactor(this);
+	}
+
+	io_uring_service::~io_uring_service()
+	{
+		if (mPool)
+			mPool->set_reactor(nullptr);
+		close_ring();
+	}
+
+	void io_uring_service::close_ring() noexcept
+	{
+		if (mSqes)
+			::munmap(mSqes, mSqesSize);
+		if (mCqMap && mCqMap != mSqMap)
+			::munmap(mCqMap, mCqMapSize);
+		if (mSqMap)
+			::munmap(mSqMap, mSqMapSize);
+		if (mRing >= 0)
+			::close(mRing);
+		mSqes = nullptr;
+		mSqMap = mCqMap = nullptr;
+		mRing = -1;
+	}
+
+	unsigned io_uring_service::pending() const noexcept
+	{
+		return load_acquire(mSqTail) - load_acquire(mSqHead);
+	}
+
+	int io_uring_service::enter(unsigned toSubmit, unsigned minComplete, unsigned flags, const void* arg, std::size_t argSize)
+	{
+		while (true)
+		{
+			auto r = ::syscall(__NR_io_uring_enter, mRing, toSubmit, minComplete, flags, arg, argSize);
+			if (r >= 0)
+				return static_cast<int>(r);
+			if (errno == EINTR)
+				continue;
+
+			// EBUSY: the completion ring overflowed and nothing can be
+			// submitted until it is drained. ETIME: the timeout passed.
+			if (errno == EBUSY)
+				return -EBUSY;
+			if (errno == ETIME)
+				return 0;
+			throw_errno(errno, "io_uring_enter");
+		}
+	}
+
+	io_uring_sqe* io_uring_service::get_sqe(bool& reaped)
+	{
+		auto tail = *mSqTail;
+		while (tail - load_acquire(mSqHead) >= mSqEntries)
+		{
+			// full. The kernel consumes sqes during submission, so make
+			// room by submitting them ourselves.
+			if (enter(pending(), 0, 0, nullptr, 0) != -EBUSY)
+				continue;
+
+			// it refuses while the completion ring overflows. Drain it
+			// into mReady, the coroutines cannot be resumed while the
+			// lock is held. If another thread got there first, entering
+			// with GETEVENTS moves the overflow into the ring.
+			std::lock_guard<std::mutex> lock(mCqMutex);
+			if (reap())
+				reaped = true;
+			else
+				enter(0, 0, IORING_ENTER_GETEVENTS, nullptr, 0);
+		}
+		return &mSqes[tail & mSqMask];
+	}
+
+	bool io_uring_service::push_sqe(const io_uring_sqe& sqe)
+	{
+		bool reaped = false;
+		std::lock_guard<std::mutex> lock(mSqMutex);
+		*get_sqe(reaped) = sqe;
+		store_release(mSqTail, *mSqTail + 1);
+		return reaped;
+	}
+
+	void io_uring_service::submit(const io_uring_sqe& sqe)
+	{
+		auto reaped = push_sqe(sqe);
+
+		// the thread that resumed us submits it with the rest once it
+		// enters the kernel again. Nobody else is known to do so soon,
+		// a pool whose workers are all busy may not poll for a while.
+		if (t_resuming != this)
+			enter(pending(), 0, 0, nullptr, 0);
+
+		if (reaped)
+			flush_reaped();
+	}
+
+	void io_uring_service::flush_reaped()
+	{
+		if (mPool)
+		{
+			std::vector<coroutine_handle<>> ready;
+			{
+				std::lock_guard<std::mutex> lock(mCqMutex);
+				ready.swap(mReady);
+			}
+			for (auto h : ready)
+				mPool->post(h);
+		}
+
+		// the reaped cqes may have included a wake up, and in standalone
+		// mode the loop has to return to resume the rest.
+		if (t_resuming != this)
+			wake();
+	}
+
+	void io_uring_service::wake()
+	{
+		if (mWakePending.exchange(true) == false)
+		{
+			io_uring_sqe sqe{};
+			sqe.opcode = IORING_OP_NOP;
+			sqe.user_data = detail::io_uring_wake_tag;
+
+			// anything reaped is picked up by the run_once() that this
+			// wakes up.
+			push_sqe(sqe);
+			enter(pending(), 0, 0, nullptr, 0);
+		}
+	}
+
+	void io_uring_service::stop() noexcept
+	{
+		mStopped.store(true);
+		try {
+			wake();
+		}
+		catch (...)
+		{
+			// process_events() checks mStopped before it blocks again.
+		}
+	}
+
+	std::size_t io_uring_service::reap() noexcept
+	{
+		auto head = *mCqHead;
+		auto tail = load_acquire(mCqTail);
+		std::size_t count = tail - head;
+		for (; head != tail; ++head)
+		{
+			auto& cqe = mCqes[head & mCqMask];
+			if (cqe.user_data == detail::io_uring_wake_tag)
+				mWakePending.store(false);
+			else if (cqe.user_data != detail::io_uring_ignore_tag)
+			{
+				auto op = reinterpret_cast<detail::io_uring_operation_base*>(cqe.user_data);
+				if (auto h = op->mOnComplete(op, cqe.res))
+					mReady.push_back(h);
+			}
+		}
+		store_release(mCqHead, head);
+		return count;
+	}
+
+	std::size_t io_uring_service::run_once(bool wait, const __kernel_timespec* timeout)
+	{
+		io_uring_getevents_arg arg{};
+		arg.ts = reinterpret_cast<std::uint64_t>(timeout);
+
+		std::vector<coroutine_handle<>> ready;
+		{
+			// a coroutine we resumed may have had to reap completions in
+			// get_sqe(). Those must not wait for another one.
+			std::lock_guard<std::mutex> lock(mCqMutex);
+			if (mReady.size())
+				wait = false;
+		}
+
+		enter(pending(), wait ? 1 : 0,
+			(wait ? IORING_ENTER_GETEVENTS : 0) | IORING_ENTER_EXT_ARG,
+			&arg, sizeof(arg));
+
+		{
+			std::lock_guard<std::mutex> lock(mCqMutex);
+			reap();
+			ready.swap(mReady);
+		}
+
+		auto count = ready.size();
+		if (mPool)
+		{
+			for (auto h : ready)
+				mPool->post(h);
+		}
+		else
+		{
+			// a resumed coroutine may call process_pending_events().
+			auto prev = std::exchange(t_resuming, this);
+			for (auto h : ready)
+				h.resume();
+			t_resuming = prev;
+		}
+
+		// keep the allocation for the next round.
+		ready.clear();
+		std::lock_guard<std::mutex> lock(mCqMutex);
+		if (mReady.empty())
+			mReady.swap(ready);
+		return count;
+	}
+
+	void io_uring_service::poll(detail::thread_pool_time_point deadline)
+	{
+		if (deadline == detail::thread_pool_time_point::max())
+		{
+			run_once(true, nullptr);
+			return;
+		}
+
+		auto now = detail::thread_pool_clock::now();
+		auto ns = deadline > now ?
+			std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - now).count() :
+			0;
+		__kernel_timespec ts{};
+		ts.tv_sec = ns / 1000000000;
+		ts.tv_nsec = ns % 1000000000;
+		run_once(true, &ts);
+	}
+
+	void io_uring_service::process_events()
+	{
+		assert(mPool == nullptr);
+		while (mStopped.load() == false)
+			run_once(true, nullptr);
+	}
+
+	std::size_t io_uring_service::process_pending_events()
+	{
+		assert(mPool == nullptr);
+		return run_once(false, nullptr);
+	}
+
+	void io_uring_service::register_buffers(const iovec* buffers, unsigned count)
+	{
+		unregister_buffers();
+		if (io_uring_register(mRing, IORING_REGISTER_BUFFERS, buffers, count))
+			throw_errno(errno, "io_uring_register");
+	}
+
+	void io_uring_service::unregister_buffers()
+	{
+		// ENXIO if there were none.
+		io_uring_register(mRing, IORING_UNREGISTER_BUFFERS, nullptr, 0);
+	}
+
+	detail::io_uring_operation<std::size_t> io_uring_service::read_at(
+		int fd, void* buffer, std::size_t size, std::uint64_t offset, stop_token token)
+	{
+		return { *this, make_sqe(IORING_OP_READ, fd, buffer, size, offset), std::move(token) };
+	}
+
+	detail::io_uring_operation<std::size_t> io_uring_service::write_at(
+		int fd, const void* buffer, std::size_t size, std::uint64_t offset, stop_token token)
+	{
+		return { *this, make_sqe(IORING_OP_WRITE, fd, buffer, size, offset), std::move(token) };
+	}
+
+	detail::io_uring_operation<std::size_t> io_uring_service::read_fixed(
+		int fd, void* buffer, std::size_t size, std::uint64_t offset, unsigned bufferIndex, stop_token token)
+	{
+		auto sqe = make_sqe(IORING_OP_READ_FIXED, fd, buffer, size, offset);
+		sqe.buf_index = static_cast<std::uint16_t>(bufferIndex);
+		return { *this, sqe, std::move(token) };
+	}
+
+	detail::io_uring_operation<int> io_uring_service::accept(int fd, stop_token token)
+	{
+		auto sqe = make_sqe(IORING_OP_ACCEPT, fd, nullptr, 0, 0);
+		sqe.accept_flags = SOCK_CLOEXEC;
+		return { *this, sqe, std::move(token) };
+	}
+
+	detail::io_uring_operation<std::size_t> io_uring_service::recv(
+		int fd, void* buffer, std::size_t size, stop_token token)
+	{
+		return { *this, make_sqe(IORING_OP_RECV, fd, buffer, size, 0), std::move(token) };
+	}
+
+	detail::io_uring_operation<std::size_t> io_uring_service::send(
+		int fd, const void* buffer, std::size_t size, stop_token token)
+	{
+		auto sqe = make_sqe(IORING_OP_SEND, fd, buffer, size, 0);
+		sqe.msg_flags = MSG_NOSIGNAL;
+		return { *this, sqe, std::move(token) };
+	}
+}
@@ -0,0 +1,376 @@
+#pragma once
+
+#include "macoro/config.h"
+
+#ifndef MACORO_IO_URING
+# error "macoro/io_uring_service.h" requires <linux/io_uring.h>.
+#endif
+
+#include "macoro/coroutine_handle.h"
+#include "macoro/thread_pool.h"
+#include "macoro/stop.h"
+#include "macoro/detail/operation_cancelled.h"
+
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+
+#include <atomic>
+#include <cassert>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <system_error>
+#include <vector>
+
+namespace macoro
+{
+	class io_uring_service;
+
+	namespace detail
+	{
+		// user_data values that do not refer to an operation. Operations
+		// are at least pointer aligned so these never collide.
+		constexpr std::uint64_t io_uring_ignore_tag = 0;
+		constexpr std::uint64_t io_uring_wake_tag = 1;
+
+		struct io_uring_operation_base
+		{
+			/// Called by the service with the cqe result. Returns the
+			/// coroutine that should be resumed, if any.
+			coroutine_handle<> (*mOnComplete)(io_uring_operation_base*, int res) noexcept = nullptr;
+		};
+
+		/// An io_uring submission awaitable. Has the same shape as
+		/// win32_overlapped_operation_cancellable: if the stop token can
+		/// be stopped a callback is registered before the sqe is submitted
+		/// and requests cancellation with IORING_OP_ASYNC_CANCEL once the
+		/// operation has started. Without a token this costs a single
+		/// relaxed store, so there is no separate uncancellable variant.
+		///
+		/// Result is the type that a non-negative cqe result is converted
+		/// to. Negative results throw std::system_error, or
+		/// operation_cancelled for -ECANCELED.
+		template<typename Result>
+		class io_uring_operation : protected io_uring_operation_base
+		{
+		public:
+
+			io_uring_operation(io_uring_service& s, const io_uring_sqe& sqe, stop_token&& token) noexcept
+				: m_service(&s)
+				, m_sqe(sqe)
+				, m_state(token.stop_requested() ? state::completed : state::not_started)
+				, m_cancellationToken(std::move(token))
+			{
+				mOnComplete = &io_uring_operation::on_operation_completed;
+				m_res = -ECANCELED;
+			}
+
+			io_uring_operation(io_uring_operation&& o) noexcept
+				: m_service(o.m_service)
+				, m_sqe(o.m_sqe)
+				, m_state(o.m_state.load(std::memory_order_relaxed))
+				, m_cancellationToken(std::move(o.m_cancellationToken))
+				, m_res(o.m_res)
+			{
+				mOnComplete = &io_uring_operation::on_operation_completed;
+			}
+
+			bool await_ready() const noexcept
+			{
+				return m_state.load(std::memory_order_relaxed) == state::completed;
+			}
+
+			template<typename H>
+			bool await_suspend(H h);
+
+			Result await_resume()
+			{
+				m_cancellationCallback.reset();
+				if (m_res == -ECANCELED)
+					throw operation_cancelled{};
+				if (m_res < 0)
+					throw std::system_error(-m_res, std::system_category());
+				return static_cast<Result>(m_res);
+			}
+
+		private:
+
+			enum class state
+			{
+				not_started,
+				started,
+				cancellation_requested,
+				completed
+			};
+
+			void cancel() noexcept;
+
+			void on_cancellation_requested() noexcept
+			{
+				auto oldState = m_state.load(std::memory_order_acquire);
+				if (oldState == state::not_started)
+				{
+					// await_suspend() has not finished submitting. Hand the
+					// cancellation over to it.
+					if (m_state.compare_exchange_strong(
+						oldState,
+						state::cancellation_requested,
+						std::memory_order_release,
+						std::memory_order_acquire))
+						return;
+				}
+
+				if (oldState != state::completed)
+					cancel();
+			}
+
+			static coroutine_handle<> on_operation_completed(io_uring_operation_base* base, int res) noexcept
+			{
+				auto* op = static_cast<io_uring_operation*>(base);
+				op->m_res = res;
+
+				auto s = op->m_state.load(std::memory_order_acquire);
+				if (s == state::started)
+				{
+					op->m_state.store(state::completed, std::memory_order_relaxed);
+					return op->m_awaitingCoroutine;
+				}
+
+				// racing with await_suspend(). Whoever marks it completed
+				// second resumes the coroutine.
+				s = op->m_state.exchange(state::completed, std::memory_order_acq_rel);
+				if (s == state::started)
+					return op->m_awaitingCoroutine;
+				return nullptr;
+			}
+
+			io_uring_service* m_service;
+			io_uring_sqe m_sqe;
+			std::atomic<state> m_state;
+			stop_token m_cancellationToken;
+			optional_stop_callback m_cancellationCallback;
+			coroutine_handle<> m_awaitingCoroutine;
+			int m_res;
+		};
+	}
+
+	/// An io_uring based I/O engine. Operations started by coroutines
+	/// that process_events() resumes are left in the submission ring and
+	/// submitted in bulk when the loop next enters the kernel, and
+	/// completions are likewise drained in bulk. Any other thread, e.g. a
+	/// thread_pool worker, submits its operation right away since nothing
+	/// guarantees that a thread will wait for completions soon.
+	///
+	/// Like io_service it either runs standalone with process_events(),
+	/// resuming coroutines inline, or attaches to a thread_pool as its
+	/// reactor and posts completed coroutines to the pool.
+	///
+	/// Requires Linux 5.11 or newer.
+	class io_uring_service : private detail::thread_pool_reactor
+	{
+	public:
+		explicit io_uring_service(unsigned entries = 256);
+		explicit io_uring_service(thread_pool& pool, unsigned entries = 256);
+		io_uring_service(const io_uring_service&) = delete;
+		io_uring_service& operator=(const io_uring_service&) = delete;
+		~io_uring_service();
+
+		/// Processes completions until stop() is called. Must not be
+		/// called concurrently or when attached to a thread_pool.
+		void process_events();
+
+		/// Submits pending operations and processes the completions that
+		/// are ready without blocking. Returns the number of coroutines
+		/// that were resumed.
+		std::size_t process_pending_events();
+
+		/// Makes process_events() return. Thread safe.
+		void stop() noexcept;
+
+		/// Undoes stop() so that process_events() can be called again.
+		void reset() noexcept { mStopped.store(false); }
+
+		/// Registers buffers with the kernel so that read_fixed() does not
+		/// have to map the pages for every read. Replaces any buffers
+		/// registered before. No operations may be outstanding.
+		void register_buffers(const iovec* buffers, unsigned count);
+		void unregister_buffers();
+
+		/// Reads up to size bytes from fd at offset. Returns the number of
+		/// bytes read, 0 at end of file.
+		detail::io_uring_operation<std::size_t> read_at(
+			int fd, void* buffer, std::size_t size, std::uint64_t offset, stop_token token = {});
+
+		/// Writes up to size bytes to fd at offset.
+		detail::io_uring_operation<std::size_t> write_at(
+			int fd, const void* buffer, std::size_t size, std::uint64_t offset, stop_token token = {});
+
+		/// Like read_at but into the registered buffer at bufferIndex.
+		/// [buffer, buffer + size) must lie within that buffer.
+		detail::io_uring_operation<std::size_t> read_fixed(
+			int fd, void* buffer, std::size_t size, std::uint64_t offset, unsigned bufferIndex, stop_token token = {});
+
+		/// Accepts a connection on a listening socket. Returns the new fd.
+		detail::io_uring_operation<int> accept(int fd, stop_token token = {});
+
+		detail::io_uring_operation<std::size_t> recv(
+			int fd, void* buffer, std::size_t size, stop_token token = {});
+
+		/// Sends with MSG_NOSIGNAL, a closed peer is reported as EPIPE.
+		detail::io_uring_operation<std::size_t> send(
+			int fd, const void* buffer, std::size_t size, stop_token token = {});
+
+	private:
+		template<typename Result>
+		friend class detail::io_uring_operation;
+
+		void poll(detail::thread_pool_time_point deadline) override;
+		void wake() override;
+
+		// copies sqe into the submission ring. Enters the kernel unless
+		// called from a coroutine that run_once() resumed inline.
+		void submit(const io_uring_sqe& sqe);
+
+		// copies sqe into the submission ring without submitting it.
+		// Returns true if completions had to be reaped into mReady to
+		// make room.
+		bool push_sqe(const io_uring_sqe& sqe);
+
+		// hands the completions that push_sqe() reaped to whoever runs
+		// the ring.
+		void flush_reaped();
+
+		// submits the pending sqes and waits for at least one completion
+		// if wait is set, for at most timeout if it is not null.
+		std::size_t run_once(bool wait, const __kernel_timespec* timeout);
+
+		// unmaps the rings and closes the io_uring fd.
+		void close_ring() noexcept;
+
+		// must hold mSqMutex. Sets reaped if it had to reap completions.
+		io_uring_sqe* get_sqe(bool& reaped);
+
+		// drains the completion ring into mReady. Must hold mCqMutex.
+		// Returns the number of cqes consumed.
+		std::size_t reap() noexcept;
+
+		// the number of sqes the kernel has not consumed yet. enter()
+		// must not be asked to submit more, the kernel skips waiting for
+		// completions if it submits fewer than requested.
+		unsigned pending() const noexcept;
+
+		// returns -EBUSY if the kernel refused to submit because the
+		// completion ring overflowed.
+		int enter(unsigned toSubmit, unsigned minComplete, unsigned flags, const void* arg, std::size_t argSize);
+
+		int mRing = -1;
+		thread_pool* mPool = nullptr;
+
+		void* mSqMap = nullptr;
+		void* mCqMap = nullptr;
+		std::size_t mSqMapSize = 0;
+		std::size_t mCqMapSize = 0;
+		io_uring_sqe* mSqes = nullptr;
+		std::size_t mSqesSize = 0;
+
+		unsigned* mSqHead = nullptr;
+		unsigned* mSqTail = nullptr;
+		unsigned mSqMask = 0;
+		unsigned mSqEntries = 0;
+		unsigned* mSqArray = nullptr;
+
+		unsigned* mCqHead = nullptr;
+		unsigned* mCqTail = nullptr;
+		unsigned mCqMask = 0;
+		io_uring_cqe* mCqes = nullptr;
+
+		std::mutex mSqMutex;
+		std::mutex mCqMutex;
+
+		std::atomic<bool> mWakePending;
+		std::atomic<bool> mStopped;
+
+		// coroutines whose operations completed but have not been
+		// resumed or posted yet. Guarded by mCqMutex.
+		std::vector<coroutine_handle<>> mReady;
+	};
+
+	namespace detail
+	{
+		template<typename Result>
+		template<typename H>
+		bool io_uring_operation<Result>::await_suspend(H h)
+		{
+			m_awaitingCoroutine = coroutine_handle<>(h);
+
+			// register before submitting so that a failed registration
+			// does not leave a started operation behind.
+			const bool canBeCancelled = m_cancellationToken.stop_possible();
+			if (canBeCancelled)
+			{
+				m_cancellationCallback.emplace(
+					std::move(m_cancellationToken),
+					[this] { this->on_cancellation_requested(); });
+			}
+			else
+			{
+				m_state.store(state::started, std::memory_order_relaxed);
+			}
+
+			m_sqe.user_data = reinterpret_cast<std::uint64_t>(static_cast<io_uring_operation_base*>(this));
+			m_service->submit(m_sqe);
+
+			if (canBeCancelled)
+			{
+				state oldState = state::not_started;
+				if (!m_state.compare_exchange_strong(
+					oldState,
+					state::started,
+					std::memory_order_release,
+					std::memory_order_acquire))
+				{
+					if (oldState == state::cancellation_requested)
+					{
+						cancel();
+						if (!m_state.compare_exchange_strong(
+							oldState,
+							state::started,
+							std::memory_order_release,
+							std::memory_order_acquire))
+						{
+							assert(oldState == state::completed);
+							return false;
+						}
+					}
+					else
+					{
+						assert(oldState == state::completed);
+						return false;
+					}
+				}
+			}
+
+			return true;
+		}
+
+		template<typename Result>
+		void io_uring_operation<Result>::cancel() noexcept
+		{
+			io_uring_sqe sqe{};
+			sqe.opcode = IORING_OP_ASYNC_CANCEL;
+			sqe.fd = -1;
+			sqe.addr = reinterpret_cast<std::uint64_t>(static_cast<io_uring_operation_base*>(this));
+
+			// the completion of the cancel request itself is ignored.
+			sqe.user_data = io_uring_ignore_tag;
+			try {
+				m_service->submit(sqe);
+			}
+			catch (...)
+			{
+				// the operation will still complete, just not early.
+			}
+		}
+	}
+}
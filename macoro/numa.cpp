@@ -0,0 +1,145 @@
+#include "macoro/numa.h"
+
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <stdexcept>
+#include <thread>
+
+#if MACORO_LINUX_OS
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace macoro
+{
+	namespace detail
+	{
+		std::vector<std::size_t> parse_cpu_list(const std::string& list)
+		{
+			std::vector<std::size_t> cpus;
+			std::size_t i = 0;
+			auto number = [&]() {
+				if (i == list.size() || !std::isdigit(static_cast<unsigned char>(list[i])))
+					throw std::invalid_argument("bad cpu list: " + list);
+				std::size_t v = 0;
+				while (i < list.size() && std::isdigit(static_cast<unsigned char>(list[i])))
+					v = v * 10 + (list[i++] - '0');
+				return v;
+			};
+
+			while (i < list.size() && !std::isspace(static_cast<unsigned char>(list[i])))
+			{
+				auto begin = number();
+				auto end = begin;
+				if (i < list.size() && list[i] == '-')
+				{
+					++i;
+					end = number();
+					if (end < begin)
+						throw std::invalid_argument("bad cpu list: " + list);
+				}
+				for (auto c = begin; c <= end; ++c)
+					cpus.push_back(c);
+
+				if (i < list.size() && list[i] == ',')
+					++i;
+			}
+			return cpus;
+		}
+	}
+
+	namespace
+	{
+		std::vector<std::size_t> allowed_cpus()
+		{
+			std::vector<std::size_t> cpus;
+#if MACORO_LINUX_OS
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			if (::sched_getaffinity(0, sizeof(set), &set) == 0)
+			{
+				for (std::size_t c = 0; c < CPU_SETSIZE; ++c)
+					if (CPU_ISSET(c, &set))
+						cpus.push_back(c);
+			}
+#endif
+			if (cpus.empty())
+			{
+				auto n = std::max(1u, std::thread::hardware_concurrency());
+				for (std::size_t c = 0; c < n; ++c)
+					cpus.push_back(c);
+			}
+			return cpus;
+		}
+	}
+
+	std::vector<numa_node> numa_topology()
+	{
+		auto allowed = allowed_cpus();
+		std::vector<numa_node> nodes;
+
+#if MACORO_LINUX_OS
+		if (auto dir = ::opendir("/sys/devices/system/node"))
+		{
+			while (auto e = ::readdir(dir))
+			{
+				std::string name = e->d_name;
+				if (name.size() <= 4 || name.compare(0, 4, "node") ||
+					!std::all_of(name.begin() + 4, name.end(), [](char c) { return std::isdigit(static_cast<unsigned char>(c)); }))
+					continue;
+
+				std::ifstream in("/sys/devices/system/node/" + name + "/cpulist");
+				std::string list;
+				if (!std::getline(in, list))
+					continue;
+
+				numa_node node;
+				node.id = std::stoul(name.substr(4));
+				try {
+					for (auto c : detail::parse_cpu_list(list))
+						if (std::binary_search(allowed.begin(), allowed.end(), c))
+							node.cpus.push_back(c);
+				}
+				catch (std::invalid_argument&)
+				{
+					continue;
+				}
+
+				if (node.cpus.size())
+					nodes.push_back(std::move(node));
+			}
+			::closedir(dir);
+		}
+#endif
+
+		if (nodes.empty())
+		{
+			nodes.emplace_back();
+			nodes.back().cpus = std::move(allowed);
+		}
+
+		std::sort(nodes.begin(), nodes.end(),
+			[](const numa_node& a, const numa_node& b) { return a.id < b.id; });
+		return nodes;
+	}
+
+	bool set_thread_affinity(const std::vector<std::size_t>& cpus)
+	{
+#if MACORO_LINUX_OS
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (auto c : cpus)
+		{
+			if (c >= CPU_SETSIZE)
+				return false;
+			CPU_SET(c, &set);
+		}
+		return cpus.size() && ::pthread_setaffinity_np(::pthread_self(), sizeof(set), &set) == 0;
+#else
+		(void)cpus;
+		return false;
+#endif
+	}
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include "macoro/config.h"
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace macoro
+{
+	/// A NUMA node and the cpus that belong to it.
+	struct numa_node
+	{
+		std::size_t id = 0;
+		std::vector<std::size_t> cpus;
+	};
+
+	/// Returns the NUMA nodes of the machine, read from
+	/// /sys/devices/system/node on Linux. Only the cpus that this process
+	/// may run on are included and nodes without any are skipped. Where
+	/// the topology is unknown a single node with every cpu is returned.
+	std::vector<numa_node> numa_topology();
+
+	/// Pins the calling thread to the given cpus with
+	/// pthread_setaffinity_np. Returns false if the cpus could not be
+	/// set or affinity is not supported on this platform.
+	bool set_thread_affinity(const std::vector<std::size_t>& cpus);
+
+	namespace detail
+	{
+		/// Parses a kernel cpu list such as "0-3,8,10-11".
+		///
+		/// \throw std::invalid_argument if the list is malformed.
+		std::vector<std::size_t> parse_cpu_list(const std::string& list);
+	}
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#include "macoro/thread_pool.h"
+#include "macoro/numa.h"
+#include "macoro/detail/frame_arena.h"
+
+#include <atomic>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+namespace macoro
+{
+	/// A thread_pool per NUMA node. The workers of a node are pinned to
+	/// its cpus and allocate coroutine frames from the node's frame_arena.
+	/// Work is scheduled on the caller's node, or round robin from outside
+	/// the pool, and a worker only steals from the other nodes once its
+	/// own queue has drained.
+	class numa_thread_pool
+	{
+	public:
+
+		/// Keeps the workers of every node running, see thread_pool::work.
+		struct work
+		{
+			std::vector<thread_pool::work> mWork;
+
+			void reset()
+			{
+				for (auto& w : mWork)
+					w.reset();
+			}
+		};
+
+		numa_thread_pool()
+			: numa_thread_pool(numa_topology())
+		{}
+
+		explicit numa_thread_pool(std::vector<numa_node> nodes)
+			: mNodes(std::move(nodes))
+		{
+			if (mNodes.empty())
+				throw std::invalid_argument("numa_thread_pool requires at least one node.");
+
+			for (std::size_t i = 0; i < mNodes.size(); ++i)
+			{
+				mPools.emplace_back(new thread_pool);
+				mPools.back()->mState->mArena = detail::frame_arena::create();
+			}
+
+			for (auto& p : mPools)
+			{
+				for (auto& q : mPools)
+					if (p != q)
+						p->mState->mSiblings.push_back(q->mState.get());
+			}
+		}
+
+		numa_thread_pool(const numa_thread_pool&) = delete;
+		numa_thread_pool& operator=(const numa_thread_pool&) = delete;
+
+		~numa_thread_pool()
+		{
+			join();
+
+			// outstanding frames keep their arena alive.
+			for (auto& p : mPools)
+				p->mState->mArena->release();
+		}
+
+		/// The number of nodes.
+		std::size_t size() const { return mPools.size(); }
+
+		const numa_node& topology(std::size_t i) const { return mNodes[i]; }
+
+		thread_pool& node(std::size_t i) { return *mPools[i]; }
+
+		/// The pool of the calling worker or, from outside the pool, the
+		/// next node in round robin order.
+		thread_pool& local()
+		{
+			auto cur = detail::thread_pool_state::mCurrentExecutor;
+			for (auto& p : mPools)
+				if (p->mState.get() == cur)
+					return *p;
+			return *mPools[mNext.fetch_add(1, std::memory_order_relaxed) % mPools.size()];
+		}
+
+		detail::thread_pool_post schedule(priority p = priority::inherit) { return local().schedule(p); }
+
+		void post(coroutine_handle<void> fn, priority p = priority::inherit) { local().post(fn, p); }
+
+		work make_work()
+		{
+			work w;
+			for (auto& p : mPools)
+				w.mWork.push_back(p->make_work());
+			return w;
+		}
+
+		/// Creates threadsPerNode workers on every node, pinned to the
+		/// node's cpus. 0 creates one per cpu of the node.
+		void create_threads(std::size_t threadsPerNode = 0)
+		{
+			for (std::size_t i = 0; i < mPools.size(); ++i)
+			{
+				auto n = threadsPerNode ? threadsPerNode : mNodes[i].cpus.size();
+				mPools[i]->create_threads(n, mNodes[i].cpus);
+			}
+		}
+
+		void join()
+		{
+			for (auto& p : mPools)
+				p->join();
+		}
+
+	private:
+		std::vector<numa_node> mNodes;
+		std::vector<std::unique_ptr<thread_pool>> mPools;
+		std::atomic<std::size_t> mNext{ 0 };
+	};
+}
@@ -0,0 +1,168 @@
+#pragma once
+
+#include "macoro/thread_pool.h"
+#include "macoro/coro_frame.h"
+#include "macoro/result.h"
+#include "macoro/stop.h"
+#include "macoro/type_traits.h"
+#include "macoro/detail/operation_cancelled.h"
+
+#include <cassert>
+#include <type_traits>
+#include <utility>
+
+namespace macoro
+{
+	namespace detail
+	{
+		template<typename F, typename = void>
+		struct takes_stop_token : std::false_type {};
+
+		template<typename F>
+		struct takes_stop_token<F, void_t<decltype(std::declval<F&>()(std::declval<const stop_token&>()))>> : std::true_type {};
+
+		template<typename F>
+		auto invoke_blocking(F& f, const stop_token& token, std::true_type) -> decltype(f(token)) { return f(token); }
+
+		template<typename F>
+		auto invoke_blocking(F& f, const stop_token&, std::false_type) -> decltype(f()) { return f(); }
+
+		template<typename F>
+		using run_blocking_result_t = remove_cvref_t<decltype(
+			invoke_blocking(std::declval<F&>(), std::declval<const stop_token&>(), takes_stop_token<F>{}))>;
+
+		/// The awaiter of run_blocking(). It posts a frame of its own to
+		/// the blocking pool whose resume() calls the function, so the
+		/// callable lives in the awaiting coroutine's frame and nothing is
+		/// allocated.
+		template<typename F>
+		class run_blocking_awaiter
+		{
+		public:
+			using value_type = run_blocking_result_t<F>;
+
+			run_blocking_awaiter(thread_pool& blocking, F&& fn, stop_token&& token)
+				: mBlocking(&blocking)
+				, mFn(std::move(fn))
+				, mToken(std::move(token))
+			{
+				init();
+			}
+
+			run_blocking_awaiter(run_blocking_awaiter&& o)
+				: mBlocking(o.mBlocking)
+				, mFn(std::move(o.mFn))
+				, mToken(std::move(o.mToken))
+			{
+				init();
+			}
+
+			bool await_ready() const noexcept
+			{
+				return mToken.stop_requested();
+			}
+
+			template<typename H>
+			void await_suspend(H h)
+			{
+				mAwaiting = coroutine_handle<>(h);
+				mResumeOn = thread_pool_state::mCurrentExecutor;
+				mPriority = thread_pool_state::mCurrentPriority;
+				mBlocking->post(_macoro_frame_handle(&mFrame));
+			}
+
+			value_type await_resume()
+			{
+				if (!mStarted)
+					throw operation_cancelled{};
+				return get(std::is_void<value_type>{});
+			}
+
+		private:
+
+			struct frame : FrameBase<void>
+			{
+				run_blocking_awaiter* mSelf;
+			};
+
+			void init()
+			{
+				mFrame.mSelf = this;
+				mFrame.resume = &run_blocking_awaiter::on_resume;
+				mFrame.destroy = &run_blocking_awaiter::on_destroy;
+			}
+
+			void call(std::true_type)
+			{
+				invoke_blocking(mFn, mToken, takes_stop_token<F>{});
+				mResult = Ok();
+			}
+
+			void call(std::false_type)
+			{
+				mResult = Ok(invoke_blocking(mFn, mToken, takes_stop_token<F>{}));
+			}
+
+			void get(std::true_type) { mResult.value(); }
+			value_type get(std::false_type) { return std::move(mResult.value()); }
+
+			// runs on the blocking pool.
+			static coroutine_handle<> on_resume(FrameBase<void>* f)
+			{
+				auto self = static_cast<frame*>(f)->mSelf;
+				self->mStarted = true;
+				try {
+					self->call(std::is_void<value_type>{});
+				}
+				catch (...)
+				{
+					self->mResult = Err(std::current_exception());
+				}
+
+				// once posted the coroutine may resume and destroy this
+				// awaiter, so nothing is touched afterwards.
+				auto h = self->mAwaiting;
+				if (auto pool = self->mResumeOn)
+				{
+					pool->post(h, self->mPriority);
+					return noop_coroutine();
+				}
+				return h;
+			}
+
+			static void on_destroy(FrameBase<void>*) noexcept
+			{
+				assert(0 && "run_blocking is owned by the awaiting coroutine.");
+			}
+
+			frame mFrame;
+			thread_pool* mBlocking;
+			F mFn;
+			stop_token mToken;
+			result<value_type> mResult;
+			coroutine_handle<> mAwaiting;
+			thread_pool_state* mResumeOn = nullptr;
+			priority mPriority = priority::normal;
+			bool mStarted = false;
+		};
+	}
+
+	/// Runs fn on the blocking pool, a thread_pool set aside for calls
+	/// that block such as synchronous I/O, so that they do not hold up
+	/// the workers of the awaiting coroutine's pool. The coroutine is then
+	/// resumed on the thread_pool it was running on, at its priority, or
+	/// on the blocking thread if it was not running on a pool.
+	///
+	/// fn is called with token if it accepts a stop_token. If token is
+	/// already stopped fn is not called and operation_cancelled is thrown.
+	/// Exceptions thrown by fn are rethrown to the awaiting coroutine.
+	///
+	/// fn is stored in the awaiter, so nothing is allocated. MC_AWAIT
+	/// takes the decltype of its expression, so there fn can not be a
+	/// lambda written inline; make it a frame variable instead.
+	template<typename F>
+	detail::run_blocking_awaiter<remove_cvref_t<F>> run_blocking(thread_pool& blocking, F&& fn, stop_token token = {})
+	{
+		return { blocking, remove_cvref_t<F>(std::forward<F>(fn)), std::move(token) };
+	}
+}
@@ -0,0 +1,530 @@
+#pragma once
+
+#include <atomic>
+#include <exception>
+#include <utility>
+#include <type_traits>
+#include <cstdint>
+#include <cassert>
+
+#ifdef MACORO_CPP_20
+#include <coroutine>
+#endif
+#include "macoro/coroutine_handle.h"
+#include "macoro/awaiter.h"
+#include "macoro/type_traits.h"
+#include "macoro/macros.h"
+
+namespace macoro
+{
+	template<typename T = void> class shared_task;
+
+	namespace detail
+	{
+		/// A coroutine that is waiting for a shared_task. Lives in the
+		/// awaiter, which is in the waiting coroutine's frame.
+		struct shared_task_waiter
+		{
+			coroutine_handle<> m_awaiter;
+			shared_task_waiter* m_next = nullptr;
+		};
+
+		class shared_task_promise_base
+		{
+			struct final_awaitable
+			{
+				bool await_ready() const noexcept { return false; }
+
+#ifdef MACORO_CPP_20
+				template<typename PROMISE>
+				std::coroutine_handle<> await_suspend(
+					std::coroutine_handle<PROMISE> coro) noexcept
+				{
+					return await_suspend(coroutine_handle<PROMISE>(coro)).std_cast();
+				}
+#endif
+
+				// Resumes every waiter. All but the last are resumed inline,
+				// the last one by symmetric transfer. A resumed waiter may
+				// release the last reference and destroy this frame, so
+				// nothing here touches the promise after the exchange.
+				template<typename PROMISE>
+				coroutine_handle<> await_suspend(
+					coroutine_handle<PROMISE> coro) noexcept
+				{
+					shared_task_promise_base& promise = coro.promise();
+
+					// release our result. acquire the waiters.
+					void* waiters = promise.m_state.exchange(
+						static_cast<void*>(&promise), std::memory_order_acq_rel);
+
+					auto* waiter = static_cast<shared_task_waiter*>(waiters);
+					if (waiter == nullptr)
+						return noop_coroutine();
+
+					while (waiter->m_next)
+					{
+						// read next before resuming, the waiter goes away
+						// with its frame.
+						auto* next = waiter->m_next;
+						waiter->m_awaiter.resume();
+						waiter = next;
+					}
+					return waiter->m_awaiter;
+				}
+
+				void await_resume() noexcept {}
+			};
+
+		public:
+
+			shared_task_promise_base() noexcept
+				: m_refCount(1)
+				, m_state(static_cast<void*>(&m_state))
+			{}
+
+			auto initial_suspend() noexcept
+			{
+				return suspend_always{};
+			}
+
+			auto final_suspend() noexcept
+			{
+				return final_awaitable{};
+			}
+
+			bool is_ready() const noexcept
+			{
+				return m_state.load(std::memory_order_acquire) == static_cast<const void*>(this);
+			}
+
+			void add_ref() noexcept
+			{
+				m_refCount.fetch_add(1, std::memory_order_relaxed);
+			}
+
+			/// Returns true if this was the last reference.
+			bool release() noexcept
+			{
+				return m_refCount.fetch_sub(1, std::memory_order_acq_rel) == 1;
+			}
+
+			/// Adds the waiter to the list. Returns the coroutine to
+			/// transfer to: the shared coroutine if this is the first waiter,
+			/// the waiter itself if the result became ready, otherwise
+			/// noop_coroutine().
+			coroutine_handle<> try_await(
+				shared_task_waiter& waiter,
+				coroutine_handle<> coroutine) noexcept
+			{
+				void* const readyState = static_cast<void*>(this);
+				void* const notStartedState = static_cast<void*>(&m_state);
+
+				void* oldState = m_state.load(std::memory_order_acquire);
+				do
+				{
+					if (oldState == readyState)
+						return waiter.m_awaiter;
+
+					// nullptr is both "started with no waiters" and the
+					// end of the list.
+					waiter.m_next = oldState == notStartedState
+						? nullptr
+						: static_cast<shared_task_waiter*>(oldState);
+				} while (!m_state.compare_exchange_weak(
+					oldState,
+					static_cast<void*>(&waiter),
+					std::memory_order_release,
+					std::memory_order_acquire));
+
+				if (oldState == notStartedState)
+					return coroutine;
+				return noop_coroutine();
+			}
+
+		private:
+
+			std::atomic<std::uint32_t> m_refCount;
+
+			// This variable has 4 states:
+			// - &m_state - The coroutine has not been started.
+			// - nullptr  - The coroutine is running and has no waiters.
+			// - this     - The coroutine has completed.
+			// - other    - The coroutine is running. Points to the
+			//              shared_task_waiter that is the head of a
+			//              linked-list of waiters.
+			std::atomic<void*> m_state;
+		};
+
+		template<typename T>
+		class shared_task_promise final : public shared_task_promise_base
+		{
+		public:
+
+			shared_task_promise() noexcept {}
+
+			~shared_task_promise()
+			{
+				switch (m_resultType)
+				{
+				case result_type::value:
+					m_value.~T();
+					break;
+				case result_type::exception:
+					m_exception.~exception_ptr();
+					break;
+				default:
+					break;
+				}
+			}
+
+			shared_task<T> get_return_object() noexcept;
+			shared_task<T> macoro_get_return_object() noexcept;
+
+			void unhandled_exception() noexcept
+			{
+				::new (static_cast<void*>(std::addressof(m_exception))) std::exception_ptr(
+					std::current_exception());
+				m_resultType = result_type::exception;
+			}
+
+			template<
+				typename VALUE,
+				typename = enable_if_t<std::is_convertible<VALUE&&, T>::value>>
+				void return_value(VALUE&& value)
+				noexcept(std::is_nothrow_constructible<T, VALUE&&>::value)
+			{
+				::new (static_cast<void*>(std::addressof(m_value))) T(std::forward<VALUE>(value));
+				m_resultType = result_type::value;
+			}
+
+			/// Every awaiter gets a reference to the same value.
+			const T& result() const
+			{
+				if (m_resultType == result_type::exception)
+				{
+					std::rethrow_exception(m_exception);
+				}
+
+				assert(m_resultType == result_type::value);
+
+				return m_value;
+			}
+
+		private:
+
+			enum class result_type { empty, value, exception };
+
+			result_type m_resultType = result_type::empty;
+
+			union
+			{
+				T m_value;
+				std::exception_ptr m_exception;
+			};
+		};
+
+		template<>
+		class shared_task_promise<void> final : public shared_task_promise_base
+		{
+		public:
+
+			shared_task_promise() noexcept = default;
+
+			shared_task<void> get_return_object() noexcept;
+			shared_task<void> macoro_get_return_object() noexcept;
+
+			void return_void() noexcept
+			{}
+
+			void unhandled_exception() noexcept
+			{
+				m_exception = std::current_exception();
+			}
+
+			void result() const
+			{
+				if (m_exception)
+				{
+					std::rethrow_exception(m_exception);
+				}
+			}
+
+		private:
+
+			std::exception_ptr m_exception;
+		};
+
+		template<typename T>
+		class shared_task_promise<T&> final : public shared_task_promise_base
+		{
+		public:
+
+			shared_task_promise() noexcept = default;
+
+			shared_task<T&> get_return_object() noexcept;
+			shared_task<T&> macoro_get_return_object() noexcept;
+
+			void unhandled_exception() noexcept
+			{
+				m_exception = std::current_exception();
+			}
+
+			void return_value(T& value) noexcept
+			{
+				m_value = std::addressof(value);
+			}
+
+			T& result() const
+			{
+				if (m_exception)
+				{
+					std::rethrow_exception(m_exception);
+				}
+
+				return *m_value;
+			}
+
+		private:
+
+			T* m_value = nullptr;
+			std::exception_ptr m_exception;
+		};
+	}
+
+	/// \brief
+	/// A shared_task is a task that can be awaited any number of times,
+	/// concurrently and from any thread. It is lazy: the first awaiter
+	/// starts the coroutine and the others queue up on a lock-free list,
+	/// the same way as async_manual_reset_event. Once the coroutine
+	/// completes every awaiter is resumed and gets a const reference to
+	/// the one result, or the exception is rethrown to each of them.
+	///
+	/// Copies share the coroutine frame, which is destroyed with the last
+	/// copy. The result is only valid while some copy is alive. This makes
+	/// single-flight request coalescing straightforward: hand the same
+	/// shared_task to everyone that asks for a key while it is in flight.
+	template<typename T>
+	class [[nodiscard]] shared_task
+	{
+	public:
+
+		using promise_type = detail::shared_task_promise<T>;
+
+		using value_type = T;
+
+		shared_task() noexcept
+			: m_coroutine(nullptr)
+		{}
+
+#ifdef MACORO_CPP_20
+		explicit shared_task(std::coroutine_handle<promise_type> coroutine)
+			: m_coroutine(coroutine_handle<promise_type>(coroutine))
+		{}
+#endif
+		explicit shared_task(coroutine_handle<promise_type> coroutine)
+			: m_coroutine(coroutine)
+		{}
+
+		shared_task(shared_task&& t) noexcept
+			: m_coroutine(std::exchange(t.m_coroutine, nullptr))
+		{}
+
+		shared_task(const shared_task& t) noexcept
+			: m_coroutine(t.m_coroutine)
+		{
+			if (m_coroutine)
+				m_coroutine.promise().add_ref();
+		}
+
+		~shared_task()
+		{
+			destroy();
+		}
+
+		shared_task& operator=(shared_task&& other) noexcept
+		{
+			if (std::addressof(other) != this)
+			{
+				destroy();
+				m_coroutine = std::exchange(other.m_coroutine, nullptr);
+			}
+
+			return *this;
+		}
+
+		shared_task& operator=(const shared_task& other) noexcept
+		{
+			if (m_coroutine != other.m_coroutine)
+			{
+				destroy();
+				m_coroutine = other.m_coroutine;
+				if (m_coroutine)
+					m_coroutine.promise().add_ref();
+			}
+
+			return *this;
+		}
+
+		/// \brief
+		/// Query if the task result is complete.
+		///
+		/// Awaiting a task that is ready is guaranteed not to block/suspend.
+		bool is_ready() const noexcept
+		{
+			return !m_coroutine || m_coroutine.promise().is_ready();
+		}
+
+		struct awaitable_base : detail::shared_task_waiter
+		{
+			coroutine_handle<promise_type> m_coroutine;
+
+			awaitable_base(coroutine_handle<promise_type> coroutine) noexcept
+				: m_coroutine(coroutine)
+			{}
+
+			bool await_ready() const noexcept
+			{
+				return !m_coroutine || m_coroutine.promise().is_ready();
+			}
+
+#ifdef MACORO_CPP_20
+			std::coroutine_handle<> await_suspend(
+				std::coroutine_handle<> awaitingCoroutine) noexcept
+			{
+				return await_suspend(
+					coroutine_handle<>(awaitingCoroutine)).std_cast();
+			}
+#endif
+
+			coroutine_handle<> await_suspend(
+				coroutine_handle<> awaitingCoroutine) noexcept
+			{
+				this->m_awaiter = awaitingCoroutine;
+				return m_coroutine.promise().try_await(*this, m_coroutine);
+			}
+		};
+
+		struct awaitable : awaitable_base
+		{
+			using awaitable_base::awaitable_base;
+
+			decltype(auto) await_resume()
+			{
+				if (!this->m_coroutine)
+				{
+					throw broken_promise{};
+				}
+
+				return this->m_coroutine.promise().result();
+			}
+		};
+
+		auto MACORO_OPERATOR_COAWAIT() const noexcept
+		{
+			return awaitable{ m_coroutine };
+		}
+
+		struct ready_awaitable : awaitable_base
+		{
+			using awaitable_base::awaitable_base;
+
+			void await_resume() const noexcept {}
+		};
+
+		/// \brief
+		/// Returns an awaitable that will await completion of the task without
+		/// attempting to retrieve the result.
+		auto when_ready() const noexcept
+		{
+			return ready_awaitable{ m_coroutine };
+		}
+
+		coroutine_handle<promise_type> handle() const
+		{
+			return m_coroutine;
+		}
+
+		bool operator==(const shared_task& o) const noexcept { return m_coroutine == o.m_coroutine; }
+		bool operator!=(const shared_task& o) const noexcept { return m_coroutine != o.m_coroutine; }
+
+	private:
+
+		void destroy() noexcept
+		{
+			if (m_coroutine && m_coroutine.promise().release())
+				m_coroutine.destroy();
+			m_coroutine = nullptr;
+		}
+
+		coroutine_handle<promise_type> m_coroutine;
+	};
+
+	namespace detail
+	{
+		template<typename T>
+		shared_task<T> shared_task_promise<T>::get_return_object() noexcept
+		{
+			return shared_task<T>{ coroutine_handle<shared_task_promise>::from_promise(*this, coroutine_handle_type::std) };
+		}
+
+		inline shared_task<void> shared_task_promise<void>::get_return_object() noexcept
+		{
+			return shared_task<void>{ coroutine_handle<shared_task_promise>::from_promise(*this, coroutine_handle_type::std) };
+		}
+
+		template<typename T>
+		shared_task<T&> shared_task_promise<T&>::get_return_object() noexcept
+		{
+			return shared_task<T&>{ coroutine_handle<shared_task_promise>::from_promise(*this, coroutine_handle_type::std) };
+		}
+
+		template<typename T>
+		shared_task<T> shared_task_promise<T>::macoro_get_return_object() noexcept
+		{
+			return shared_task<T>{ coroutine_handle<shared_task_promise>::from_promise(*this, coroutine_handle_type::macoro) };
+		}
+
+		inline shared_task<void> shared_task_promise<void>::macoro_get_return_object() noexcept
+		{
+			return shared_task<void>{ coroutine_handle<shared_task_promise>::from_promise(*this, coroutine_handle_type::macoro) };
+		}
+
+		template<typename T>
+		shared_task<T&> shared_task_promise<T&>::macoro_get_return_object() noexcept
+		{
+			return shared_task<T&>{ coroutine_handle<shared_task_promise>::from_promise(*this, coroutine_handle_type::macoro) };
+		}
+	}
+
+#ifdef MACORO_CPP_20
+	template<typename AWAITABLE>
+	auto make_shared_task(AWAITABLE awaitable)
+		-> shared_task<remove_rvalue_reference_t<awaitable_result_t<AWAITABLE>>>
+	{
+		co_return co_await static_cast<AWAITABLE&&>(awaitable);
+	}
+#else
+	template<typename AWAITABLE,
+		enable_if_t<!std::is_void<awaitable_result_t<AWAITABLE>>::value, int> = 0
+	>
+		auto make_shared_task(AWAITABLE a)
+		-> shared_task<remove_rvalue_reference_t<awaitable_result_t<AWAITABLE>>>
+	{
+		MC_BEGIN(shared_task<remove_rvalue_reference_t<awaitable_result_t<AWAITABLE>>>, awaitable = std::move(a));
+		MC_RETURN_AWAIT(static_cast<AWAITABLE&&>(awaitable));
+		MC_END();
+	}
+
+	template<typename AWAITABLE,
+		enable_if_t<std::is_void<awaitable_result_t<AWAITABLE>>::value, int> = 0
+	>
+		auto make_shared_task(AWAITABLE a)
+		-> shared_task<void>
+	{
+		MC_BEGIN(shared_task<void>, awaitable = std::move(a));
+		MC_AWAIT(static_cast<AWAITABLE&&>(awaitable));
+		MC_END();
+	}
+#endif
+}
@@ -4,5 +4,6 @@
 #include "detail/stop_callback.h"
 #include "detail/stop_source.h"
 #include "detail/stop_token.h"
+#include "detail/local_stop.h"
 #include "detail/stop_awaiter.h"
 #include "detail/operation_cancelled.h"
@@ -0,0 +1,217 @@
+#pragma once
+
+#include "macoro/thread_pool.h"
+#include "macoro/coro_frame.h"
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <thread>
+#include <utility>
+
+namespace macoro
+{
+	template<typename Scheduler>
+	class strand;
+
+	namespace detail
+	{
+		template<typename Scheduler>
+		class strand_operation
+		{
+		public:
+			strand_operation(strand<Scheduler>& s, bool dispatch) noexcept
+				: mStrand(&s)
+				, mInline(dispatch && s.running_in_this_thread())
+			{}
+
+			bool await_ready() const noexcept { return mInline; }
+
+			template<typename H>
+			void await_suspend(H h)
+			{
+				mAwaiting = coroutine_handle<>(h);
+				mStrand->push(this);
+			}
+
+			void await_resume() const noexcept {}
+
+		private:
+			friend class strand<Scheduler>;
+
+			strand<Scheduler>* mStrand;
+			strand_operation* mNext = nullptr;
+			coroutine_handle<> mAwaiting;
+			bool mInline;
+		};
+	}
+
+	/// Runs the coroutines that are scheduled through it one at a time,
+	/// in FIFO order, on an underlying Scheduler such as thread_pool. State
+	/// that is only touched from within a strand needs no lock. A coroutine
+	/// leaves the strand when it next suspends.
+	///
+	/// The queue is a lock-free intrusive list of the awaiters, so
+	/// scheduling does not allocate. The strand posts itself to the
+	/// scheduler only while it has work, and yields the worker after
+	/// budget coroutines so that a busy strand does not starve the rest of
+	/// the pool. Scheduler must have post(coroutine_handle<>). The strand
+	/// must outlive the coroutines scheduled through it.
+	template<typename Scheduler = thread_pool>
+	class strand
+	{
+	public:
+		using operation = detail::strand_operation<Scheduler>;
+
+		explicit strand(Scheduler& s, std::size_t budget = 64) noexcept
+			: mScheduler(&s)
+			, mBudget(budget ? budget : 1)
+		{
+			mFrame.mSelf = this;
+			mFrame.resume = &strand::drain;
+			mFrame.destroy = &strand::on_destroy;
+		}
+
+		strand(const strand&) = delete;
+		strand& operator=(const strand&) = delete;
+
+		/// Waits for the drain to return. The last coroutine may complete,
+		/// and the strand be destroyed, just before it does. A coroutine
+		/// running within the strand may destroy it, as long as nothing else
+		/// is queued. The drain then returns without touching it.
+		~strand()
+		{
+			if (mCurrent == this)
+			{
+				assert(mReady == nullptr &&
+					mIncoming.load(std::memory_order_relaxed) == nullptr &&
+					"a strand was destroyed with coroutines queued on it.");
+				*mDestroyed = true;
+				return;
+			}
+
+			while (mCount.load(std::memory_order_acquire))
+				std::this_thread::yield();
+		}
+
+		/// Resumes the caller within the strand, after the coroutines that
+		/// are already queued.
+		operation schedule() noexcept { return { *this, false }; }
+
+		/// Like schedule() but continues inline if the caller is already
+		/// running within this strand.
+		operation dispatch() noexcept { return { *this, true }; }
+
+		/// Returns true if the calling thread is running a coroutine of
+		/// this strand.
+		bool running_in_this_thread() const noexcept { return mCurrent == this; }
+
+		Scheduler& scheduler() const noexcept { return *mScheduler; }
+
+	private:
+		friend operation;
+
+		struct frame : FrameBase<void>
+		{
+			strand* mSelf;
+		};
+
+		void push(operation* op)
+		{
+			// counted before it is linked so that the drain does not stop
+			// while an operation is on its way.
+			bool active = mCount.fetch_add(1, std::memory_order_acq_rel) != 0;
+
+			op->mNext = mIncoming.load(std::memory_order_relaxed);
+			while (!mIncoming.compare_exchange_weak(op->mNext, op,
+				std::memory_order_release, std::memory_order_relaxed))
+				;
+
+			if (!active)
+				mScheduler->post(_macoro_frame_handle(&mFrame));
+		}
+
+		// runs on the scheduler. Resumes up to mBudget coroutines, one at
+		// a time. Once the count is released the strand may be gone.
+		static coroutine_handle<> drain(FrameBase<void>* f)
+		{
+			auto self = static_cast<frame*>(f)->mSelf;
+			auto prev = std::exchange(mCurrent, self);
+			bool destroyed = false;
+			self->mDestroyed = &destroyed;
+
+			std::size_t n = 0;
+			while (n < self->mBudget)
+			{
+				if (self->mReady == nullptr)
+				{
+					auto list = self->mIncoming.exchange(nullptr, std::memory_order_acquire);
+					if (list == nullptr)
+					{
+						if (self->mCount.fetch_sub(n, std::memory_order_acq_rel) == n)
+						{
+							mCurrent = prev;
+							return noop_coroutine();
+						}
+
+						// an operation has been counted but not linked yet.
+						n = 0;
+						std::this_thread::yield();
+						continue;
+					}
+
+					// the list is newest first.
+					while (list)
+					{
+						auto next = list->mNext;
+						list->mNext = self->mReady;
+						self->mReady = list;
+						list = next;
+					}
+				}
+
+				// the awaiter lives in the coroutine frame and may be gone
+				// once it is resumed.
+				auto op = self->mReady;
+				self->mReady = op->mNext;
+				++n;
+				op->mAwaiting.resume();
+				if (destroyed)
+				{
+					mCurrent = prev;
+					return noop_coroutine();
+				}
+			}
+
+			mCurrent = prev;
+			if (self->mCount.fetch_sub(n, std::memory_order_acq_rel) != n)
+				self->mScheduler->post(_macoro_frame_handle(&self->mFrame));
+			return noop_coroutine();
+		}
+
+		static void on_destroy(FrameBase<void>*) noexcept
+		{
+			assert(0 && "a strand is not owned by its scheduler.");
+		}
+
+		static thread_local strand* mCurrent;
+
+		Scheduler* mScheduler;
+		std::size_t mBudget;
+		frame mFrame;
+
+		// operations that are queued. Every pushed operation is counted.
+		std::atomic<std::size_t> mCount{ 0 };
+		std::atomic<operation*> mIncoming{ nullptr };
+
+		// only touched by the drain, oldest first.
+		operation* mReady = nullptr;
+
+		// set by the destructor if a coroutine that the drain resumed
+		// destroys the strand.
+		bool* mDestroyed = nullptr;
+	};
+
+	template<typename Scheduler>
+	thread_local strand<Scheduler>* strand<Scheduler>::mCurrent = nullptr;
+}
@@ -4,6 +4,7 @@
 #include "macoro/coro_frame.h"
 #include "macoro/optional.h"
 #include "macoro/coroutine_handle.h"
+#include "macoro/detail/blocking_event.h"
 #include <future>
 #include "macros.h"
 namespace macoro
@@ -31,22 +32,25 @@ namespace macoro
 			};
 
 			std::exception_ptr exception;
-			std::mutex mutex;
-			std::condition_variable cv;
-			bool is_set = false;
+			blocking_event event;
+
+			// Sets the event instead of set() if not null, so that a
+			// thread that is not blocked in wait() can be woken, see
+			// thread_pool::run_until().
+			void (*setter)(blocking_event&, void*) = nullptr;
+			void* setterContext = nullptr;
 
 			void wait()
 			{
-				std::unique_lock<std::mutex> lock(mutex);
-				cv.wait(lock, [this] { return is_set; });
+				event.wait();
 			}
 
 			void set()
 			{
-				assert(is_set == false);
-				std::lock_guard<std::mutex> lock(this->mutex);
-				this->is_set = true;
-				this->cv.notify_all();
+				if (setter)
+					setter(event, setterContext);
+				else
+					event.set();
 			}
 
 
@@ -64,15 +68,24 @@ namespace macoro
 		template<typename T>
 		struct blocking_promise : public blocking_promise_base<T>
 		{
-			typename std::remove_reference<T>::type* mVal = nullptr;
+			// A reference result refers to something that outlives the
+			// blocking task. A value result is a temporary that is gone
+			// by the time get() returns, so it is moved in here.
+			using storage_type = typename std::conditional<
+				std::is_reference<T>::value,
+				typename std::remove_reference<T>::type*,
+				optional<T>>::type;
+
+			storage_type mVal{};
 
 			blocking_task<T> get_return_object() noexcept;
 			blocking_task<T> macoro_get_return_object() noexcept;
 
 			using reference_type = T&&;
-			void return_value(reference_type v) noexcept
+			void return_value(reference_type v)
+				noexcept(std::is_reference<T>::value || std::is_nothrow_move_constructible<T>::value)
 			{
-				mVal = std::addressof(v);
+				store(mVal, static_cast<reference_type>(v));
 			}
 
 			reference_type value()
@@ -81,6 +94,19 @@ namespace macoro
 					std::rethrow_exception(this->exception);
 				return static_cast<reference_type>(*mVal);
 			}
+
+		private:
+			template<typename P, typename V>
+			static void store(P*& ptr, V&& v) noexcept
+			{
+				ptr = std::addressof(v);
+			}
+
+			template<typename V>
+			static void store(optional<V>& opt, V&& v)
+			{
+				opt.emplace(std::move(v));
+			}
 		};
 
 		template<>
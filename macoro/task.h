@@ -18,6 +18,7 @@
 #include "macoro/awaiter.h"
 #include "macoro/type_traits.h"
 #include "macoro/macros.h"
+#include "macoro/deadline.h"
 
 namespace macoro
 {
@@ -32,7 +33,7 @@ namespace macoro
 		struct task_awaitable_base;
 
 		template<>
-		class task_promise_base<true>
+		class task_promise_base<true> : public deadline_promise_base
 		{
 			friend struct final_awaitable;
 
@@ -94,7 +95,7 @@ namespace macoro
 		};
 
 		template<>
-		class task_promise_base<false>
+		class task_promise_base<false> : public deadline_promise_base
 		{
 			friend struct final_awaitable;
 
@@ -552,6 +553,16 @@ namespace macoro
 			return m_coroutine;
 		}
 
+		/// Sets the deadline that the task inherits, see with_deadline().
+		/// Only lazy tasks inherit deadlines since an eager task is already
+		/// running by the time it is awaited.
+		template<bool L = lazy, enable_if_t<L, int> = 0>
+		void macoro_set_deadline(const detail::deadline_context* d) noexcept
+		{
+			if (m_coroutine)
+				m_coroutine.promise().set_deadline_context(d);
+		}
+
 	private:
 
 		coroutine_handle<promise_type> m_coroutine;
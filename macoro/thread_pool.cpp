@@ -2,4 +2,7 @@
 
 
 
-thread_local macoro::detail::thread_pool_state * macoro::detail::thread_pool_state::mCurrentExecutor;
\ No newline at end of file
+thread_local macoro::detail::thread_pool_state * macoro::detail::thread_pool_state::mCurrentExecutor;
+thread_local macoro::priority macoro::detail::thread_pool_state::mCurrentPriority = macoro::priority::normal;
+thread_local macoro::detail::thread_pool_state::next_slot macoro::detail::thread_pool_state::mNext;
+thread_local macoro::detail::thread_pool_state::dispatch_budget macoro::detail::thread_pool_state::mDispatched;
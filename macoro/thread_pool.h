@@ -8,11 +8,63 @@
 #include "macoro/coroutine_handle.h"
 #include "macoro/awaiter.h"
 #include "stop.h"
+#include "macoro/detail/timer_node.h"
+#include "macoro/detail/atomic_wait.h"
+#include "macoro/detail/frame_arena.h"
+#include "macoro/numa.h"
+#include "macoro/deadline.h"
+#include "macoro/sync_wait.h"
 #include <algorithm>
 #include <sstream>
 #include <condition_variable>
 namespace macoro
 {
+    /// The priority of work posted to a thread_pool. Higher priority work
+    /// is resumed first. Queued work is aged so that low priority work is
+    /// not starved, see thread_pool::set_aging().
+    enum class priority : std::uint8_t
+    {
+        high,
+        normal,
+        low,
+
+        /// The priority of the coroutine that is currently running on a
+        /// thread_pool worker, or normal on any other thread. A task that
+        /// is awaited runs inline in its parent and so moves to a pool,
+        /// e.g. with schedule() or start_on(), at the parent's priority.
+        inherit
+    };
+
+    /// How long runnable work waited before a worker picked it up.
+    struct scheduling_lag
+    {
+        using duration = std::chrono::steady_clock::duration;
+
+        std::uint64_t count = 0;
+        duration total{ 0 }, max{ 0 };
+
+        duration mean() const
+        {
+            return count ? total / std::int64_t(count) : duration{ 0 };
+        }
+
+        void add(duration d)
+        {
+            d = std::max(d, duration{ 0 });
+            ++count;
+            total += d;
+            max = std::max(max, d);
+        }
+    };
+
+    /// The scheduling lag of a thread_pool. immediate is posted work,
+    /// measured from when it was queued. delayed is schedule_after() and
+    /// timers, measured from their deadline.
+    struct thread_pool_lag
+    {
+        scheduling_lag immediate, delayed;
+    };
+
     namespace detail
     {
         using thread_pool_clock = std::chrono::steady_clock;
@@ -32,24 +84,246 @@ namespace macoro
                 , deadline(p)
             {}
 
+            thread_pool_delay_op(std::size_t i, timer_node* t, thread_pool_time_point p)
+                : idx(i)
+                , timer(t)
+                , deadline(p)
+            {}
+
+            // exactly one of handle or timer is set.
             std::size_t idx;
             coroutine_handle<> handle;
+            timer_node* timer = nullptr;
             thread_pool_time_point deadline;
+            priority prio = priority::normal;
 
             bool operator<(const thread_pool_delay_op& o) const { return deadline > o.deadline; }
         };
 
 
 
+        /// A source of events, e.g. io_service, that an idle thread_pool
+        /// worker blocks on instead of parking. At most one worker polls
+        /// at a time, the others park as usual.
+        struct thread_pool_reactor
+        {
+            /// Block until events are ready, wake() is called or the deadline
+            /// passes. Continuations made ready should be posted to the pool.
+            virtual void poll(thread_pool_time_point deadline) = 0;
+
+            /// Interrupts a concurrent or the next call to poll().
+            virtual void wake() = 0;
+
+        protected:
+            ~thread_pool_reactor() = default;
+        };
+
+        /// The run queue of a thread_pool, a FIFO per priority level.
+        ///
+        /// Each entry is stamped with the time it was queued and is
+        /// treated as one level higher for every mAging it has waited.
+        /// pop() takes the front with the highest such priority, i.e. the
+        /// smallest stamp + level * mAging, the older one on a tie. Only
+        /// the fronts have to be compared since each level is FIFO, and
+        /// pop() never reads the clock.
+        struct thread_pool_queue
+        {
+            static constexpr std::size_t levels = 3;
+
+            struct entry
+            {
+                coroutine_handle<void> handle;
+                thread_pool_time_point queued;
+                std::uint64_t ticket;
+
+                // moved here from the delay heap, queued is the deadline.
+                bool delayed;
+            };
+
+            std::deque<entry> mLevels[levels];
+            std::size_t mSize = 0;
+            std::uint64_t mNextTicket = 0;
+
+            // zero makes the queue a single FIFO.
+            thread_pool_clock::duration mAging = std::chrono::milliseconds(10);
+
+            std::size_t size() const { return mSize; }
+            bool empty() const { return mSize == 0; }
+
+            void push(coroutine_handle<void> h, priority p)
+            {
+                assert(p != priority::inherit);
+                mLevels[std::size_t(p)].push_back({ h, thread_pool_clock::now(), mNextTicket++, false });
+                ++mSize;
+            }
+
+            void push(const coroutine_handle<void>* fns, std::size_t n, priority p)
+            {
+                assert(p != priority::inherit);
+                auto& q = mLevels[std::size_t(p)];
+                auto now = thread_pool_clock::now();
+                for (std::size_t i = 0; i < n; ++i)
+                    q.push_back({ fns[i], now, mNextTicket++, false });
+                mSize += n;
+            }
+
+            // when the longest waiting entry was queued. Must not be empty.
+            thread_pool_time_point oldest() const
+            {
+                auto t = thread_pool_time_point::max();
+                for (auto& l : mLevels)
+                    if (l.size())
+                        t = std::min(t, l.front().queued);
+                return t;
+            }
+
+            // queues an expired delay op at the back of its level, aged
+            // from its deadline.
+            void push_delayed(coroutine_handle<void> h, priority p, thread_pool_time_point deadline)
+            {
+                mLevels[std::size_t(p)].push_back({ h, deadline, mNextTicket++, true });
+                ++mSize;
+            }
+
+            // must not be empty. p is set to the level it was queued at.
+            entry pop(priority& p)
+            {
+                assert(mSize);
+                std::size_t best = levels;
+                thread_pool_time_point bestKey;
+                for (std::size_t i = 0; i < levels; ++i)
+                {
+                    if (mLevels[i].empty())
+                        continue;
+
+                    // when the front reaches the top level.
+                    auto& e = mLevels[i].front();
+                    auto key = e.queued + std::int64_t(i) * mAging;
+                    if (best == levels || key < bestKey ||
+                        (key == bestKey && e.ticket < mLevels[best].front().ticket))
+                    {
+                        best = i;
+                        bestKey = key;
+                    }
+                }
+
+                auto e = mLevels[best].front();
+                mLevels[best].pop_front();
+                --mSize;
+                p = priority(best);
+                return e;
+            }
+        };
+
         struct thread_pool_state
         {
             std::mutex              mMutex;
-            std::condition_variable mCondition;
+
+            // notified when a timer that someone is waiting to cancel
+            // has finished firing.
+            std::condition_variable mTimerCondition;
+
+            // notified when a worker stops polling a detached reactor.
+            std::condition_variable mReactorCondition;
 
             std::size_t mWork = 0;
+
+            // Idle workers park on mWakeEpoch with atomic_wait(), a futex
+            // on Linux, and the epoch is bumped whenever there is something
+            // for them to do. mIdle counts the workers that are spinning or
+            // parked and is modified under mMutex, so that posting to a busy
+            // pool neither bumps the epoch nor makes a syscall. Sibling
+            // pools read it without the lock as a hint. mParked counts the
+            // ones blocked in atomic_wait(), only those need to be woken by
+            // the kernel.
+            std::atomic<std::size_t> mIdle{ 0 };
+            std::atomic<std::uint32_t> mWakeEpoch{ 0 };
+            std::atomic<std::uint32_t> mParked{ 0 };
+
+            // how many times an idle worker polls mWakeEpoch before parking.
+            std::atomic<std::size_t> mSpinCount{ 0 };
+
+            // The attached reactor and the one a worker is currently
+            // blocked in, if any. Both are protected by mMutex.
+            thread_pool_reactor* mReactor = nullptr;
+            thread_pool_reactor* mPolling = nullptr;
+
+            // While there is work no worker is idle to block in the
+            // reactor, so one polls it without blocking once mLastPoll is
+            // mPollInterval old. mLastPoll is protected by mMutex.
+            thread_pool_time_point mLastPoll;
+            std::atomic<thread_pool_clock::duration> mPollInterval{ std::chrono::milliseconds(1) };
+
+            // The other sub-pools of a numa_thread_pool. An idle worker
+            // steals from them once its own queue has drained. Set before
+            // any thread is created and not changed afterwards.
+            std::vector<thread_pool_state*> mSiblings;
+
+            // where the workers' coroutine frames are allocated, if set.
+            frame_arena* mArena = nullptr;
+
             static thread_local thread_pool_state* mCurrentExecutor;
 
-            std::deque<coroutine_handle<void>> mDeque;
+            // the priority of the coroutine this thread is resuming, used
+            // for priority::inherit.
+            static thread_local priority mCurrentPriority;
+
+            static priority resolve(priority p)
+            {
+                return p == priority::inherit ? mCurrentPriority : p;
+            }
+
+            // The coroutine that a worker posted last with post_next(). The
+            // worker resumes it as soon as the current one suspends, up to
+            // mNextBudget times in a row, before the queue is looked at.
+            // running is the one the worker resumed, which posting itself
+            // yields to the queue instead.
+            struct next_slot
+            {
+                coroutine_handle<void> handle;
+                priority prio = priority::normal;
+                coroutine_handle<void> running;
+            };
+            static thread_local next_slot mNext;
+            std::atomic<std::size_t> mNextBudget{ 16 };
+
+            static coroutine_handle<void> take_next(priority& p)
+            {
+                p = mNext.prio;
+                return std::exchange(mNext.handle, {});
+            }
+
+            // Queues the next slot's coroutine, where other workers can
+            // run it. Called before the worker blocks, see before_block().
+            static void flush_next()
+            {
+                priority p;
+                if (auto fn = take_next(p))
+                    mCurrentExecutor->post(fn, p);
+            }
+
+            // How many times, and since when, the worker resumed a coroutine
+            // inline in try_dispatch() this scheduling round. Past either
+            // limit it posts instead.
+            struct dispatch_budget
+            {
+                std::size_t count = 0;
+                thread_pool_time_point start;
+            };
+            static thread_local dispatch_budget mDispatched;
+            std::atomic<std::size_t> mDispatchLimit{ 64 };
+            std::atomic<thread_pool_clock::duration> mDispatchTime{ thread_pool_clock::duration::zero() };
+
+            bool within_dispatch_budget()
+            {
+                if (++mDispatched.count > mDispatchLimit.load(std::memory_order_relaxed))
+                    return false;
+                auto t = mDispatchTime.load(std::memory_order_relaxed);
+                return t == thread_pool_clock::duration::zero() ||
+                    thread_pool_clock::now() - mDispatched.start < t;
+            }
+
+            thread_pool_queue mQueue;
             //struct LE
             //{
             //	LE(const char* s, thread_pool_time_point t)
@@ -68,52 +342,359 @@ namespace macoro
 
             std::vector<thread_pool_delay_op> mDelayHeap;
             std::size_t mDelayOpIdx = 0;
+
+            // Expired delay ops are moved out of the heap at the start of
+            // each scheduling round, at most harvest_batch at a time.
+            // Coroutines join mQueue and timers join mDueTimers, and a
+            // worker alternates between the two while both are non-empty
+            // so that neither can starve the other.
+            static constexpr std::size_t harvest_batch = 64;
+            std::deque<timer_node*> mDueTimers;
+            bool mTimersTurn = false;
+
+            thread_pool_lag mLag;
+
+            // Elastic mode, see thread_pool::make_elastic(). The supervisor
+            // thread adds workers while work waits and none is idle. It
+            // sleeps on mElasticCondition until mSupervisorWake, max if
+            // there is nothing to time, and min while it is awake. Work
+            // that becomes runnable before then notifies it. Retired
+            // workers move their std::thread to mRetiredThreads for the
+            // supervisor to join.
+            bool mElastic = false;
+            std::size_t mMinThreads = 0, mMaxThreads = 0;
+            thread_pool_clock::duration mSpawnLag{ 0 }, mIdleTimeout{ 0 };
+            std::condition_variable mElasticCondition;
+            thread_pool_time_point mSupervisorWake = thread_pool_time_point::min();
+            std::thread mSupervisor;
+            std::vector<std::thread> mRetiredThreads;
             std::vector<std::thread> mThreads;
 
-            void post(coroutine_handle<void> fn)
+            // Interrupt the worker that is blocked in the reactor so that
+            // it picks up new work or recomputes its deadline. Must be
+            // called with mMutex held, which keeps the reactor attached.
+            void wake_reactor()
+            {
+                if (mPolling)
+                    mPolling->wake();
+            }
+
+            // Tells the idle workers that something changed. Must be
+            // called with mMutex held. Returns true if some are parked,
+            // in which case notify_one() or notify_all() must be called
+            // once the lock is released.
+            bool signal_idle()
+            {
+                if (mIdle.load(std::memory_order_relaxed) == 0)
+                    return false;
+
+                // pairs with the increment of mParked in park().
+                mWakeEpoch.fetch_add(1);
+                return mParked.load() != 0;
+            }
+
+            void notify_one() { atomic_notify_one(mWakeEpoch); }
+            void notify_all() { atomic_notify_all(mWakeEpoch); }
+
+            // The blocking_promise setter of run_until(). The thread that
+            // waits for the event may be parked or in the reactor, so it
+            // is woken like an idle worker would be.
+            static void set_blocking_event(blocking_event& event, void* context)
+            {
+                auto self = static_cast<thread_pool_state*>(context);
+                bool notify;
+                {
+                    std::lock_guard<std::mutex> lock(self->mMutex);
+                    event.set();
+                    self->wake_reactor();
+                    notify = self->signal_idle();
+                }
+                if (notify)
+                    self->notify_all();
+            }
+
+            // Wakes the supervisor of an elastic pool if work that is
+            // runnable at t should be looked at before it would wake up.
+            // Must hold mMutex.
+            void wake_supervisor(thread_pool_time_point t)
+            {
+                if (mElastic && t + mSpawnLag < mSupervisorWake)
+                {
+                    mSupervisorWake = thread_pool_time_point::min();
+                    mElasticCondition.notify_one();
+                }
+            }
+
+            // Called after queueing. The supervisor only needs to know if
+            // there may not be an idle worker for it all.
+            void wake_supervisor_if_busy()
+            {
+                if (mElastic && (mPolling == nullptr &&
+                    mQueue.size() > mIdle.load(std::memory_order_relaxed)))
+                    wake_supervisor(thread_pool_clock::now());
+            }
+
+            // Moves the calling worker's thread to mRetiredThreads if the
+            // elastic pool has more than the minimum and no queued work.
+            // Must hold mMutex. The worker must then leave run().
+            bool retire_current()
+            {
+                if (mThreads.size() <= mMinThreads || mQueue.size() || mDueTimers.size())
+                    return false;
+
+                // run() may have been called by the user.
+                auto id = std::this_thread::get_id();
+                auto iter = std::find_if(mThreads.begin(), mThreads.end(),
+                    [id](const std::thread& t) { return t.get_id() == id; });
+                if (iter == mThreads.end())
+                    return false;
+
+                mRetiredThreads.push_back(std::move(*iter));
+                mThreads.erase(iter);
+                wake_supervisor(thread_pool_time_point::min());
+                return true;
+            }
+
+            // Called when this pool has no idle worker for new work. Wakes
+            // one of a sibling's so that it steals the work. Must not hold
+            // mMutex.
+            void wake_sibling()
+            {
+                for (auto s : mSiblings)
+                {
+                    if (s->mIdle.load(std::memory_order_relaxed) == 0)
+                        continue;
+
+                    bool notify;
+                    {
+                        std::lock_guard<std::mutex> lock(s->mMutex);
+                        notify = s->signal_idle();
+                    }
+                    if (notify)
+                        s->notify_one();
+                    return;
+                }
+            }
+
+            // Moves the expired delay ops out of the heap, see
+            // harvest_batch. Must hold mMutex. Returns how many moved.
+            std::size_t harvest(thread_pool_time_point now)
+            {
+                std::size_t n = 0;
+                while (n < harvest_batch && mDelayHeap.size() && mDelayHeap.front().deadline <= now)
+                {
+                    auto& op = mDelayHeap.front();
+                    if (op.timer)
+                        mDueTimers.push_back(op.timer);
+                    else
+                        mQueue.push_delayed(op.handle, op.prio, op.deadline);
+                    std::pop_heap(mDelayHeap.begin(), mDelayHeap.end());
+                    mDelayHeap.pop_back();
+                    ++n;
+                }
+                return n;
+            }
+
+            // Pops the next coroutine of mQueue and records how long it
+            // waited. Must hold mMutex.
+            coroutine_handle<void> pop_queued(thread_pool_time_point now, priority& p)
+            {
+                auto e = mQueue.pop(p);
+                (e.delayed ? mLag.delayed : mLag.immediate).add(now - e.queued);
+                return e.handle;
+            }
+
+            // Takes the next queued coroutine of a sibling, if any. lock
+            // is released while the siblings are searched.
+            coroutine_handle<void> steal(std::unique_lock<std::mutex>& lock, thread_pool_time_point now, priority& p)
+            {
+                coroutine_handle<void> fn;
+                if (mSiblings.empty())
+                    return fn;
+
+                lock.unlock();
+                for (auto s : mSiblings)
+                {
+                    std::lock_guard<std::mutex> l(s->mMutex);
+                    if (s->mQueue.size())
+                    {
+                        fn = s->pop_queued(now, p);
+                        break;
+                    }
+                }
+                lock.lock();
+                return fn;
+            }
+
+            // Polls the reactor until the deadline, or without blocking
+            // if it has passed, with lock released. Must be called with
+            // lock held, a reactor attached and no worker polling.
+            void poll_reactor(std::unique_lock<std::mutex>& lock, thread_pool_time_point now, thread_pool_time_point deadline)
+            {
+                auto reactor = mReactor;
+                mPolling = reactor;
+                mLastPoll = now;
+                lock.unlock();
+
+                reactor->poll(deadline);
+
+                lock.lock();
+                mPolling = nullptr;
+
+                // set_reactor() waits for us to leave poll(). Otherwise,
+                // if we are about to run work, hand the reactor to an
+                // idle worker.
+                if (mReactor != reactor)
+                {
+                    mReactorCondition.notify_all();
+                    if (mReactor && signal_idle())
+                        notify_one();
+                }
+                else if (mQueue.size() && signal_idle())
+                    notify_one();
+            }
+
+            // Blocks an idle worker until signal_idle() is called or the
+            // deadline passes. May return spuriously. lock is released
+            // while waiting.
+            void park(std::unique_lock<std::mutex>& lock, thread_pool_time_point deadline)
+            {
+                auto epoch = mWakeEpoch.load(std::memory_order_relaxed);
+                ++mIdle;
+                lock.unlock();
+
+                // spinning on a single core only delays whoever would wake us.
+                static const bool multicore = std::thread::hardware_concurrency() > 1;
+                auto spin = multicore ? mSpinCount.load(std::memory_order_relaxed) : 0;
+                for (std::size_t i = 0; i < spin && mWakeEpoch.load(std::memory_order_acquire) == epoch; ++i)
+                    cpu_relax();
+
+                if (mWakeEpoch.load(std::memory_order_acquire) == epoch)
+                {
+                    // a signal_idle() that does not see us parked has
+                    // already bumped the epoch.
+                    mParked.fetch_add(1);
+                    while (mWakeEpoch.load() == epoch && thread_pool_clock::now() < deadline)
+                        atomic_wait_until(mWakeEpoch, epoch, deadline);
+                    mParked.fetch_sub(1, std::memory_order_relaxed);
+                }
+
+                lock.lock();
+                --mIdle;
+            }
+
+            void post(coroutine_handle<void> fn, priority p = priority::inherit)
             {
                 //log("post");
                 assert(fn);
+                p = resolve(p);
+                bool notify, busy;
                 {
                     std::lock_guard<std::mutex> lock(mMutex);
-                    mDeque.push_back(std::move(fn));
+                    mQueue.push(fn, p);
+                    wake_reactor();
+                    notify = signal_idle();
+                    busy = mIdle.load(std::memory_order_relaxed) == 0;
+                    wake_supervisor_if_busy();
+                }
+                if (notify)
+                    notify_one();
+                else if (busy && mSiblings.size())
+                    wake_sibling();
+            }
+
+            // Posts a coroutine that the caller is waking. On a worker of
+            // this pool it goes to the worker's next slot, unless that would
+            // put it ahead of more urgent work, and any previous occupant is
+            // queued. Only the worker can run it until it is flushed.
+            void post_next(coroutine_handle<void> fn, priority p = priority::inherit)
+            {
+                assert(fn);
+                p = resolve(p);
+                if (mCurrentExecutor != this ||
+                    p > mCurrentPriority ||
+                    fn.address() == mNext.running.address() ||
+                    mNextBudget.load(std::memory_order_relaxed) == 0)
+                    return post(fn, p);
+
+                auto old = std::exchange(mNext.handle, fn);
+                auto oldPrio = std::exchange(mNext.prio, p);
+                if (old)
+                    post(old, oldPrio);
+            }
+
+            // Inserts all of the handles under one lock and wakes at most
+            // one idle worker per handle.
+            void post_batch(const coroutine_handle<void>* fns, std::size_t n, priority p = priority::inherit)
+            {
+                if (n == 0)
+                    return;
+
+                p = resolve(p);
+                std::size_t wake = 0, idle;
+                bool all = false;
+                {
+                    std::lock_guard<std::mutex> lock(mMutex);
+                    assert(std::all_of(fns, fns + n, [](coroutine_handle<void> h) { return bool(h); }));
+                    mQueue.push(fns, n, p);
+                    wake_reactor();
+                    wake_supervisor_if_busy();
+                    idle = mIdle.load(std::memory_order_relaxed);
+                    if (signal_idle())
+                    {
+                        wake = std::min(n, idle);
+                        all = wake == idle;
+                    }
+                }
+
+                if (all)
+                    notify_all();
+                else
+                {
+                    for (std::size_t i = 0; i < wake; ++i)
+                        notify_one();
                 }
-                mCondition.notify_one();
+
+                if (n > idle && mSiblings.size())
+                    wake_sibling();
             }
 
             MACORO_NODISCARD
                 bool try_dispatch(coroutine_handle<void> fn)
             {
                 //log("try_dispatch");
-                if (mCurrentExecutor == this)
+                if (mCurrentExecutor == this && within_dispatch_budget())
                     return true;
                 else
                 {
-                    {
-                        std::lock_guard<std::mutex> lock(mMutex);
-                        mDeque.push_back(std::move(fn));
-                    }
-
-                    mCondition.notify_one();
+                    post(fn);
                     return false;
                 }
             }
 
+            // Token may be a stop_token or a local_stop_token. Reg is
+            // the matching optional callback that holds the registration.
+            template<typename Token, typename Callback>
             void post_after(
                 coroutine_handle<> h,
                 thread_pool_time_point deadline,
-                stop_token&& token,
-                optional_stop_callback& reg
+                Token&& token,
+                basic_optional_stop_callback<Callback>& reg
             )
             {
                 if (token.stop_requested() == false)
                 {
                     std::size_t idx;
+                    bool notify;
                     {
                         std::unique_lock<std::mutex> lock(mMutex);
                         idx = mDelayOpIdx++;
                         mDelayHeap.emplace_back(idx, h, deadline);
+                        mDelayHeap.back().prio = resolve(priority::inherit);
                         std::push_heap(mDelayHeap.begin(), mDelayHeap.end());
+                        wake_reactor();
+                        wake_supervisor(deadline);
+                        notify = signal_idle();
                     }
 
                     if (token.stop_possible())
@@ -122,7 +703,8 @@ namespace macoro
                             cancel_delay_op(idx);
                             });
                     }
-                    mCondition.notify_one();
+                    if (notify)
+                        notify_one();
                 }
                 else
                 {
@@ -131,6 +713,99 @@ namespace macoro
             }
 
 
+            void add_timer(timer_node& t)
+            {
+                assert(t.mCallback && t.mState != timer_node::state::pending);
+                t.mCancel = &thread_pool_state::cancel_timer;
+                t.mAdd = [](void* self, timer_node& n) {
+                    static_cast<thread_pool_state*>(self)->add_timer(n); };
+                t.mScheduler = this;
+                t.mWaiting = false;
+                t.mDetached = nullptr;
+                bool notify;
+                {
+                    std::unique_lock<std::mutex> lock(mMutex);
+                    t.mIdx = mDelayOpIdx++;
+                    t.mState = timer_node::state::pending;
+                    mDelayHeap.emplace_back(t.mIdx, &t, t.mDeadline);
+                    std::push_heap(mDelayHeap.begin(), mDelayHeap.end());
+                    wake_reactor();
+                    wake_supervisor(t.mDeadline);
+                    notify = signal_idle();
+                }
+                if (notify)
+                    notify_one();
+            }
+
+            static bool cancel_timer(timer_node* t) noexcept
+            {
+                auto self = static_cast<thread_pool_state*>(t->mScheduler);
+                std::unique_lock<std::mutex> lock(self->mMutex);
+                switch (t->mState)
+                {
+                case timer_node::state::pending:
+                {
+                    // either still in the heap or already harvested.
+                    auto iter = std::find_if(self->mDelayHeap.begin(), self->mDelayHeap.end(),
+                        [t](const thread_pool_delay_op& op) { return op.timer == t; });
+                    if (iter != self->mDelayHeap.end())
+                    {
+                        *iter = std::move(self->mDelayHeap.back());
+                        self->mDelayHeap.pop_back();
+                        std::make_heap(self->mDelayHeap.begin(), self->mDelayHeap.end());
+                    }
+                    else
+                    {
+                        auto due = std::find(self->mDueTimers.begin(), self->mDueTimers.end(), t);
+                        assert(due != self->mDueTimers.end());
+                        self->mDueTimers.erase(due);
+                    }
+                    t->mState = timer_node::state::idle;
+                    return true;
+                }
+                case timer_node::state::firing:
+                    if (t->mFiringThread == std::this_thread::get_id())
+                    {
+                        // cancelled from inside the callback. Tell the
+                        // firing loop not to touch the node again.
+                        *t->mDetached = true;
+                        t->mDetached = nullptr;
+                        t->mState = timer_node::state::done;
+                    }
+                    else
+                    {
+                        t->mWaiting = true;
+                        self->mTimerCondition.wait(lock, [t] {
+                            return t->mState != timer_node::state::firing; });
+                    }
+                    return false;
+                default:
+                    return false;
+                }
+            }
+
+            // Runs the timer callback. The lock is released while the
+            // callback executes.
+            void fire_timer(timer_node* t, std::unique_lock<std::mutex>& lock)
+            {
+                bool detached = false;
+                t->mState = timer_node::state::firing;
+                t->mFiringThread = std::this_thread::get_id();
+                t->mDetached = &detached;
+                lock.unlock();
+
+                t->mCallback(t);
+
+                lock.lock();
+                if (!detached)
+                {
+                    t->mState = timer_node::state::done;
+                    t->mDetached = nullptr;
+                    if (t->mWaiting)
+                        mTimerCondition.notify_all();
+                }
+            }
+
             void cancel_delay_op(std::size_t idx)
             {
                 //log("cancel_delay_op");
@@ -143,13 +818,14 @@ namespace macoro
                         {
                             mDelayHeap[i].deadline = thread_pool_clock::now();
                             std::make_heap(mDelayHeap.begin(), mDelayHeap.end());
-                            notify = true;
+                            wake_reactor();
+                            notify = signal_idle();
                             break;
                         }
                     }
                 }
                 if (notify)
-                    mCondition.notify_one();
+                    notify_one();
             }
 
         };
@@ -158,12 +834,13 @@ namespace macoro
         struct thread_pool_post
         {
             thread_pool_state* mPool;
+            priority mPriority = priority::inherit;
 
             bool await_ready() const noexcept { return false; }
 
             template<typename H>
             void await_suspend(H h) const {
-                mPool->post(coroutine_handle<void>(h));
+                mPool->post(coroutine_handle<void>(h), mPriority);
             }
 
             void await_resume() const noexcept {}
@@ -189,23 +866,136 @@ namespace macoro
             void await_resume() const noexcept {}
         };
 
+        /// An awaitable for exactly n coroutines. Each one suspends until
+        /// all n have awaited it, then they are posted together with
+        /// thread_pool_state::post_batch(). Fewer than n awaiters are never
+        /// resumed. Must not be moved once it has been awaited.
+        class thread_pool_schedule_n
+        {
+        public:
+            thread_pool_schedule_n(thread_pool_state* pool, std::size_t n, priority p = priority::inherit)
+                : mPool(pool)
+                , mPriority(p)
+                , mHandles(n)
+                , mNext(0)
+                , mArrived(0)
+            {}
+
+            thread_pool_schedule_n(thread_pool_schedule_n&& o)
+                : mPool(o.mPool)
+                , mPriority(o.mPriority)
+                , mHandles(std::move(o.mHandles))
+                , mNext(0)
+                , mArrived(0)
+            {
+                assert(o.mNext.load(std::memory_order_relaxed) == 0);
+            }
+
+            thread_pool_schedule_n(const thread_pool_schedule_n&) = delete;
+            thread_pool_schedule_n& operator=(const thread_pool_schedule_n&) = delete;
+            thread_pool_schedule_n& operator=(thread_pool_schedule_n&&) = delete;
+
+            std::size_t size() const noexcept { return mHandles.size(); }
+
+            auto MACORO_OPERATOR_COAWAIT() & noexcept
+            {
+                struct awaiter
+                {
+                    thread_pool_schedule_n* mSelf;
+
+                    bool await_ready() const noexcept { return false; }
+
+#ifdef MACORO_CPP_20
+                    void await_suspend(std::coroutine_handle<> h)
+                    {
+                        mSelf->arrive(coroutine_handle<void>(h));
+                    }
+#endif
+                    void await_suspend(coroutine_handle<void> h)
+                    {
+                        mSelf->arrive(h);
+                    }
+
+                    void await_resume() const noexcept {}
+                };
+                return awaiter{ this };
+            }
+
+        private:
+
+            void arrive(coroutine_handle<void> h)
+            {
+                auto i = mNext.fetch_add(1, std::memory_order_relaxed);
+                assert(i < mHandles.size() && "schedule_n awaited more than n times.");
+                mHandles[i] = h;
+
+                // the last to arrive sees every handle. inherit is
+                // resolved by whoever that is.
+                if (mArrived.fetch_add(1, std::memory_order_acq_rel) + 1 == mHandles.size())
+                    mPool->post_batch(mHandles.data(), mHandles.size(), mPriority);
+            }
+
+            thread_pool_state* mPool;
+            priority mPriority;
+            std::vector<coroutine_handle<void>> mHandles;
+            std::atomic<std::size_t> mNext, mArrived;
+        };
+
+        template<typename Token = stop_token>
         struct thread_pool_post_after
         {
             thread_pool_state* mPool;
             thread_pool_time_point mDeadline;
-            stop_token mToken;
-            optional_stop_callback mReg;
+            Token mToken;
+            basic_optional_stop_callback<stop_callback_for_t<Token>> mReg;
+            const detail::deadline_context* mContext = nullptr;
+            bool mClamped = false;
+
+            // don't sleep past the deadline of the awaiting task.
+            void macoro_set_deadline(const detail::deadline_context* d) noexcept
+            {
+                mContext = d;
+                if (d->mDeadline < mDeadline)
+                {
+                    mDeadline = d->mDeadline;
+                    mClamped = true;
+                }
+            }
 
             bool await_ready() const noexcept { return false; }
 
             template<typename H>
             void await_suspend(const H& h) {
-                using traits_C = coroutine_handle_traits<H>;
-                using return_type = typename traits_C::template coroutine_handle<void>;
+                if (mContext)
+                {
+                    mContext->arm(*mPool);
+                    use_deadline_token(mToken);
+                }
                 mPool->post_after(coroutine_handle<void>(h), mDeadline, std::move(mToken), mReg);
             }
 
-            void await_resume() const noexcept {}
+            // a sleep that the deadline cut short, or that began after
+            // it was stopped, fails.
+            void await_resume() const
+            {
+                if (mContext && (
+                    mContext->token().stop_requested() ||
+                    (mClamped && thread_pool_clock::now() >= mDeadline)))
+                    throw operation_cancelled{};
+            }
+
+        private:
+
+            // without a token of its own the sleep is woken once the
+            // deadline is stopped.
+            void use_deadline_token(stop_token& t)
+            {
+                if (!t.stop_possible())
+                    t = mContext->token();
+            }
+
+            template<typename T>
+            void use_deadline_token(T&) {}
         };
     }
 
@@ -243,15 +1033,19 @@ namespace macoro
                 if (mEx)
                 {
 
-                    std::size_t v = 0;
+                    bool notify = false;
                     {
                         std::lock_guard<std::mutex> lock(mEx->mMutex);
-                        v = --mEx->mWork;
-                    }
-                    if (v == 0)
-                    {
-                        mEx->mCondition.notify_all();
+                        if (--mEx->mWork == 0)
+                        {
+                            mEx->wake_reactor();
+                            notify = mEx->signal_idle();
+                            if (mEx->mElastic)
+                                mEx->mElasticCondition.notify_all();
+                        }
                     }
+                    if (notify)
+                        mEx->notify_all();
                     mEx = nullptr;
                 }
             }
@@ -281,15 +1075,16 @@ namespace macoro
         }
 
 
-        detail::thread_pool_post schedule()
+        /// Resume the caller on the pool at priority p.
+        detail::thread_pool_post schedule(priority p = priority::inherit)
         {
-            return { mState.get() };
+            return { mState.get(), p };
         }
 
 
-        detail::thread_pool_post post()
+        detail::thread_pool_post post(priority p = priority::inherit)
         {
-            return { mState.get() };
+            return { mState.get(), p };
         }
 
 
@@ -298,16 +1093,50 @@ namespace macoro
             return { mState.get() };
         }
 
-        void schedule(coroutine_handle<void> fn)
+        void schedule(coroutine_handle<void> fn, priority p = priority::inherit)
         {
-            mState->post(fn);
+            mState->post(fn, p);
         };
 
-        void post(coroutine_handle<void> fn)
+        void post(coroutine_handle<void> fn, priority p = priority::inherit)
         {
-            mState->post(fn);
+            mState->post(fn, p);
         };
 
+        /// Posts fn. Called from a worker of this pool, fn is instead
+        /// resumed by that worker as soon as the caller suspends, see
+        /// set_lifo_budget(). Until then no other worker can run it, so the
+        /// caller should suspend soon. If the worker blocks in sync_wait()
+        /// first, fn is queued.
+        void post_next(coroutine_handle<void> fn, priority p = priority::inherit)
+        {
+            mState->post_next(fn, p);
+        }
+
+        /// Posts n handles at once. Cheaper than n calls to post() since
+        /// the lock is taken once and at most min(n, idle) workers are
+        /// woken.
+        void post_batch(const coroutine_handle<void>* fns, std::size_t n, priority p = priority::inherit)
+        {
+            mState->post_batch(fns, n, p);
+        }
+
+        /// Posts every handle in a contiguous range such as a
+        /// std::vector<coroutine_handle<>>.
+        template<typename Range>
+        void post_batch(const Range& fns, priority p = priority::inherit)
+        {
+            mState->post_batch(fns.data(), fns.size(), p);
+        }
+
+        /// Returns an awaitable that n coroutines, e.g. the tasks of a
+        /// when_all_ready() fan-out, co_await to move onto the pool. They
+        /// are posted together once the last one arrives.
+        detail::thread_pool_schedule_n schedule_n(std::size_t n, priority p = priority::inherit)
+        {
+            return { mState.get(), n, p };
+        }
+
         coroutine_handle<void> dispatch(coroutine_handle<void> fn)
         {
             if (mState->try_dispatch(fn))
@@ -316,27 +1145,211 @@ namespace macoro
                 return noop_coroutine();
         };
 
-        template<typename Rep, typename Per>
-        detail::thread_pool_post_after schedule_after(
+        /// Resume the caller on the pool after the delay or once stop
+        /// is requested, whichever is first. The token can be either a
+        /// stop_token or a local_stop_token.
+        template<typename Rep, typename Per, typename Token = stop_token>
+        detail::thread_pool_post_after<Token> schedule_after(
             std::chrono::duration<Rep, Per> delay,
-            stop_token token = {})
+            Token token = {})
         {
             return { mState.get(), delay + clock::now(), std::move(token) };
         }
 
+        /// Registers an intrusive timer that is fired on one of the pool's
+        /// threads once t.mDeadline has passed. The node must outlive the
+        /// timer or be cancelled with t.cancel().
+        void add_timer(detail::timer_node& t)
+        {
+            mState->add_timer(t);
+        }
+
         work make_work() {
             return { mState.get() };
         }
 
+        /// Attaches a reactor, e.g. an io_service, that idle worker threads
+        /// block on instead of sleeping. Passing nullptr detaches the
+        /// current one and waits until no worker is polling it.
+        void set_reactor(detail::thread_pool_reactor* r)
+        {
+            std::unique_lock<std::mutex> lock(mState->mMutex);
+            auto old = std::exchange(mState->mReactor, r);
+            if (old == r)
+                return;
+
+            mState->wake_reactor();
+            if (old)
+            {
+                mState->mReactorCondition.wait(lock, [&] {
+                    return mState->mPolling != old;
+                });
+            }
+
+            // let an idle worker start polling the new reactor.
+            if (r && mState->signal_idle())
+            {
+                lock.unlock();
+                mState->notify_one();
+            }
+        }
+
+        /// An idle worker blocks in the reactor. While the pool is busy
+        /// and none is idle, a worker instead polls it without blocking once
+        /// the last poll is this old, so that I/O still completes. Zero
+        /// polls every scheduling round. The default is 1ms.
+        template<typename Rep, typename Per>
+        void set_reactor_poll_interval(std::chrono::duration<Rep, Per> interval)
+        {
+            mState->mPollInterval.store(std::max(clock::duration::zero(),
+                std::chrono::duration_cast<clock::duration>(interval)), std::memory_order_relaxed);
+        }
+
+        /// Sets how many times an idle worker checks for new work before
+        /// it parks in the kernel. Spinning lowers the latency of waking
+        /// it at the cost of burning cpu while idle. The default is 0.
+        void set_spin_count(std::size_t n)
+        {
+            mState->mSpinCount.store(n, std::memory_order_relaxed);
+        }
+
+        /// dispatch() resumes the caller inline if it is already on a
+        /// worker of this pool. Sets how many times, and for how long, a
+        /// worker does so per item of work before dispatch() posts
+        /// instead, so that a coroutine that dispatches in a loop does not
+        /// starve the queue. The defaults are 64 and no time limit, which
+        /// a zero time also means. A time limit costs a clock read per
+        /// dispatch.
+        void set_dispatch_budget(std::size_t n)
+        {
+            mState->mDispatchLimit.store(n, std::memory_order_relaxed);
+        }
+
+        template<typename Rep, typename Per>
+        void set_dispatch_budget(std::size_t n, std::chrono::duration<Rep, Per> time)
+        {
+            set_dispatch_budget(n);
+            mState->mDispatchTime.store(std::max(clock::duration::zero(),
+                std::chrono::duration_cast<clock::duration>(time)), std::memory_order_relaxed);
+        }
+
+        /// A coroutine posted with post_next() by a worker of this pool,
+        /// e.g. a consumer woken by a producer, is kept in a slot of that
+        /// worker and resumed as soon as the producer suspends instead of
+        /// behind the rest of the queue, while its data is still in cache.
+        /// Reposting the coroutine the worker is running still yields to
+        /// the queue. Sets how many times in a row a worker does so before
+        /// it goes back to the queue, so that coroutines that keep waking
+        /// each other do not starve other work. Zero disables the slot.
+        /// The default is 16.
+        void set_lifo_budget(std::size_t n)
+        {
+            mState->mNextBudget.store(n, std::memory_order_relaxed);
+        }
+
+        /// Queued work is promoted one priority level for every aging
+        /// it has waited, so low priority work waits at most about twice
+        /// that behind a stream of higher priority work. Zero ignores
+        /// priorities and runs work in FIFO order. The default is 10ms.
+        template<typename Rep, typename Per>
+        void set_aging(std::chrono::duration<Rep, Per> aging)
+        {
+            // longer is as good as never and would overflow the queue's
+            // time points.
+            auto max = std::chrono::duration_cast<clock::duration>(std::chrono::hours(24 * 365));
+            auto d = std::chrono::duration_cast<clock::duration>(aging);
+            std::lock_guard<std::mutex> lock(mState->mMutex);
+            mState->mQueue.mAging = std::max(clock::duration::zero(), std::min(d, max));
+        }
+
+        /// How long work has waited for a worker since the pool was
+        /// created or reset_lag() was called.
+        thread_pool_lag lag() const
+        {
+            std::lock_guard<std::mutex> lock(mState->mMutex);
+            return mState->mLag;
+        }
+
+        void reset_lag()
+        {
+            std::lock_guard<std::mutex> lock(mState->mMutex);
+            mState->mLag = {};
+        }
+
+        /// The priority of the coroutine that the calling thread is
+        /// resuming for some thread_pool, normal if none.
+        static priority current_priority()
+        {
+            return detail::thread_pool_state::mCurrentPriority;
+        }
+
+        struct elastic_options
+        {
+            /// Idle workers are not retired below this.
+            std::size_t min_threads;
+
+            /// Workers are not added above this.
+            std::size_t max_threads;
+
+            /// A worker is added once runnable work has waited this long
+            /// and no worker is idle, e.g. because they are all blocked.
+            /// At most one is added per spawn_lag.
+            clock::duration spawn_lag;
+
+            /// A worker that has been idle this long is retired.
+            clock::duration idle_timeout;
+        };
+
+        /// Lets the pool grow and shrink with its load. min_threads
+        /// workers are created now, along with a supervisor thread that
+        /// adds more while work is waiting. Like create_threads() this
+        /// does nothing unless the pool has work, and it must only be
+        /// called once.
+        void make_elastic(const elastic_options& o)
+        {
+            assert(o.min_threads <= o.max_threads && o.max_threads);
+            std::unique_lock<std::mutex> lock(mState->mMutex);
+            assert(mState->mElastic == false && "make_elastic() called twice.");
+            if (mState->mWork || mState->mQueue.size() || mState->mDueTimers.size() || mState->mDelayHeap.size())
+            {
+                mState->mElastic = true;
+                mState->mMinThreads = o.min_threads;
+                mState->mMaxThreads = o.max_threads;
+                mState->mSpawnLag = o.spawn_lag;
+                mState->mIdleTimeout = o.idle_timeout;
+                while (mState->mThreads.size() < o.min_threads)
+                    mState->mThreads.emplace_back([this] { run(); });
+                mState->mSupervisor = std::thread([this] { supervise(); });
+            }
+        }
+
+        /// The number of worker threads.
+        std::size_t thread_count() const
+        {
+            std::lock_guard<std::mutex> lock(mState->mMutex);
+            return mState->mThreads.size();
+        }
+
         void create_threads(std::size_t n)
+        {
+            create_threads(n, {});
+        }
+
+        /// Like create_threads(n) but each thread is pinned to the given
+        /// cpus. An empty set leaves the threads unpinned.
+        void create_threads(std::size_t n, const std::vector<std::size_t>& cpus)
         {
             std::unique_lock<std::mutex> lock(mState->mMutex);
-            if (mState->mWork || mState->mDeque.size() || mState->mDelayHeap.size())
+            if (mState->mWork || mState->mQueue.size() || mState->mDueTimers.size() || mState->mDelayHeap.size())
             {
                 mState->mThreads.reserve(mState->mThreads.size() + n);
                 for (std::size_t i = 0; i < n; ++i)
                 {
-                    mState->mThreads.emplace_back([this] {run(); });
+                    mState->mThreads.emplace_back([this, cpus] {
+                        if (cpus.size())
+                            set_thread_affinity(cpus);
+                        run();
+                    });
                 }
             }
         }
@@ -351,14 +1364,26 @@ namespace macoro
             if (mState)
             {
 
-                std::vector<std::thread> thrds;
+                // an elastic pool can add workers until its supervisor
+                // has exited.
+                while (true)
                 {
-                    std::unique_lock<std::mutex> lock(mState->mMutex);
-                    thrds = std::move(mState->mThreads);
-                }
+                    std::vector<std::thread> thrds;
+                    {
+                        std::unique_lock<std::mutex> lock(mState->mMutex);
+                        thrds = std::move(mState->mThreads);
+                        for (auto& t : mState->mRetiredThreads)
+                            thrds.push_back(std::move(t));
+                        mState->mRetiredThreads.clear();
+                        if (mState->mSupervisor.joinable())
+                            thrds.push_back(std::move(mState->mSupervisor));
+                    }
 
-                for (auto& t : thrds)
-                    t.join();
+                    if (thrds.empty())
+                        break;
+                    for (auto& t : thrds)
+                        t.join();
+                }
             }
         }
 
@@ -383,71 +1408,271 @@ namespace macoro
             if (detail::thread_pool_state::mCurrentExecutor != nullptr)
                 throw std::runtime_error("calling run() on a thread that is already controlled by a thread_pool is not supported. ");
             detail::thread_pool_state::mCurrentExecutor = state;
+            auto prevArena = std::exchange(detail::frame_arena::current(), state->mArena);
+            auto prevBlock = std::exchange(detail::before_block(), &detail::thread_pool_state::flush_next);
+
+            run_loop({}, true, [state] {
+                return !(
+                    state->mWork ||
+                    state->mQueue.size() ||
+                    state->mDueTimers.size() ||
+                    state->mDelayHeap.size() ||
+                    detail::thread_pool_state::mNext.handle);
+            });
+
+            detail::before_block() = prevBlock;
+            detail::frame_arena::current() = prevArena;
+            detail::thread_pool_state::mCurrentExecutor = nullptr;
+        }
+
+        /// Awaits a on the calling thread, which works for the pool until
+        /// a completes: it resumes queued coroutines, fires timers and
+        /// polls the reactor like any worker, and a is resumed by it
+        /// whenever a is posted to the pool. Returns the result of a.
+        ///
+        /// Unlike sync_wait() this does not block a thread that has work
+        /// to do, and a worker of this pool may call it without
+        /// deadlocking a small pool. It then runs the pool's work nested
+        /// inside the coroutine that called it, so that coroutine must not
+        /// hold locks that the work may need. Calling it on a worker of
+        /// another pool is not supported.
+        template<typename Awaitable>
+        typename awaitable_traits<Awaitable&&>::await_result run_until(Awaitable&& a)
+        {
+            auto state = mState.get();
+            auto prevExecutor = detail::thread_pool_state::mCurrentExecutor;
+            if (prevExecutor != nullptr && prevExecutor != state)
+                throw std::runtime_error("calling run_until() on a thread that is controlled by another thread_pool is not supported. ");
+
+            auto task = detail::make_blocking_task<Awaitable&&>(std::forward<Awaitable>(a));
+            auto& promise = task.handle.promise();
+            promise.setter = &detail::thread_pool_state::set_blocking_event;
+            promise.setterContext = state;
+
+            // when nested in a worker, the coroutine that called us
+            // continues once we return.
+            auto prevPriority = detail::thread_pool_state::mCurrentPriority;
+            auto prevRunning = detail::thread_pool_state::mNext.running;
+            auto prevDispatched = detail::thread_pool_state::mDispatched;
+            detail::thread_pool_state::mCurrentExecutor = state;
+            auto prevArena = std::exchange(detail::frame_arena::current(), state->mArena);
+            auto prevBlock = std::exchange(detail::before_block(), &detail::thread_pool_state::flush_next);
+
+            run_loop(task.handle, false, [&promise] { return promise.event.is_set(); });
+
+            // the last coroutine may have posted to the slot. Nested, the
+            // worker's own loop runs it, otherwise no one would.
+            if (prevExecutor == nullptr)
+                detail::thread_pool_state::flush_next();
+            detail::before_block() = prevBlock;
+            detail::frame_arena::current() = prevArena;
+            detail::thread_pool_state::mDispatched = prevDispatched;
+            detail::thread_pool_state::mNext.running = prevRunning;
+            detail::thread_pool_state::mCurrentPriority = prevPriority;
+            detail::thread_pool_state::mCurrentExecutor = prevExecutor;
+
+            return task.get();
+        }
 
+    private:
+
+        // Runs scheduling rounds on the calling thread until done(),
+        // which is called with the pool's mutex held. first is resumed
+        // before anything else. An idle worker of an elastic pool may
+        // only leave early if mayRetire.
+        template<typename Done>
+        void run_loop(coroutine_handle<void> first, bool mayRetire, Done done)
+        {
+            auto state = mState.get();
             coroutine_handle<void> fn;
+            priority prio = priority::normal;
 
             {
                 std::unique_lock<std::mutex> lock(state->mMutex);
-                while (
-                    state->mWork ||
-                    state->mDeque.size() ||
-                    state->mDelayHeap.size())
+                while (!done())
                 {
+                    // a scheduling round. The expired delay ops are moved
+                    // to the queues, then one item is run.
+                    auto now = clock::now();
+                    detail::thread_pool_state::mDispatched = { 0, now };
+                    if (state->harvest(now) > 1 && state->signal_idle())
+                        state->notify_one();
+
+                    // the pool is too busy for a worker to block in the
+                    // reactor, collect its events now and then anyway.
+                    if (state->mReactor && state->mPolling == nullptr &&
+                        (state->mQueue.size() || state->mDueTimers.size()) &&
+                        now - state->mLastPoll >= state->mPollInterval.load(std::memory_order_relaxed))
+                    {
+                        state->poll_reactor(lock, now, now);
+                        continue;
+                    }
 
-                    if ((state->mDelayHeap.empty() || state->mDelayHeap.front().deadline > clock::now()) &&
-                        state->mDeque.empty())
+                    if ((fn = std::exchange(first, {})))
+                    {
+                        // run_until()'s awaitable.
+                        prio = detail::thread_pool_state::mCurrentPriority;
+                    }
+                    else if ((fn = state->take_next(prio)))
+                    {
+                        // posted outside of a coroutine, e.g. by a timer
+                        // callback or the reactor.
+                    }
+                    else if (state->mQueue.empty() && state->mDueTimers.empty())
                     {
                         //state->log("run::no-work");
 
-                        if (state->mDelayHeap.size())
+                        if (state->mReactor && state->mPolling == nullptr)
                         {
-                            state->mCondition.wait_until(lock, state->mDelayHeap.front().deadline);
+                            // block in the reactor instead. It is woken
+                            // by wake_reactor() whenever there is new work.
+                            auto deadline = state->mDelayHeap.size() ?
+                                state->mDelayHeap.front().deadline :
+                                detail::thread_pool_time_point::max();
+                            state->poll_reactor(lock, now, deadline);
+                            continue;
                         }
-                        else
+
+                        if (!(fn = state->steal(lock, now, prio)))
                         {
-                            state->mCondition.wait(lock, [&] {
-                                // wake up when theres something in the
-                                //  queue, or state->state->mWork == 0
-                                return
-                                    state->mDeque.size() ||
-                                    state->mDelayHeap.size() ||
-                                    state->mWork == 0;
-                                });
+                            // copy the deadline. The heap may reallocate while we wait.
+                            auto deadline = state->mDelayHeap.size() ?
+                                state->mDelayHeap.front().deadline :
+                                detail::thread_pool_time_point::max();
+
+                            // an elastic pool retires workers that stay idle.
+                            auto retire = mayRetire && state->mElastic && state->mThreads.size() > state->mMinThreads ?
+                                now + state->mIdleTimeout :
+                                detail::thread_pool_time_point::max();
+
+                            // woken when theres something in the queue,
+                            // state->mWork == 0 or the reactor is free.
+                            state->park(lock, std::min(deadline, retire));
+                            if (retire != detail::thread_pool_time_point::max() &&
+                                clock::now() >= retire &&
+                                state->retire_current())
+                                break;
+                            continue;
                         }
-                    }
 
-                    if (state->mDelayHeap.size() && state->mDelayHeap.front().deadline <= clock::now())
+                        // stolen from a sibling.
+                    }
+                    else if (state->mDueTimers.size() && (state->mQueue.empty() || state->mTimersTurn))
                     {
-                        //state->log("run::pop-delay");
-
-                        fn = state->mDelayHeap.front().handle;
-                        std::pop_heap(state->mDelayHeap.begin(), state->mDelayHeap.end());
-                        state->mDelayHeap.pop_back();
+                        //state->log("run::fire-timer");
+                        auto t = state->mDueTimers.front();
+                        state->mDueTimers.pop_front();
+                        state->mTimersTurn = false;
+                        state->mLag.delayed.add(now - t->mDeadline);
+                        state->fire_timer(t, lock);
                     }
-                    else if (state->mDeque.size())
+                    else
                     {
                         //state->log("run::pop");
-                        fn = state->mDeque.front();
-                        state->mDeque.pop_front();
+                        fn = state->pop_queued(now, prio);
+                        state->mTimersTurn = true;
                     }
 
                     if (fn)
                     {
                         lock.unlock();
 
-                        fn.resume();
-                        fn = {};
+                        // then whatever it posts to the next slot, within
+                        // the budget.
+                        auto budget = state->mNextBudget.load(std::memory_order_relaxed);
+                        while (fn)
+                        {
+                            detail::thread_pool_state::mCurrentPriority = prio;
+                            detail::thread_pool_state::mNext.running = fn;
+                            fn.resume();
+                            fn = state->take_next(prio);
+                            if (budget-- == 0)
+                                break;
+                        }
+                        detail::thread_pool_state::mCurrentPriority = priority::normal;
+                        detail::thread_pool_state::mNext.running = {};
 
                         lock.lock();
+                        if (fn)
+                        {
+                            state->mQueue.push(fn, prio);
+                            fn = {};
+                        }
                     }
                     //state->log("run::next");
                 }
+
+                // the supervisor exits with the last worker.
+                if (state->mElastic)
+                    state->mElasticCondition.notify_all();
             }
+        }
 
-            detail::thread_pool_state::mCurrentExecutor = nullptr;
+        // The supervisor of an elastic pool. Adds a worker whenever the
+        // oldest runnable work has waited mSpawnLag while no worker was
+        // idle, and joins the retired ones. Exits with the workers.
+        void supervise()
+        {
+            auto state = mState.get();
+            std::unique_lock<std::mutex> lock(state->mMutex);
+            while (
+                state->mWork ||
+                state->mQueue.size() ||
+                state->mDueTimers.size() ||
+                state->mDelayHeap.size())
+            {
+                if (state->mRetiredThreads.size())
+                {
+                    auto retired = std::move(state->mRetiredThreads);
+                    state->mRetiredThreads.clear();
+                    lock.unlock();
+                    for (auto& t : retired)
+                        t.join();
+                    lock.lock();
+                    continue;
+                }
+
+                // expired delay ops count as waiting too, the workers
+                // may be too busy to move them to the queue.
+                auto oldest = state->mQueue.size() ?
+                    state->mQueue.oldest() :
+                    detail::thread_pool_time_point::max();
+                if (state->mDueTimers.size())
+                    oldest = std::min(oldest, state->mDueTimers.front()->mDeadline);
+                if (state->mDelayHeap.size())
+                    oldest = std::min(oldest, state->mDelayHeap.front().deadline);
+
+                // while there is work, look again every mSpawnLag.
+                auto wake = detail::thread_pool_time_point::max();
+                if (oldest != detail::thread_pool_time_point::max())
+                {
+                    auto now = clock::now();
+                    if (now - oldest >= state->mSpawnLag &&
+                        state->mIdle.load(std::memory_order_relaxed) == 0 &&
+                        state->mPolling == nullptr &&
+                        state->mThreads.size() < state->mMaxThreads)
+                        state->mThreads.emplace_back([this] { run(); });
+                    wake = std::max(oldest, now) + state->mSpawnLag;
+                }
+
+                state->mSupervisorWake = wake;
+                if (wake == detail::thread_pool_time_point::max())
+                    state->mElasticCondition.wait(lock);
+                else
+                    state->mElasticCondition.wait_until(lock, wake);
+                state->mSupervisorWake = detail::thread_pool_time_point::min();
+            }
         }
 
 
     };
 
+    /// Awaits a with the calling thread working for pool until a
+    /// completes, see thread_pool::run_until().
+    template<typename Awaitable>
+    typename awaitable_traits<Awaitable&&>::await_result
+        sync_wait(thread_pool& pool, Awaitable&& a)
+    {
+        return pool.run_until(std::forward<Awaitable>(a));
+    }
 }
\ No newline at end of file
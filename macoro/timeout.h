@@ -6,56 +6,90 @@
 #include "type_traits.h"
 #include "result.h"
 #include "macoro/macros.h"
+#include "macoro/detail/timer_node.h"
 
 namespace macoro
 {
 
+	/// A stop_source that requests stop after a duration or when a parent
+	/// token is stopped, whichever is first.
+	///
+	/// If the scheduler supports add_timer(), e.g. thread_pool, the timeout
+	/// registers an intrusive timer node and the scheduler calls
+	/// request_stop() directly when it expires. Together with the pooled
+	/// stop_state and inline callback slots this does not allocate. Other
+	/// schedulers fall back to a coroutine that awaits schedule_after().
 	struct timeout
 	{
 		optional<stop_source> mSrc;
-		std::unique_ptr<stop_callback> mReg;
+
+		// The token that we were asked to forward cancellation from and
+		// our registration with it. The registration is held inline and
+		// refers to this object, so it is re-registered when moved. At
+		// most one of the two parent kinds is set.
+		stop_token mParent;
+		optional_stop_callback mReg;
+		local_stop_token mLocalParent;
+		optional_local_stop_callback mLocalReg;
+
+		// The timer fast path. mSelfReg cancels the timer when stop is
+		// requested by someone else.
+		detail::timer_node mTimer;
+		optional_stop_callback mSelfReg;
+
+		// The fallback for schedulers without add_timer().
 		eager_task<> mTask;
 
 		timeout() = default;
 		timeout(const timeout&) = delete;
 		timeout(timeout&& o)
 			: mSrc(o.mSrc) // required to be copy so that the token can still be used.
-			, mReg(std::move(o.mReg))
 			, mTask(std::move(o.mTask))
-		{}
+		{
+			take_parent(o);
+			take_timer(o);
+		}
 
 		timeout& operator=(const timeout&) = delete;
 		timeout& operator=(timeout&& o) {
+			clear();
 			mSrc = o.mSrc; // required to be copy so that the token can still be used.
-			mReg = std::move(o.mReg);
 			mTask = std::move(o.mTask);
+			take_parent(o);
+			take_timer(o);
 			return *this;
 		};
 
+		~timeout()
+		{
+			clear();
+		}
 
-		template<typename Scheduler, typename Rep, typename Per>
+		/// Requests stop on get_token() after the duration d or when
+		/// the parent token is stopped. The parent can be a stop_token
+		/// or a local_stop_token.
+		template<typename Scheduler, typename Rep, typename Per, typename Token = stop_token>
 		timeout(Scheduler& s,
 			std::chrono::duration<Rep, Per> d,
-			stop_token token = {})
+			Token token = {})
 		{
 			reset(s, d, std::move(token));
 		}
 
 
-		template<typename Scheduler, typename Rep, typename Per>
+		template<typename Scheduler, typename Rep, typename Per, typename Token = stop_token>
 		void reset(Scheduler& s,
 			std::chrono::duration<Rep, Per> d,
-			stop_token token = {})
+			Token token = {})
 		{
+			clear();
 			mSrc.emplace();
-			if (token.stop_possible())
-			{
-				mReg.reset(new stop_callback(token, [src = mSrc.value()]() mutable {
-					src.request_stop();
-				}));
-			}
+			mParent = {};
+			mLocalParent = {};
+			set_parent(std::move(token));
+			register_parent();
 
-			mTask = make_task(s, mSrc.value(), d);
+			start(s, d, detail::has_add_timer<Scheduler>{});
 		}
 
 		void request_stop() {
@@ -66,13 +100,136 @@ namespace macoro
 
 		stop_source get_source() { return mSrc.value(); }
 
-		auto MACORO_OPERATOR_COAWAIT()
+		/// Completes once stop has been requested. When using the timer
+		/// the awaiting coroutine is resumed inside request_stop(), on the
+		/// scheduler thread if the timer expired.
+		struct awaiter
+		{
+			bool mUseTask;
+			eager_task<>::ready_awaitable mTask;
+			stop_awaiter mStop;
+
+			bool await_ready() noexcept
+			{
+				return mUseTask ? mTask.await_ready() : false;
+			}
+
+#ifdef MACORO_CPP_20
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<> h)
+			{
+				return await_suspend(coroutine_handle<>(h)).std_cast();
+			}
+#endif
+			coroutine_handle<> await_suspend(coroutine_handle<> h)
+			{
+				if (mUseTask)
+					return mTask.await_suspend(h);
+				return mStop.await_suspend(h);
+			}
+
+			void await_resume() noexcept {}
+		};
+
+		awaiter MACORO_OPERATOR_COAWAIT()
 		{
-			return mTask.MACORO_OPERATOR_COAWAIT();
+			if (mTask.handle())
+				return awaiter{ true, mTask.when_ready(), stop_awaiter{} };
+			return awaiter{ false, mTask.when_ready(), stop_awaiter{ get_token() } };
 		}
 
 	private:
 
+		void set_parent(stop_token&& t) { mParent = std::move(t); }
+		void set_parent(local_stop_token&& t) { mLocalParent = std::move(t); }
+
+		void register_parent()
+		{
+			if (mParent.stop_possible())
+			{
+				mReg.emplace(mParent, [this]() {
+					mSrc.value().request_stop();
+				});
+			}
+			if (mLocalParent.stop_possible())
+			{
+				mLocalReg.emplace(mLocalParent, [this]() {
+					mSrc.value().request_stop();
+				});
+			}
+		}
+
+		void take_parent(timeout& o)
+		{
+			// deregistering o first ensures its callback is not running
+			// while we register ours.
+			o.mReg.reset();
+			o.mLocalReg.reset();
+			mParent = std::move(o.mParent);
+			mLocalParent = std::move(o.mLocalParent);
+			register_parent();
+		}
+
+		// Deregisters everything that refers to this object. Once this
+		// returns the timer callback is not running and will not run.
+		void clear()
+		{
+			mReg.reset();
+			mLocalReg.reset();
+			mSelfReg.reset();
+			mTimer.cancel();
+		}
+
+		template<typename Scheduler, typename Rep, typename Per>
+		void start(Scheduler& s, std::chrono::duration<Rep, Per> d, std::true_type)
+		{
+			mTimer.mDeadline = detail::timer_node::clock::now() +
+				std::chrono::duration_cast<detail::timer_node::clock::duration>(d);
+			arm_timer(s);
+		}
+
+		template<typename Scheduler, typename Rep, typename Per>
+		void start(Scheduler& s, std::chrono::duration<Rep, Per> d, std::false_type)
+		{
+			mTask = make_task(s, mSrc.value(), d);
+		}
+
+		template<typename Scheduler>
+		void arm_timer(Scheduler& s)
+		{
+			mTimer.mCallback = &timeout::on_timer;
+			mTimer.mContext = this;
+			s.add_timer(mTimer);
+			register_self();
+		}
+
+		// if stop is already requested this cancels the timer inline.
+		void register_self()
+		{
+			mSelfReg.emplace(mSrc.value().get_token(), [this]() {
+				mTimer.cancel();
+			});
+		}
+
+		void take_timer(timeout& o)
+		{
+			o.mSelfReg.reset();
+
+			// re-arm on this object if o's timer had not fired yet.
+			if (o.mTimer.cancel())
+			{
+				mTimer.mDeadline = o.mTimer.mDeadline;
+				mTimer.mCallback = &timeout::on_timer;
+				mTimer.mContext = this;
+				o.mTimer.mAdd(o.mTimer.mScheduler, mTimer);
+				register_self();
+			}
+		}
+
+		static void on_timer(detail::timer_node* t)
+		{
+			static_cast<timeout*>(t->mContext)->mSrc.value().request_stop();
+		}
+
 		template<typename Scheduler, typename Rep, typename Per>
 		static eager_task<> make_task(Scheduler& s,
 			stop_source mSrc,
@@ -0,0 +1,178 @@
+#include "any_scheduler_tests.h"
+#include "macoro/any_scheduler.h"
+#include "macoro/thread_pool.h"
+#include "macoro/inline_scheduler.h"
+#include "macoro/strand.h"
+#include "macoro/timeout.h"
+#include "macoro/deadline.h"
+#include "macoro/start_on.h"
+#include "macoro/task.h"
+#include "macoro/sync_wait.h"
+#include "macoro/macros.h"
+
+#include <chrono>
+#include <iostream>
+#include <stdexcept>
+#include <thread>
+
+namespace macoro
+{
+	namespace tests
+	{
+		namespace
+		{
+			// its awaiter is not trivial, so it is resumed through the table.
+			struct throwing_scheduler
+			{
+				struct awaiter
+				{
+					std::string msg = "scheduled";
+					bool await_ready() const noexcept { return true; }
+					void await_suspend(coroutine_handle<>) {}
+					void await_resume() { throw std::runtime_error(msg); }
+				};
+				awaiter schedule() { return {}; }
+			};
+
+			bool on(thread_pool& p)
+			{
+				return p.mState.get() == detail::thread_pool_state::mCurrentExecutor;
+			}
+
+			task<> hop(any_scheduler s, std::size_t n)
+			{
+				MC_BEGIN(task<>, s, n, i = std::size_t{});
+				for (i = 0; i < n; ++i)
+					MC_AWAIT(s.schedule());
+				MC_END();
+			}
+
+			template<typename Scheduler>
+			task<> hop_direct(Scheduler& s, std::size_t n)
+			{
+				MC_BEGIN(task<>, &s, n, i = std::size_t{});
+				for (i = 0; i < n; ++i)
+					MC_AWAIT(s.schedule());
+				MC_END();
+			}
+
+			template<typename F>
+			double ns_per(std::size_t n, F&& f)
+			{
+				auto begin = std::chrono::steady_clock::now();
+				f();
+				return std::chrono::duration<double, std::nano>(
+					std::chrono::steady_clock::now() - begin).count() / n;
+			}
+		}
+
+		void any_scheduler_test()
+		{
+			thread_pool pool;
+			auto w = pool.make_work();
+			pool.create_threads(2);
+			strand<> str(pool);
+			inline_scheduler inl;
+			throwing_scheduler thr;
+
+			auto t = [](any_scheduler p, any_scheduler s, any_scheduler i, thread_pool& pool, strand<>& str) -> task<>
+			{
+				MC_BEGIN(task<>, p, s, i, &pool, &str
+					, begin = std::chrono::steady_clock::time_point{}
+					, src = stop_source{});
+
+				MC_AWAIT(p.schedule());
+				if (!on(pool))
+					throw MACORO_RTE_LOC;
+
+				MC_AWAIT(s.schedule());
+				if (!str.running_in_this_thread())
+					throw MACORO_RTE_LOC;
+
+				begin = std::chrono::steady_clock::now();
+				MC_AWAIT(p.schedule_after(std::chrono::milliseconds(5)));
+				if (!on(pool) || std::chrono::steady_clock::now() - begin < std::chrono::milliseconds(5))
+					throw MACORO_RTE_LOC;
+
+				// stopped, so it resumes right away.
+				src.request_stop();
+				begin = std::chrono::steady_clock::now();
+				MC_AWAIT(p.schedule_after(std::chrono::seconds(100), src.get_token()));
+				if (std::chrono::steady_clock::now() - begin > std::chrono::seconds(50))
+					throw MACORO_RTE_LOC;
+
+				// continues on the same thread.
+				MC_AWAIT(i.schedule());
+				if (!on(pool))
+					throw MACORO_RTE_LOC;
+				MC_END();
+			};
+			sync_wait(t(pool, str, inl, pool, str));
+
+			any_scheduler a(pool), b(inl);
+			if (a == b || a != any_scheduler(pool) || !a.has_schedule_after() || b.has_schedule_after())
+				throw MACORO_RTE_LOC;
+
+			bool thrown = false;
+			try { b.schedule_after(std::chrono::milliseconds(1)); }
+			catch (std::logic_error&) { thrown = true; }
+			if (!thrown)
+				throw MACORO_RTE_LOC;
+
+			// await_resume of the wrapped awaiter is called.
+			thrown = false;
+			try { sync_wait(hop(thr, 1)); }
+			catch (std::runtime_error& e) { thrown = std::string(e.what()) == "scheduled"; }
+			if (!thrown)
+				throw MACORO_RTE_LOC;
+
+			// algorithms that are templated on the scheduler.
+			auto c = [](thread_pool& pool) -> task<>
+			{
+				MC_BEGIN(task<>, &pool);
+				if (!on(pool))
+					throw MACORO_RTE_LOC;
+				MC_END();
+			};
+			sync_wait(start_on(a, c(pool)));
+
+			timeout to(a, std::chrono::milliseconds(1));
+			sync_wait(to);
+			if (!to.get_token().stop_requested())
+				throw MACORO_RTE_LOC;
+
+			// the deadline reaches the pool's awaiter, which cuts the
+			// sleep short.
+			auto sleep = [](any_scheduler s) -> task<>
+			{
+				MC_BEGIN(task<>, s);
+				MC_AWAIT(s.schedule_after(std::chrono::hours(1)));
+				MC_END();
+			};
+			auto begin = std::chrono::steady_clock::now();
+			thrown = false;
+			try { sync_wait(with_deadline(std::chrono::milliseconds(5), sleep(a))); }
+			catch (operation_cancelled&) { thrown = true; }
+			if (!thrown || std::chrono::steady_clock::now() - begin > std::chrono::seconds(10))
+				throw MACORO_RTE_LOC;
+		}
+
+		void any_scheduler_bench(const CLP& cmd)
+		{
+			if (!cmd.isSet("bench"))
+				throw UnitTestSkipped("pass -bench to run.");
+
+			auto n = cmd.getOr<std::size_t>("n", 1000000);
+			inline_scheduler inl;
+			std::cout << "\n  inline direct " << ns_per(n, [&] { sync_wait(hop_direct(inl, n)); }) << " ns"
+				<< "\n  inline any    " << ns_per(n, [&] { sync_wait(hop(inl, n)); }) << " ns";
+
+			thread_pool pool;
+			auto w = pool.make_work();
+			pool.create_threads(1);
+			n /= 10;
+			std::cout << "\n  pool direct   " << ns_per(n, [&] { sync_wait(hop_direct(pool, n)); }) << " ns"
+				<< "\n  pool any      " << ns_per(n, [&] { sync_wait(hop(pool, n)); }) << " ns ";
+		}
+	}
+}
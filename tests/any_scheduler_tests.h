@@ -0,0 +1,12 @@
+#pragma once
+#include "tests.h"
+
+
+namespace macoro
+{
+	namespace tests
+	{
+		void any_scheduler_test();
+		void any_scheduler_bench(const CLP& cmd);
+	}
+}
@@ -0,0 +1,279 @@
+#include "async_cache_tests.h"
+#include "macoro/async_cache.h"
+#include "macoro/manual_reset_event.h"
+#include "macoro/task.h"
+#include "macoro/thread_pool.h"
+#include "macoro/sync_wait.h"
+#include "macoro/when_all.h"
+#include "macoro/macros.h"
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+namespace macoro
+{
+	namespace tests
+	{
+		namespace
+		{
+			using cache_t = async_cache<int, std::string>;
+
+			// loads key as a string once the event is set.
+			struct gated_loader
+			{
+				async_manual_reset_event* mEvent;
+				std::atomic<std::size_t>* mLoads;
+
+				task<std::string> operator()(const int& key) const
+				{
+					MC_BEGIN(task<std::string>, ev = mEvent, loads = mLoads, key);
+					++*loads;
+					MC_AWAIT(*ev);
+					MC_RETURN(std::to_string(key));
+					MC_END();
+				}
+			};
+
+			struct loader
+			{
+				std::atomic<std::size_t>* mLoads;
+
+				task<std::string> operator()(const int& key) const
+				{
+					MC_BEGIN(task<std::string>, loads = mLoads, key);
+					++*loads;
+					MC_RETURN(std::to_string(key));
+					MC_END();
+				}
+			};
+
+			// waits for its token and then gives up.
+			struct stoppable_loader
+			{
+				std::atomic<std::size_t>* mLoads;
+
+				task<std::string> operator()(const int&, const stop_token& token) const
+				{
+					MC_BEGIN(task<std::string>, loads = mLoads, token);
+					++*loads;
+					MC_AWAIT(token);
+					throw operation_cancelled{};
+					MC_RETURN(std::string{});
+					MC_END();
+				}
+			};
+
+			struct throwing_loader
+			{
+				std::atomic<std::size_t>* mLoads;
+
+				task<std::string> operator()(const int&) const
+				{
+					MC_BEGIN(task<std::string>, loads = mLoads);
+					++*loads;
+					throw std::runtime_error("load");
+					MC_RETURN(std::string{});
+					MC_END();
+				}
+			};
+		}
+
+		void async_cache_test()
+		{
+			cache_t cache(16);
+			async_manual_reset_event ev;
+			std::atomic<std::size_t> loads(0);
+
+			// concurrent misses share one load.
+			std::vector<eager_task<cache_t::value_ptr>> gets;
+			for (std::size_t i = 0; i < 4; ++i)
+				gets.push_back(make_eager(cache.get(1, gated_loader{ &ev, &loads })));
+			if (loads != 1 || cache.size() != 1 || cache.try_get(1))
+				throw MACORO_RTE_LOC;
+			ev.set();
+
+			auto v = sync_wait(gets[0]);
+			if (!v || *v != "1")
+				throw MACORO_RTE_LOC;
+			for (auto& g : gets)
+				if (sync_wait(g) != v)
+					throw MACORO_RTE_LOC;
+
+			// a hit does not load.
+			if (sync_wait(cache.get(1, loader{ &loads })) != v || cache.try_get(1) != v || loads != 1)
+				throw MACORO_RTE_LOC;
+
+			// the value outlives its entry.
+			cache.erase(1);
+			if (cache.size() || cache.try_get(1) || *v != "1")
+				throw MACORO_RTE_LOC;
+			if (*sync_wait(cache.get(1, loader{ &loads })) != "1" || loads != 2)
+				throw MACORO_RTE_LOC;
+		}
+
+		void async_cache_lru_test()
+		{
+			std::atomic<std::size_t> loads(0);
+			{
+				cache_t cache(2, 1);
+				sync_wait(cache.get(1, loader{ &loads }));
+				sync_wait(cache.get(2, loader{ &loads }));
+				sync_wait(cache.get(1, loader{ &loads }));
+				sync_wait(cache.get(3, loader{ &loads }));
+
+				// 2 was the least recently used.
+				if (cache.size() != 2 || !cache.try_get(1) || cache.try_get(2) || !cache.try_get(3) || loads != 3)
+					throw MACORO_RTE_LOC;
+			}
+
+			{
+				// evicted by size.
+				cache_t cache(4, 1, [](const std::string& s) { return s.size(); });
+				sync_wait(cache.get(1, loader{ &loads }));
+				sync_wait(cache.get(22, loader{ &loads }));
+				if (cache.size() != 2)
+					throw MACORO_RTE_LOC;
+				sync_wait(cache.get(333, loader{ &loads }));
+				if (cache.size() != 1 || !cache.try_get(333))
+					throw MACORO_RTE_LOC;
+			}
+		}
+
+		void async_cache_pending_test()
+		{
+			cache_t cache(1, 1);
+			async_manual_reset_event ev;
+			std::atomic<std::size_t> loads(0);
+
+			// loads in flight are kept past the capacity, so each key
+			// is loaded once.
+			std::vector<int> keys{ 1, 2, 1, 2 };
+			std::vector<eager_task<cache_t::value_ptr>> gets;
+			for (auto key : keys)
+				gets.push_back(make_eager(cache.get(key, gated_loader{ &ev, &loads })));
+			if (loads != 2 || cache.size() != 2)
+				throw MACORO_RTE_LOC;
+			ev.set();
+
+			for (std::size_t i = 0; i < gets.size(); ++i)
+			{
+				auto v = sync_wait(gets[i]);
+				if (!v || *v != std::to_string(keys[i]))
+					throw MACORO_RTE_LOC;
+			}
+
+			// and evicted once they complete.
+			if (cache.size() != 1 || loads != 2)
+				throw MACORO_RTE_LOC;
+		}
+
+		void async_cache_ex_test()
+		{
+			cache_t cache(16);
+			std::atomic<std::size_t> loads(0);
+
+			// every waiter sees the failure and it is not cached.
+			for (std::size_t i = 0; i < 2; ++i)
+			{
+				bool thrown = false;
+				try { sync_wait(cache.get(1, throwing_loader{ &loads })); }
+				catch (std::runtime_error& e) { thrown = std::string(e.what()) == "load"; }
+				if (!thrown || cache.size() || loads != i + 1)
+					throw MACORO_RTE_LOC;
+			}
+
+			if (*sync_wait(cache.get(1, loader{ &loads })) != "1" || loads != 3)
+				throw MACORO_RTE_LOC;
+		}
+
+		void async_cache_cancel_test()
+		{
+			cache_t cache(16);
+			std::atomic<std::size_t> loads(0);
+
+			// already stopped, nothing is loaded.
+			{
+				stop_source src;
+				src.request_stop();
+				bool thrown = false;
+				try { sync_wait(cache.get(1, loader{ &loads }, src.get_token())); }
+				catch (operation_cancelled&) { thrown = true; }
+				if (!thrown || loads || cache.size())
+					throw MACORO_RTE_LOC;
+			}
+
+			// the load is stopped once both waiters are.
+			stop_source a, b;
+			auto ga = make_eager(cache.get(1, stoppable_loader{ &loads }, a.get_token()));
+			auto gb = make_eager(cache.get(1, stoppable_loader{ &loads }, b.get_token()));
+			if (loads != 1 || ga.is_ready())
+				throw MACORO_RTE_LOC;
+			a.request_stop();
+			if (!ga.is_ready() || gb.is_ready() || cache.size() != 1)
+				throw MACORO_RTE_LOC;
+			b.request_stop();
+			if (!ga.is_ready() || !gb.is_ready() || cache.size())
+				throw MACORO_RTE_LOC;
+			for (auto g : { &ga, &gb })
+			{
+				bool thrown = false;
+				try { sync_wait(*g); }
+				catch (operation_cancelled&) { thrown = true; }
+				if (!thrown)
+					throw MACORO_RTE_LOC;
+			}
+
+			// a later get starts over.
+			if (*sync_wait(cache.get(1, loader{ &loads })) != "1" || loads != 2)
+				throw MACORO_RTE_LOC;
+
+			// a stopped waiter returns while the loader is still blocked.
+			// The waiter without a token keeps the load alive.
+			async_manual_reset_event ev;
+			stop_source c;
+			auto gc = make_eager(cache.get(2, gated_loader{ &ev, &loads }, c.get_token()));
+			auto gd = make_eager(cache.get(2, gated_loader{ &ev, &loads }));
+			c.request_stop();
+			if (!gc.is_ready() || gd.is_ready() || cache.size() != 2)
+				throw MACORO_RTE_LOC;
+			bool thrown = false;
+			try { sync_wait(gc); }
+			catch (operation_cancelled&) { thrown = true; }
+			if (!thrown)
+				throw MACORO_RTE_LOC;
+			ev.set();
+			if (*sync_wait(gd) != "2" || loads != 3)
+				throw MACORO_RTE_LOC;
+		}
+
+		void async_cache_concurrent_test()
+		{
+			thread_pool pool;
+			auto w = pool.make_work();
+			pool.create_threads(4);
+
+			cache_t cache(1000, 8);
+			std::atomic<std::size_t> loads(0);
+
+			auto t = [](thread_pool& pool, cache_t& cache, std::atomic<std::size_t>& loads, int key) -> task<>
+			{
+				MC_BEGIN(task<>, &pool, &cache, &loads, key, v = cache_t::value_ptr{});
+				MC_AWAIT(pool.schedule());
+				MC_AWAIT_SET(v, cache.get(key, loader{ &loads }));
+				if (*v != std::to_string(key))
+					throw MACORO_RTE_LOC;
+				MC_END();
+			};
+
+			std::vector<task<>> tasks;
+			for (int i = 0; i < 1000; ++i)
+				tasks.push_back(t(pool, cache, loads, i % 50));
+			auto r = sync_wait(when_all_ready(std::move(tasks)));
+			for (auto& rr : r)
+				rr.result();
+			if (loads != 50 || cache.size() != 50)
+				throw MACORO_RTE_LOC;
+		}
+	}
+}
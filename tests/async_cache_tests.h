@@ -0,0 +1,16 @@
+#pragma once
+#include "tests.h"
+
+
+namespace macoro
+{
+	namespace tests
+	{
+		void async_cache_test();
+		void async_cache_lru_test();
+		void async_cache_pending_test();
+		void async_cache_ex_test();
+		void async_cache_cancel_test();
+		void async_cache_concurrent_test();
+	}
+}
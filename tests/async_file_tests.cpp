@@ -0,0 +1,342 @@
+#include "async_file_tests.h"
+#include "macoro/config.h"
+
+#if MACORO_LINUX_OS
+#include "macoro/async_file.h"
+#include "macoro/task.h"
+#include "macoro/when_all.h"
+#include "macoro/sync_wait.h"
+#include "macoro/thread_pool.h"
+#include "macoro/result.h"
+#include "macoro/macros.h"
+
+#include <unistd.h>
+#include <cstdlib>
+#endif
+
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace macoro
+{
+	namespace tests
+	{
+#if MACORO_LINUX_OS
+		namespace
+		{
+			struct temp_file
+			{
+				std::string mPath;
+
+				temp_file(std::string dir = "/tmp")
+				{
+					mPath = dir + "/macoro_async_file_XXXXXX";
+					int fd = ::mkstemp(&mPath[0]);
+					if (fd < 0)
+						throw MACORO_RTE_LOC;
+					::close(fd);
+				}
+
+				~temp_file() { ::unlink(mPath.c_str()); }
+			};
+
+			std::vector<char> make_data(std::size_t size)
+			{
+				std::vector<char> data(size);
+				for (std::size_t i = 0; i < size; ++i)
+					data[i] = char(i * 7 + (i >> 12));
+				return data;
+			}
+
+			// awaits channel_receiver::front() and returns false once the
+			// channel is closed.
+			template<typename Awaitable>
+			struct front_or_closed
+			{
+				Awaitable mInner;
+
+				bool await_ready() { return mInner.await_ready(); }
+
+				template<typename H>
+				auto await_suspend(H h) { return mInner.await_suspend(coroutine_handle<>(h)); }
+
+				bool await_resume()
+				{
+					try {
+						mInner.await_resume();
+						return true;
+					}
+					catch (channel_closed_exception&)
+					{
+						return false;
+					}
+				}
+			};
+
+			template<typename Engine>
+			task<> write_all(async_file<Engine>& f, const char* data, std::size_t size, std::uint64_t offset)
+			{
+				MC_BEGIN(task<>, &f, data, size, offset
+					, n = std::size_t{});
+				while (size)
+				{
+					MC_AWAIT_SET(n, f.write_at(data, size, offset));
+					data += n;
+					size -= n;
+					offset += n;
+				}
+				MC_END();
+			}
+
+			template<typename Awaitable>
+			front_or_closed<Awaitable> make_front_or_closed(Awaitable&& a)
+			{
+				return { std::move(a) };
+			}
+
+			// pops every buffer, checks that they are in order and match
+			// data if it is not null. total is set to the number of bytes.
+			task<> consume(spsc::channel_receiver<file_buffer>& in, const std::vector<char>* data, std::size_t& total)
+			{
+				MC_BEGIN(task<>, &in, data, &total
+					, more = bool{}
+					, buff = spsc::channel<file_buffer>::pop_wrapper{});
+
+				total = 0;
+				while (true)
+				{
+					MC_AWAIT_SET(more, make_front_or_closed(in.front()));
+					if (!more)
+						break;
+
+					MC_AWAIT_SET(buff, in.pop());
+					if (buff->offset() != total || buff->size() == 0)
+						throw MACORO_RTE_LOC;
+					if (data && (total + buff->size() > data->size() ||
+						!std::equal(buff->data(), buff->data() + buff->size(), data->begin() + total)))
+						throw MACORO_RTE_LOC;
+					total += buff->size();
+					buff.publish();
+				}
+				MC_END();
+			}
+
+			template<typename Engine>
+			std::size_t stream(Engine& e, const std::string& path, file_options opt,
+				std::size_t chunk, std::size_t inFlight, const std::vector<char>* data)
+			{
+				file_buffer_pool pool(chunk, 4096, inFlight);
+				async_file<Engine> f(e, path, file_mode::read, opt);
+				auto chl = spsc::make_channel<file_buffer>(inFlight);
+				std::size_t total = 0;
+				auto r = sync_wait(when_all_ready(
+					stream_file(f, chl.first, pool, inFlight),
+					consume(chl.second, data, total)));
+				std::get<0>(r).result();
+				std::get<1>(r).result();
+				return total;
+			}
+
+			// O_DIRECT is not supported by every file system, e.g. tmpfs.
+			bool supports_direct(const std::string& path)
+			{
+				thread_pool pool;
+				file_options opt;
+				opt.direct = true;
+				try {
+					async_file<thread_pool> f(pool, path, file_mode::read, opt);
+					return true;
+				}
+				catch (std::system_error& e)
+				{
+					if (e.code().value() == EINVAL)
+						return false;
+					throw;
+				}
+			}
+
+#ifdef MACORO_IO_URING
+			// io_uring can be disabled by the kernel or a seccomp profile.
+			std::unique_ptr<io_uring_service> make_io_uring(thread_pool& pool)
+			{
+				try {
+					return std::unique_ptr<io_uring_service>(new io_uring_service(pool));
+				}
+				catch (std::system_error& e)
+				{
+					if (e.code().value() == ENOSYS || e.code().value() == EPERM)
+						return nullptr;
+					throw;
+				}
+			}
+#endif
+
+			template<typename Engine>
+			void read_write(Engine& e)
+			{
+				temp_file tmp;
+				file_options opt;
+				opt.truncate = true;
+				async_file<Engine> f(e, tmp.mPath, file_mode::read_write, opt);
+				auto data = make_data(100000);
+
+				auto t = [](async_file<Engine>& f, std::vector<char>& data) -> task<>
+				{
+					MC_BEGIN(task<>, &f, &data
+						, n = std::size_t{}
+						, buff = std::vector<char>{});
+
+					MC_AWAIT_SET(n, f.write_at(data.data(), data.size(), 0));
+					if (n != data.size() || f.size() != data.size())
+						throw MACORO_RTE_LOC;
+
+					buff.resize(1000);
+					MC_AWAIT_SET(n, f.read_at(buff.data(), buff.size(), 5000));
+					if (n != buff.size() || !std::equal(buff.begin(), buff.end(), data.begin() + 5000))
+						throw MACORO_RTE_LOC;
+
+					MC_AWAIT_SET(n, f.read_at(buff.data(), buff.size(), data.size()));
+					if (n != 0)
+						throw MACORO_RTE_LOC;
+					MC_END();
+				};
+				sync_wait(t(f, data));
+			}
+		}
+#endif
+
+		void async_file_test()
+		{
+#if MACORO_LINUX_OS
+			thread_pool pool;
+			auto w = pool.make_work();
+			pool.create_threads(2);
+			read_write(pool);
+
+#ifdef MACORO_IO_URING
+			auto io = make_io_uring(pool);
+			if (io)
+				read_write(*io);
+#endif
+#else
+			throw UnitTestSkipped("requires linux.");
+#endif
+		}
+
+		void file_stream_test()
+		{
+#if MACORO_LINUX_OS
+			thread_pool pool;
+			auto w = pool.make_work();
+			pool.create_threads(2);
+
+			// not a multiple of the chunk size, or of the block size.
+			auto data = make_data((3 << 19) + 123);
+			temp_file tmp;
+			{
+				async_file<thread_pool> f(pool, tmp.mPath, file_mode::write);
+				sync_wait(write_all(f, data.data(), data.size(), 0));
+			}
+
+			std::vector<file_options> opts(1);
+			if (supports_direct(tmp.mPath))
+			{
+				opts.emplace_back();
+				opts.back().direct = true;
+			}
+
+			for (auto opt : opts)
+			{
+				for (std::size_t inFlight : { 1, 4 })
+				{
+					if (stream(pool, tmp.mPath, opt, 1 << 16, inFlight, &data) != data.size())
+						throw MACORO_RTE_LOC;
+#ifdef MACORO_IO_URING
+					auto io = make_io_uring(pool);
+					if (io && stream(*io, tmp.mPath, opt, 1 << 16, inFlight, &data) != data.size())
+						throw MACORO_RTE_LOC;
+#endif
+				}
+			}
+
+			// direct reads must start on a block boundary.
+			if (opts.size() > 1)
+			{
+				async_file<thread_pool> f(pool, tmp.mPath, file_mode::read, opts.back());
+				auto chl = spsc::make_channel<file_buffer>(4);
+				file_buffer_pool aligned(1 << 16), unaligned(1000);
+				auto rejects = [&](file_buffer_pool& buffers, std::uint64_t offset) {
+					try { auto t = stream_file(f, chl.first, buffers, 4, offset); }
+					catch (std::invalid_argument&) { return true; }
+					return false;
+				};
+				if (!rejects(aligned, 100) || !rejects(unaligned, 0) || rejects(aligned, 4096))
+					throw MACORO_RTE_LOC;
+			}
+
+			// an empty file closes the channel without sending anything.
+			temp_file empty;
+			if (stream(pool, empty.mPath, {}, 1 << 16, 4, nullptr) != 0)
+				throw MACORO_RTE_LOC;
+#else
+			throw UnitTestSkipped("requires linux.");
+#endif
+		}
+
+		void file_stream_bench(const CLP& cmd)
+		{
+#if MACORO_LINUX_OS
+			if (!cmd.isSet("bench"))
+				throw UnitTestSkipped("pass -bench to run.");
+
+			auto mb = cmd.getOr<std::size_t>("mb", 1024);
+			auto chunk = cmd.getOr<std::size_t>("chunk", std::size_t(1) << 20);
+			auto inFlight = cmd.getOr<std::size_t>("inflight", 8);
+			auto dir = cmd.getOr<std::string>("dir", "/tmp");
+			file_options opt;
+			opt.direct = cmd.isSet("direct");
+
+			thread_pool pool;
+			auto w = pool.make_work();
+			pool.create_threads(2);
+
+			temp_file tmp(dir);
+			{
+				async_file<thread_pool> f(pool, tmp.mPath, file_mode::write);
+				auto data = make_data(std::size_t(1) << 20);
+				for (std::size_t i = 0; i < mb; ++i)
+					sync_wait(write_all(f, data.data(), data.size(), i << 20));
+			}
+
+			auto report = [&](const char* name, std::size_t n, std::chrono::steady_clock::time_point begin) {
+				auto us = std::chrono::duration_cast<std::chrono::microseconds>(
+					std::chrono::steady_clock::now() - begin).count();
+				if (n != mb << 20)
+					throw MACORO_RTE_LOC;
+				std::cout << "\n  " << name << " " << (double(n) / us) << " MB/s";
+			};
+
+			{
+				auto begin = std::chrono::steady_clock::now();
+				auto n = stream(pool, tmp.mPath, opt, chunk, inFlight, nullptr);
+				report("thread_pool", n, begin);
+			}
+#ifdef MACORO_IO_URING
+			if (auto io = make_io_uring(pool))
+			{
+				auto begin = std::chrono::steady_clock::now();
+				auto n = stream(*io, tmp.mPath, opt, chunk, inFlight, nullptr);
+				report("io_uring   ", n, begin);
+			}
+#endif
+			std::cout << " ";
+#else
+			throw UnitTestSkipped("requires linux.");
+#endif
+		}
+	}
+}
@@ -0,0 +1,13 @@
+#pragma once
+#include "tests.h"
+
+
+namespace macoro
+{
+	namespace tests
+	{
+		void async_file_test();
+		void file_stream_test();
+		void file_stream_bench(const CLP& cmd);
+	}
+}
@@ -0,0 +1,177 @@
+#include "deadline_tests.h"
+#include "macoro/deadline.h"
+#include "macoro/task.h"
+#include "macoro/sync_wait.h"
+#include "macoro/thread_pool.h"
+#include "macoro/macros.h"
+
+using namespace std::chrono;
+
+namespace macoro
+{
+	namespace tests
+	{
+		namespace
+		{
+			task<deadline_time_point> get_deadline()
+			{
+				MC_BEGIN(task<deadline_time_point>, d = deadline_time_point{});
+				MC_AWAIT_SET(d, current_deadline());
+				MC_RETURN(d);
+				MC_END();
+			}
+
+			// one more level of task between the deadline and the query.
+			task<deadline_time_point> get_deadline_nested()
+			{
+				MC_BEGIN(task<deadline_time_point>, d = deadline_time_point{});
+				MC_AWAIT_SET(d, get_deadline());
+				MC_RETURN(d);
+				MC_END();
+			}
+		}
+
+		void deadline_inherit_test()
+		{
+			if (sync_wait(get_deadline_nested()) != deadline_time_point::max())
+				throw MACORO_RTE_LOC;
+
+			auto tp = deadline_clock::now() + hours(1);
+			if (sync_wait(with_deadline(tp, get_deadline_nested())) != tp)
+				throw MACORO_RTE_LOC;
+
+			// awaited outside of a task there is no deadline.
+			if (sync_wait(with_deadline(tp, current_deadline())) != deadline_time_point::max())
+				throw MACORO_RTE_LOC;
+		}
+
+		void deadline_nested_test()
+		{
+			auto outer = deadline_clock::now() + hours(1);
+			auto inner = outer + hours(1);
+
+			using pair = std::pair<deadline_time_point, deadline_time_point>;
+			auto t = [](deadline_time_point outer, deadline_time_point inner) -> task<pair>
+			{
+				MC_BEGIN(task<pair>, outer, inner, r = pair{});
+
+				// a looser deadline keeps the enclosing one.
+				MC_AWAIT_SET(r.first, with_deadline(inner, get_deadline()));
+
+				// a tighter one replaces it.
+				MC_AWAIT_SET(r.second, with_deadline(outer - minutes(1), get_deadline()));
+				MC_RETURN(r);
+				MC_END();
+			};
+
+			auto r = sync_wait(with_deadline(outer, t(outer, inner)));
+			if (r.first != outer)
+				throw MACORO_RTE_LOC;
+			if (r.second != outer - minutes(1))
+				throw MACORO_RTE_LOC;
+		}
+
+		void deadline_schedule_after_test()
+		{
+			thread_pool pool;
+			auto w = pool.make_work();
+			pool.create_thread();
+
+			auto t = [](thread_pool& pool) -> task<>
+			{
+				MC_BEGIN(task<>, &pool);
+				MC_AWAIT(pool.schedule_after(hours(1)));
+				MC_END();
+			};
+
+			// the sleep is cut short and fails.
+			auto b = steady_clock::now();
+			bool cancelled = false;
+			try { sync_wait(with_deadline(milliseconds(5), t(pool))); }
+			catch (operation_cancelled&) { cancelled = true; }
+			if (!cancelled || steady_clock::now() - b > seconds(10))
+				throw MACORO_RTE_LOC;
+
+			// one that ends before the deadline does not.
+			auto s = [](thread_pool& pool) -> task<>
+			{
+				MC_BEGIN(task<>, &pool);
+				MC_AWAIT(pool.schedule_after(milliseconds(1)));
+				MC_END();
+			};
+			sync_wait(with_deadline(hours(1), s(pool)));
+
+			w = {};
+			pool.join();
+		}
+
+		namespace
+		{
+			// waits for the deadline's token, after a sleep if given one.
+			task<bool> wait_deadline_token(thread_pool* pool)
+			{
+				MC_BEGIN(task<bool>, pool, token = stop_token{});
+				if (pool)
+				{
+					MC_AWAIT(pool->schedule_after(milliseconds(0)));
+				}
+				MC_AWAIT_SET(token, current_deadline_token());
+				if (!token.stop_possible())
+					MC_RETURN(false);
+				MC_AWAIT(token);
+				MC_RETURN(token.stop_requested());
+				MC_END();
+			}
+		}
+
+		void deadline_cancel_test()
+		{
+			thread_pool pool;
+			auto w = pool.make_work();
+			pool.create_thread();
+
+			// the timer is armed on the given scheduler.
+			if (!sync_wait(with_deadline(pool, milliseconds(5), wait_deadline_token(nullptr))))
+				throw MACORO_RTE_LOC;
+
+			// or on the first schedule_after().
+			if (!sync_wait(with_deadline(milliseconds(5), wait_deadline_token(&pool))))
+				throw MACORO_RTE_LOC;
+
+			// a tighter nested deadline uses the enclosing scheduler and
+			// does not stop the enclosing one.
+			auto nested = [](thread_pool& pool) -> task<bool>
+			{
+				MC_BEGIN(task<bool>, &pool, inner = false, outer = stop_token{});
+				MC_AWAIT_SET(inner, with_deadline(milliseconds(5), wait_deadline_token(nullptr)));
+				MC_AWAIT_SET(outer, current_deadline_token());
+				MC_RETURN(inner && !outer.stop_requested());
+				MC_END();
+			};
+			if (!sync_wait(with_deadline(pool, hours(1), nested(pool))))
+				throw MACORO_RTE_LOC;
+
+			// and is stopped along with it.
+			auto looser = [](thread_pool& pool) -> task<bool>
+			{
+				MC_BEGIN(task<bool>, &pool, token = stop_token{});
+				MC_AWAIT_SET(token, current_deadline_token());
+				MC_AWAIT(token);
+				MC_RETURN(token.stop_requested());
+				MC_END();
+			};
+			auto outer = [&](thread_pool& pool) -> task<bool>
+			{
+				MC_BEGIN(task<bool>, &pool, &looser, r = false);
+				MC_AWAIT_SET(r, with_deadline(deadline_clock::now() + hours(1), looser(pool)));
+				MC_RETURN(r);
+				MC_END();
+			};
+			if (!sync_wait(with_deadline(pool, milliseconds(5), outer(pool))))
+				throw MACORO_RTE_LOC;
+
+			w = {};
+			pool.join();
+		}
+	}
+}
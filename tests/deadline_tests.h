@@ -0,0 +1,13 @@
+#pragma once
+
+
+namespace macoro
+{
+	namespace tests
+	{
+		void deadline_inherit_test();
+		void deadline_nested_test();
+		void deadline_schedule_after_test();
+		void deadline_cancel_test();
+	}
+}
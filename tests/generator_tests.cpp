@@ -0,0 +1,262 @@
+#include "generator_tests.h"
+#include "macoro/generator.h"
+#include "macoro/async_generator.h"
+#include "macoro/thread_pool.h"
+#include "macoro/task.h"
+#include "macoro/sync_wait.h"
+#include "macoro/macros.h"
+
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <string>
+
+namespace macoro
+{
+	namespace tests
+	{
+		namespace
+		{
+			// yields its counter, so the consumer sees the frame variable.
+			generator<std::size_t> iota(std::size_t n, std::size_t*& addr)
+			{
+				MC_BEGIN(generator<std::size_t>, n, &addr, i = std::size_t{});
+				addr = &i;
+				for (; i < n; ++i)
+				{
+					MC_YIELD(i);
+				}
+				MC_END();
+			}
+
+			generator<std::string> words(std::shared_ptr<int> alive)
+			{
+				MC_BEGIN(generator<std::string>, alive);
+				MC_YIELD(std::string("hello"));
+				MC_YIELD(std::string("world"));
+				MC_END();
+			}
+
+			generator<int> throws_after(int n)
+			{
+				MC_BEGIN(generator<int>, n, i = int{});
+				for (; i < n; ++i)
+				{
+					MC_YIELD(i);
+				}
+				throw std::runtime_error("generator");
+				MC_END();
+			}
+
+#ifdef MACORO_CPP_20
+			generator<std::size_t> iota20(std::size_t n)
+			{
+				for (std::size_t i = 0; i < n; ++i)
+					co_yield i;
+			}
+
+			async_generator<std::size_t> async_iota20(thread_pool& pool, std::size_t n)
+			{
+				for (std::size_t i = 0; i < n; ++i)
+				{
+					co_await pool.schedule();
+					co_yield i;
+				}
+			}
+
+			task<> async_sum20(async_generator<std::size_t>& gen, std::size_t& sum)
+			{
+				for (auto it = co_await gen.begin(); it != gen.end(); co_await ++it)
+					sum += *it;
+			}
+#endif
+
+			// hops onto the pool before each value, if it has one.
+			async_generator<std::size_t> async_iota(thread_pool* pool, std::size_t n)
+			{
+				MC_BEGIN(async_generator<std::size_t>, pool, n, i = std::size_t{});
+				for (; i < n; ++i)
+				{
+					if (pool)
+					{
+						MC_AWAIT(pool->schedule());
+					}
+					MC_YIELD(i);
+				}
+				MC_END();
+			}
+
+			task<> async_sum(async_generator<std::size_t>& gen, std::size_t& sum)
+			{
+				MC_BEGIN(task<>, &gen, &sum, it = async_generator<std::size_t>::iterator{});
+				MC_AWAIT_SET(it, gen.begin());
+				while (it != gen.end())
+				{
+					sum += *it;
+					MC_AWAIT(++it);
+				}
+				MC_END();
+			}
+
+			async_generator<int> async_throws()
+			{
+				MC_BEGIN(async_generator<int>);
+				MC_YIELD(1);
+				throw std::runtime_error("async_generator");
+				MC_END();
+			}
+
+			task<> async_count(async_generator<int>& gen, std::size_t& count)
+			{
+				MC_BEGIN(task<>, &gen, &count, it = async_generator<int>::iterator{});
+				MC_AWAIT_SET(it, gen.begin());
+				while (it != gen.end())
+				{
+					++count;
+					MC_AWAIT(++it);
+				}
+				MC_END();
+			}
+		}
+
+		void generator_test()
+		{
+			// lvalues are passed by pointer.
+			std::size_t* addr = nullptr;
+			std::size_t expected = 0;
+			for (auto& v : iota(10, addr))
+			{
+				if (&v != addr || v != expected++)
+					throw MACORO_RTE_LOC;
+			}
+			if (expected != 10)
+				throw MACORO_RTE_LOC;
+
+			// rvalues are moved into the frame. Stopping early destroys
+			// the frame.
+			auto alive = std::make_shared<int>();
+			{
+				auto g = words(alive);
+				auto it = g.begin();
+				if (it == g.end() || *it != "hello")
+					throw MACORO_RTE_LOC;
+				auto s = std::move(*it);
+				++it;
+				if (it == g.end() || *it != "world" || s != "hello")
+					throw MACORO_RTE_LOC;
+			}
+			if (alive.use_count() != 1)
+				throw MACORO_RTE_LOC;
+
+			// never started.
+			{
+				auto g = words(alive);
+			}
+			if (alive.use_count() != 1)
+				throw MACORO_RTE_LOC;
+
+#ifdef MACORO_CPP_20
+			expected = 0;
+			for (auto v : iota20(10))
+			{
+				if (v != expected++)
+					throw MACORO_RTE_LOC;
+			}
+			if (expected != 10)
+				throw MACORO_RTE_LOC;
+#endif
+		}
+
+		void generator_ex_test()
+		{
+			int count = 0;
+			bool thrown = false;
+			try {
+				for (auto v : throws_after(3))
+				{
+					if (v != count++)
+						throw MACORO_RTE_LOC;
+				}
+			}
+			catch (std::runtime_error& e)
+			{
+				thrown = std::string(e.what()) == "generator";
+			}
+			if (!thrown || count != 3)
+				throw MACORO_RTE_LOC;
+
+			auto g = async_throws();
+			std::size_t n = 0;
+			thrown = false;
+			try {
+				sync_wait(async_count(g, n));
+			}
+			catch (std::runtime_error& e)
+			{
+				thrown = std::string(e.what()) == "async_generator";
+			}
+			if (!thrown || n != 1)
+				throw MACORO_RTE_LOC;
+		}
+
+		void async_generator_test()
+		{
+			thread_pool pool;
+			auto w = pool.make_work();
+			pool.create_threads(2);
+
+			// each value is produced on the pool and the consumer follows.
+			std::size_t n = 100, sum = 0;
+			auto g = async_iota(&pool, n);
+			sync_wait(async_sum(g, sum));
+			if (sum != n * (n - 1) / 2)
+				throw MACORO_RTE_LOC;
+
+			// inline.
+			sum = 0;
+			auto g2 = async_iota(nullptr, n);
+			sync_wait(async_sum(g2, sum));
+			if (sum != n * (n - 1) / 2)
+				throw MACORO_RTE_LOC;
+
+			// empty.
+			sum = 0;
+			auto g3 = async_iota(&pool, 0);
+			sync_wait(async_sum(g3, sum));
+			if (sum)
+				throw MACORO_RTE_LOC;
+
+#ifdef MACORO_CPP_20
+			sum = 0;
+			auto g4 = async_iota20(pool, n);
+			sync_wait(async_sum20(g4, sum));
+			if (sum != n * (n - 1) / 2)
+				throw MACORO_RTE_LOC;
+#endif
+		}
+
+		void generator_bench(const CLP& cmd)
+		{
+			if (!cmd.isSet("bench"))
+				throw UnitTestSkipped("pass -bench to run.");
+
+			std::size_t n = 10000000, sum = 0;
+			std::size_t* addr;
+			auto begin = std::chrono::steady_clock::now();
+			for (auto v : iota(n, addr))
+				sum += v;
+			auto mid = std::chrono::steady_clock::now();
+			auto g = async_iota(nullptr, n);
+			sync_wait(async_sum(g, sum));
+			auto end = std::chrono::steady_clock::now();
+			if (sum != n * (n - 1))
+				throw MACORO_RTE_LOC;
+
+			auto ns = [n](std::chrono::steady_clock::duration d) {
+				return double(std::chrono::duration_cast<std::chrono::nanoseconds>(d).count()) / n;
+			};
+			std::cout << "\n  generator       " << ns(mid - begin) << " ns/value";
+			std::cout << "\n  async_generator " << ns(end - mid) << " ns/value ";
+		}
+	}
+}
@@ -0,0 +1,14 @@
+#pragma once
+#include "tests.h"
+
+
+namespace macoro
+{
+	namespace tests
+	{
+		void generator_test();
+		void generator_ex_test();
+		void async_generator_test();
+		void generator_bench(const CLP& cmd);
+	}
+}
@@ -0,0 +1,326 @@
+#include "io_service_tests.h"
+#include "macoro/config.h"
+
+#if MACORO_LINUX_OS
+#include "macoro/io_service.h"
+#include "macoro/task.h"
+#include "macoro/when_all.h"
+#include "macoro/sync_wait.h"
+#include "macoro/thread_pool.h"
+#include "macoro/result.h"
+#include "macoro/macros.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+namespace macoro
+{
+	namespace tests
+	{
+#if MACORO_LINUX_OS
+		namespace
+		{
+			void set_nonblocking(int fd)
+			{
+				if (::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK))
+					throw MACORO_RTE_LOC;
+			}
+
+			struct socket_pair
+			{
+				int mFds[2];
+
+				socket_pair()
+				{
+					if (::socketpair(AF_UNIX, SOCK_STREAM, 0, mFds))
+						throw MACORO_RTE_LOC;
+					set_nonblocking(mFds[0]);
+					set_nonblocking(mFds[1]);
+				}
+
+				// a connected tcp loopback pair.
+				socket_pair(bool)
+				{
+					int l = ::socket(AF_INET, SOCK_STREAM, 0);
+					sockaddr_in addr{};
+					addr.sin_family = AF_INET;
+					addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+					socklen_t len = sizeof(addr);
+					if (l < 0 ||
+						::bind(l, (sockaddr*)&addr, sizeof(addr)) ||
+						::listen(l, 1) ||
+						::getsockname(l, (sockaddr*)&addr, &len))
+						throw MACORO_RTE_LOC;
+
+					mFds[0] = ::socket(AF_INET, SOCK_STREAM, 0);
+					if (mFds[0] < 0 || ::connect(mFds[0], (sockaddr*)&addr, sizeof(addr)))
+						throw MACORO_RTE_LOC;
+					mFds[1] = ::accept(l, nullptr, nullptr);
+					::close(l);
+					if (mFds[1] < 0)
+						throw MACORO_RTE_LOC;
+
+					int one = 1;
+					for (auto fd : mFds)
+					{
+						::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+						set_nonblocking(fd);
+					}
+				}
+
+				~socket_pair()
+				{
+					::close(mFds[0]);
+					::close(mFds[1]);
+				}
+			};
+
+			char pattern(std::size_t i)
+			{
+				return char(i * 7 + (i >> 11));
+			}
+
+			// writes total bytes of the pattern in chunks.
+			task<> send_all(io_fd& fd, std::size_t total, std::size_t chunk)
+			{
+				MC_BEGIN(task<>, &fd, total, chunk
+					, buff = std::vector<char>(chunk)
+					, sent = std::size_t{}
+					, n = std::size_t{});
+
+				while (sent < total)
+				{
+					n = std::min(chunk, total - sent);
+					for (std::size_t i = 0; i < n; ++i)
+						buff[i] = pattern(sent + i);
+					MC_AWAIT_SET(n, fd.write_some(buff.data(), n));
+					sent += n;
+				}
+				MC_END();
+			}
+
+			// reads total bytes and checks that they match the pattern.
+			task<> recv_all(io_fd& fd, std::size_t total, std::size_t chunk)
+			{
+				MC_BEGIN(task<>, &fd, total, chunk
+					, buff = std::vector<char>(chunk)
+					, recved = std::size_t{}
+					, n = std::size_t{});
+
+				while (recved < total)
+				{
+					MC_AWAIT_SET(n, fd.read_some(buff.data(), std::min(chunk, total - recved)));
+					if (n == 0)
+						throw MACORO_RTE_LOC;
+					for (std::size_t i = 0; i < n; ++i)
+						if (buff[i] != pattern(recved + i))
+							throw MACORO_RTE_LOC;
+					recved += n;
+				}
+				MC_END();
+			}
+
+			// writes back whatever it reads until the peer closes.
+			task<> echo(io_fd& fd, std::size_t chunk)
+			{
+				MC_BEGIN(task<>, &fd
+					, buff = std::vector<char>(chunk)
+					, n = std::size_t{}
+					, w = std::size_t{}
+					, k = std::size_t{});
+
+				while (true)
+				{
+					MC_AWAIT_SET(n, fd.read_some(buff.data(), buff.size()));
+					if (n == 0)
+						break;
+
+					w = 0;
+					while (w < n)
+					{
+						MC_AWAIT_SET(k, fd.write_some(buff.data() + w, n - w));
+						w += k;
+					}
+				}
+				MC_END();
+			}
+
+			// the client streams total bytes through the echo server and
+			// closes its write side once they have all been sent.
+			task<> echo_session(io_fd& client, io_fd& server, std::size_t total, std::size_t chunk)
+			{
+				using results = std::vector<detail::when_all_task<void>>;
+				MC_BEGIN(task<>, &client, &server, total, chunk
+					, tasks = std::vector<task<>>{}
+					, r = results{});
+
+				tasks.push_back(echo(server, chunk));
+				tasks.push_back([](io_fd& client, std::size_t total, std::size_t chunk) -> task<> {
+					MC_BEGIN(task<>, &client, total, chunk);
+					MC_AWAIT(send_all(client, total, chunk));
+					::shutdown(client.native_handle(), SHUT_WR);
+					MC_END();
+					}(client, total, chunk));
+				tasks.push_back(recv_all(client, total, chunk));
+
+				MC_AWAIT_SET(r, when_all_ready(std::move(tasks)));
+				for (auto& t : r)
+					t.result();
+				MC_END();
+			}
+
+			eager_task<> stop_after(io_service& io, task<> t)
+			{
+				MC_BEGIN(eager_task<>, &io, t = std::move(t), r = result<void>{});
+				MC_AWAIT_TRY(r, std::move(t));
+				io.stop();
+				r.value();
+				MC_END();
+			}
+
+			void run_standalone(socket_pair& s, std::size_t total, std::size_t chunk)
+			{
+				io_service io;
+				io_fd client(io, s.mFds[0]);
+				io_fd server(io, s.mFds[1]);
+
+				auto t = stop_after(io, echo_session(client, server, total, chunk));
+				io.process_events();
+				sync_wait(std::move(t));
+			}
+
+			void run_pool(socket_pair& s, std::size_t total, std::size_t chunk, std::size_t numThreads)
+			{
+				thread_pool pool;
+				auto w = pool.make_work();
+				pool.create_threads(numThreads);
+
+				io_service io(pool);
+				io_fd client(io, s.mFds[0]);
+				io_fd server(io, s.mFds[1]);
+
+				sync_wait(echo_session(client, server, total, chunk));
+			}
+		}
+#endif
+
+		void io_service_echo_test()
+		{
+#if MACORO_LINUX_OS
+			// larger than the socket buffers so that both sides block.
+			socket_pair s;
+			run_standalone(s, 1 << 22, 1 << 14);
+#else
+			throw UnitTestSkipped("requires linux.");
+#endif
+		}
+
+		void io_service_pool_echo_test()
+		{
+#if MACORO_LINUX_OS
+			socket_pair s;
+			run_pool(s, 1 << 22, 1 << 14, 2);
+#else
+			throw UnitTestSkipped("requires linux.");
+#endif
+		}
+
+		void io_service_busy_pool_test()
+		{
+#if MACORO_LINUX_OS
+			thread_pool pool;
+			auto w = pool.make_work();
+			pool.create_threads(2);
+			io_service io(pool);
+
+			// keeps every worker busy until done is set.
+			auto load = [](thread_pool& pool, std::atomic<bool>& done) -> task<>
+			{
+				MC_BEGIN(task<>, &pool, &done);
+				while (!done)
+					MC_AWAIT(pool.schedule());
+				MC_END();
+			};
+			auto read = [](io_fd& fd, std::atomic<bool>& read) -> task<>
+			{
+				MC_BEGIN(task<>, &fd, &read
+					, buff = std::vector<char>(16)
+					, n = std::size_t{});
+				MC_AWAIT_SET(n, fd.read_some(buff.data(), buff.size()));
+				if (n != 5)
+					throw MACORO_RTE_LOC;
+				read = true;
+				MC_END();
+			};
+
+			socket_pair s;
+			io_fd fd(io, s.mFds[0]);
+			std::atomic<bool> done(false), wasRead(false);
+			std::vector<eager_task<>> tasks;
+			for (std::size_t i = 0; i < 2; ++i)
+				tasks.push_back(make_eager(load(pool, done)));
+			tasks.push_back(make_eager(read(fd, wasRead)));
+			if (::write(s.mFds[1], "hello", 5) != 5)
+				throw MACORO_RTE_LOC;
+
+			// the read completes while the pool is still saturated.
+			auto end = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+			while (!wasRead && std::chrono::steady_clock::now() < end)
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			bool completed = wasRead;
+			done = true;
+			for (auto& t : tasks)
+				sync_wait(t);
+			if (!completed)
+				throw MACORO_RTE_LOC;
+#else
+			throw UnitTestSkipped("requires linux.");
+#endif
+		}
+
+		void io_service_echo_bench(const CLP& cmd)
+		{
+#if MACORO_LINUX_OS
+			if (!cmd.isSet("bench"))
+				throw UnitTestSkipped("pass -bench to run.");
+
+			auto total = cmd.getOr<std::size_t>("bytes", std::size_t(1) << 30);
+			auto chunk = cmd.getOr<std::size_t>("chunk", std::size_t(1) << 16);
+			auto numThreads = cmd.getOr<std::size_t>("threads", 2);
+
+			auto report = [&](const char* name, std::chrono::steady_clock::time_point begin) {
+				auto us = std::chrono::duration_cast<std::chrono::microseconds>(
+					std::chrono::steady_clock::now() - begin).count();
+				std::cout << "\n  " << name << " " << (double(total) / us) << " MB/s";
+			};
+
+			{
+				socket_pair s(true);
+				auto begin = std::chrono::steady_clock::now();
+				run_standalone(s, total, chunk);
+				report("process_events", begin);
+			}
+			{
+				socket_pair s(true);
+				auto begin = std::chrono::steady_clock::now();
+				run_pool(s, total, chunk, numThreads);
+				report("thread_pool   ", begin);
+			}
+			std::cout << " ";
+#else
+			throw UnitTestSkipped("requires linux.");
+#endif
+		}
+	}
+}
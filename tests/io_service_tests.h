@@ -0,0 +1,14 @@
+#pragma once
+#include "tests.h"
+
+
+namespace macoro
+{
+	namespace tests
+	{
+		void io_service_echo_test();
+		void io_service_pool_echo_test();
+		void io_service_busy_pool_test();
+		void io_service_echo_bench(const CLP& cmd);
+	}
+}
@@ -0,0 +1,358 @@
+#include "io_uring_tests.h"
+#include "macoro/config.h"
+
+#ifdef MACORO_IO_URING
+#include "macoro/io_uring_service.h"
+#include "macoro/task.h"
+#include "macoro/when_all.h"
+#include "macoro/sync_wait.h"
+#include "macoro/thread_pool.h"
+#include "macoro/result.h"
+#include "macoro/macros.h"
+
+#include <sys/socket.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <cstdlib>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace macoro
+{
+	namespace tests
+	{
+#ifdef MACORO_IO_URING
+		namespace
+		{
+			// io_uring can be disabled by the kernel or a seccomp profile.
+			template<typename... Args>
+			std::unique_ptr<io_uring_service> make_service(Args&... args)
+			{
+				try {
+					return std::unique_ptr<io_uring_service>(new io_uring_service(args...));
+				}
+				catch (std::system_error& e)
+				{
+					if (e.code().value() == ENOSYS || e.code().value() == EPERM)
+						throw UnitTestSkipped("io_uring is not available.");
+					throw;
+				}
+			}
+
+			eager_task<> stop_after(io_uring_service& io, task<> t)
+			{
+				MC_BEGIN(eager_task<>, &io, t = std::move(t), r = result<void>{});
+				MC_AWAIT_TRY(r, std::move(t));
+				io.stop();
+				r.value();
+				MC_END();
+			}
+
+			void run(io_uring_service& io, task<> t)
+			{
+				auto e = stop_after(io, std::move(t));
+				io.process_events();
+				sync_wait(std::move(e));
+			}
+		}
+#endif
+
+		void io_uring_file_test()
+		{
+#ifdef MACORO_IO_URING
+			auto io = make_service();
+
+			char path[] = "/tmp/macoro_io_uring_XXXXXX";
+			int fd = ::mkstemp(path);
+			if (fd < 0)
+				throw MACORO_RTE_LOC;
+			::unlink(path);
+
+			std::vector<char> data(1 << 16);
+			for (std::size_t i = 0; i < data.size(); ++i)
+				data[i] = char(i * 13);
+
+			// the second page is read into a registered buffer.
+			std::vector<char> fixed(4096);
+			iovec v{ fixed.data(), fixed.size() };
+			io->register_buffers(&v, 1);
+
+			auto t = [](io_uring_service& io, int fd, std::vector<char>& data, std::vector<char>& fixed) -> task<>
+			{
+				MC_BEGIN(task<>, &io, fd, &data, &fixed
+					, n = std::size_t{}
+					, buff = std::vector<char>{});
+
+				MC_AWAIT_SET(n, io.write_at(fd, data.data(), data.size(), 0));
+				if (n != data.size())
+					throw MACORO_RTE_LOC;
+
+				buff.resize(data.size());
+				MC_AWAIT_SET(n, io.read_at(fd, buff.data(), buff.size(), 0));
+				if (n != data.size() || buff != data)
+					throw MACORO_RTE_LOC;
+
+				MC_AWAIT_SET(n, io.read_fixed(fd, fixed.data(), fixed.size(), 4096, 0));
+				if (n != fixed.size() || !std::equal(fixed.begin(), fixed.end(), data.begin() + 4096))
+					throw MACORO_RTE_LOC;
+
+				// end of file.
+				MC_AWAIT_SET(n, io.read_at(fd, buff.data(), buff.size(), data.size()));
+				if (n != 0)
+					throw MACORO_RTE_LOC;
+				MC_END();
+			};
+
+			run(*io, t(*io, fd, data, fixed));
+			io->unregister_buffers();
+			::close(fd);
+#else
+			throw UnitTestSkipped("requires io_uring.");
+#endif
+		}
+
+		void io_uring_socket_test()
+		{
+#ifdef MACORO_IO_URING
+			thread_pool pool;
+			auto w = pool.make_work();
+			pool.create_threads(2);
+			auto io = make_service(pool);
+
+			int l = ::socket(AF_INET, SOCK_STREAM, 0);
+			sockaddr_in addr{};
+			addr.sin_family = AF_INET;
+			addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+			socklen_t len = sizeof(addr);
+			if (l < 0 ||
+				::bind(l, (sockaddr*)&addr, sizeof(addr)) ||
+				::listen(l, 1) ||
+				::getsockname(l, (sockaddr*)&addr, &len))
+				throw MACORO_RTE_LOC;
+
+			// accepts one connection and echoes one message back.
+			auto server = [](io_uring_service& io, int l) -> task<>
+			{
+				MC_BEGIN(task<>, &io, l
+					, fd = int{}
+					, n = std::size_t{}
+					, buff = std::vector<char>(64));
+
+				MC_AWAIT_SET(fd, io.accept(l));
+				MC_AWAIT_SET(n, io.recv(fd, buff.data(), buff.size()));
+				MC_AWAIT_SET(n, io.send(fd, buff.data(), n));
+				::close(fd);
+				MC_END();
+			};
+
+			auto client = [](io_uring_service& io, sockaddr_in addr) -> task<>
+			{
+				MC_BEGIN(task<>, &io, addr
+					, fd = int{}
+					, n = std::size_t{}
+					, buff = std::vector<char>(64));
+
+				fd = ::socket(AF_INET, SOCK_STREAM, 0);
+				if (fd < 0 || ::connect(fd, (sockaddr*)&addr, sizeof(addr)))
+					throw MACORO_RTE_LOC;
+
+				MC_AWAIT_SET(n, io.send(fd, "hello", 5));
+				if (n != 5)
+					throw MACORO_RTE_LOC;
+
+				MC_AWAIT_SET(n, io.recv(fd, buff.data(), buff.size()));
+				if (n != 5 || std::string(buff.data(), n) != "hello")
+					throw MACORO_RTE_LOC;
+
+				// the server closed its end.
+				MC_AWAIT_SET(n, io.recv(fd, buff.data(), buff.size()));
+				if (n != 0)
+					throw MACORO_RTE_LOC;
+				::close(fd);
+				MC_END();
+			};
+
+			auto r = sync_wait(when_all_ready(server(*io, l), client(*io, addr)));
+			std::get<0>(r).result();
+			std::get<1>(r).result();
+			::close(l);
+#else
+			throw UnitTestSkipped("requires io_uring.");
+#endif
+		}
+
+		void io_uring_cancel_test()
+		{
+#ifdef MACORO_IO_URING
+			auto io = make_service();
+
+			int fds[2];
+			if (::socketpair(AF_UNIX, SOCK_STREAM, 0, fds))
+				throw MACORO_RTE_LOC;
+
+			auto recv = [](io_uring_service& io, int fd, stop_token token) -> task<>
+			{
+				MC_BEGIN(task<>, &io, fd, token = std::move(token), c = char{});
+				MC_AWAIT(io.recv(fd, &c, 1, std::move(token)));
+				MC_END();
+			};
+
+			// nothing is ever sent so the recv only completes by being
+			// cancelled.
+			stop_source src;
+			auto e = stop_after(*io, recv(*io, fds[0], src.get_token()));
+			src.request_stop();
+			io->process_events();
+
+			bool cancelled = false;
+			try { sync_wait(std::move(e)); }
+			catch (operation_cancelled&) { cancelled = true; }
+			if (!cancelled)
+				throw MACORO_RTE_LOC;
+
+			// already stopped, the operation is never submitted.
+			io->reset();
+			cancelled = false;
+			try { run(*io, recv(*io, fds[0], src.get_token())); }
+			catch (operation_cancelled&) { cancelled = true; }
+			if (!cancelled)
+				throw MACORO_RTE_LOC;
+
+			::close(fds[0]);
+			::close(fds[1]);
+#else
+			throw UnitTestSkipped("requires io_uring.");
+#endif
+		}
+
+		void io_uring_busy_pool_test()
+		{
+#ifdef MACORO_IO_URING
+			thread_pool pool;
+			auto w = pool.make_work();
+			pool.create_threads(2);
+			auto io = make_service(pool);
+
+			// the workers never poll while they are busy, so the send
+			// only reaches the kernel if the worker submits it.
+			pool.set_reactor_poll_interval(std::chrono::hours(1));
+
+			int fds[2];
+			if (::socketpair(AF_UNIX, SOCK_STREAM, 0, fds))
+				throw MACORO_RTE_LOC;
+
+			auto load = [](thread_pool& pool, std::atomic<bool>& done) -> task<>
+			{
+				MC_BEGIN(task<>, &pool, &done);
+				while (!done)
+					MC_AWAIT(pool.schedule());
+				MC_END();
+			};
+			auto send = [](thread_pool& pool, io_uring_service& io, int fd) -> task<>
+			{
+				MC_BEGIN(task<>, &pool, &io, fd, n = std::size_t{});
+				MC_AWAIT(pool.schedule());
+				MC_AWAIT_SET(n, io.send(fd, "hello", 5));
+				if (n != 5)
+					throw MACORO_RTE_LOC;
+				MC_END();
+			};
+
+			std::atomic<bool> done(false);
+			std::vector<eager_task<>> tasks;
+			for (std::size_t i = 0; i < 2; ++i)
+				tasks.push_back(make_eager(load(pool, done)));
+			tasks.push_back(make_eager(send(pool, *io, fds[0])));
+
+			pollfd p{ fds[1], POLLIN, 0 };
+			bool sent = ::poll(&p, 1, 5000) == 1;
+			char buff[5];
+			sent = sent && ::read(fds[1], buff, 5) == 5;
+
+			// the idle workers poll and complete the send.
+			done = true;
+			for (auto& t : tasks)
+				sync_wait(t);
+			if (!sent)
+				throw MACORO_RTE_LOC;
+
+			::close(fds[0]);
+			::close(fds[1]);
+#else
+			throw UnitTestSkipped("requires io_uring.");
+#endif
+		}
+
+		void io_uring_full_ring_test()
+		{
+#ifdef MACORO_IO_URING
+			// two sqes and four cqes.
+			unsigned entries = 2;
+			auto io = make_service(entries);
+
+			int fds[2];
+			if (::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) ||
+				::write(fds[1], "x", 1) != 1)
+				throw MACORO_RTE_LOC;
+
+			auto send = [](io_uring_service& io, int fd) -> task<>
+			{
+				MC_BEGIN(task<>, &io, fd, n = std::size_t{});
+				MC_AWAIT_SET(n, io.send(fd, "y", 1));
+				if (n != 1)
+					throw MACORO_RTE_LOC;
+				MC_END();
+			};
+
+			// once the recv is resumed by process_events() the sends are
+			// queued without entering the kernel, which overflows both
+			// rings.
+			auto burst = [&send](io_uring_service& io, int fd, std::size_t count) -> task<>
+			{
+				using results = std::vector<detail::when_all_task<void>>;
+				MC_BEGIN(task<>, &io, fd, count, &send
+					, c = char{}
+					, sends = std::vector<task<>>{}
+					, r = results{});
+
+				MC_AWAIT(io.recv(fd, &c, 1));
+				for (std::size_t i = 0; i < count; ++i)
+					sends.push_back(send(io, fd));
+				MC_AWAIT_SET(r, when_all_ready(std::move(sends)));
+				for (auto& t : r)
+					t.result();
+				MC_END();
+			};
+
+			std::size_t count = 64;
+			run(*io, burst(*io, fds[0], count));
+
+			std::string received;
+			char buff[128];
+			pollfd p{ fds[1], POLLIN, 0 };
+			while (received.size() < count && ::poll(&p, 1, 1000) == 1)
+			{
+				auto n = ::read(fds[1], buff, sizeof(buff));
+				if (n <= 0)
+					break;
+				received.append(buff, n);
+			}
+			if (received != std::string(count, 'y'))
+				throw MACORO_RTE_LOC;
+
+			::close(fds[0]);
+			::close(fds[1]);
+#else
+			throw UnitTestSkipped("requires io_uring.");
+#endif
+		}
+	}
+}
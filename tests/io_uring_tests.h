@@ -0,0 +1,15 @@
+#pragma once
+#include "tests.h"
+
+
+namespace macoro
+{
+	namespace tests
+	{
+		void io_uring_file_test();
+		void io_uring_socket_test();
+		void io_uring_cancel_test();
+		void io_uring_busy_pool_test();
+		void io_uring_full_ring_test();
+	}
+}
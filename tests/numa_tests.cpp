@@ -0,0 +1,261 @@
+#include "numa_tests.h"
+#include "macoro/numa_thread_pool.h"
+#include "macoro/task.h"
+#include "macoro/sync_wait.h"
+#include "macoro/when_all.h"
+#include "macoro/macros.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#if MACORO_LINUX_OS
+#include <sched.h>
+#endif
+
+namespace macoro
+{
+	namespace tests
+	{
+		namespace
+		{
+			// two nodes that share every cpu, so that the tests run on
+			// any machine.
+			std::vector<numa_node> fake_nodes()
+			{
+				auto real = numa_topology();
+				std::vector<numa_node> nodes(2);
+				for (auto& n : real)
+					for (auto c : n.cpus)
+						for (auto& f : nodes)
+							f.cpus.push_back(c);
+				nodes[1].id = 1;
+				return nodes;
+			}
+
+			std::size_t node_of(numa_thread_pool& p)
+			{
+				for (std::size_t i = 0; i < p.size(); ++i)
+					if (p.node(i).mState.get() == detail::thread_pool_state::mCurrentExecutor)
+						return i;
+				throw MACORO_RTE_LOC;
+			}
+		}
+
+		void numa_topology_test()
+		{
+			using detail::parse_cpu_list;
+			if (parse_cpu_list("0-3,8,10-11\n") != std::vector<std::size_t>{ 0, 1, 2, 3, 8, 10, 11 })
+				throw MACORO_RTE_LOC;
+			if (parse_cpu_list("") != std::vector<std::size_t>{})
+				throw MACORO_RTE_LOC;
+
+			bool thrown = false;
+			try { parse_cpu_list("3-1"); }
+			catch (std::invalid_argument&) { thrown = true; }
+			if (!thrown)
+				throw MACORO_RTE_LOC;
+
+			auto nodes = numa_topology();
+			if (nodes.empty() || nodes[0].cpus.empty())
+				throw MACORO_RTE_LOC;
+
+#if MACORO_LINUX_OS
+			// pin a thread to the last cpu and check where it runs.
+			auto cpu = nodes.back().cpus.back();
+			bool ok = false;
+			std::thread t([&] {
+				ok = set_thread_affinity({ cpu }) && std::size_t(::sched_getcpu()) == cpu;
+			});
+			t.join();
+			if (!ok)
+				throw MACORO_RTE_LOC;
+#endif
+		}
+
+		void numa_thread_pool_test()
+		{
+			numa_thread_pool pool(fake_nodes());
+			auto w = pool.make_work();
+			pool.create_threads(2);
+
+			// every task runs on some node and creates its frames from
+			// that node's arena.
+			auto t = [](numa_thread_pool& pool, std::atomic<std::size_t>& count) -> task<>
+			{
+				MC_BEGIN(task<>, &pool, &count);
+				MC_AWAIT(pool.schedule());
+				node_of(pool);
+				if (detail::frame_arena::current() == nullptr)
+					throw MACORO_RTE_LOC;
+				++count;
+				MC_END();
+			};
+
+			std::atomic<std::size_t> count(0);
+			std::vector<task<>> tasks;
+			for (std::size_t i = 0; i < 100; ++i)
+				tasks.push_back(t(pool, count));
+			auto r = sync_wait(when_all_ready(std::move(tasks)));
+			for (auto& rr : r)
+				rr.result();
+			if (count != 100)
+				throw MACORO_RTE_LOC;
+
+			// created on a worker, destroyed here after the pool is gone.
+			auto make = [](numa_thread_pool& pool) -> task<task<int>>
+			{
+				MC_BEGIN(task<task<int>>, &pool);
+				MC_AWAIT(pool.schedule());
+				MC_RETURN([]() -> task<int> {
+					MC_BEGIN(task<int>);
+					MC_RETURN(42);
+					MC_END();
+				}());
+				MC_END();
+			};
+			auto inner = std::move(sync_wait(make(pool)));
+			w.reset();
+			pool.join();
+			if (sync_wait(std::move(inner)) != 42)
+				throw MACORO_RTE_LOC;
+		}
+
+		void numa_steal_test()
+		{
+			numa_thread_pool pool(fake_nodes());
+			auto w = pool.make_work();
+			pool.create_threads(1);
+
+			// occupies one node's only worker. It may itself be stolen by
+			// the other node.
+			std::atomic<bool> release(false), blocked(false);
+			std::size_t busy = ~std::size_t(0);
+			auto block = [](numa_thread_pool& pool, std::size_t& busy, std::atomic<bool>& blocked, std::atomic<bool>& release) -> task<>
+			{
+				MC_BEGIN(task<>, &pool, &busy, &blocked, &release);
+				MC_AWAIT(pool.node(0).schedule());
+				busy = node_of(pool);
+				blocked = true;
+				while (!release)
+					std::this_thread::yield();
+				MC_END();
+			};
+			auto b = make_eager(block(pool, busy, blocked, release));
+			while (!blocked)
+				std::this_thread::yield();
+
+			// queued on the busy node but run by the other one.
+			auto stolen = [](numa_thread_pool& pool, std::size_t busy, std::size_t& node) -> task<>
+			{
+				MC_BEGIN(task<>, &pool, busy, &node);
+				MC_AWAIT(pool.node(busy).schedule());
+				node = node_of(pool);
+				MC_END();
+			};
+			std::size_t node = ~std::size_t(0);
+			sync_wait(stolen(pool, busy, node));
+			release = true;
+			sync_wait(b);
+			if (node != 1 - busy)
+				throw MACORO_RTE_LOC;
+		}
+			namespace
+		{
+			struct alignas(128) wide
+			{
+				char mData[128];
+			};
+
+			// the misalignment of an over-aligned frame capture.
+			task<std::size_t> wide_frame()
+			{
+				MC_BEGIN(task<std::size_t>, w = wide{});
+				MC_RETURN(reinterpret_cast<std::uintptr_t>(&w) % alignof(wide));
+				MC_END();
+			}
+		}
+
+		void frame_arena_test()
+		{
+			using detail::frame_arena;
+			auto arena = frame_arena::create();
+			std::vector<std::pair<void*, std::size_t>> frames;
+			bool ok = true;
+
+			std::thread([&] {
+				frame_arena::current() = arena;
+				for (std::size_t i = 0; i < 1000; ++i)
+				{
+					auto size = 8 + i % 300;
+					auto p = detail::frame_allocate(size);
+					ok &= reinterpret_cast<std::uintptr_t>(p) % frame_arena::granularity == 0;
+					std::memset(p, 0xab, size);
+					frames.emplace_back(p, size);
+				}
+
+				// freed to this thread's cache and handed out again.
+				auto last = frames.back();
+				detail::frame_deallocate(last.first, last.second);
+				ok &= detail::frame_allocate(last.second) == last.first;
+
+				for (std::size_t i = 0; i < 500; ++i)
+					detail::frame_deallocate(frames[i].first, frames[i].second);
+
+#ifdef __cpp_aligned_new
+				ok &= sync_wait(wide_frame()) == 0;
+#endif
+				frame_arena::current() = nullptr;
+			}).join();
+			if (!ok)
+				throw MACORO_RTE_LOC;
+
+			// the rest outlive the thread and the owner's reference.
+			arena->release();
+			for (std::size_t i = 500; i < frames.size(); ++i)
+				detail::frame_deallocate(frames[i].first, frames[i].second);
+
+#ifdef __cpp_aligned_new
+			if (sync_wait(wide_frame()) != 0)
+				throw MACORO_RTE_LOC;
+#endif
+		}
+
+		void frame_arena_bench(const CLP& cmd)
+		{
+			if (!cmd.isSet("bench"))
+				throw UnitTestSkipped("pass -bench to run.");
+
+			using detail::frame_arena;
+			auto n = cmd.getOr<std::size_t>("n", 1000000);
+			auto arena = frame_arena::create();
+			auto run = [n](frame_arena* a) {
+				frame_arena::current() = a;
+				void* live[16];
+				auto begin = std::chrono::steady_clock::now();
+				for (std::size_t i = 0; i < n; ++i)
+				{
+					auto size = 100 + 40 * (i % 16);
+					if (i >= 16)
+						detail::frame_deallocate(live[i % 16], size);
+					live[i % 16] = detail::frame_allocate(size);
+				}
+				auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+					std::chrono::steady_clock::now() - begin).count();
+				for (std::size_t i = 0; i < std::min<std::size_t>(n, 16); ++i)
+					detail::frame_deallocate(live[i], 100 + 40 * i);
+				frame_arena::current() = nullptr;
+				return double(ns) / n;
+			};
+
+			std::cout << "\n  heap  " << run(nullptr) << " ns/frame ";
+			std::cout << "\n  arena " << run(arena) << " ns/frame ";
+			arena->release();
+		}
+	}
+}
@@ -0,0 +1,15 @@
+#pragma once
+#include "tests.h"
+
+
+namespace macoro
+{
+	namespace tests
+	{
+		void numa_topology_test();
+		void numa_thread_pool_test();
+		void numa_steal_test();
+		void frame_arena_test();
+		void frame_arena_bench(const CLP& cmd);
+	}
+}
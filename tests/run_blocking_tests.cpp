@@ -0,0 +1,135 @@
+#include "run_blocking_tests.h"
+#include "macoro/run_blocking.h"
+#include "macoro/task.h"
+#include "macoro/sync_wait.h"
+#include "macoro/result.h"
+#include "macoro/macros.h"
+
+#include <atomic>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+
+namespace macoro
+{
+	namespace tests
+	{
+		namespace
+		{
+			bool on(thread_pool& p)
+			{
+				return p.mState.get() == detail::thread_pool_state::mCurrentExecutor;
+			}
+		}
+
+		void run_blocking_test()
+		{
+			thread_pool pool, blocking;
+			auto w0 = pool.make_work();
+			auto w1 = blocking.make_work();
+			pool.create_threads(1);
+			blocking.create_threads(1);
+
+			auto t = [](thread_pool& pool, thread_pool& blocking) -> task<>
+			{
+				MC_BEGIN(task<>, &pool, &blocking
+					, v = std::unique_ptr<int>{}
+					, r = result<void>{}
+					, threw = false
+					, make = [&blocking, p = std::make_unique<int>(42)]() mutable {
+						if (!on(blocking))
+							throw MACORO_RTE_LOC;
+						return std::move(p);
+					}
+					, fail = [] { throw std::logic_error("blocking"); });
+				MC_AWAIT(pool.schedule());
+
+				// a move only callable, resumed back on pool.
+				MC_AWAIT_SET(v, run_blocking(blocking, std::move(make)));
+				if (!on(pool) || !v || *v != 42)
+					throw MACORO_RTE_LOC;
+
+				MC_AWAIT_TRY(r, run_blocking(blocking, fail));
+				if (!on(pool))
+					throw MACORO_RTE_LOC;
+				try { r.value(); }
+				catch (std::logic_error&) { threw = true; }
+				if (!threw)
+					throw MACORO_RTE_LOC;
+				MC_END();
+			};
+			sync_wait(t(pool, blocking));
+
+			// the pool's only worker stays free while the call blocks.
+			std::atomic<bool> release(false);
+			auto block = [](thread_pool& pool, thread_pool& blocking, std::atomic<bool>& release) -> task<>
+			{
+				MC_BEGIN(task<>, &pool, &blocking, &release
+					, wait = [&release] {
+						while (!release)
+							std::this_thread::yield();
+					});
+				MC_AWAIT(pool.schedule());
+				MC_AWAIT(run_blocking(blocking, wait));
+				if (!on(pool))
+					throw MACORO_RTE_LOC;
+				MC_END();
+			};
+			auto b = make_eager(block(pool, blocking, release));
+
+			auto other = [](thread_pool& pool, std::atomic<bool>& release) -> task<>
+			{
+				MC_BEGIN(task<>, &pool, &release);
+				MC_AWAIT(pool.schedule());
+				release = true;
+				MC_END();
+			};
+			sync_wait(other(pool, release));
+			sync_wait(b);
+
+			// not started on a pool, resumed on the blocking thread.
+			auto inline_ = [](thread_pool& blocking) -> task<>
+			{
+				MC_BEGIN(task<>, &blocking, nop = [] {});
+				MC_AWAIT(run_blocking(blocking, nop));
+				if (!on(blocking))
+					throw MACORO_RTE_LOC;
+				MC_END();
+			};
+			sync_wait(inline_(blocking));
+		}
+
+		void run_blocking_cancel_test()
+		{
+			thread_pool blocking;
+			auto w = blocking.make_work();
+			blocking.create_threads(1);
+
+			auto t = [](thread_pool& blocking, stop_token token, bool& called, bool& possible) -> task<>
+			{
+				MC_BEGIN(task<>, &blocking, token, &called, &possible
+					, fn = [&called](const stop_token& t) {
+						called = true;
+						return t.stop_possible();
+					});
+				MC_AWAIT_SET(possible, run_blocking(blocking, fn, token));
+				MC_END();
+			};
+
+			stop_source src;
+			bool called = false, possible = false;
+			sync_wait(t(blocking, src.get_token(), called, possible));
+			if (!called || !possible)
+				throw MACORO_RTE_LOC;
+
+			// already stopped, fn is never called.
+			src.request_stop();
+			called = false;
+			bool cancelled = false;
+			try { sync_wait(t(blocking, src.get_token(), called, possible)); }
+			catch (operation_cancelled&) { cancelled = true; }
+			if (!cancelled || called)
+				throw MACORO_RTE_LOC;
+		}
+	}
+}
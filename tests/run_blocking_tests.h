@@ -0,0 +1,12 @@
+#pragma once
+#include "tests.h"
+
+
+namespace macoro
+{
+	namespace tests
+	{
+		void run_blocking_test();
+		void run_blocking_cancel_test();
+	}
+}
@@ -0,0 +1,190 @@
+#include "shared_task_tests.h"
+#include "macoro/shared_task.h"
+#include "macoro/task.h"
+#include "macoro/thread_pool.h"
+#include "macoro/sync_wait.h"
+#include "macoro/when_all.h"
+#include "macoro/macros.h"
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace macoro
+{
+	namespace tests
+	{
+		namespace
+		{
+			shared_task<std::string> load(std::atomic<std::size_t>& runs)
+			{
+				MC_BEGIN(shared_task<std::string>, &runs);
+				++runs;
+				MC_RETURN(std::string("value"));
+				MC_END();
+			}
+
+			// awaits the shared task and records where the result lives.
+			task<> get(shared_task<std::string> s, const std::string*& addr)
+			{
+				MC_BEGIN(task<>, s, &addr);
+				MC_AWAIT_FN(addr = &, s);
+				if (*addr != "value")
+					throw MACORO_RTE_LOC;
+				MC_END();
+			}
+
+#ifdef MACORO_CPP_20
+			shared_task<int> load20(std::atomic<std::size_t>& runs)
+			{
+				++runs;
+				co_return 42;
+			}
+
+			task<int> get20(shared_task<int> s)
+			{
+				co_return co_await s;
+			}
+#endif
+		}
+
+		void shared_task_test()
+		{
+			std::atomic<std::size_t> runs(0);
+			auto s = load(runs);
+			if (s.is_ready() || runs)
+				throw MACORO_RTE_LOC;
+
+			// every awaiter gets the one result, the coroutine runs once.
+			std::vector<const std::string*> addr(3);
+			std::vector<task<>> tasks;
+			for (auto& a : addr)
+				tasks.push_back(get(s, a));
+			auto r = sync_wait(when_all_ready(std::move(tasks)));
+			for (auto& rr : r)
+				rr.result();
+			if (runs != 1 || !s.is_ready())
+				throw MACORO_RTE_LOC;
+			for (auto a : addr)
+				if (a != addr[0])
+					throw MACORO_RTE_LOC;
+
+			// ready, does not suspend.
+			if (&sync_wait(s) != addr[0])
+				throw MACORO_RTE_LOC;
+
+			// default constructed.
+			bool thrown = false;
+			try { sync_wait(shared_task<int>{}); }
+			catch (broken_promise&) { thrown = true; }
+			if (!thrown)
+				throw MACORO_RTE_LOC;
+
+#ifdef MACORO_CPP_20
+			runs = 0;
+			auto s20 = load20(runs);
+			if (sync_wait(get20(s20)) != 42 || sync_wait(get20(s20)) != 42 || runs != 1)
+				throw MACORO_RTE_LOC;
+#endif
+		}
+
+		void shared_task_concurrent_test()
+		{
+			thread_pool pool;
+			auto w = pool.make_work();
+			pool.create_threads(4);
+
+			// the shared work runs on the pool while awaiters queue up
+			// from other workers.
+			auto work = [](thread_pool& pool, std::atomic<std::size_t>& runs) -> shared_task<std::size_t>
+			{
+				MC_BEGIN(shared_task<std::size_t>, &pool, &runs);
+				MC_AWAIT(pool.schedule());
+				++runs;
+				MC_RETURN(std::size_t(7));
+				MC_END();
+			};
+
+			auto t = [](thread_pool& pool, shared_task<std::size_t> s, std::atomic<std::size_t>& sum) -> task<>
+			{
+				MC_BEGIN(task<>, &pool, s, &sum, v = std::size_t{});
+				MC_AWAIT(pool.schedule());
+				MC_AWAIT_SET(v, s);
+				sum += v;
+				MC_END();
+			};
+
+			for (std::size_t j = 0; j < 100; ++j)
+			{
+				std::atomic<std::size_t> runs(0), sum(0);
+				auto s = work(pool, runs);
+				std::vector<task<>> tasks;
+				for (std::size_t i = 0; i < 20; ++i)
+					tasks.push_back(t(pool, s, sum));
+				auto r = sync_wait(when_all_ready(std::move(tasks)));
+				for (auto& rr : r)
+					rr.result();
+				if (runs != 1 || sum != 7 * 20)
+					throw MACORO_RTE_LOC;
+			}
+		}
+
+		void shared_task_ex_test()
+		{
+			auto fail = []() -> shared_task<int>
+			{
+				MC_BEGIN(shared_task<int>);
+				throw std::runtime_error("shared");
+				MC_RETURN(0);
+				MC_END();
+			};
+
+			// each awaiter sees the exception.
+			auto s = fail();
+			for (std::size_t i = 0; i < 3; ++i)
+			{
+				bool thrown = false;
+				try { sync_wait(s); }
+				catch (std::runtime_error& e) { thrown = std::string(e.what()) == "shared"; }
+				if (!thrown)
+					throw MACORO_RTE_LOC;
+			}
+		}
+
+		void shared_task_lifetime_test()
+		{
+			auto hold = [](std::shared_ptr<int> alive) -> shared_task<>
+			{
+				MC_BEGIN(shared_task<>, alive);
+				MC_END();
+			};
+
+			// the frame goes with the last copy, started or not.
+			auto alive = std::make_shared<int>();
+			{
+				auto s = hold(alive);
+				auto s2 = s;
+				shared_task<> s3;
+				s3 = s2;
+				s = {};
+				if (alive.use_count() != 2)
+					throw MACORO_RTE_LOC;
+			}
+			if (alive.use_count() != 1)
+				throw MACORO_RTE_LOC;
+
+			{
+				auto s = hold(alive);
+				auto s2 = std::move(s);
+				sync_wait(s2);
+				auto s3 = s2;
+				s2 = {};
+				if (alive.use_count() != 2 || !s3.is_ready())
+					throw MACORO_RTE_LOC;
+			}
+			if (alive.use_count() != 1)
+				throw MACORO_RTE_LOC;
+		}
+	}
+}
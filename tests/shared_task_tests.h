@@ -0,0 +1,14 @@
+#pragma once
+#include "tests.h"
+
+
+namespace macoro
+{
+	namespace tests
+	{
+		void shared_task_test();
+		void shared_task_concurrent_test();
+		void shared_task_ex_test();
+		void shared_task_lifetime_test();
+	}
+}
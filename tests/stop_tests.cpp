@@ -0,0 +1,316 @@
+#include "stop_tests.h"
+#include "macoro/stop.h"
+#include "macoro/detail/stop_state.h"
+#include "macoro/timeout.h"
+#include "macoro/thread_pool.h"
+#include "macoro/sync_wait.h"
+#include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <ctime>
+#include <iostream>
+
+namespace macoro
+{
+	namespace tests
+	{
+		void stop_callback_inline_test()
+		{
+			stop_source src;
+			int count = 0;
+			{
+				stop_callback c0(src.get_token(), [&] { ++count; });
+				stop_callback c1(src.get_token(), [&] { ++count; });
+			}
+
+			// the slots freed above should be reused.
+			std::vector<std::unique_ptr<stop_callback>> cbs;
+			for (std::size_t i = 0; i < detail::stop_state::inline_callback_count; ++i)
+				cbs.emplace_back(new stop_callback(src.get_token(), [&] { ++count; }));
+
+			src.request_stop();
+			if (count != int(detail::stop_state::inline_callback_count))
+				throw MACORO_RTE_LOC;
+
+			// already stopped, executed inline.
+			stop_callback c2(src.get_token(), [&] { ++count; });
+			if (count != int(detail::stop_state::inline_callback_count) + 1)
+				throw MACORO_RTE_LOC;
+		}
+
+		void stop_callback_overflow_test()
+		{
+			stop_source src;
+			std::size_t n = 100;
+			std::vector<int> called(n);
+			std::vector<std::unique_ptr<stop_callback>> cbs;
+			for (std::size_t i = 0; i < n; ++i)
+				cbs.emplace_back(new stop_callback(src.get_token(), [&called, i] { ++called[i]; }));
+
+			// remove a mix of inline and chunk registrations.
+			for (std::size_t i = 0; i < n; i += 3)
+				cbs[i].reset();
+
+			src.request_stop();
+			for (std::size_t i = 0; i < n; ++i)
+			{
+				if (called[i] != (i % 3 ? 1 : 0))
+					throw MACORO_RTE_LOC;
+			}
+		}
+
+		void stop_state_pool_test()
+		{
+			for (int j = 0; j < 2; ++j)
+			{
+				std::vector<stop_source> srcs(100);
+				for (auto& s : srcs)
+				{
+					if (s.stop_requested())
+						throw MACORO_RTE_LOC;
+					s.request_stop();
+				}
+			}
+
+			// states freed on other threads are recycled.
+			std::vector<stop_source> srcs(100);
+			std::thread thrd([&] { srcs.clear(); });
+			thrd.join();
+
+			// a state released after the thread's cache is destroyed. The
+			// holder is constructed first, so it is destroyed last.
+			std::thread late([] {
+				thread_local std::unique_ptr<stop_source> holder;
+				holder.reset(new stop_source);
+				stop_source warm;
+			});
+			late.join();
+
+			// many states returned at once are taken back in bounded batches.
+			std::vector<stop_source> many(5000);
+			std::thread drop([&] { many.clear(); });
+			drop.join();
+			std::vector<stop_source> again(5000);
+			again.clear();
+
+			for (int i = 0; i < 1000; ++i)
+			{
+				stop_source s;
+				auto token = s.get_token();
+				bool called = false;
+				stop_callback cb(token, [&] { called = true; });
+				if (token.stop_requested() || called)
+					throw MACORO_RTE_LOC;
+				s.request_stop();
+				if (!token.stop_requested() || !called)
+					throw MACORO_RTE_LOC;
+			}
+		}
+
+		void optional_stop_callback_test()
+		{
+			stop_source src;
+			int count = 0;
+
+			optional_stop_callback a;
+			optional_stop_callback b(std::move(a));
+			b.emplace(src.get_token(), [&] { ++count; });
+			if (!b)
+				throw MACORO_RTE_LOC;
+
+			b.reset();
+			if (b.has_value())
+				throw MACORO_RTE_LOC;
+
+			b.emplace(src.get_token(), [&] { ++count; });
+			src.request_stop();
+			if (count != 1)
+				throw MACORO_RTE_LOC;
+		}
+
+		void timeout_move_test()
+		{
+			thread_pool pool;
+			auto w = pool.make_work();
+			pool.create_thread();
+
+			stop_source parent;
+			timeout t0(pool, std::chrono::hours(1), parent.get_token());
+			timeout t1(std::move(t0));
+			timeout t2;
+			t2 = std::move(t1);
+
+			auto token = t2.get_token();
+			if (token.stop_requested())
+				throw MACORO_RTE_LOC;
+
+			parent.request_stop();
+			if (!token.stop_requested())
+				throw MACORO_RTE_LOC;
+
+			sync_wait(t2);
+
+			w = {};
+			pool.join();
+		}
+
+		void local_stop_callback_test()
+		{
+			std::vector<int> order;
+			local_stop_token token;
+			{
+				local_stop_source src;
+				token = src.get_token();
+				if (!token.stop_possible() || token.stop_requested())
+					throw MACORO_RTE_LOC;
+
+				local_stop_callback c0(token, [&] { order.push_back(0); });
+				std::unique_ptr<local_stop_callback> c1(new local_stop_callback(token, [&] { order.push_back(1); }));
+				std::unique_ptr<local_stop_callback> c2;
+				std::unique_ptr<local_stop_callback> c3;
+
+				// a callback that removes a later callback and itself.
+				c2.reset(new local_stop_callback(token, [&] {
+					order.push_back(2);
+					c3.reset();
+					c2.reset();
+					}));
+				c3.reset(new local_stop_callback(token, [&] { order.push_back(3); }));
+				local_stop_callback c4(token, [&] { order.push_back(4); });
+				c1.reset();
+
+				src.request_stop();
+				if (order != std::vector<int>{ 0, 2, 4 })
+					throw MACORO_RTE_LOC;
+
+				// already stopped, executed inline.
+				local_stop_callback c5(token, [&] { order.push_back(5); });
+				if (order.back() != 5)
+					throw MACORO_RTE_LOC;
+			}
+
+			// the token outlives the source and remains stopped.
+			if (!token.stop_requested() || !token.stop_possible())
+				throw MACORO_RTE_LOC;
+
+			local_stop_token t2;
+			{
+				local_stop_source src;
+				t2 = src.get_token();
+			}
+			if (t2.stop_possible())
+				throw MACORO_RTE_LOC;
+		}
+
+		void local_stop_schedule_after_test()
+		{
+			// everything runs on this thread so the local token is never
+			// shared between threads.
+			thread_pool pool;
+			auto w = pool.make_work();
+			local_stop_source src;
+			bool resumed = false;
+
+			auto t = [&]() -> eager_task<>
+			{
+				MC_BEGIN(eager_task<>, &);
+				MC_AWAIT(pool.schedule_after(std::chrono::hours(1), src.get_token()));
+				resumed = true;
+				w.reset();
+				MC_END();
+			}();
+
+			timeout to(pool, std::chrono::hours(1), src.get_token());
+			auto toToken = to.get_token();
+
+			src.request_stop();
+			if (!toToken.stop_requested())
+				throw MACORO_RTE_LOC;
+
+			pool.run();
+			if (!resumed)
+				throw MACORO_RTE_LOC;
+		}
+
+		void stop_deregister_wait_test()
+		{
+			// deregister a callback while request_stop() is executing it on
+			// another thread. The destructor must block until it returns.
+			for (int i = 0; i < 10; ++i)
+			{
+				stop_source src;
+				std::atomic<bool> entered(false), done(false);
+				std::unique_ptr<stop_callback> cb(new stop_callback(src.get_token(), [&] {
+					entered = true;
+					std::this_thread::sleep_for(std::chrono::milliseconds(2));
+					done = true;
+					}));
+
+				std::thread thrd([&] { src.request_stop(); });
+				while (!entered)
+					std::this_thread::yield();
+
+				cb.reset();
+				if (!done)
+					throw MACORO_RTE_LOC;
+				thrd.join();
+			}
+		}
+
+		// Measures the CPU time burned by threads that are waiting in
+		// deregister_callback() while another thread runs slow callbacks.
+		// run with -bench, optionally -threads and -rounds.
+		void stop_deregister_bench(const CLP& cmd)
+		{
+			if (!cmd.isSet("bench"))
+				throw UnitTestSkipped("pass -bench to run.");
+
+			auto numThreads = cmd.getOr<std::size_t>("threads", std::max<std::size_t>(4, std::thread::hardware_concurrency()));
+			auto rounds = cmd.getOr<std::size_t>("rounds", 20);
+
+			auto wallBegin = std::chrono::steady_clock::now();
+			auto cpuBegin = std::clock();
+
+			for (std::size_t r = 0; r < rounds; ++r)
+			{
+				stop_source src;
+				std::atomic<std::size_t> registered(0);
+				std::vector<std::thread> thrds;
+				for (std::size_t t = 0; t < numThreads; ++t)
+				{
+					thrds.emplace_back([&] {
+						auto token = src.get_token();
+						std::unique_ptr<stop_callback> cb(new stop_callback(token, [] {
+							std::this_thread::sleep_for(std::chrono::microseconds(500));
+							}));
+						++registered;
+
+						// wait without burning cpu ourselves.
+						while (!token.stop_requested())
+							std::this_thread::sleep_for(std::chrono::microseconds(50));
+
+						// most of these will find their callback running or
+						// already run and have to wait for request_stop().
+						cb.reset();
+						});
+				}
+
+				while (registered != numThreads)
+					std::this_thread::sleep_for(std::chrono::microseconds(50));
+
+				src.request_stop();
+				for (auto& t : thrds)
+					t.join();
+			}
+
+			auto cpu = double(std::clock() - cpuBegin) * 1000 / CLOCKS_PER_SEC;
+			auto wall = std::chrono::duration_cast<std::chrono::milliseconds>(
+				std::chrono::steady_clock::now() - wallBegin).count();
+
+			std::cout << "\n  threads " << numThreads << ", rounds " << rounds
+				<< ", wall " << wall << "ms, cpu " << cpu << "ms ";
+		}
+	}
+}
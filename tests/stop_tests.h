@@ -0,0 +1,19 @@
+#pragma once
+#include "tests.h"
+
+
+namespace macoro
+{
+	namespace tests
+	{
+		void stop_callback_inline_test();
+		void stop_callback_overflow_test();
+		void stop_state_pool_test();
+		void optional_stop_callback_test();
+		void timeout_move_test();
+		void local_stop_callback_test();
+		void local_stop_schedule_after_test();
+		void stop_deregister_wait_test();
+		void stop_deregister_bench(const CLP& cmd);
+	}
+}
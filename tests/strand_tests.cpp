@@ -0,0 +1,170 @@
+#include "strand_tests.h"
+#include "macoro/strand.h"
+#include "macoro/task.h"
+#include "macoro/sync_wait.h"
+#include "macoro/when_all.h"
+#include "macoro/macros.h"
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace macoro
+{
+	namespace tests
+	{
+		void strand_test()
+		{
+			thread_pool pool;
+			auto w = pool.make_work();
+			pool.create_threads(4);
+			strand<> s(pool, 8);
+
+			// hop onto the pool, then into the strand. The counter is not
+			// atomic, the strand is the lock.
+			auto t = [](thread_pool& pool, strand<>& s, std::atomic<bool>& inside, std::size_t& count) -> task<>
+			{
+				MC_BEGIN(task<>, &pool, &s, &inside, &count);
+				MC_AWAIT(pool.schedule());
+				MC_AWAIT(s.schedule());
+				if (inside.exchange(true) || !s.running_in_this_thread())
+					throw MACORO_RTE_LOC;
+				++count;
+				inside = false;
+				MC_END();
+			};
+
+			std::atomic<bool> inside(false);
+			std::size_t count = 0;
+			std::vector<task<>> tasks;
+			for (std::size_t i = 0; i < 1000; ++i)
+				tasks.push_back(t(pool, s, inside, count));
+			auto r = sync_wait(when_all_ready(std::move(tasks)));
+			for (auto& rr : r)
+				rr.result();
+			if (count != 1000 || s.running_in_this_thread())
+				throw MACORO_RTE_LOC;
+
+			// a single producer is resumed in the order it was queued.
+			auto q = [](strand<>& s, std::size_t i, std::vector<std::size_t>& order) -> task<>
+			{
+				MC_BEGIN(task<>, &s, i, &order);
+				MC_AWAIT(s.schedule());
+				order.push_back(i);
+				MC_END();
+			};
+			std::vector<std::size_t> order;
+			std::vector<eager_task<>> eager;
+			for (std::size_t i = 0; i < 1000; ++i)
+				eager.push_back(make_eager(q(s, i, order)));
+			for (auto& e : eager)
+				sync_wait(e);
+			for (std::size_t i = 0; i < order.size(); ++i)
+				if (order[i] != i)
+					throw MACORO_RTE_LOC;
+			if (order.size() != 1000)
+				throw MACORO_RTE_LOC;
+		}
+
+		void strand_dispatch_test()
+		{
+			thread_pool pool;
+			auto w = pool.make_work();
+			pool.create_threads(2);
+			strand<> s(pool);
+
+			auto t = [](strand<>& s, std::string& log) -> task<>
+			{
+				MC_BEGIN(task<>, &s, &log);
+
+				// not in the strand, so it is queued.
+				MC_AWAIT(s.dispatch());
+				if (!s.running_in_this_thread())
+					throw MACORO_RTE_LOC;
+				log += "a";
+
+				// already in the strand, continues inline.
+				MC_AWAIT(s.dispatch());
+				log += "b";
+				MC_END();
+			};
+
+			auto other = [](strand<>& s, std::string& log) -> task<>
+			{
+				MC_BEGIN(task<>, &s, &log);
+				MC_AWAIT(s.schedule());
+				log += "c";
+				MC_END();
+			};
+
+			// other is queued behind t and so runs after both its steps.
+			std::string log;
+			auto r = sync_wait(when_all_ready(t(s, log), other(s, log)));
+			std::get<0>(r).result();
+			std::get<1>(r).result();
+			if (log != "abc")
+				throw MACORO_RTE_LOC;
+		}
+
+		void strand_destroy_test()
+		{
+			thread_pool pool;
+			auto w = pool.make_work();
+			pool.create_threads(1);
+
+			// the last coroutine of the strand destroys it, like the state
+			// of a connection that is closed.
+			auto t = [](std::unique_ptr<strand<>>& s) -> task<>
+			{
+				MC_BEGIN(task<>, &s);
+				MC_AWAIT(s->schedule());
+				if (!s->running_in_this_thread())
+					throw MACORO_RTE_LOC;
+				s.reset();
+				MC_END();
+			};
+
+			std::unique_ptr<strand<>> s(new strand<>(pool));
+			sync_wait(t(s));
+			if (s)
+				throw MACORO_RTE_LOC;
+		}
+
+		void strand_budget_test()
+		{
+			// queue everything before the pool has a thread.
+			thread_pool pool;
+			auto w = pool.make_work();
+			strand<> s(pool, 2);
+
+			auto q = [](strand<>& s, char c, std::string& log) -> task<>
+			{
+				MC_BEGIN(task<>, &s, c, &log);
+				MC_AWAIT(s.schedule());
+				log += c;
+				MC_END();
+			};
+			auto p = [](thread_pool& pool, std::string& log) -> task<>
+			{
+				MC_BEGIN(task<>, &pool, &log);
+				MC_AWAIT(pool.schedule());
+				log += 'p';
+				MC_END();
+			};
+
+			// after two coroutines the strand goes to the back of the
+			// pool's queue.
+			std::string log;
+			std::vector<eager_task<>> eager;
+			for (char c : std::string("abcd"))
+				eager.push_back(make_eager(q(s, c, log)));
+			eager.push_back(make_eager(p(pool, log)));
+			pool.create_threads(1);
+			for (auto& e : eager)
+				sync_wait(e);
+			if (log != "abpcd")
+				throw MACORO_RTE_LOC;
+		}
+	}
+}
@@ -0,0 +1,14 @@
+#pragma once
+#include "tests.h"
+
+
+namespace macoro
+{
+	namespace tests
+	{
+		void strand_test();
+		void strand_dispatch_test();
+		void strand_destroy_test();
+		void strand_budget_test();
+	}
+}
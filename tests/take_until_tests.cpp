@@ -42,11 +42,13 @@ namespace macoro
 		task<void> use(thread_pool& ex, bool wait)
 		{
 			MC_BEGIN(task<>, &ex, wait
-				, to = timeout(ex, wait ? 10ms : 100000ms)
+				, to = timeout{}
 				, i = int{}
 			);
 
+			// started after begin so that the time is measured from it.
 			begin = steady_clock::now();
+			to.reset(ex, wait ? 10ms : 100000ms);
 			MC_AWAIT_SET(i, take_until(makeTask(ex, to.get_source(), wait), std::move(to)));
 			end = steady_clock::now();
 
@@ -151,6 +153,77 @@ namespace macoro
 
 
 
+		void timeout_timer_test()
+		{
+			thread_pool s;
+			auto w = s.make_work();
+			s.create_thread();
+
+			// the timer fires request_stop() on the pool thread, which
+			// resumes the awaiter, which destroys the timeout.
+			std::unique_ptr<timeout> to(new timeout(s, milliseconds(1)));
+			if (to->mTask.handle())
+				throw MACORO_RTE_LOC;
+
+			auto t = [](std::unique_ptr<timeout>& to) -> task<>
+			{
+				MC_BEGIN(task<>, &to);
+				MC_AWAIT(*to);
+				to.reset();
+				MC_END();
+			}(to);
+			sync_wait(t);
+			if (to)
+				throw MACORO_RTE_LOC;
+
+			// an external stop removes the timer so join() does not wait
+			// for the deadline.
+			auto b = steady_clock::now();
+			{
+				timeout to2(s, hours(1));
+				to2.request_stop();
+				sync_wait(to2);
+			}
+
+			w = {};
+			s.join();
+			if (steady_clock::now() - b > seconds(10))
+				throw MACORO_RTE_LOC;
+		}
+
+		namespace
+		{
+			// a scheduler without add_timer().
+			struct no_timer_scheduler
+			{
+				thread_pool& mPool;
+
+				template<typename Rep, typename Per>
+				auto schedule_after(std::chrono::duration<Rep, Per> d, stop_token token)
+				{
+					return mPool.schedule_after(d, std::move(token));
+				}
+			};
+		}
+
+		void timeout_fallback_test()
+		{
+			thread_pool s;
+			auto w = s.make_work();
+			s.create_thread();
+			no_timer_scheduler ns{ s };
+
+			timeout to(ns, milliseconds(1));
+			if (!to.mTask.handle())
+				throw MACORO_RTE_LOC;
+			sync_wait(to);
+			if (!to.get_token().stop_requested())
+				throw MACORO_RTE_LOC;
+
+			w = {};
+			s.join();
+		}
+
 		void take_until_tests()
 		{
 			timeout_test();
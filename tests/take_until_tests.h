@@ -8,6 +8,8 @@ namespace macoro
 		void schedule_after();
 		void schedule_after_cancaled();
 		void take_until_tests();
+		void timeout_timer_test();
+		void timeout_fallback_test();
 
 	}
 }
\ No newline at end of file
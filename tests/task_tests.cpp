@@ -1,7 +1,9 @@
+#include "task_tests.h"
 #include "macoro/task.h"
 #include <iostream>
 #include "macoro/sync_wait.h"
 #include "macoro/stop.h"
+#include "macoro/thread_pool.h"
 #include <chrono>
 #include <thread>
 namespace
@@ -21,6 +23,62 @@ namespace
 		MC_RETURN(42);
 		MC_END();
 	}
+
+	// each task awaits the next, n deep. Every await and every
+	// completion is a symmetric transfer.
+	macoro::task<> chain14(std::size_t n, std::size_t& depth)
+	{
+		MC_BEGIN(macoro::task<>, n, &depth);
+		if (n)
+		{
+			MC_AWAIT(chain14(n - 1, depth));
+		}
+		++depth;
+		MC_END();
+	}
+
+#ifdef MACORO_CPP_20
+	macoro::task<> chain20(std::size_t n, std::size_t& depth)
+	{
+		if (n)
+			co_await chain20(n - 1, depth);
+		++depth;
+	}
+
+	// alternates between std and macoro coroutines.
+	macoro::task<> chainMixed14(std::size_t n, std::size_t& depth);
+	macoro::task<> chainMixed20(std::size_t n, std::size_t& depth)
+	{
+		if (n)
+			co_await chainMixed14(n - 1, depth);
+		++depth;
+	}
+
+	macoro::task<> chainMixed14(std::size_t n, std::size_t& depth)
+	{
+		MC_BEGIN(macoro::task<>, n, &depth);
+		if (n)
+		{
+			MC_AWAIT(chainMixed20(n - 1, depth));
+		}
+		++depth;
+		MC_END();
+	}
+#endif
+
+	// returns the time per level in nanoseconds.
+	template<typename Chain>
+	double run_chain(Chain chain, std::size_t n)
+	{
+		std::size_t depth = 0;
+		auto begin = std::chrono::steady_clock::now();
+		macoro::sync_wait(chain(n, depth));
+		auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now() - begin).count();
+		if (depth != n + 1)
+			throw MACORO_RTE_LOC;
+		return double(ns) / n;
+	}
 }
 
 namespace macoro
@@ -479,6 +537,81 @@ namespace macoro
 
 			//std::cout << "passed" << std::endl;
 		}
+
+		namespace
+		{
+			task<std::size_t> identity(thread_pool* pool, std::size_t i)
+			{
+				MC_BEGIN(task<std::size_t>, pool, i);
+				if (pool)
+				{
+					MC_AWAIT(pool->schedule());
+				}
+				MC_RETURN(i);
+				MC_END();
+			}
+		}
+
+		void task_blocking_thread_test()
+		{
+			// completes on a worker while the caller may or may not have
+			// gone to sleep yet. The frame is destroyed right after.
+			thread_pool pool;
+			auto w = pool.make_work();
+			pool.create_threads(2);
+			for (std::size_t i = 0; i < 10000; ++i)
+			{
+				if (sync_wait(identity(&pool, i)) != i)
+					throw MACORO_RTE_LOC;
+			}
+		}
+
+		void task_sync_wait_bench(const CLP& cmd)
+		{
+			if (!cmd.isSet("bench"))
+				throw UnitTestSkipped("pass -bench to run.");
+
+			auto run = [](thread_pool* pool, std::size_t n) {
+				auto begin = std::chrono::steady_clock::now();
+				for (std::size_t i = 0; i < n; ++i)
+					if (sync_wait(identity(pool, i)) != i)
+						throw MACORO_RTE_LOC;
+				auto end = std::chrono::steady_clock::now();
+				return double(std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count()) / n;
+			};
+
+			thread_pool pool;
+			auto w = pool.make_work();
+			pool.create_threads(1);
+			std::cout << "\n  inline " << run(nullptr, 1000000) << " ns/call";
+			std::cout << "\n  pool   " << run(&pool, 100000) << " ns/call ";
+		}
+
+		void task_deep_chain_test()
+		{
+			// deep enough to overflow the stack if the transfers recursed.
+			std::size_t n = 100000;
+			run_chain(chain14, n);
+#ifdef MACORO_CPP_20
+			// the std transfers are only tail calls in optimized builds.
+			run_chain(chainMixed20, 1000);
+			run_chain(chainMixed14, 1000);
+#endif
+		}
+
+		void task_deep_chain_bench(const CLP& cmd)
+		{
+			if (!cmd.isSet("bench"))
+				throw UnitTestSkipped("pass -bench to run.");
+
+			std::size_t n = 1000000;
+			std::cout << "\n  macoro " << run_chain(chain14, n) << " ns/level";
+#ifdef MACORO_CPP_20
+			std::cout << "\n  std    " << run_chain(chain20, n) << " ns/level";
+			std::cout << "\n  mixed  " << run_chain(chainMixed20, n) << " ns/level";
+#endif
+			std::cout << " ";
+		}
 	}
 
 }
\ No newline at end of file
@@ -1,5 +1,5 @@
 #pragma once
-
+#include "tests.h"
 
 namespace macoro
 {
@@ -16,6 +16,10 @@ namespace macoro
 		void task_blocking_move_test();
 		void task_blocking_ex_test();
 		void task_blocking_cancel_test();
+		void task_blocking_thread_test();
+		void task_sync_wait_bench(const CLP& cmd);
+		void task_deep_chain_test();
+		void task_deep_chain_bench(const CLP& cmd);
 
 	}
 }
\ No newline at end of file
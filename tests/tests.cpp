@@ -9,6 +9,19 @@
 #include "sequence_tests.h"
 #include "channel_spsc_tests.h"
 #include "channel_mpsc_tests.h"
+#include "stop_tests.h"
+#include "deadline_tests.h"
+#include "io_service_tests.h"
+#include "io_uring_tests.h"
+#include "async_file_tests.h"
+#include "thread_pool_tests.h"
+#include "numa_tests.h"
+#include "run_blocking_tests.h"
+#include "strand_tests.h"
+#include "any_scheduler_tests.h"
+#include "generator_tests.h"
+#include "shared_task_tests.h"
+#include "async_cache_tests.h"
 
 #ifdef _MSC_VER
 #include <windows.h>
@@ -291,11 +304,17 @@ namespace macoro
 		t.add("task_blocking_move_test            ", task_blocking_move_test);
 		t.add("task_blocking_ex_test              ", task_blocking_ex_test);
 		t.add("task_blocking_cancel_test          ", task_blocking_cancel_test);
+		t.add("task_blocking_thread_test          ", task_blocking_thread_test);
+		t.add("task_sync_wait_bench               ", task_sync_wait_bench);
+		t.add("task_deep_chain_test               ", task_deep_chain_test);
+		t.add("task_deep_chain_bench              ", task_deep_chain_bench);
 
 		//t.add("when_all_basic_tests               ", when_all_basic_tests);
 		t.add("schedule_after_test                ", schedule_after);
 		t.add("take_until_tests                   ", take_until_tests);
 		t.add("schedule_after_cancaled            ", schedule_after_cancaled);
+		t.add("timeout_timer_test                 ", timeout_timer_test);
+		t.add("timeout_fallback_test              ", timeout_fallback_test);
 		t.add("result_basic_store_test            ", result_basic_store_test);
 		t.add("result_co_await_test               ", result_co_await_test);
 		t.add("result_task_wrap_test              ", result_task_wrap_test);
@@ -328,6 +347,74 @@ namespace macoro
 		t.add("spsc_channel_ex_test               ", spsc_channel_ex_test);
 		t.add("mpsc_channel_test                  ", mpsc_channel_test);
 		t.add("mpsc_channel_ex_test               ", mpsc_channel_ex_test);
+		t.add("stop_callback_inline_test          ", stop_callback_inline_test);
+		t.add("stop_callback_overflow_test        ", stop_callback_overflow_test);
+		t.add("stop_state_pool_test               ", stop_state_pool_test);
+		t.add("optional_stop_callback_test        ", optional_stop_callback_test);
+		t.add("timeout_move_test                  ", timeout_move_test);
+		t.add("local_stop_callback_test           ", local_stop_callback_test);
+		t.add("local_stop_schedule_after_test     ", local_stop_schedule_after_test);
+		t.add("stop_deregister_wait_test          ", stop_deregister_wait_test);
+		t.add("stop_deregister_bench              ", stop_deregister_bench);
+		t.add("deadline_inherit_test              ", deadline_inherit_test);
+		t.add("deadline_nested_test               ", deadline_nested_test);
+		t.add("deadline_schedule_after_test       ", deadline_schedule_after_test);
+		t.add("deadline_cancel_test               ", deadline_cancel_test);
+		t.add("io_service_echo_test               ", io_service_echo_test);
+		t.add("io_service_pool_echo_test          ", io_service_pool_echo_test);
+		t.add("io_service_busy_pool_test          ", io_service_busy_pool_test);
+		t.add("io_service_echo_bench              ", io_service_echo_bench);
+		t.add("io_uring_file_test                 ", io_uring_file_test);
+		t.add("io_uring_socket_test               ", io_uring_socket_test);
+		t.add("io_uring_cancel_test               ", io_uring_cancel_test);
+		t.add("io_uring_busy_pool_test            ", io_uring_busy_pool_test);
+		t.add("io_uring_full_ring_test            ", io_uring_full_ring_test);
+		t.add("async_file_test                    ", async_file_test);
+		t.add("file_stream_test                   ", file_stream_test);
+		t.add("file_stream_bench                  ", file_stream_bench);
+		t.add("thread_pool_ping_pong_test         ", thread_pool_ping_pong_test);
+		t.add("thread_pool_ping_pong_bench        ", thread_pool_ping_pong_bench);
+		t.add("thread_pool_post_batch_test        ", thread_pool_post_batch_test);
+		t.add("thread_pool_schedule_n_test        ", thread_pool_schedule_n_test);
+		t.add("thread_pool_fan_out_bench          ", thread_pool_fan_out_bench);
+		t.add("thread_pool_priority_test          ", thread_pool_priority_test);
+		t.add("thread_pool_priority_bench         ", thread_pool_priority_bench);
+		t.add("thread_pool_delay_fairness_test    ", thread_pool_delay_fairness_test);
+		t.add("thread_pool_timer_load_bench       ", thread_pool_timer_load_bench);
+		t.add("thread_pool_elastic_test           ", thread_pool_elastic_test);
+		t.add("thread_pool_lifo_test              ", thread_pool_lifo_test);
+		t.add("thread_pool_lifo_block_test        ", thread_pool_lifo_block_test);
+		t.add("thread_pool_lifo_bench             ", thread_pool_lifo_bench);
+		t.add("thread_pool_dispatch_budget_test   ", thread_pool_dispatch_budget_test);
+		t.add("thread_pool_run_until_test         ", thread_pool_run_until_test);
+		t.add("thread_pool_run_until_bench        ", thread_pool_run_until_bench);
+		t.add("numa_topology_test                 ", numa_topology_test);
+		t.add("numa_thread_pool_test              ", numa_thread_pool_test);
+		t.add("numa_steal_test                    ", numa_steal_test);
+		t.add("frame_arena_test                   ", frame_arena_test);
+		t.add("frame_arena_bench                  ", frame_arena_bench);
+		t.add("run_blocking_test                  ", run_blocking_test);
+		t.add("run_blocking_cancel_test           ", run_blocking_cancel_test);
+		t.add("strand_test                        ", strand_test);
+		t.add("strand_dispatch_test               ", strand_dispatch_test);
+		t.add("strand_destroy_test                ", strand_destroy_test);
+		t.add("strand_budget_test                 ", strand_budget_test);
+		t.add("any_scheduler_test                 ", any_scheduler_test);
+		t.add("any_scheduler_bench                ", any_scheduler_bench);
+		t.add("generator_test                     ", generator_test);
+		t.add("generator_ex_test                  ", generator_ex_test);
+		t.add("async_generator_test               ", async_generator_test);
+		t.add("generator_bench                    ", generator_bench);
+		t.add("shared_task_test                   ", shared_task_test);
+		t.add("shared_task_concurrent_test        ", shared_task_concurrent_test);
+		t.add("shared_task_ex_test                ", shared_task_ex_test);
+		t.add("shared_task_lifetime_test          ", shared_task_lifetime_test);
+		t.add("async_cache_test                   ", async_cache_test);
+		t.add("async_cache_lru_test               ", async_cache_lru_test);
+		t.add("async_cache_pending_test           ", async_cache_pending_test);
+		t.add("async_cache_ex_test                ", async_cache_ex_test);
+		t.add("async_cache_cancel_test            ", async_cache_cancel_test);
+		t.add("async_cache_concurrent_test        ", async_cache_concurrent_test);
 		
 		});
 }
\ No newline at end of file
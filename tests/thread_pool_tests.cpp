@@ -0,0 +1,868 @@
+#include "thread_pool_tests.h"
+#include "macoro/thread_pool.h"
+#include "macoro/task.h"
+#include "macoro/sync_wait.h"
+#include "macoro/when_all.h"
+#include "macoro/start_on.h"
+#include "macoro/manual_reset_event.h"
+#include "macoro/macros.h"
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+
+namespace macoro
+{
+	namespace tests
+	{
+		namespace
+		{
+			// hops back and forth between two single threaded pools. Every
+			// hop wakes the other pool's idle worker.
+			task<> ping_pong(thread_pool& a, thread_pool& b, std::size_t n)
+			{
+				MC_BEGIN(task<>, &a, &b, n
+					, i = std::size_t{});
+				for (i = 0; i < n; ++i)
+				{
+					MC_AWAIT(a.schedule());
+					MC_AWAIT(b.schedule());
+				}
+				MC_END();
+			}
+
+			// returns the average round trip in nanoseconds.
+			double run_ping_pong(std::size_t n, std::size_t spin)
+			{
+				thread_pool a, b;
+				a.set_spin_count(spin);
+				b.set_spin_count(spin);
+				auto wa = a.make_work();
+				auto wb = b.make_work();
+				a.create_thread();
+				b.create_thread();
+
+				auto begin = std::chrono::steady_clock::now();
+				sync_wait(ping_pong(a, b, n));
+				auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+					std::chrono::steady_clock::now() - begin).count();
+				return double(ns) / n;
+			}
+
+			// moves onto the pool and counts the tasks that made it.
+			template<typename Scheduler>
+			task<> fan_out_task(Scheduler& s, thread_pool& p, std::atomic<std::size_t>& count)
+			{
+				MC_BEGIN(task<>, &s, &p, &count);
+				MC_AWAIT(s);
+				if (p.mState.get() != detail::thread_pool_state::mCurrentExecutor)
+					throw MACORO_RTE_LOC;
+				++count;
+				MC_END();
+			}
+
+			// returns nanoseconds per task.
+			template<typename MakeScheduler>
+			double run_fan_out(thread_pool& p, std::size_t n, MakeScheduler make)
+			{
+				std::atomic<std::size_t> count(0);
+				auto s = make(n);
+				std::vector<task<>> tasks;
+				tasks.reserve(n);
+				for (std::size_t i = 0; i < n; ++i)
+					tasks.push_back(fan_out_task(s, p, count));
+
+				auto begin = std::chrono::steady_clock::now();
+				auto r = sync_wait(when_all_ready(std::move(tasks)));
+				auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+					std::chrono::steady_clock::now() - begin).count();
+
+				for (auto& t : r)
+					t.result();
+				if (count != n)
+					throw MACORO_RTE_LOC;
+				return double(ns) / n;
+			}
+
+			// records the order in which the pool resumes it.
+			eager_task<> record(thread_pool& p, priority prio, std::size_t id, std::vector<std::size_t>& order)
+			{
+				MC_BEGIN(eager_task<>, &p, prio, id, &order);
+				MC_AWAIT(p.schedule(prio));
+				if (thread_pool::current_priority() != prio)
+					throw MACORO_RTE_LOC;
+				order.push_back(id);
+				MC_END();
+			}
+
+			// keeps rescheduling itself at high priority until done is set.
+			eager_task<> reschedule(thread_pool& p, std::atomic<bool>& done, std::size_t& count)
+			{
+				MC_BEGIN(eager_task<>, &p, &done, &count);
+				for (count = 0; !done; ++count)
+					MC_AWAIT(p.schedule(priority::high));
+				MC_END();
+			}
+
+			eager_task<> snapshot(thread_pool& p, std::atomic<bool>& done, std::size_t& count, std::size_t& seen)
+			{
+				MC_BEGIN(eager_task<>, &p, &done, &count, &seen);
+				MC_AWAIT(p.schedule(priority::low));
+				seen = count;
+				done = true;
+				MC_END();
+			}
+
+			task<> child(thread_pool& p, priority& prio)
+			{
+				MC_BEGIN(task<>, &p, &prio);
+				MC_AWAIT(p.schedule());
+				prio = thread_pool::current_priority();
+				MC_END();
+			}
+
+			task<> parent(thread_pool& p, priority& inherited, priority& startedOn)
+			{
+				MC_BEGIN(task<>, &p, &inherited, &startedOn);
+				MC_AWAIT(p.schedule(priority::low));
+				MC_AWAIT(child(p, inherited));
+				MC_AWAIT(start_on(p, child(p, startedOn)));
+				MC_END();
+			}
+
+			// keeps rescheduling itself with a zero delay until done is set.
+			eager_task<> reschedule_after(thread_pool& p, std::atomic<bool>& done, std::atomic<std::size_t>& count)
+			{
+				MC_BEGIN(eager_task<>, &p, &done, &count);
+				for (count = 0; !done && count < 100000; ++count)
+					MC_AWAIT(p.schedule_after(std::chrono::seconds(0)));
+				MC_END();
+			}
+
+			eager_task<> snapshot_now(thread_pool& p, std::atomic<bool>& done, std::atomic<std::size_t>& count, std::size_t& seen)
+			{
+				MC_BEGIN(eager_task<>, &p, &done, &count, &seen);
+				MC_AWAIT(p.schedule());
+				seen = count;
+				done = true;
+				MC_END();
+			}
+
+			struct counting_timer : detail::timer_node
+			{
+				std::atomic<bool>* mDone;
+				std::atomic<std::size_t>* mCount;
+				std::size_t mSeen = ~std::size_t(0);
+			};
+
+			// keeps rescheduling itself until done is set.
+			eager_task<> reschedule_now(thread_pool& p, std::atomic<bool>& done, std::atomic<std::size_t>& count)
+			{
+				MC_BEGIN(eager_task<>, &p, &done, &count);
+				for (count = 0; !done && count < 10000000; ++count)
+					MC_AWAIT(p.schedule());
+				MC_END();
+			}
+
+			// occupies a worker like a call into blocking code would.
+			eager_task<> block_worker(thread_pool& p, std::atomic<std::size_t>& blocked, std::atomic<bool>& release)
+			{
+				MC_BEGIN(eager_task<>, &p, &blocked, &release);
+				MC_AWAIT(p.schedule());
+				++blocked;
+				while (!release)
+					std::this_thread::sleep_for(std::chrono::milliseconds(1));
+				MC_END();
+			}
+
+			template<typename Pred>
+			bool wait_for(Pred pred, std::chrono::milliseconds timeout)
+			{
+				auto end = std::chrono::steady_clock::now() + timeout;
+				while (!pred())
+				{
+					if (std::chrono::steady_clock::now() > end)
+						return false;
+					std::this_thread::sleep_for(std::chrono::milliseconds(1));
+				}
+				return true;
+			}
+
+			// the average lag in microseconds.
+			double micros(const scheduling_lag& l)
+			{
+				return std::chrono::duration<double, std::micro>(l.mean()).count();
+			}
+
+			// a bulk job that occupies a worker for about 1us.
+			eager_task<> bulk_job(thread_pool& p)
+			{
+				MC_BEGIN(eager_task<>, &p
+					, end = std::chrono::steady_clock::time_point{});
+				MC_AWAIT(p.schedule(priority::normal));
+				end = std::chrono::steady_clock::now() + std::chrono::microseconds(1);
+				while (std::chrono::steady_clock::now() < end)
+					;
+				MC_END();
+			}
+
+			// returns how long it takes, in nanoseconds, to get onto the
+			// pool at prio while it has a backlog of bulk jobs.
+			double run_behind_bulk(thread_pool& p, std::size_t bulk, priority prio)
+			{
+				std::vector<eager_task<>> jobs;
+				jobs.reserve(bulk);
+				for (std::size_t i = 0; i < bulk; ++i)
+					jobs.push_back(bulk_job(p));
+
+				auto begin = std::chrono::steady_clock::now();
+				sync_wait(p.schedule(prio));
+				auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+					std::chrono::steady_clock::now() - begin).count();
+
+				for (auto& j : jobs)
+					sync_wait(j);
+				return double(ns);
+			}
+
+			// one hop of a relay. Waits to be posted, then posts the next.
+			eager_task<> hop(thread_pool& p, std::vector<eager_task<>>& hops, std::size_t i, std::string& log)
+			{
+				MC_BEGIN(eager_task<>, &p, &hops, i, &log);
+				MC_AWAIT(suspend_always{});
+				log += 'r';
+				if (i + 1 < hops.size())
+					p.post_next(hops[i + 1].handle());
+				MC_END();
+			}
+
+			// keeps the queue busy until done is set.
+			eager_task<> load(thread_pool& p, std::atomic<bool>& done)
+			{
+				MC_BEGIN(eager_task<>, &p, &done);
+				while (!done)
+					MC_AWAIT(p.schedule());
+				MC_END();
+			}
+
+			// returns nanoseconds per hop of a relay through a pool that
+			// also has jobs coroutines requeueing themselves.
+			double run_relay(std::size_t n, std::size_t jobs, std::size_t budget)
+			{
+				thread_pool p;
+				auto w = p.make_work();
+				p.set_lifo_budget(budget);
+				p.create_threads(2);
+
+				std::string log;
+				std::vector<eager_task<>> hops;
+				hops.reserve(n);
+				for (std::size_t i = 0; i < n; ++i)
+					hops.push_back(hop(p, hops, i, log));
+
+				std::atomic<bool> done(false);
+				std::vector<eager_task<>> background;
+				for (std::size_t i = 0; i < jobs; ++i)
+					background.push_back(load(p, done));
+
+				auto begin = std::chrono::steady_clock::now();
+				p.post(hops[0].handle());
+				sync_wait(hops.back());
+				auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+					std::chrono::steady_clock::now() - begin).count();
+
+				done = true;
+				for (auto& b : background)
+					sync_wait(b);
+				for (auto& h : hops)
+					sync_wait(h);
+				return double(ns) / n;
+			}
+		}
+
+		void thread_pool_ping_pong_test()
+		{
+			run_ping_pong(1000, 0);
+			run_ping_pong(1000, 1000);
+
+			// the workers of a pool are parked when work arrives.
+			thread_pool p;
+			auto w = p.make_work();
+			p.create_threads(4);
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			for (std::size_t i = 0; i < 100; ++i)
+				sync_wait(p.schedule());
+
+			// timers still fire while workers are parked.
+			auto begin = std::chrono::steady_clock::now();
+			sync_wait(p.schedule_after(std::chrono::milliseconds(5)));
+			if (std::chrono::steady_clock::now() - begin < std::chrono::milliseconds(5))
+				throw MACORO_RTE_LOC;
+		}
+
+		void thread_pool_ping_pong_bench(const CLP& cmd)
+		{
+			if (!cmd.isSet("bench"))
+				throw UnitTestSkipped("pass -bench to run.");
+
+			auto n = cmd.getOr<std::size_t>("n", 100000);
+			auto spin = cmd.getOr<std::size_t>("spin", 4000);
+
+			std::cout << "\n  park      " << run_ping_pong(n, 0) << " ns/round trip";
+			std::cout << "\n  spin " << spin << " " << run_ping_pong(n, spin) << " ns/round trip ";
+		}
+
+		void thread_pool_post_batch_test()
+		{
+			thread_pool p;
+			auto w = p.make_work();
+			p.create_threads(4);
+
+			std::atomic<std::size_t> count(0);
+			auto fn = [](thread_pool& p, std::atomic<std::size_t>& count) -> eager_task<>
+			{
+				MC_BEGIN(eager_task<>, &p, &count);
+				MC_AWAIT(suspend_always{});
+				++count;
+				MC_END();
+			};
+
+			// the coroutines are suspended at suspend_always and the
+			// handles are taken from the frames.
+			std::vector<eager_task<>> tasks;
+			std::vector<coroutine_handle<>> handles;
+			for (std::size_t i = 0; i < 100; ++i)
+			{
+				tasks.push_back(fn(p, count));
+				handles.push_back(tasks.back().handle());
+			}
+
+			p.post_batch(handles);
+			p.post_batch(handles.data(), 0);
+			for (auto& t : tasks)
+				sync_wait(t);
+			if (count != tasks.size())
+				throw MACORO_RTE_LOC;
+		}
+
+		void thread_pool_schedule_n_test()
+		{
+			thread_pool p;
+			auto w = p.make_work();
+			p.create_threads(4);
+
+			for (std::size_t n : { 1, 2, 100 })
+			{
+				run_fan_out(p, n, [&](std::size_t n) { return p.schedule_n(n); });
+			}
+		}
+
+		void thread_pool_fan_out_bench(const CLP& cmd)
+		{
+			if (!cmd.isSet("bench"))
+				throw UnitTestSkipped("pass -bench to run.");
+
+			auto n = cmd.getOr<std::size_t>("n", 100000);
+			auto threads = cmd.getOr<std::size_t>("threads", 4);
+
+			thread_pool p;
+			auto w = p.make_work();
+			p.create_threads(threads);
+
+			auto post = run_fan_out(p, n, [&](std::size_t) { return p.schedule(); });
+			auto batch = run_fan_out(p, n, [&](std::size_t n) { return p.schedule_n(n); });
+			std::cout << "\n  schedule   " << post << " ns/task";
+			std::cout << "\n  schedule_n " << batch << " ns/task ";
+		}
+	
+		void thread_pool_priority_test()
+		{
+			// queued before there is a worker so the order is known.
+			{
+				thread_pool p;
+				auto w = p.make_work();
+				std::vector<std::size_t> order;
+				std::vector<eager_task<>> tasks;
+				priority prios[] = { priority::low, priority::normal, priority::high };
+				for (std::size_t i = 0; i < 6; ++i)
+					tasks.push_back(record(p, prios[i % 3], i, order));
+
+				p.create_thread();
+				for (auto& t : tasks)
+					sync_wait(t);
+				if (order != std::vector<std::size_t>{ 2, 5, 1, 4, 0, 3 })
+					throw MACORO_RTE_LOC;
+			}
+
+			// a low priority task is not starved by a stream of high
+			// priority work, and runs first without aging.
+			for (auto aging : { 0, 5 })
+			{
+				thread_pool p;
+				p.set_aging(std::chrono::milliseconds(aging));
+				auto w = p.make_work();
+				std::atomic<bool> done(false);
+				std::size_t count = 0, seen = ~std::size_t(0);
+				auto low = snapshot(p, done, count, seen);
+				auto high = reschedule(p, done, count);
+
+				auto begin = std::chrono::steady_clock::now();
+				p.create_thread();
+				sync_wait(low);
+				sync_wait(high);
+				auto waited = std::chrono::steady_clock::now() - begin;
+				if (aging == 0 && seen != 0)
+					throw MACORO_RTE_LOC;
+				if (aging && (seen == 0 || waited < std::chrono::milliseconds(aging)))
+					throw MACORO_RTE_LOC;
+			}
+
+			// an awaited task moves to the pool at its parent's priority.
+			{
+				thread_pool p;
+				auto w = p.make_work();
+				p.create_threads(2);
+
+				priority inherited = priority::inherit, startedOn = priority::inherit;
+				sync_wait(parent(p, inherited, startedOn));
+				if (inherited != priority::low || startedOn != priority::low)
+					throw MACORO_RTE_LOC;
+
+				// from outside the pool inherit means normal.
+				sync_wait(child(p, inherited));
+				if (inherited != priority::normal)
+					throw MACORO_RTE_LOC;
+			}
+		}
+
+		void thread_pool_priority_bench(const CLP& cmd)
+		{
+			if (!cmd.isSet("bench"))
+				throw UnitTestSkipped("pass -bench to run.");
+
+			auto bulk = cmd.getOr<std::size_t>("bulk", 10000);
+			auto threads = cmd.getOr<std::size_t>("threads", 4);
+
+			thread_pool p;
+			auto w = p.make_work();
+			p.create_threads(threads);
+
+			auto normal = run_behind_bulk(p, bulk, priority::normal);
+			auto high = run_behind_bulk(p, bulk, priority::high);
+			std::cout << "\n  normal " << normal / 1000 << " us behind " << bulk << " jobs";
+			std::cout << "\n  high   " << high / 1000 << " us behind " << bulk << " jobs ";
+		}
+	
+		void thread_pool_delay_fairness_test()
+		{
+			// delayed work that keeps expiring does not starve work that
+			// is posted after it.
+			{
+				thread_pool p;
+				auto w = p.make_work();
+				std::atomic<bool> done(false);
+				std::atomic<std::size_t> count(0);
+				std::size_t seen = ~std::size_t(0);
+				auto delayed = reschedule_after(p, done, count);
+				p.create_thread();
+				while (count < 10)
+					std::this_thread::yield();
+
+				auto now = snapshot_now(p, done, count, seen);
+				sync_wait(now);
+				sync_wait(delayed);
+				if (seen > count || count - seen > 3 || count == 100000)
+					throw MACORO_RTE_LOC;
+			}
+
+			// and an expired timer takes turns with a stream of posted work.
+			{
+				thread_pool p;
+				auto w = p.make_work();
+				std::atomic<bool> done(false);
+				std::atomic<std::size_t> count(0);
+				counting_timer t;
+				t.mDone = &done;
+				t.mCount = &count;
+				t.mCallback = [](detail::timer_node* n) {
+					auto t = static_cast<counting_timer*>(n);
+					t->mSeen = *t->mCount;
+					*t->mDone = true;
+				};
+
+				auto now = reschedule_now(p, done, count);
+				p.create_thread();
+				while (count < 10)
+					std::this_thread::yield();
+				t.mDeadline = detail::timer_node::clock::now();
+				p.add_timer(t);
+				sync_wait(now);
+
+				if (t.mSeen == ~std::size_t(0) || count - t.mSeen > 3 || count == 10000000)
+					throw MACORO_RTE_LOC;
+
+				auto lag = p.lag();
+				if (lag.immediate.count < count || lag.delayed.count != 1 ||
+					lag.immediate.max < lag.immediate.mean())
+					throw MACORO_RTE_LOC;
+				p.reset_lag();
+				if (p.lag().immediate.count)
+					throw MACORO_RTE_LOC;
+			}
+		}
+
+		void thread_pool_timer_load_bench(const CLP& cmd)
+		{
+			if (!cmd.isSet("bench"))
+				throw UnitTestSkipped("pass -bench to run.");
+
+			auto timers = cmd.getOr<std::size_t>("timers", 100);
+			auto n = cmd.getOr<std::size_t>("n", 1000);
+			auto threads = cmd.getOr<std::size_t>("threads", 4);
+
+			thread_pool p;
+			auto w = p.make_work();
+			p.create_threads(threads);
+
+			// coroutines that keep the delay heap full of expired ops.
+			std::atomic<bool> done(false);
+			std::vector<std::atomic<std::size_t>> counts(timers);
+			std::vector<eager_task<>> load;
+			for (std::size_t i = 0; i < timers; ++i)
+				load.push_back(reschedule_after(p, done, counts[i]));
+
+			p.reset_lag();
+			for (std::size_t i = 0; i < n; ++i)
+				sync_wait(p.schedule());
+			auto lag = p.lag();
+			done = true;
+			for (auto& l : load)
+				sync_wait(l);
+
+			std::cout << "\n  immediate " << micros(lag.immediate) << " us mean, "
+				<< std::chrono::duration<double, std::micro>(lag.immediate.max).count() << " us max";
+			std::cout << "\n  delayed   " << micros(lag.delayed) << " us mean, "
+				<< std::chrono::duration<double, std::micro>(lag.delayed.max).count() << " us max ";
+		}
+	
+		void thread_pool_elastic_test()
+		{
+			thread_pool p;
+			auto w = p.make_work();
+			thread_pool::elastic_options o;
+			o.min_threads = 1;
+			o.max_threads = 4;
+			o.spawn_lag = std::chrono::milliseconds(1);
+			o.idle_timeout = std::chrono::milliseconds(20);
+			p.make_elastic(o);
+			if (p.thread_count() != 1)
+				throw MACORO_RTE_LOC;
+
+			// every worker that blocks is replaced until max_threads.
+			std::atomic<std::size_t> blocked(0);
+			std::atomic<bool> release(false);
+			std::vector<eager_task<>> tasks;
+			for (std::size_t i = 0; i < 3; ++i)
+				tasks.push_back(block_worker(p, blocked, release));
+			if (!wait_for([&] { return blocked == 3; }, std::chrono::seconds(10)))
+				throw MACORO_RTE_LOC;
+
+			// the fourth worker runs everything else.
+			for (std::size_t i = 0; i < 10; ++i)
+				sync_wait(p.schedule());
+			if (p.thread_count() != 4)
+				throw MACORO_RTE_LOC;
+
+			// at max_threads a fifth blocking call waits for a worker to
+			// free up.
+			tasks.push_back(block_worker(p, blocked, release));
+			tasks.push_back(block_worker(p, blocked, release));
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			bool capped = p.thread_count() == 4 && blocked == 4;
+
+			release = true;
+			for (auto& t : tasks)
+				sync_wait(t);
+			if (!capped || blocked != 5)
+				throw MACORO_RTE_LOC;
+
+			// the idle workers retire down to min_threads.
+			if (!wait_for([&] { return p.thread_count() == 1; }, std::chrono::seconds(10)))
+				throw MACORO_RTE_LOC;
+			sync_wait(p.schedule());
+
+			w.reset();
+			p.join();
+			if (p.thread_count())
+				throw MACORO_RTE_LOC;
+		}
+
+		void thread_pool_lifo_test()
+		{
+			auto start = [](thread_pool& p, std::vector<eager_task<>>& hops) -> eager_task<>
+			{
+				MC_BEGIN(eager_task<>, &p, &hops);
+				MC_AWAIT(p.schedule());
+				p.post_next(hops[0].handle());
+				MC_END();
+			};
+			auto queued = [](thread_pool& p, std::string& log) -> eager_task<>
+			{
+				MC_BEGIN(eager_task<>, &p, &log);
+				MC_AWAIT(p.schedule());
+				log += 'q';
+				MC_END();
+			};
+
+			// the relay is started by a worker while two coroutines are
+			// queued. The hops jump the queue until the budget runs out.
+			for (std::size_t budget : { 0, 3 })
+			{
+				thread_pool p;
+				auto w = p.make_work();
+				p.set_lifo_budget(budget);
+
+				std::string log;
+				std::vector<eager_task<>> hops;
+				hops.reserve(5);
+				for (std::size_t i = 0; i < 5; ++i)
+					hops.push_back(hop(p, hops, i, log));
+
+				std::vector<eager_task<>> tasks;
+				tasks.push_back(start(p, hops));
+				tasks.push_back(queued(p, log));
+				tasks.push_back(queued(p, log));
+				p.create_threads(1);
+				for (auto& t : tasks)
+					sync_wait(t);
+				for (auto& h : hops)
+					sync_wait(h);
+
+				if (log != (budget ? "rrrqqrr" : "qqrrrrr"))
+					throw MACORO_RTE_LOC;
+			}
+		}
+
+		void thread_pool_lifo_block_test()
+		{
+			auto woken = [](async_manual_reset_event& ran) -> eager_task<>
+			{
+				MC_BEGIN(eager_task<>, &ran);
+				MC_AWAIT(suspend_always{});
+				ran.set();
+				MC_END();
+			};
+			auto poster = [](thread_pool& p, eager_task<>& w, async_manual_reset_event& ran) -> eager_task<>
+			{
+				MC_BEGIN(eager_task<>, &p, &w, &ran);
+				MC_AWAIT(p.schedule());
+				p.post_next(w.handle());
+				sync_wait(ran);
+				MC_END();
+			};
+
+			// the worker blocks on the coroutine it just posted to its
+			// slot. The slot is queued first so the other worker runs it.
+			for (int i = 0; i < 10; ++i)
+			{
+				thread_pool p;
+				auto work = p.make_work();
+				p.create_threads(2);
+
+				async_manual_reset_event ran;
+				auto w = woken(ran);
+				auto t = poster(p, w, ran);
+				sync_wait(t);
+				sync_wait(w);
+			}
+		}
+
+		void thread_pool_lifo_bench(const CLP& cmd)
+		{
+			if (!cmd.isSet("bench"))
+				throw UnitTestSkipped("pass -bench to run.");
+
+			auto n = cmd.getOr<std::size_t>("n", 10000);
+			auto jobs = cmd.getOr<std::size_t>("jobs", 64);
+			for (std::size_t budget : { 0, 16 })
+				std::cout << "\n  budget " << budget << " " << run_relay(n, jobs, budget) << " ns/hop ";
+		}
+
+		void thread_pool_dispatch_budget_test()
+		{
+			auto queued = [](thread_pool& p, std::string& log) -> eager_task<>
+			{
+				MC_BEGIN(eager_task<>, &p, &log);
+				MC_AWAIT(p.schedule());
+				log += 'q';
+				MC_END();
+			};
+			auto dispatcher = [](thread_pool& p, std::string& log, std::chrono::milliseconds spin) -> eager_task<>
+			{
+				MC_BEGIN(eager_task<>, &p, &log, spin
+					, i = 0
+					, end = std::chrono::steady_clock::time_point{});
+				MC_AWAIT(p.schedule());
+				for (i = 0; i < 10; ++i)
+				{
+					MC_AWAIT(p.dispatch());
+					log += 'd';
+					end = std::chrono::steady_clock::now() + spin;
+					while (std::chrono::steady_clock::now() < end)
+						;
+				}
+				MC_END();
+			};
+
+			// after four inline dispatches the fifth goes behind the
+			// queued coroutine.
+			{
+				thread_pool p;
+				auto w = p.make_work();
+				p.set_dispatch_budget(4);
+				std::string log;
+				auto d = dispatcher(p, log, std::chrono::milliseconds(0));
+				auto q = queued(p, log);
+				p.create_threads(1);
+				sync_wait(d);
+				sync_wait(q);
+				if (log != "ddddqdddddd")
+					throw MACORO_RTE_LOC;
+			}
+
+			// or once the time runs out.
+			{
+				thread_pool p;
+				auto w = p.make_work();
+				p.set_dispatch_budget(1000, std::chrono::milliseconds(20));
+				std::string log;
+				auto d = dispatcher(p, log, std::chrono::milliseconds(5));
+				auto q = queued(p, log);
+				p.create_threads(1);
+				sync_wait(d);
+				sync_wait(q);
+				auto pos = log.find('q');
+				if (pos == 0 || pos >= 10)
+					throw MACORO_RTE_LOC;
+			}
+		}
+			namespace
+		{
+			task<std::thread::id> scheduled_id(thread_pool& p)
+			{
+				MC_BEGIN(task<std::thread::id>, &p);
+				MC_AWAIT(p.schedule());
+				MC_AWAIT(p.schedule_after(std::chrono::milliseconds(1)));
+				MC_RETURN(std::this_thread::get_id());
+				MC_END();
+			}
+
+			task<std::thread::id> nested_sync_wait(thread_pool& p)
+			{
+				MC_BEGIN(task<std::thread::id>, &p);
+				MC_AWAIT(p.schedule());
+
+				// the only worker waits for work that is queued behind it.
+				MC_RETURN(sync_wait(p, scheduled_id(p)));
+				MC_END();
+			}
+
+			task<int> scheduled_throw(thread_pool& p)
+			{
+				MC_BEGIN(task<int>, &p);
+				MC_AWAIT(p.schedule());
+				throw std::runtime_error("scheduled_throw");
+				MC_END();
+			}
+		}
+
+		void thread_pool_run_until_test()
+		{
+			// a pool without threads is run by the caller.
+			{
+				thread_pool p;
+				if (sync_wait(p, scheduled_id(p)) != std::this_thread::get_id())
+					throw MACORO_RTE_LOC;
+
+				bool threw = false;
+				try { sync_wait(p, scheduled_throw(p)); }
+				catch (std::runtime_error&) { threw = true; }
+				if (!threw)
+					throw MACORO_RTE_LOC;
+			}
+
+			// a worker that waits keeps running the pool.
+			{
+				thread_pool p;
+				auto w = p.make_work();
+				p.create_threads(1);
+				auto id = sync_wait(nested_sync_wait(p));
+				if (id == std::this_thread::get_id())
+					throw MACORO_RTE_LOC;
+				w.reset();
+				p.join();
+			}
+
+			// the caller and the workers share the work.
+			{
+				thread_pool p;
+				auto w = p.make_work();
+				p.create_threads(2);
+				std::vector<task<std::thread::id>> tasks;
+				for (std::size_t i = 0; i < 100; ++i)
+					tasks.push_back(scheduled_id(p));
+				auto ids = sync_wait(p, when_all_ready(std::move(tasks)));
+				if (ids.size() != 100)
+					throw MACORO_RTE_LOC;
+				w.reset();
+				p.join();
+			}
+
+			// but not a worker of another pool.
+			{
+				thread_pool p0, p1;
+				auto w0 = p0.make_work();
+				p0.create_threads(1);
+				auto other = [](thread_pool& p0, thread_pool& p1) -> task<bool>
+				{
+					MC_BEGIN(task<bool>, &p0, &p1, threw = false);
+					MC_AWAIT(p0.schedule());
+					try { sync_wait(p1, scheduled_id(p1)); }
+					catch (std::runtime_error&) { threw = true; }
+					MC_RETURN(threw);
+					MC_END();
+				};
+				if (!sync_wait(other(p0, p1)))
+					throw MACORO_RTE_LOC;
+				w0.reset();
+				p0.join();
+			}
+		}
+
+		void thread_pool_run_until_bench(const CLP& cmd)
+		{
+			if (!cmd.isSet("bench"))
+				throw UnitTestSkipped("pass -bench to run.");
+
+			auto n = cmd.getOr<std::size_t>("n", 100000);
+			thread_pool p;
+			auto w = p.make_work();
+			p.create_threads(1);
+
+			auto measure = [n](auto&& f) {
+				auto begin = std::chrono::steady_clock::now();
+				for (std::size_t i = 0; i < n; ++i)
+					f();
+				return double(std::chrono::duration_cast<std::chrono::nanoseconds>(
+					std::chrono::steady_clock::now() - begin).count()) / n;
+			};
+
+			std::cout << "\n  sync_wait       " << measure([&] { sync_wait(p.schedule()); }) << " ns/op ";
+			std::cout << "\n  sync_wait(pool) " << measure([&] { sync_wait(p, p.schedule()); }) << " ns/op ";
+			w.reset();
+			p.join();
+		}
+	}
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include "tests.h"
+
+
+namespace macoro
+{
+	namespace tests
+	{
+		void thread_pool_ping_pong_test();
+		void thread_pool_ping_pong_bench(const CLP& cmd);
+		void thread_pool_post_batch_test();
+		void thread_pool_schedule_n_test();
+		void thread_pool_fan_out_bench(const CLP& cmd);
+		void thread_pool_priority_test();
+		void thread_pool_priority_bench(const CLP& cmd);
+		void thread_pool_delay_fairness_test();
+		void thread_pool_timer_load_bench(const CLP& cmd);
+		void thread_pool_elastic_test();
+		void thread_pool_lifo_test();
+		void thread_pool_lifo_block_test();
+		void thread_pool_lifo_bench(const CLP& cmd);
+		void thread_pool_dispatch_budget_test();
+		void thread_pool_run_until_test();
+		void thread_pool_run_until_bench(const CLP& cmd);
+	}
+}